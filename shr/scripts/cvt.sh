@@ -7,7 +7,7 @@
 # A2B="/usr/bin/a2b"
 A2B="/usr/local/bin/a2b"
 
-if [ ! -z "${A2B}" ]; then
+if [ ! -x "${A2B}" ]; then
    echo "ERROR: Couldn't find path to 'a2b'"
    exit 1
 fi
@@ -38,26 +38,32 @@ if [ ! -e done ]; then
 	mkdir done
 fi
 
-# make External Segmented Palettes using ImageMagick
-./slicer.sh
+# A2B builds the segmented palettes itself (pim1, pim16 and pim200)
+# set USEMAGICK=1 to make External Segmented Palettes using ImageMagick instead
+USEMAGICK=0
+if [ "${USEMAGICK}" = "1" ]; then
+   ./slicer.sh
+   SH0="PIMsh0pcx/*/foo"
+   SH2="PIMsh2pcx/*/foo"
+   SH3="PIMsh3pcx/*/foo"
+else
+   SH0="pim1"
+   SH2="pim16"
+   SH3="pim200"
+fi
 
 # Call A2B to create SHR files
-criteria="*.bmp"
+# each call converts all the bmp files in this directory in batch mode
+# and for ImageMagick the * in the seed path is replaced with the name of each bmp file
 if ls ./*.bmp 1> /dev/null 2>&1 ; then
-for i in $( ls $criteria); do
-   src=$i
-   tgt=$(basename $i .bmp)
-
-   $A2B $src SH30709/$src dr m2s t PIMsh0pcx/$tgt/foo sum l709 > /dev/null
-   $A2B $src SH32709/$src dr m2s t PIMsh2pcx/$tgt/foo sum l709 > /dev/null
-   $A2B $src SH33709/$src dr m2s t PIMsh3pcx/$tgt/foo sum l709 > /dev/null
-
-   $A2B $src SH30709raw/$src m2s t PIMsh0pcx/$tgt/foo sum l709 > /dev/null
-   $A2B $src SH32709raw/$src m2s t PIMsh2pcx/$tgt/foo sum l709 > /dev/null
-   $A2B $src SH33709raw/$src m2s t PIMsh3pcx/$tgt/foo sum l709 > /dev/null
-done
+   $A2B "*.bmp" SH30709 dr m2s t "$SH0" sum l709 > /dev/null
+   $A2B "*.bmp" SH32709 dr m2s t "$SH2" sum l709 > /dev/null
+   $A2B "*.bmp" SH33709 dr m2s t "$SH3" sum l709 > /dev/null
+
+   $A2B "*.bmp" SH30709raw m2s t "$SH0" sum l709 > /dev/null
+   $A2B "*.bmp" SH32709raw m2s t "$SH2" sum l709 > /dev/null
+   $A2B "*.bmp" SH33709raw m2s t "$SH3" sum l709 > /dev/null
 mv *.bmp ./done/
 fi
 
 # this is the end
-
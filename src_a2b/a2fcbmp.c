@@ -77,10 +77,48 @@
 /* ------------------------------------------------------------------------ */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <math.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifndef NOBATCH
+#include <dirent.h>
+#endif
+#ifndef NOTHREADS
+#include <pthread.h>
+#endif
+#include <sys/time.h>
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__OPTIMIZE__) && !defined(NOSIMD)
+/* SSE2 and AVX color distance kernels are selected at run time */
+/* without optimization the intrinsics are not inlined and are slower
+   than the scalar code, so -O0 builds only have the scalar code */
+#define SIMDKERNEL
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef NOTHREADS
+/* built without pthreads - a thread can never be started, so each worker
+   pool does all of its work on the calling thread */
+#define pthread_t int
+#define pthread_mutex_t int
+#define pthread_mutex_init(m,a) (*(m) = 0)
+#define pthread_mutex_destroy(m) ((void)0)
+#define pthread_mutex_lock(m) ((void)0)
+#define pthread_mutex_unlock(m) ((void)0)
+#define pthread_create(t,a,f,p) (-1)
+#define pthread_join(t,r) ((void)(t))
+#define pthread_key_t void *
+#define pthread_key_create(k,d) (*(k) = NULL, 0)
+#define pthread_key_delete(k) ((void)0)
+#define pthread_setspecific(k,v) ((void)((k) = (void *)(v)))
+#define pthread_getspecific(k) (k)
+#endif
 
 #define LOBLACK     0
 #define LORED       1
@@ -115,19 +153,6 @@
 /* Declarations, Vars. etc.                                                 */
 /* ------------------------------------------------------------------------ */
 
-/* options flags */
-
-int longnames = 1, bmp = 0, bm2 = 0, bmp3 = 0, a2fc = 0, auxbin = 0, tohgr = 0, dhr = 0, frag = 0,
-    mono = 0, doublepixel = 1, applesoft = 0, palnumber = 5, doublegrey = 0, vbmp = 0,
-    dither = 0, dithertype = 9, randomdither = 0, errorsum = 0, outline = 0, lores = 0, doublelores = 0, tags=0, dosheader=0;
-int shr = 0, shrgrey = 0, usegscolors = 0, usegspalette = 0, hsl = 1, shrpalette = 15, brooks = 0, shrmode = 0, shrpalettes = 1,
-    shr256 = 0, useimagetone = 0, usepalettedistance = 0, quietmode = 1, m2s = 0, shrinput = 0, mix256 = 0,
-    imnumpalettes = 0, fourbit = 0, fourplay = 0, fourpal = 0;
-
-double desaturate[16];
-
-char fullname[256], shortname[256], outname[256], mainfile[256],auxfile[256],a2fcfile[256];
-
 char *palname[] = {
     "Kegs32 RGB",
     "CiderPress RGB",
@@ -152,40 +177,6 @@ typedef unsigned short ushort;
 typedef unsigned long ulong;
 typedef short sshort;
 
-/* put this here for now */
-/* shr colors start */
-uchar ColorsUsed[16][16][16];
-int shrcolorcount = 0;
-
-/* for checking duplicate 12-bit colors in 24-bit conversion palettes */
-/* expand as necessary */
-int shrdupedebug = 0, shrdupes = 0, shrdupecount = 0;
-
-void shrcolorsused(uchar r, uchar g, uchar b)
-{
-     r = r >> 4;
-     g = g >> 4;
-     b = b >> 4;
-     if (ColorsUsed[r][g][b] == 0) {
-        ColorsUsed[r][g][b] = 1;
-        shrcolorcount++;
-     }
-     else if (shrdupedebug != 0 && r !=0 && g != 0 && b != 0) {
-		/* do not count black as dupes */
-		if (ColorsUsed[r][g][b] == 1) {
-			ColorsUsed[r][g][b] = 2;
-			shrdupes = 1;
-		}
-		shrdupecount++;
-	}
-}
-
-void clearcolorsused()
-{
-    shrcolorcount = shrdupecount = shrdupes = 0;
-    memset(&ColorsUsed[0][0][0],0,4096);
-}
-/* shr colors end */
 
 /* Bitmap Header structures */
 #ifdef MINGW
@@ -368,21 +359,344 @@ typedef struct tagPICFILE
 /* constant for the biCompression field */
 #define BI_RGB      0L
 
-/* static structures for processing bmp input files */
-BITMAPFILEHEADER BitMapFileHeader;
-RGBQUAD sbmp[256]; /* super vga - applewin */
-sshort palettesused = 0, palettecolorsused[16];
+/* raw SHR structures */
+/* FileType $C1 AuxType $0000 - mode320 and mode640 */
+#ifdef MINGW
+typedef struct __attribute__((__packed__)) tagINPIC
+#else
+typedef struct tagINPIC
+#endif
+{
+    uchar line[200][160]; /* 32000 bytes */
+    uchar scb[200];
+    uchar padding[56];
+    uchar pal[16][32];
+} INPIC;
+
+/* FileType $C1 AuxType $0002 - mode3200 */
+#ifdef MINGW
+typedef struct __attribute__((__packed__)) tagINBROOKS
+#else
+typedef struct tagINBROOKS
+#endif
+{
+    uchar line[200][160];
+    uchar pal[200][32]; /* $0RGB table buffer palette entries 0-16 reversed */
+} INBROOKS;
+
 
-BITMAPINFOHEADER bmi;
-/* support for BMP version 4 but not sure about other versions */
-BITMAPINFOHEADERV5 bmiV5;
+/* ------------------------------------------------------------------------ */
+/* Conversion Context                                                       */
+/* ------------------------------------------------------------------------ */
+
+/* everything that a single conversion reads or writes lives in here rather
+   than in file-scope variables so that more than one conversion can run in
+   the same process. main() fills one of these in from the command line and
+   passes it down. a batch driver can copy that one for each of its workers.
+
+   nothing in a context is shared with any other context, including the
+   random number generator, so a context converts an image exactly the same
+   way no matter how many others are running beside it. */
+
+/* fixed-point color distance shared with b2d */
+#include "../src_common/colordist.h"
+#include "../src_common/packbytes.h"
+#include "../src_common/shrdecode.h"
+#include "../src_common/shrencode.h"
+#include "../src_common/bench.h"
+#include "../src_common/stats.h"
+
+#ifndef NOBATCH
+/* batch workers convert files side by side. each worker collects the
+   messages of the file that it is converting and BatchWorker prints them
+   in one piece when the file is done, so the output of a -j run is not
+   interleaved. outside of a batch job the messages go straight to stdout. */
+typedef struct tagJOBLOG
+{
+    char *text;
+    int len, size, failed;
+} JOBLOG;
+
+pthread_key_t joblogkey;
+int joblogs = 0;
+
+#ifdef __GNUC__
+/* keep the format checks of printf */
+int JobPrintf(const char *fmt, ...) __attribute__((format(printf,1,2)));
+#endif
+
+/* make room for len more characters - 0 if there is no memory */
+int GrowJobLog(JOBLOG *log, int len)
+{
+    char *text;
+    int size;
+
+    if (log->failed == 1) return 0;
+    if (log->len + len + 1 <= log->size) return 1;
+    size = log->size + len + 1024;
+    text = (char *)realloc(log->text,size);
+    if (NULL == text) {
+        log->failed = 1;
+        return 0;
+    }
+    log->text = text;
+    log->size = size;
+    return 1;
+}
 
-/* DHR Image Fragments - Sprites */
-BMPHEADER mybmp;
-ushort bmpwidth = 0, bmpheight = 0, fragwidth = 140, fragheight = 192, fragx = 0, fragy = 0;
+int JobPrintf(const char *fmt, ...)
+{
+    JOBLOG *log = NULL;
+    va_list args;
+    int len;
+
+    if (joblogs == 1) log = (JOBLOG *)pthread_getspecific(joblogkey);
+
+    va_start(args,fmt);
+    if (NULL == log) len = vprintf(fmt,args);
+    else len = vsnprintf(NULL,0,fmt,args);
+    va_end(args);
+    if (NULL == log || len < 0) return len;
+
+    if (GrowJobLog(log,len) == 0) {
+        /* out of memory - the message goes out now rather than not at all */
+        va_start(args,fmt);
+        len = vprintf(fmt,args);
+        va_end(args);
+        return len;
+    }
+    va_start(args,fmt);
+    vsnprintf((char *)&log->text[log->len],len + 1,fmt,args);
+    va_end(args);
+    log->len += len;
+    return len;
+}
+
+int JobPuts(const char *str)
+{
+    return JobPrintf("%s\n",str);
+}
+
+#define printf JobPrintf
+#define puts JobPuts
+#endif
+
+/* blue weighting for the closest color routines */
+#define DIST_CLOSEST 0 /* GetClosestColor() */
+#define DIST_256     1 /* GetClosest256Color() */
+#define DIST_INDEX   2 /* GetColorDistance() */
+
+/* rate-distortion dithering - default lambda for option "rd" */
+#define RD_LAMBDA 300
+
+/* scores a pixel against all 16 entries of the current palette */
+struct tagA2BCONTEXT;
+typedef void (*DISTANCEKERNEL)(struct tagA2BCONTEXT *ctx, double dr, double dg, double db, double luma,
+                               double blue0, double blue, double *distance);
+
+/* the error diffusion engine is inlined into each dither so that its
+   pattern and match tests fold away. other compilers just get a static
+   function with the tests left in */
+#ifdef __GNUC__
+#define DIFFUSEINLINE static inline __attribute__((always_inline))
+#else
+#define DIFFUSEINLINE static
+#endif
+
+/* error diffusion of a scanline to a 16 color palette */
+typedef void (*DIFFUSEKERNEL)(struct tagA2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random);
+
+/* the error diffusion taps for one error value */
+typedef struct tagDITHERTAPS
+{
+    /* (error * weight) / bleed */
+    sshort one, two, three, five, seven;
+    /* the rounding error that error summing adds back - 0 if it is off */
+    sshort floydrest, rest;
+} DITHERTAPS;
 
-/* SHR PIC file */
-PICFILE mypic;
+typedef struct tagA2BCONTEXT
+{
+    /* options flags */
+    int longnames, bmp, bm2, bmp3, a2fc, auxbin, tohgr, dhr, frag,
+        mono, doublepixel, applesoft, palnumber, doublegrey, vbmp,
+        dither, dithertype, randomdither, errorsum, outline, lores, doublelores, tags, dosheader;
+    int shr, shrgrey, usegscolors, usegspalette, hsl, shrpalette, brooks, shrmode, shrpalettes,
+        shr256, useimagetone, usepalettedistance, quietmode, m2s, shrinput, mix256,
+        imnumpalettes, fourbit, fourplay, fourpal, shr2;
+    /* built-in segment palettes instead of ImageMagick */
+    /* segmentthreads is for these, the line palettes and k-means - 0 for the default */
+    int pimquantize, segmentthreads;
+    /* set for each file of a batch conversion */
+    int batchjob;
+    /* k-means line palettes - iterations per line and time budget in milliseconds */
+    int kmeans, kmeanstime;
+    /* palettes follow the image instead of fixed bands */
+    int adaptivescb;
+    /* packed SHR output instead of the raw file - 1 for APF, 2 for 3201 */
+    int packedshr;
+    /* rate-distortion dithering - byte repeats within rdlambda are kept */
+    int rdlambda;
+    /* option "stats" - stage times and color counts for each file */
+    int statsformat;
+    STATS *stats;
+    double rdsse, rdbestsse;
+    long rdspent;   /* extra error of the first pixel of the byte */
+    uchar rdline[320], rdbest[200][160];
+
+    /* brooks output is experimental at this point */
+    int brooks2, brooks3, brooks4, brooks5;
+    int useoriginalcolors, usesixteencolors, usefourteencolors, useegacolors;
+
+    double desaturate[16];
+    uchar greyoveride[16];
+
+    char fullname[256], shortname[256], outname[256], mainfile[256],auxfile[256],a2fcfile[256];
+
+    /* shr colors used */
+    uchar ColorsUsed[16][16][16];
+    int shrcolorcount;
+    /* for checking duplicate 12-bit colors in 24-bit conversion palettes */
+    int shrdupedebug, shrdupes, shrdupecount;
+
+    /* structures for processing bmp input files */
+    BITMAPFILEHEADER BitMapFileHeader;
+    RGBQUAD sbmp[256]; /* super vga - applewin */
+    sshort palettesused, palettecolorsused[16];
+    BITMAPINFOHEADER bmi;
+    /* support for BMP version 4 but not sure about other versions */
+    BITMAPINFOHEADERV5 bmiV5;
+
+    /* DHR Image Fragments - Sprites */
+    BMPHEADER mybmp;
+    ushort bmpwidth, bmpheight, fragwidth, fragheight, fragx, fragy;
+
+    uchar bmpscanline[1680], bmpscanline2[1680];
+    uchar buf560[560];
+    /* palette indexes for a mapped scanline */
+    uchar lineindex[560];
+
+    /* DHGR, LGR, DLGR and SHR output buffer */
+    uchar *dhrbuf;
+
+    /* SHR PIC file */
+    PICFILE mypic;
+
+    /* imported palette file */
+    uchar rgbUser[16][3];
+    /* our working copy of the apple II double hires colors */
+    uchar rgbArray[16][3];
+
+    /* for SHR output */
+    /* 200 brooks palettes */
+    uchar rgbArrays[200][16][3];
+    uchar rgbUsed[200][16];
+    double rgbDistance[200][16];
+    /* save palettes for palette distance resassignment */
+    uchar savepalettes[200][16][3];
+    uchar savescb[200];
+
+    /* 16 pic palettes */
+    uchar rgb256Arrays[200][16][3];
+    uchar rgb256Used[16][16];
+    double rgb256Distance[16][16];
+
+    /* 16 color palette building */
+    uchar rgbColorCount[16][3];
+    sshort rgbColorCounter;
+
+    /* brooks4 and brooks5 arrays */
+    uchar linecolors[320][4];
+    ushort linecount[320];
+    double linedistance[320];
+    uchar linepalette[16][4];  /* r,g,b,used */
+    ushort linecolorindex[16]; /* index in linecolors array for color info */
+    uchar brooks5colors[16];
+
+    /* thresholds for color reduction on 24 bit values */
+    sshort globalthreshold, rhold, ghold, bhold;
+
+    /* luma coefficients for color distance */
+    int lumaREQ, lumaRED, lumaGREEN, lumaBLUE;
+    double dlumaRED, dlumaGREEN, dlumaBLUE;
+
+    /* current palette for color distance */
+    double rgbLuma[16], rgbDouble[16][3];
+    int brooksline;
+    double globaldistance, indexdistance, brooksdistance;
+    /* current palette in rows for the distance kernel */
+    double kernelRed[16], kernelGreen[16], kernelBlue[16], kernelLuma[16];
+    /* selected once per run - NULL for the scalar code in GetKernelColor */
+    DISTANCEKERNEL distancekernel;
+    /* fixed-point distance - 0 = off, 1 = use it, 2 = check it against the kernel */
+    int fixeddistance;
+    DISTPALETTE distpalette;
+    DISTWEIGHTS distweights[3];
+    ulong distlookups, distmismatches;
+
+    /* error diffusion buffers */
+    sshort redDither[640],greenDither[640],blueDither[640];
+    /* seed values from previous line */
+    sshort redSeed[640],greenSeed[640],blueSeed[640];
+    sshort redSeed2[640],greenSeed2[640],blueSeed2[640];
+    /* save and restore values for SHR palette matching */
+    sshort redSave[640],greenSave[640], blueSave[640];
+    /* in this implementation color bleed is fixed for my dither */
+    /* it will be either full (8/8) like Floyd-Steinberg or reduced 20% (8/10) */
+    int bleed;
+    /* taps for the errors -255 to 255 at this bleed and error summing */
+    DITHERTAPS dithertaps[511];
+    int tapsbleed, tapserrorsum;
+
+    /* local random number generator */
+    ushort RandomSeed;
+
+    /* external segmented palettes */
+    char pcxheader[66], pcxfile[256];
+
+    /* reformatted 24-bit bmp input kept in memory */
+    uchar *reformatbuf;
+    ushort reformatpacket, reformatheight, reformatline;
+
+    /* palette indices of 16 color and 256 color bmp input */
+    uchar *indexbuf;
+    ushort indexcolors;
+    uchar indexremap[256];
+
+    /* SHR input */
+    INPIC *p16;
+    INBROOKS *p200;
+    uchar *shrbuf;
+
+} A2BCONTEXT;
+
+/* put this here for now */
+/* shr colors start */
+void shrcolorsused(A2BCONTEXT *ctx, uchar r, uchar g, uchar b)
+{
+     r = r >> 4;
+     g = g >> 4;
+     b = b >> 4;
+     if (ctx->ColorsUsed[r][g][b] == 0) {
+        ctx->ColorsUsed[r][g][b] = 1;
+        ctx->shrcolorcount++;
+     }
+     else if (ctx->shrdupedebug != 0 && r !=0 && g != 0 && b != 0) {
+		/* do not count black as dupes */
+		if (ctx->ColorsUsed[r][g][b] == 1) {
+			ctx->ColorsUsed[r][g][b] = 2;
+			ctx->shrdupes = 1;
+		}
+		ctx->shrdupecount++;
+	}
+}
+
+void clearcolorsused(A2BCONTEXT *ctx)
+{
+    ctx->shrcolorcount = ctx->shrdupecount = ctx->shrdupes = 0;
+    memset(&ctx->ColorsUsed[0][0][0],0,4096);
+}
+/* shr colors end */
 
 #define ASCIIZ  0
 #define CRETURN 13
@@ -446,9 +760,6 @@ uchar mono192[62] ={
 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x00};
 
 uchar msk[]={0x80,0x40,0x20,0x10,0x8,0x4,0x2,0x1};
-uchar bmpscanline[1680], bmpscanline2[1680];
-
-uchar buf560[560];
 
 /* built-in palette options */
 /* based on DHGR, DLGR, LGR colors */
@@ -625,9 +936,6 @@ uchar hgrpal[16][3] = {
     0x5b,0xeb,0xd9, /* aqua */
     0xff,0xff,0xff};/* white */
 
-/* imported palette file */
-uchar rgbUser[16][3];
-
 uchar SuperConvert[16][3] = {
     0,0,0,       /* black */
     221,0,51,    /* red */
@@ -799,10 +1107,10 @@ uchar rgbPcxArray[16][3] = {
 85 , 255, 255,
 255, 255, 255};
 
-/* our working copy of the apple II double hires colors */
+/* initial value of the working copy of the apple II double hires colors */
 /* this is in Apple II lo-res color order */
 /* todhr palette */
-uchar rgbArray[NUM_VGA_COLORS][NUM_RGB_COLORS]={
+uchar rgbDefaultArray[NUM_VGA_COLORS][NUM_RGB_COLORS]={
     0,0,0,       /* black */
     148,12,125,  /* red */
     32,54,212,   /* dk blue */
@@ -839,20 +1147,6 @@ char *colornames[] = {
 "white"};
 
 
-/* for SHR output */
-/* 200 brooks palettes */
-uchar rgbArrays[200][16][3];
-uchar rgbUsed[200][16];
-double rgbDistance[200][16];
-/* save palettes for palette distance resassignment */
-uchar savepalettes[200][16][3];
-uchar savescb[200];
-
-/* 16 pic palettes */
-uchar rgb256Arrays[200][16][3];
-uchar rgb256Used[16][16];
-double rgb256Distance[16][16];
-
 /* all possible EGA ECD Values in Indexed Order */
 uchar rgbEgaArray[64][3] = {
 0x00, 0x00, 0x00,
@@ -964,8 +1258,6 @@ sshort rgb2ega(uchar red, uchar green, uchar blue)
 
 }
 
-sshort globalthreshold = 4, rhold = 4, ghold = 4, bhold = 4;
-
 
 /* set thresholds for color reduction on 24 bit values */
 uchar sethold(uchar ch, sshort hold)
@@ -1137,8 +1429,6 @@ unsigned HB[]={
 0x23D0, 0x27D0, 0x2BD0, 0x2FD0, 0x33D0, 0x37D0, 0x3BD0, 0x3FD0};
 
 
-unsigned char *dhrbuf=NULL;
-
 /*
 
 The following is logically reordered to match the lores
@@ -1221,14 +1511,13 @@ unsigned char dlomaincolor[16] = {
 /* local random number generator                                  */
 /* -------------------------------------------------------------- */
 /* http://stackoverflow.com/questions/7602919/how-do-i-generate-random-numbers-without-rand-function */
-ushort RandomSeed = (ushort)0xACE1;
-ushort my_random()
+ushort my_random(A2BCONTEXT *ctx)
 {
-    ushort bit = ((RandomSeed >> 0) ^ (RandomSeed >> 2) ^ (RandomSeed >> 3) ^ (RandomSeed >> 5) ) & 1;
+    ushort bit = ((ctx->RandomSeed >> 0) ^ (ctx->RandomSeed >> 2) ^ (ctx->RandomSeed >> 3) ^ (ctx->RandomSeed >> 5) ) & 1;
 
-    RandomSeed =  (RandomSeed >> 1) | (bit << 15);
+    ctx->RandomSeed =  (ctx->RandomSeed >> 1) | (bit << 15);
 
-    return RandomSeed;
+    return ctx->RandomSeed;
 }
 
 /* ------------------------------------------------------------- */
@@ -1237,13 +1526,13 @@ ushort my_random()
 /* args                                                          */
 /*   MaxValue - the highest number we want                       */
 /* ------------------------------------------------------------- */
-int RandomRange(int iMaxValue)
+int RandomRange(A2BCONTEXT *ctx, int iMaxValue)
 {
   int iRetVal;
 
   do {
     /* get random number */
-    iRetVal = (int)my_random();
+    iRetVal = (int)my_random(ctx);
     /* get a positive value */
     if (iRetVal < 0) iRetVal *= -1;
 
@@ -1285,23 +1574,32 @@ void WriteDosHeader(FILE *fp, ushort fl, ushort fa)
 }
 
 /* upper case name for Apple II Output */
-void ucase(char *str)
+/* upper case for ProDOS file names */
+/* in batch mode the directory part of a path is left alone, because the
+   output and input directories given for the batch must still be found on
+   case-sensitive file systems */
+void ucase(A2BCONTEXT *ctx, char *str)
 {
-    int idx;
+    int idx, jdx = 0;
 
-    for (idx = 0; str[idx] != (char)0; idx++) {
+    if (ctx->batchjob == 1) {
+        for (idx = 0; str[idx] != (char)0; idx++) {
+            if (str[idx] == (char)92 || str[idx] == (char)47) jdx = idx + 1;
+        }
+    }
+    for (idx = jdx; str[idx] != (char)0; idx++) {
         str[idx] = toupper(str[idx]);
     }
 }
 
 /* sets up a line oriented write buffer for lores and double lo-res files */
 /* this uses a different LGR and DLGR buffer organization method than Bmp2DHR */
-void setlopixel(unsigned char color,int x, int y)
+void setlopixel(A2BCONTEXT *ctx, unsigned char color,int x, int y)
 {
      unsigned char *crt, c1, c2;
      int y1, offset;
 
-     if (doublelores == 1) {
+     if (ctx->doublelores == 1) {
          if (x%2 == 0) {
              /* auxiliary memory uses a different color index value */
              color = dloauxcolor[color];
@@ -1336,19 +1634,19 @@ void setlopixel(unsigned char color,int x, int y)
      /* each paired scanline is offset by 320 bytes in our write buffer */
      offset += (y1 * 320);
 
-     crt = (unsigned char *)&dhrbuf[offset];
+     crt = (unsigned char *)&ctx->dhrbuf[offset];
      crt[0] &= c1;
      crt[0] |= c2;
 }
 
-uchar getlopixel(int x, int y)
+uchar getlopixel(A2BCONTEXT *ctx, int x, int y)
 {
      unsigned char *crt, color;
      int y1, offset;
 
 
 
-     if (doublelores == 1) {
+     if (ctx->doublelores == 1) {
          if (x%2 == 0) {
              /* first 160 bytes goes to auxiliary memory (even pixels) */
              offset = (x/2);
@@ -1367,7 +1665,7 @@ uchar getlopixel(int x, int y)
      /* each paired scanline is offset by 320 bytes in our write buffer */
      offset += (y1 * 320);
 
-     crt = (unsigned char *)&dhrbuf[offset];
+     crt = (unsigned char *)&ctx->dhrbuf[offset];
 
      if (y%2 == 0) {
          /* even rows in low nibble */
@@ -1379,7 +1677,7 @@ uchar getlopixel(int x, int y)
 
      }
 
-     if (doublelores == 1 && x%2 == 0) {
+     if (ctx->doublelores == 1 && x%2 == 0) {
         /* auxiliary memory uses a different color index value */
          color = dlomaincolor[color];
      }
@@ -1387,35 +1685,45 @@ uchar getlopixel(int x, int y)
      return color;
 }
 
-ushort WriteDIBHeader(FILE *fp, ushort pixels, ushort rasters)
+/* set-up the header for a 24-bit BMP in mybmp - returns the scanline length */
+ushort SetDIBHeader(A2BCONTEXT *ctx, ushort pixels, ushort rasters)
 {
     ushort outpacket;
-    int c;
 
-    memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+    memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
 
     /* create the info header */
-    mybmp.bmi.biSize = (ulong)sizeof(BITMAPINFOHEADER);
-    mybmp.bmi.biWidth  = (ulong)pixels;
-    mybmp.bmi.biHeight = (ulong)rasters;
-    mybmp.bmi.biPlanes = 1;
-    mybmp.bmi.biBitCount = 24;
-    mybmp.bmi.biCompression = (ulong) BI_RGB;
+    ctx->mybmp.bmi.biSize = (ulong)sizeof(BITMAPINFOHEADER);
+    ctx->mybmp.bmi.biWidth  = (ulong)pixels;
+    ctx->mybmp.bmi.biHeight = (ulong)rasters;
+    ctx->mybmp.bmi.biPlanes = 1;
+    ctx->mybmp.bmi.biBitCount = 24;
+    ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
 
     /* BMP scanlines are padded to a multiple of 4 bytes (DWORD) */
-    outpacket = (ushort)mybmp.bmi.biWidth * 3;
+    outpacket = (ushort)ctx->mybmp.bmi.biWidth * 3;
     while (outpacket%4 != 0)outpacket++;
-    mybmp.bmi.biSizeImage = (ulong)outpacket;
-    mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+    ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+    ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
 
     /* create the file header */
-    mybmp.bfi.bfType[0] = 'B';
-    mybmp.bfi.bfType[1] = 'M';
-    mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-    mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+    ctx->mybmp.bfi.bfType[0] = 'B';
+    ctx->mybmp.bfi.bfType[1] = 'M';
+    ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+    ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+    return outpacket;
+}
+
+ushort WriteDIBHeader(A2BCONTEXT *ctx, FILE *fp, ushort pixels, ushort rasters)
+{
+    ushort outpacket;
+    int c;
+
+    outpacket = SetDIBHeader(ctx, pixels, rasters);
 
     /* write the header for the output BMP */
-    c = fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    c = fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
 
     if (c!= 1)outpacket = 0;
 
@@ -1423,7 +1731,7 @@ return outpacket;
 }
 
 /* DHGR file input Helper Function for HGR raster format image fragments */
-int read_dhr(uchar *basename)
+int read_dhr(A2BCONTEXT *ctx, uchar *basename)
 {
 
     FILE *fp;
@@ -1434,13 +1742,13 @@ int read_dhr(uchar *basename)
     sprintf(infile,"%s.DHR",basename);
     fp = fopen(infile,"rb");
 
-    if (NULL == fp && longnames == 1) {
+    if (NULL == fp && ctx->longnames == 1) {
         sprintf(infile,"%s.DHR#062000",basename);
         fp = fopen(infile,"rb");
     }
     if (NULL == fp)return INVALID;
 
-    memset(dhrbuf,0,16384);
+    memset(ctx->dhrbuf,0,16384);
 
     for (;;) {
         /* read 5 byte header */
@@ -1454,8 +1762,8 @@ int read_dhr(uchar *basename)
         if (height< 1 || height > 192) break;
 
         /* set some globals for BMP output */
-        bmpwidth = (ushort)((width / 4) * 7);
-        bmpheight = (ushort) height;
+        ctx->bmpwidth = (ushort)((width / 4) * 7);
+        ctx->bmpheight = (ushort) height;
 
         status = SUCCESS;
 
@@ -1470,9 +1778,9 @@ int read_dhr(uchar *basename)
             }
             dest = HB[y];
             /* move to auxiliary screen memory */
-            memcpy((char *)&dhrbuf[dest-0x2000],(char *)&lodebuf[0],packet);
+            memcpy((char *)&ctx->dhrbuf[dest-0x2000],(char *)&lodebuf[0],packet);
             /* move to main screen memory */
-            memcpy((char *)&dhrbuf[dest],(char *)&lodebuf[packet],packet);
+            memcpy((char *)&ctx->dhrbuf[dest],(char *)&lodebuf[packet],packet);
 
         }
         break;
@@ -1487,7 +1795,7 @@ int read_dhr(uchar *basename)
 /* in a 4 byte block which spans aux and main screen memory */
 /* the horizontal resolution is 140 pixels */
 /* read 2 input files */
-int read_binaux(uchar *basename)
+int read_binaux(A2BCONTEXT *ctx, uchar *basename)
 {
 
     FILE *fp;
@@ -1498,24 +1806,24 @@ int read_binaux(uchar *basename)
     sprintf(infile,"%s.AUX",basename);
     fp = fopen(infile,"rb");
 
-    if (NULL == fp && longnames == 1) {
+    if (NULL == fp && ctx->longnames == 1) {
         sprintf(infile,"%s.AUX#062000",basename);
         fp = fopen(infile,"rb");
     }
     if (NULL == fp)return INVALID;
-    fread(dhrbuf,1,8192,fp);
+    fread(ctx->dhrbuf,1,8192,fp);
     fclose(fp);
 
     /* the second file is loaded into main mem */
     sprintf(infile,"%s.BIN",basename);
     fp = fopen(infile,"rb");
 
-    if (NULL == fp && longnames == 1) {
+    if (NULL == fp && ctx->longnames == 1) {
         sprintf(infile,"%s.BIN#062000",basename);
         fp = fopen(infile,"rb");
     }
     if (NULL == fp)return INVALID;
-    fread(&dhrbuf[8192],1,8192,fp);
+    fread(&ctx->dhrbuf[8192],1,8192,fp);
     fclose(fp);
 
     return SUCCESS;
@@ -1524,12 +1832,12 @@ int read_binaux(uchar *basename)
 
 /* DHGR file input Helper Function for A2FC files */
 /* read one input file */
-int read_2fc(uchar *basename)
+int read_2fc(A2BCONTEXT *ctx, uchar *basename)
 {
     FILE *fp;
     uchar infile[256];
 
-    if (longnames == 0) {
+    if (ctx->longnames == 0) {
         sprintf(infile,"%s.2FC",basename);
         fp = fopen(infile,"rb");
     }
@@ -1537,7 +1845,7 @@ int read_2fc(uchar *basename)
         for (;;) {
             /* support for longnames and ciderpress tags */
             /* support for tohgr output */
-            if (tohgr == 0)
+            if (ctx->tohgr == 0)
                 sprintf(infile,"%s.2FC",basename);
             else
                 sprintf(infile,"%s.dhgr",basename);
@@ -1545,8 +1853,8 @@ int read_2fc(uchar *basename)
             fp = fopen(infile,"rb");
             if (NULL != fp)break;
 
-            if (tohgr == 0) {
-                if (mono == 0) sprintf(infile,"%s.A2FC",basename);
+            if (ctx->tohgr == 0) {
+                if (ctx->mono == 0) sprintf(infile,"%s.A2FC",basename);
                 else sprintf(infile,"%s.A2FM",basename);
             }
             else {
@@ -1556,7 +1864,7 @@ int read_2fc(uchar *basename)
             fp = fopen(infile,"rb");
             if (NULL != fp)break;
 
-            if (tohgr == 0)
+            if (ctx->tohgr == 0)
                 sprintf(infile,"%s.2FC#062000",basename);
             else
                 sprintf(infile,"%s.dhgr#062000",basename);
@@ -1564,8 +1872,8 @@ int read_2fc(uchar *basename)
             fp = fopen(infile,"rb");
             if (NULL != fp)break;
 
-            if (tohgr == 0) {
-                if (mono == 0) sprintf(infile,"%s.A2FC#062000",basename);
+            if (ctx->tohgr == 0) {
+                if (ctx->mono == 0) sprintf(infile,"%s.A2FC#062000",basename);
                 else sprintf(infile,"%s.A2FM#062000",basename);
             }
             else {
@@ -1578,7 +1886,7 @@ int read_2fc(uchar *basename)
     }
 
     if (NULL == fp)return INVALID;
-    fread(dhrbuf,1,16384,fp);
+    fread(ctx->dhrbuf,1,16384,fp);
     fclose(fp);
 
     return SUCCESS;
@@ -1590,7 +1898,7 @@ int read_2fc(uchar *basename)
 /* a double hi-res color pixel can occur at any one of 7 positions */
 /* in a 4 byte block which spans aux and main screen memory */
 /* the horizontal resolution is 140 pixels */
-int dhrgetpixel(int x,int y)
+int dhrgetpixel(A2BCONTEXT *ctx, int x,int y)
 {
     int xoff, pattern, idx;
     unsigned char *ptraux, *ptrmain,c1, c2, d1, d2;
@@ -1600,8 +1908,8 @@ int dhrgetpixel(int x,int y)
 
     pattern = (x%7);
     xoff = HB[y] + ((x/7) * 2);
-    ptraux  = (unsigned char *) &dhrbuf[xoff-0x2000];
-    ptrmain = (unsigned char *) &dhrbuf[xoff];
+    ptraux  = (unsigned char *) &ctx->dhrbuf[xoff-0x2000];
+    ptrmain = (unsigned char *) &ctx->dhrbuf[xoff];
 
 
     switch(pattern)
@@ -1673,7 +1981,7 @@ int dhrgetpixel(int x,int y)
     return INVALID;
 }
 
-ushort WriteVbmpHeader(FILE *fp)
+ushort WriteVbmpHeader(A2BCONTEXT *ctx, FILE *fp)
 {
     ushort outpacket;
     int c, i, j;
@@ -1681,60 +1989,61 @@ ushort WriteVbmpHeader(FILE *fp)
     /* BMP scanlines are padded to a multiple of 4 bytes (DWORD) */
     outpacket = (ushort)72;
 
-    if (mono != 0) {
+    if (ctx->mono != 0) {
         c = fwrite(mono192,1,sizeof(mono192),fp);
         if (c!= sizeof(mono192))return 0;
         return outpacket;
     }
 
-    memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+    memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
 
     /* create the info header */
-    mybmp.bmi.biSize = (ulong)40;
-    mybmp.bmi.biWidth  = (ulong)140;
-    mybmp.bmi.biHeight = (ulong)192;
-    mybmp.bmi.biPlanes = 1;
-    mybmp.bmi.biBitCount = 4;
-    mybmp.bmi.biCompression = (ulong) BI_RGB;
+    ctx->mybmp.bmi.biSize = (ulong)40;
+    ctx->mybmp.bmi.biWidth  = (ulong)140;
+    ctx->mybmp.bmi.biHeight = (ulong)192;
+    ctx->mybmp.bmi.biPlanes = 1;
+    ctx->mybmp.bmi.biBitCount = 4;
+    ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
 
-    mybmp.bmi.biSizeImage = (ulong)outpacket;
-    mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+    ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+    ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
 
     /* create the file header */
-    mybmp.bfi.bfType[0] = 'B';
-    mybmp.bfi.bfType[1] = 'M';
-    mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER) + sizeof(RGBQUAD) * 16;
-    mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+    ctx->mybmp.bfi.bfType[0] = 'B';
+    ctx->mybmp.bfi.bfType[1] = 'M';
+    ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER) + sizeof(RGBQUAD) * 16;
+    ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
 
     /* write the header for the output BMP */
-    c = fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    c = fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
 
     if (c!= 1)return 0;
 
     for (i=0;i<16;i++) {
         j = RemapLoToHi[i];
-        sbmp[i].rgbRed   = rgbArray[j][0];
-        sbmp[i].rgbGreen = rgbArray[j][1];
-        sbmp[i].rgbBlue  = rgbArray[j][2];
-        sbmp[i].rgbReserved = 0;
+        ctx->sbmp[i].rgbRed   = ctx->rgbArray[j][0];
+        ctx->sbmp[i].rgbGreen = ctx->rgbArray[j][1];
+        ctx->sbmp[i].rgbBlue  = ctx->rgbArray[j][2];
+        ctx->sbmp[i].rgbReserved = 0;
 
     }
 
     /* write the palette for the output bmp */
-    c = fwrite((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+    c = fwrite((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
     if (c!= 1)return 0;
 
 return outpacket;
 }
 
 /* writes VBMP compatible 140 x 192 x 16 color bmp or VBMP compatible 560 x 192 monochrome bmp */
-int WriteVBMPFile(unsigned char *vbmpfile)
+int WriteVBMPFile(A2BCONTEXT *ctx, unsigned char *vbmpfile)
 {
 
     FILE *fp;
     uchar ch;
     int x,x1,y,y2,idx,j,packet=72;
 
+    StatsOutput(ctx->stats,vbmpfile);
     fp = fopen(vbmpfile,"wb");
 
     if (fp == NULL) {
@@ -1742,13 +2051,13 @@ int WriteVBMPFile(unsigned char *vbmpfile)
         return INVALID;
     }
 
-    if (WriteVbmpHeader(fp) == 0) {
+    if (WriteVbmpHeader(ctx, fp) == 0) {
         fclose(fp);
         remove(vbmpfile);
         printf("Error writing header to %s!\n",vbmpfile);
         return INVALID;
     }
-    memset(&bmpscanline[0],0,packet);
+    memset(&ctx->bmpscanline[0],0,packet);
 
     /* write 4 bit packed scanlines */
     /* remap from LORES color order to DHGR color order */
@@ -1758,22 +2067,22 @@ int WriteVBMPFile(unsigned char *vbmpfile)
     for (y = 0; y< 192; y++) {
        for (x = 0, x1=0; x < 140; x++) {
           if (x%2 == 0) {
-            idx = dhrgetpixel(x,y2);
+            idx = dhrgetpixel(ctx, x,y2);
             /* range check */
             if (idx < 0 || idx > 15)idx = 0; /* default black */
             j = RemapLoToHi[idx];
             ch = (uchar)j << 4;
           }
           else {
-            idx = dhrgetpixel(x,y2);
+            idx = dhrgetpixel(ctx, x,y2);
             /* range check */
             if (idx < 0 || idx > 15)idx = 0; /* default black */
             j = RemapLoToHi[idx];
-            bmpscanline[x1] = ch | (uchar)j; x1++;
+            ctx->bmpscanline[x1] = ch | (uchar)j; x1++;
           }
        }
 
-       fwrite((char *)&bmpscanline[0],1,packet,fp);
+       fwrite((char *)&ctx->bmpscanline[0],1,packet,fp);
        y2 -= 1;
     }
 
@@ -1783,7 +2092,7 @@ int WriteVBMPFile(unsigned char *vbmpfile)
 }
 
 /* Color Output Helper Function */
-int save_to_bmp24(uchar *basename)
+int save_to_bmp24(A2BCONTEXT *ctx, uchar *basename)
 {
 
     FILE *fp;
@@ -1792,56 +2101,57 @@ int save_to_bmp24(uchar *basename)
 
     sprintf(outfile,"%s.bmp",basename);
 
-    if (vbmp == 1) return WriteVBMPFile(outfile);
+    if (ctx->vbmp == 1) return WriteVBMPFile(ctx, outfile);
 
-    if (frag == 1) {
+    if (ctx->frag == 1) {
         /* create BMP image fragment from full-screen Apple II input */
-        dhr = 1;
-        bmpwidth  =  fragwidth;
-        bmpheight =  fragheight;
-        xoffset   =  fragx;
-        yoffset   =  fragy;
+        ctx->dhr = 1;
+        ctx->bmpwidth  =  ctx->fragwidth;
+        ctx->bmpheight =  ctx->fragheight;
+        xoffset   =  ctx->fragx;
+        yoffset   =  ctx->fragy;
     }
 
+    StatsOutput(ctx->stats,outfile);
     fp = fopen(outfile,"wb");
     if (NULL == fp)return INVALID;
 
     /* write rgb triples and double each pixel to preserve the aspect ratio */
-    if (doublepixel == 1) {
+    if (ctx->doublepixel == 1) {
         /* write header for 280 x 192 x 24 bit bmp */
-        if (dhr == 1) packet = (int)WriteDIBHeader(fp,bmpwidth*2,bmpheight);
+        if (ctx->dhr == 1) packet = (int)WriteDIBHeader(ctx, fp,ctx->bmpwidth*2,ctx->bmpheight);
         else fwrite(BMP_header,1,sizeof(BMP_header),fp);
     }
     else {
         /* write header for 140 x 192 x 24 bit bmp */
-        if (dhr == 1) packet = (int)WriteDIBHeader(fp,bmpwidth,bmpheight);
+        if (ctx->dhr == 1) packet = (int)WriteDIBHeader(ctx, fp,ctx->bmpwidth,ctx->bmpheight);
         else fwrite(BMP140_header,1,sizeof(BMP140_header),fp);
     }
 
-    if (dhr == 1) {
-        memset(&bmpscanline[0],0,840);
-        y2 = (bmpheight) - 1;
-        for (y = 0; y< bmpheight; y++) {
-           for (x = 0, x1=0; x < bmpwidth; x++) {
-              idx = dhrgetpixel(x+xoffset,y2+yoffset);
+    if (ctx->dhr == 1) {
+        memset(&ctx->bmpscanline[0],0,840);
+        y2 = (ctx->bmpheight) - 1;
+        for (y = 0; y< ctx->bmpheight; y++) {
+           for (x = 0, x1=0; x < ctx->bmpwidth; x++) {
+              idx = dhrgetpixel(ctx, x+xoffset,y2+yoffset);
 
               if (idx < 0 || idx > 15)idx = 0;
 
-              tempr = rgbArray[idx][0];
-              tempg = rgbArray[idx][1];
-              tempb = rgbArray[idx][2];
+              tempr = ctx->rgbArray[idx][0];
+              tempg = ctx->rgbArray[idx][1];
+              tempb = ctx->rgbArray[idx][2];
 
-              bmpscanline[x1] = tempb; x1++;
-              bmpscanline[x1] = tempg; x1++;
-              bmpscanline[x1] = tempr; x1++;
+              ctx->bmpscanline[x1] = tempb; x1++;
+              ctx->bmpscanline[x1] = tempg; x1++;
+              ctx->bmpscanline[x1] = tempr; x1++;
 
-              if (doublepixel == 1) {
-                bmpscanline[x1] = tempb; x1++;
-                bmpscanline[x1] = tempg; x1++;
-                bmpscanline[x1] = tempr; x1++;
+              if (ctx->doublepixel == 1) {
+                ctx->bmpscanline[x1] = tempb; x1++;
+                ctx->bmpscanline[x1] = tempg; x1++;
+                ctx->bmpscanline[x1] = tempr; x1++;
               }
            }
-           fwrite((char *)&bmpscanline[0],1,packet,fp);
+           fwrite((char *)&ctx->bmpscanline[0],1,packet,fp);
            y2 -= 1;
         }
 
@@ -1851,21 +2161,21 @@ int save_to_bmp24(uchar *basename)
         for (y = 0; y< 192; y++) {
 
            for (x = 0; x < 140; x++) {
-              idx = dhrgetpixel(x,y2);
+              idx = dhrgetpixel(ctx, x,y2);
 
               /* range check */
               if (idx < 0 || idx > 15)idx = 0; /* default to black */
 
-              tempr = rgbArray[idx][0];
-              tempg = rgbArray[idx][1];
-              tempb = rgbArray[idx][2];
+              tempr = ctx->rgbArray[idx][0];
+              tempg = ctx->rgbArray[idx][1];
+              tempb = ctx->rgbArray[idx][2];
 
               /* reverse order */
               fputc(tempb, fp);
               fputc(tempg, fp);
               fputc(tempr, fp);
 
-              if (doublepixel == 1) {
+              if (ctx->doublepixel == 1) {
                  /* double-up */
                  fputc(tempb, fp);
                  fputc(tempg, fp);
@@ -1883,26 +2193,26 @@ int save_to_bmp24(uchar *basename)
 
 
 /* encodes apple II dhgr scanline into buffer */
-int applewinbits(int y)
+int applewinbits(A2BCONTEXT *ctx, int y)
 {
         int xoff,idx,jdx;
         unsigned char *ptraux, *ptrmain, bits[7];
 
         xoff = HB[y];
-        ptraux  = (unsigned char *) &dhrbuf[xoff-0x2000];
-        ptrmain = (unsigned char *) &dhrbuf[xoff];
+        ptraux  = (unsigned char *) &ctx->dhrbuf[xoff-0x2000];
+        ptrmain = (unsigned char *) &ctx->dhrbuf[xoff];
 
         xoff = 0;
         for (idx = 0; idx < 40; idx++) {
 
             for (jdx = 0; jdx < 7; jdx++) {
-                bits[jdx] = bmpscanline[xoff]; xoff++;
+                bits[jdx] = ctx->bmpscanline[xoff]; xoff++;
             }
             ptraux[idx] = (bits[6]<<6|bits[5]<<5|bits[4]<<4|
                            bits[3]<<3|bits[2]<<2|bits[1]<<1|bits[0]);
 
             for (jdx = 0; jdx < 7; jdx++) {
-                bits[jdx] = bmpscanline[xoff]; xoff++;
+                bits[jdx] = ctx->bmpscanline[xoff]; xoff++;
             }
             ptrmain[idx] = (bits[6]<<6|bits[5]<<5|bits[4]<<4|
                             bits[3]<<3|bits[2]<<2|bits[1]<<1|bits[0]);
@@ -2034,9 +2344,6 @@ void hsl2rgb(float h,float s,float l,uchar *r,uchar *g,uchar *b)
 /* also read https://en.wikipedia.org/wiki/Color_space */
 /* also read https://en.wikipedia.org/wiki/RGB_color_space */
 
-int lumaREQ = 601, lumaRED = 299, lumaGREEN = 587, lumaBLUE = 114;
-double dlumaRED, dlumaGREEN, dlumaBLUE;
-
 /* strip line feeds from ascii file lines... */
 void nocr(char *ptr) {
   int idx;
@@ -2045,7 +2352,7 @@ void nocr(char *ptr) {
       ptr[idx] = 0;
 }
 
-void setluma()
+void setluma(A2BCONTEXT *ctx)
 {
 
 	FILE *fp;
@@ -2076,9 +2383,9 @@ void setluma()
 	        if (dgreen > 0.999 || dgreen < 0.001) break;
 	        if (dblue > 0.999 || dblue < 0.001) break;
 	        /* set custom luma values */
-	        dlumaRED = dred; lumaRED = (int)(dred * 1000);
-	        dlumaGREEN = dgreen; lumaGREEN = (int)(dgreen * 1000);
-	        dlumaBLUE = dblue; lumaBLUE = (int)(dblue * 1000);
+	        ctx->dlumaRED = dred; ctx->lumaRED = (int)(dred * 1000);
+	        ctx->dlumaGREEN = dgreen; ctx->lumaGREEN = (int)(dgreen * 1000);
+	        ctx->dlumaBLUE = dblue; ctx->lumaBLUE = (int)(dblue * 1000);
 	        status = SUCCESS;
 	        break;
 		}
@@ -2090,33 +2397,33 @@ void setluma()
 
 	if (status == SUCCESS) return;
 
-    switch(lumaREQ)
+    switch(ctx->lumaREQ)
     {
         /* HDMI II - Rec. 2020 specifies that if a luma (Y') signal is made that it
         uses the RGB coefficients
         0.2627 for red, 0.6780 for green, and 0.0593 for blue */
         case 2020:
-                  lumaRED = 263;     lumaGREEN = 678;    lumaBLUE = 59;
-                  dlumaRED = 0.2627;  dlumaGREEN = 0.6780; dlumaBLUE = 0.0593;
+                  ctx->lumaRED = 263;     ctx->lumaGREEN = 678;    ctx->lumaBLUE = 59;
+                  ctx->dlumaRED = 0.2627;  ctx->dlumaGREEN = 0.6780; ctx->dlumaBLUE = 0.0593;
                   break;
 
         case 240: /* SMPTE 240M transitional coefficients */
                   /* http://www.chromapure.com/colorscience-decoding.asp */
-                  lumaRED = 212;     lumaGREEN = 701;    lumaBLUE = 87;
-                  dlumaRED = 0.2124;  dlumaGREEN = 0.7011; dlumaBLUE = 0.0866;
+                  ctx->lumaRED = 212;     ctx->lumaGREEN = 701;    ctx->lumaBLUE = 87;
+                  ctx->dlumaRED = 0.2124;  ctx->dlumaGREEN = 0.7011; ctx->dlumaBLUE = 0.0866;
                   break;
 
         case 911: /* Sheldon Simms - tohgr - probably not useful */
-                  lumaRED = 77;    lumaGREEN = 151;    lumaBLUE = 28;
-                  dlumaRED = 0.077;dlumaGREEN = 0.151; dlumaBLUE = 0.028;
+                  ctx->lumaRED = 77;    ctx->lumaGREEN = 151;    ctx->lumaBLUE = 28;
+                  ctx->dlumaRED = 0.077;ctx->dlumaGREEN = 0.151; ctx->dlumaBLUE = 0.028;
                   break;
 
         case 411: /* The GIMP color managed */
                   /* https://mail.gnome.org/archives/gimp-user-list/2013-November/msg00173.html */
                   /* sRGB color managed */
                   /* http://ninedegreesbelow.com/photography/srgb-luminance.html */
-                  lumaRED = 223;     lumaGREEN = 717;      lumaBLUE = 61;
-                  dlumaRED = 0.2225; dlumaGREEN = 0.7169;  dlumaBLUE = 0.0606;
+                  ctx->lumaRED = 223;     ctx->lumaGREEN = 717;      ctx->lumaBLUE = 61;
+                  ctx->dlumaRED = 0.2225; ctx->dlumaGREEN = 0.7169;  ctx->dlumaBLUE = 0.0606;
                   break;
 
         case 709: /* CCIR 709 - modern */
@@ -2125,8 +2432,8 @@ void setluma()
                   /* also PhotoShop
                      http://www.beneaththewaves.net/Photography/Secrets_of_Photoshops_Colour_Blend_Mode_Revealed_Sort_Of.html
                   */
-                  lumaRED = 213;      lumaGREEN = 715;       lumaBLUE = 72;
-                  dlumaRED = 0.212656;dlumaGREEN = 0.715158; dlumaBLUE = 0.072186;
+                  ctx->lumaRED = 213;      ctx->lumaGREEN = 715;       ctx->lumaBLUE = 72;
+                  ctx->dlumaRED = 0.212656;ctx->dlumaGREEN = 0.715158; ctx->dlumaBLUE = 0.072186;
                   break;
 
         case 601: /* CCIR 601 - most digital standard definition formats */
@@ -2134,8 +2441,8 @@ void setluma()
                      at the introduction of NTSC television in 1953.
                   /* these coefficients do not accurately compute luminance for contemporary monitors */
 
-        default:  lumaRED = 299;     lumaGREEN = 587;      lumaBLUE = 114;
-                  dlumaRED = 0.298839;  dlumaGREEN = 0.586811;   dlumaBLUE = 0.114350;
+        default:  ctx->lumaRED = 299;     ctx->lumaGREEN = 587;      ctx->lumaBLUE = 114;
+                  ctx->dlumaRED = 0.298839;  ctx->dlumaGREEN = 0.586811;   ctx->dlumaBLUE = 0.114350;
                   break;
 
 
@@ -2143,28 +2450,208 @@ void setluma()
 }
 
 
-double rgbLuma[16], rgbDouble[16][3];
-int brooksline = 999;
+/* ------------------------------------------------------------------------ */
+/* 16-entry color distance kernel                                           */
+/* ------------------------------------------------------------------------ */
+
+/* the closest color routines score every entry of the current 16 color
+   palette against the same pixel. a SIMD kernel does the scoring for all 16
+   entries at once and leaves picking the closest to the caller. without one
+   GetKernelColor scores the entries itself in a single scalar loop.
+
+   for the kernels the palette is kept as separate red, green, blue and luma
+   rows so that 2 (SSE2) or 4 (AVX) entries can be scored together. the
+   arithmetic is done in the same order as the scalar code so every kernel
+   gives the same distances, bit for bit.
+
+   blue0 is the blue weight for the first palette entry and blue is the
+   blue weight for the rest. this preserves the weighting of the original
+   closest color routines. */
+
+void InitDistanceKernel(A2BCONTEXT *ctx)
+{
+    int i;
+
+    if (ctx->distancekernel != NULL) {
+        for (i=0;i<16;i++) {
+            ctx->kernelRed[i] = ctx->rgbDouble[i][0];
+            ctx->kernelGreen[i] = ctx->rgbDouble[i][1];
+            ctx->kernelBlue[i] = ctx->rgbDouble[i][2];
+            ctx->kernelLuma[i] = ctx->rgbLuma[i];
+        }
+    }
+
+    if (ctx->fixeddistance != 0) {
+        SetDistWeights(&ctx->distweights[DIST_CLOSEST],ctx->lumaRED,ctx->lumaGREEN,ctx->lumaBLUE,
+                       ctx->dlumaRED,ctx->dlumaGREEN,ctx->dlumaGREEN,ctx->dlumaBLUE);
+        SetDistWeights(&ctx->distweights[DIST_256],ctx->lumaRED,ctx->lumaGREEN,ctx->lumaBLUE,
+                       ctx->dlumaRED,ctx->dlumaGREEN,ctx->dlumaGREEN,0.114);
+        SetDistWeights(&ctx->distweights[DIST_INDEX],ctx->lumaRED,ctx->lumaGREEN,ctx->lumaBLUE,
+                       ctx->dlumaRED,ctx->dlumaGREEN,ctx->dlumaGREEN,ctx->dlumaGREEN);
+        SetDistPalette(&ctx->distpalette,ctx->rgbDouble,&ctx->distweights[DIST_CLOSEST]);
+    }
+}
+
+#ifdef SIMDKERNEL
+__attribute__((target("sse2")))
+void DistanceKernelSSE2(A2BCONTEXT *ctx, double dr, double dg, double db, double luma,
+                        double blue0, double blue, double *distance)
+{
+    __m128d vr = _mm_set1_pd(dr), vg = _mm_set1_pd(dg), vb = _mm_set1_pd(db), vl = _mm_set1_pd(luma);
+    __m128d v255 = _mm_set1_pd(255.0), v75 = _mm_set1_pd(0.75);
+    __m128d wr = _mm_set1_pd(ctx->dlumaRED), wg = _mm_set1_pd(ctx->dlumaGREEN);
+    __m128d wb = _mm_set_pd(blue,blue0);
+    __m128d diffR, diffG, diffB, lumadiff, sum;
+    int i;
+
+    for (i=0;i<16;i+=2) {
+        lumadiff = _mm_sub_pd(_mm_loadu_pd(&ctx->kernelLuma[i]),vl);
+        diffR = _mm_div_pd(_mm_sub_pd(_mm_loadu_pd(&ctx->kernelRed[i]),vr),v255);
+        diffG = _mm_div_pd(_mm_sub_pd(_mm_loadu_pd(&ctx->kernelGreen[i]),vg),v255);
+        diffB = _mm_div_pd(_mm_sub_pd(_mm_loadu_pd(&ctx->kernelBlue[i]),vb),v255);
+        sum = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_mul_pd(diffR,diffR),wr),
+                                    _mm_mul_pd(_mm_mul_pd(diffG,diffG),wg)),
+                         _mm_mul_pd(_mm_mul_pd(diffB,diffB),wb));
+        _mm_storeu_pd(&distance[i],_mm_add_pd(_mm_mul_pd(sum,v75),_mm_mul_pd(lumadiff,lumadiff)));
+        wb = _mm_set1_pd(blue);
+    }
+}
+
+__attribute__((target("avx")))
+void DistanceKernelAVX(A2BCONTEXT *ctx, double dr, double dg, double db, double luma,
+                       double blue0, double blue, double *distance)
+{
+    __m256d vr = _mm256_set1_pd(dr), vg = _mm256_set1_pd(dg), vb = _mm256_set1_pd(db), vl = _mm256_set1_pd(luma);
+    __m256d v255 = _mm256_set1_pd(255.0), v75 = _mm256_set1_pd(0.75);
+    __m256d wr = _mm256_set1_pd(ctx->dlumaRED), wg = _mm256_set1_pd(ctx->dlumaGREEN);
+    __m256d wb = _mm256_set_pd(blue,blue,blue,blue0);
+    __m256d diffR, diffG, diffB, lumadiff, sum;
+    int i;
+
+    for (i=0;i<16;i+=4) {
+        lumadiff = _mm256_sub_pd(_mm256_loadu_pd(&ctx->kernelLuma[i]),vl);
+        diffR = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(&ctx->kernelRed[i]),vr),v255);
+        diffG = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(&ctx->kernelGreen[i]),vg),v255);
+        diffB = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(&ctx->kernelBlue[i]),vb),v255);
+        sum = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(diffR,diffR),wr),
+                                          _mm256_mul_pd(_mm256_mul_pd(diffG,diffG),wg)),
+                            _mm256_mul_pd(_mm256_mul_pd(diffB,diffB),wb));
+        _mm256_storeu_pd(&distance[i],_mm256_add_pd(_mm256_mul_pd(sum,v75),_mm256_mul_pd(lumadiff,lumadiff)));
+        wb = _mm256_set1_pd(blue);
+    }
+}
+#endif
+
+/* pick the fastest kernel that this cpu supports */
+/* NULL if there is none and GetKernelColor uses the scalar code */
+DISTANCEKERNEL SelectDistanceKernel()
+{
+#ifdef SIMDKERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) return DistanceKernelAVX;
+    if (__builtin_cpu_supports("sse2")) return DistanceKernelSSE2;
+#endif
+    return NULL;
+}
+
+/* score the current palette and return the closest entry in mask */
+/* weights is DIST_CLOSEST, DIST_256 or DIST_INDEX */
+uchar GetKernelColor(A2BCONTEXT *ctx, uchar r, uchar g, uchar b, int weights, unsigned mask, double *mindistance)
+{
+    uchar drawcolor = 0, fixedcolor;
+    double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, dist, distance[16], blue = ctx->dlumaBLUE;
+    long long fixed;
+    int i;
+
+    if (ctx->fixeddistance == 1) {
+        drawcolor = GetDistColor(&ctx->distpalette,&ctx->distweights[weights],r,g,b,mask,&fixed);
+        mindistance[0] = (double)fixed / DIST_SCALE;
+        return drawcolor;
+    }
+
+    if (weights == DIST_256) blue = 0.114;
+    else if (weights == DIST_INDEX) blue = ctx->dlumaGREEN;
+
+    dr = (double)r;
+    dg = (double)g;
+    db = (double)b;
+    luma = (dr*ctx->lumaRED + dg*ctx->lumaGREEN + db*ctx->lumaBLUE) / (255.0*1000);
+
+    if (ctx->distancekernel != NULL) {
+        ctx->distancekernel(ctx,dr,dg,db,luma,ctx->dlumaGREEN,blue,distance);
+
+        /* first entry with the shortest distance */
+        mindistance[0] = distance[0];
+        for (i=1;i<16;i++) {
+            if ((mask & (1U << i)) == 0) continue;
+            if (distance[i] < mindistance[0]) {
+               mindistance[0] = distance[i];
+               drawcolor = (uchar)i;
+            }
+        }
+    }
+    else {
+        /* the first entry is scored with the DIST_INDEX blue weight */
+        lumadiff = ctx->rgbLuma[0]-luma;
+        diffR = (ctx->rgbDouble[0][0]-dr)/255.0;
+        diffG = (ctx->rgbDouble[0][1]-dg)/255.0;
+        diffB = (ctx->rgbDouble[0][2]-db)/255.0;
+        mindistance[0] = (diffR*diffR*ctx->dlumaRED + diffG*diffG*ctx->dlumaGREEN + diffB*diffB*ctx->dlumaGREEN)*0.75
+            + lumadiff*lumadiff;
+
+        /* score the rest and keep the first entry with the shortest distance */
+        for (i=1;i<16;i++) {
+            if ((mask & (1U << i)) == 0) continue;
+            lumadiff = ctx->rgbLuma[i]-luma;
+            diffR = (ctx->rgbDouble[i][0]-dr)/255.0;
+            diffG = (ctx->rgbDouble[i][1]-dg)/255.0;
+            diffB = (ctx->rgbDouble[i][2]-db)/255.0;
+            dist = (diffR*diffR*ctx->dlumaRED + diffG*diffG*ctx->dlumaGREEN + diffB*diffB*blue)*0.75
+                + lumadiff*lumadiff;
+            if (dist < mindistance[0]) {
+               mindistance[0] = dist;
+               drawcolor = (uchar)i;
+            }
+        }
+    }
+
+    if (ctx->fixeddistance == 2) {
+        /* count the lookups where the fixed-point engine would pick another color */
+        fixedcolor = GetDistColor(&ctx->distpalette,&ctx->distweights[weights],r,g,b,mask,&fixed);
+        ctx->distlookups++;
+        if (fixedcolor != drawcolor) ctx->distmismatches++;
+    }
+    return drawcolor;
+}
+
+/* report the results of option "fixedcheck" */
+void ReportDistanceCheck(A2BCONTEXT *ctx, char *name)
+{
+    if (ctx->fixeddistance != 2) return;
+    printf("%s: fixed-point distance differs in %lu of %lu lookups\n",
+           name,(unsigned long)ctx->distmismatches,(unsigned long)ctx->distlookups);
+}
 
 /* intialize the values for the current palette */
-void InitDoubleArrays()
+void InitDoubleArrays(A2BCONTEXT *ctx)
 {
     int i;
     double dr, dg, db;
 
    /* array for matching closest color in palette */
     for (i=0;i<16;i++) {
-        rgbDouble[i][0] = dr = (double) rgbArray[i][0];
-        rgbDouble[i][1] = dg = (double) rgbArray[i][1];
-        rgbDouble[i][2] = db = (double) rgbArray[i][2];
-        rgbLuma[i] = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
+        ctx->rgbDouble[i][0] = dr = (double) ctx->rgbArray[i][0];
+        ctx->rgbDouble[i][1] = dg = (double) ctx->rgbArray[i][1];
+        ctx->rgbDouble[i][2] = db = (double) ctx->rgbArray[i][2];
+        ctx->rgbLuma[i] = (dr*ctx->lumaRED + dg*ctx->lumaGREEN + db*ctx->lumaBLUE) / (255.0*1000);
     }
+    InitDistanceKernel(ctx);
 
 }
 
 /* for SHR output */
 /* intialize the closest color palette for each scanline */
-void InitDoubleLineArrays(int y)
+void InitDoubleLineArrays(A2BCONTEXT *ctx, int y)
 {
 
     int i;
@@ -2172,16 +2659,17 @@ void InitDoubleLineArrays(int y)
 
     /* array for matching closest color in palette */
     for (i=0;i<16;i++) {
-        rgbDouble[i][0] = dr = (double) rgbArrays[y][i][0];
-        rgbDouble[i][1] = dg = (double) rgbArrays[y][i][1];
-        rgbDouble[i][2] = db = (double) rgbArrays[y][i][2];
-        rgbLuma[i] = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
+        ctx->rgbDouble[i][0] = dr = (double) ctx->rgbArrays[y][i][0];
+        ctx->rgbDouble[i][1] = dg = (double) ctx->rgbArrays[y][i][1];
+        ctx->rgbDouble[i][2] = db = (double) ctx->rgbArrays[y][i][2];
+        ctx->rgbLuma[i] = (dr*ctx->lumaRED + dg*ctx->lumaGREEN + db*ctx->lumaBLUE) / (255.0*1000);
     }
+    InitDistanceKernel(ctx);
 
-    brooksline = y;
+    ctx->brooksline = y;
 }
 
-void InitDoubleLine256Arrays(int idx)
+void InitDoubleLine256Arrays(A2BCONTEXT *ctx, int idx)
 {
 
     int i;
@@ -2189,15 +2677,16 @@ void InitDoubleLine256Arrays(int idx)
 
     /* array for matching closest color in palette */
     for (i=0;i<16;i++) {
-        rgbDouble[i][0] = dr = (double) rgb256Arrays[idx][i][0];
-        rgbDouble[i][1] = dg = (double) rgb256Arrays[idx][i][1];
-        rgbDouble[i][2] = db = (double) rgb256Arrays[idx][i][2];
-        rgbLuma[i] = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
+        ctx->rgbDouble[i][0] = dr = (double) ctx->rgb256Arrays[idx][i][0];
+        ctx->rgbDouble[i][1] = dg = (double) ctx->rgb256Arrays[idx][i][1];
+        ctx->rgbDouble[i][2] = db = (double) ctx->rgb256Arrays[idx][i][2];
+        ctx->rgbLuma[i] = (dr*ctx->lumaRED + dg*ctx->lumaGREEN + db*ctx->lumaBLUE) / (255.0*1000);
     }
+    InitDistanceKernel(ctx);
 
-    for (i=0,brooksline=0;i<200;i++) {
-        if (idx == (int)mypic.scb[i]) {
-            brooksline = i;
+    for (i=0,ctx->brooksline=0;i<200;i++) {
+        if (idx == (int)ctx->mypic.scb[i]) {
+            ctx->brooksline = i;
             break;
         }
     }
@@ -2205,186 +2694,214 @@ void InitDoubleLine256Arrays(int idx)
 
 
 
-double globaldistance = 0.0, indexdistance = 0.0, brooksdistance = 0.0;
-
 /* use CCIR 601 luminosity to get color distance value */
-uchar GetColorDistance(uchar r, uchar g, uchar b, uchar idx)
+uchar GetColorDistance(A2BCONTEXT *ctx, uchar r, uchar g, uchar b, uchar idx)
 {
-    uchar drawcolor, i;
-    double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
+    unsigned mask = 0x8001;
 
-    indexdistance = 0.0;
+    ctx->indexdistance = 0.0;
 
-    /* use nearest color */
-    dr = (double)r;
-    dg = (double)g;
-    db = (double)b;
-    luma = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
-    lumadiff = rgbLuma[0]-luma;
+    /* only the requested index and the last color are compared with the first */
+    if (idx > 0 && idx < 15) mask |= (1U << idx);
 
     /* Compare the difference of RGB values, weigh by CCIR 601 luminosity */
-    /* set palette index to color with shortest distance */
-
-    /* get color distance to first palette color */
-    diffR = (rgbDouble[0][0]-dr)/255.0;
-    diffG = (rgbDouble[0][1]-dg)/255.0;
-    diffB = (rgbDouble[0][2]-db)/255.0;
-
-    prevdistance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
-         + lumadiff*lumadiff;
-    /* set palette index to first color */
-    drawcolor = 0;
-
-    /* get color distance to rest of palette colors */
-    for (i=1;i<16;i++) {
-
-        if (i<15) {
-            if (i != idx) continue;
-        }
-        /* get color distance of this index */
-        lumadiff = rgbLuma[i]-luma;
-        diffR = (rgbDouble[i][0]-dr)/255.0;
-        diffG = (rgbDouble[i][1]-dg)/255.0;
-        diffB = (rgbDouble[i][2]-db)/255.0;
-        distance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
-            + lumadiff*lumadiff;
-
-        /* if distance is smaller use this index */
-        if (distance < prevdistance) {
-           prevdistance = distance;
-           drawcolor = (uchar)i;
-        }
-
-    }
-    indexdistance = prevdistance;
-    return drawcolor;
+    return GetKernelColor(ctx,r,g,b,DIST_INDEX,mask,&ctx->indexdistance);
 }
 
 
 /* use CCIR 601 luminosity to get closest color in current palette */
 /* based on palette that has been selected for conversion */
-uchar GetClosestColor(uchar r, uchar g, uchar b)
+uchar GetClosestColor(A2BCONTEXT *ctx, uchar r, uchar g, uchar b)
 {
-    uchar drawcolor;
-    double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
-    int i,j=brooksline;
+    int i,j=ctx->brooksline;
 
-    globaldistance = 0.0;
+    ctx->globaldistance = 0.0;
+    StatsCount(ctx->stats,STATS_NEAREST,1L);
 
     /* look for exact match */
     for (i=0;i<16;i++) {
-        if (brooksline == 999) {
-            if (r == rgbArray[i][0] && g == rgbArray[i][1] && b == rgbArray[i][2]) return (uchar)i;
+        if (ctx->brooksline == 999) {
+            if (r == ctx->rgbArray[i][0] && g == ctx->rgbArray[i][1] && b == ctx->rgbArray[i][2]) break;
         }
         else {
-            if (r == rgbArrays[j][i][0] && g == rgbArrays[j][i][1] && b == rgbArrays[j][i][2]) return (uchar)i;
+            if (r == ctx->rgbArrays[j][i][0] && g == ctx->rgbArrays[j][i][1] && b == ctx->rgbArrays[j][i][2]) break;
         }
     }
+    if (i < 16) {
+        StatsCount(ctx->stats,STATS_EXACT,1L);
+        return (uchar)i;
+    }
 
     /* if no exact match use nearest color */
-    dr = (double)r;
-    dg = (double)g;
-    db = (double)b;
-    luma = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
-    lumadiff = rgbLuma[0]-luma;
-
     /* Compare the difference of RGB values, weigh by CCIR 601 luminosity */
-    /* set palette index to color with shortest distance */
-
-    /* get color distance to first palette color */
-    diffR = (rgbDouble[0][0]-dr)/255.0;
-    diffG = (rgbDouble[0][1]-dg)/255.0;
-    diffB = (rgbDouble[0][2]-db)/255.0;
-
-    prevdistance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
-         + lumadiff*lumadiff;
-    /* set palette index to first color */
-    drawcolor = 0;
-
-    /* get color distance to rest of palette colors */
-    for (i=1;i<16;i++) {
-
-        /* get color distance of this index */
-        lumadiff = rgbLuma[i]-luma;
-        diffR = (rgbDouble[i][0]-dr)/255.0;
-        diffG = (rgbDouble[i][1]-dg)/255.0;
-        diffB = (rgbDouble[i][2]-db)/255.0;
-        distance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaBLUE)*0.75
-            + lumadiff*lumadiff;
+    return GetKernelColor(ctx,r,g,b,DIST_CLOSEST,0xffff,&ctx->globaldistance);
+}
 
-        /* if distance is smaller use this index */
-        if (distance < prevdistance) {
-           prevdistance = distance;
-           drawcolor = (uchar)i;
+/* map a scanline of bmp blue, green, red triples to the current palette */
+/* gives the same colors as calling GetClosestColor() for each pixel */
+void GetClosestColorRow(A2BCONTEXT *ctx, uchar *bgr, uchar *colors, int width)
+{
+    unsigned exact[16], color;
+    int i,j=ctx->brooksline,x;
+    long hits = 0L;
+    uchar *ptr;
+
+    /* the palette can't change during the scanline so pack it once */
+    for (i=0;i<16;i++) {
+        if (ctx->brooksline == 999) ptr = (uchar *)&ctx->rgbArray[i][0];
+        else ptr = (uchar *)&ctx->rgbArrays[j][i][0];
+        exact[i] = ((unsigned)ptr[0] << 16) | ((unsigned)ptr[1] << 8) | ptr[2];
+    }
+
+    for (x=0;x<width;x++,bgr+=3) {
+        ctx->globaldistance = 0.0;
+
+        /* look for exact match */
+        color = ((unsigned)bgr[2] << 16) | ((unsigned)bgr[1] << 8) | bgr[0];
+        for (i=0;i<16;i++) {
+            if (color == exact[i]) break;
+        }
+        if (i < 16) {
+            colors[x] = (uchar)i;
+            hits++;
+            continue;
         }
 
+        /* if no exact match use nearest color */
+        colors[x] = GetKernelColor(ctx,bgr[2],bgr[1],bgr[0],DIST_CLOSEST,0xffff,&ctx->globaldistance);
     }
-    globaldistance = prevdistance;
-    return drawcolor;
+    StatsCount(ctx->stats,STATS_NEAREST,(long)width);
+    StatsCount(ctx->stats,STATS_EXACT,hits);
+}
+
+
+/* rate-distortion dithering (option "rd") for SHR output */
+/* PackBytes packs runs of the same byte and a byte is 2 pixels, so a run
+   only grows when both pixels repeat the byte to the left. the first pixel
+   of a byte takes the first color of the byte to the left when the extra
+   error of the pair is within lambda (squared RGB difference against the
+   closest colors). the second pixel is scored on its value before this
+   pixel's error reaches it. the second pixel then finishes the repeat if
+   the first one repeats and the pair is still within lambda with its own
+   value. the dither carries the extra error forward.
+   pal is the 16 color palette that the dither is using for the line. */
+uchar GetRunColor(A2BCONTEXT *ctx, sshort red, sshort green, sshort blue, uchar drawcolor, uchar pal[16][3], int x, int y)
+{
+    long best, dist, rundist, nextdist, nextbest;
+    int i, run, dr, dg, db, r, g, b;
+    uchar runcolor = drawcolor;
+
+    if (ctx->rdlambda == 0 || ctx->shr != 320 || x > 319 || y > 199) return drawcolor;
+
+    if (red < 0) red = 0; else if (red > 255) red = 255;
+    if (green < 0) green = 0; else if (green > 255) green = 255;
+    if (blue < 0) blue = 0; else if (blue > 255) blue = 255;
+
+    dr = red - pal[drawcolor][0];
+    dg = green - pal[drawcolor][1];
+    db = blue - pal[drawcolor][2];
+    best = rundist = (long)(dr*dr + dg*dg + db*db);
+
+    /* the same pixel of the byte to the left */
+    run = (x > 1 ? ctx->rdline[x-2] : drawcolor);
+    if (run != drawcolor) {
+        dr = red - pal[run][0];
+        dg = green - pal[run][1];
+        db = blue - pal[run][2];
+        dist = (long)(dr*dr + dg*dg + db*db);
+
+        if ((x & 1) == 0) {
+            /* the second pixel as it stands and the closest color to it */
+            r = ctx->redDither[x+1];   if (r < 0) r = 0; else if (r > 255) r = 255;
+            g = ctx->greenDither[x+1]; if (g < 0) g = 0; else if (g > 255) g = 255;
+            b = ctx->blueDither[x+1];  if (b < 0) b = 0; else if (b > 255) b = 255;
+            for (i = 0, nextbest = 0L; i < 16; i++) {
+                dr = r - pal[i][0];
+                dg = g - pal[i][1];
+                db = b - pal[i][2];
+                nextdist = (long)(dr*dr + dg*dg + db*db);
+                if (i == 0 || nextdist < nextbest) nextbest = nextdist;
+            }
+            /* and the error of repeating the second color of the byte to the left */
+            i = ctx->rdline[x-1];
+            dr = r - pal[i][0];
+            dg = g - pal[i][1];
+            db = b - pal[i][2];
+            nextdist = (long)(dr*dr + dg*dg + db*db);
+            if (dist - best + nextdist - nextbest <= (long)ctx->rdlambda) {
+                rundist = dist;
+                runcolor = (uchar)run;
+            }
+        }
+        else if (ctx->rdline[x-1] == ctx->rdline[x-3] &&
+                 ctx->rdspent + dist - best <= (long)ctx->rdlambda) {
+            rundist = dist;
+            runcolor = (uchar)run;
+        }
+    }
+    if ((x & 1) == 0) ctx->rdspent = rundist - best;
+
+    /* keep score for the report */
+    ctx->rdline[x] = runcolor;
+    if ((x & 1) == 0) ctx->rdbest[y][x/2] = (uchar)(drawcolor << 4);
+    else ctx->rdbest[y][x/2] |= drawcolor;
+    ctx->rdbestsse += (double)best;
+    ctx->rdsse += (double)rundist;
+
+    return runcolor;
 }
 
+/* bytes saved against quality lost by rate-distortion dithering */
+/* the closest colors along the same dither are packed for comparison */
+/* PSNR is the RGB error against the colors the dither asked for */
+void RDReport(A2BCONTEXT *ctx, uchar *shrpixels)
+{
+    uchar packed[PB_PACKEDMAX(160)];
+    long bytes = 0, bestbytes = 0;
+    int y;
+    double psnr, bestpsnr;
+
+    if (ctx->rdlambda == 0) return;
+
+    for (y = 0; y < 200; y++) {
+        bytes += PackBytesOptimal(&shrpixels[y*160],160,packed);
+        bestbytes += PackBytesOptimal(&ctx->rdbest[y][0],160,packed);
+    }
+
+    /* squared error against the dithered colors, per channel */
+    psnr = 10.0 * log10(255.0 * 255.0 * 192000.0 / (ctx->rdsse > 0.0 ? ctx->rdsse : 1.0));
+    bestpsnr = 10.0 * log10(255.0 * 255.0 * 192000.0 / (ctx->rdbestsse > 0.0 ? ctx->rdbestsse : 1.0));
+
+    /* the closest colors are closest by luma weighted distance so they
+       are not always closer in RGB and the PSNR can go either way */
+    printf("rd lambda %d: %ld packed bytes against %ld for the closest colors (%ld saved, %.1f%%)\n",
+        ctx->rdlambda, bytes, bestbytes, bestbytes - bytes,
+        (double)(bestbytes - bytes) * 100.0 / (bestbytes > 0 ? bestbytes : 1));
+    printf("rd lambda %d: PSNR %.2f dB against %.2f dB for the closest colors (%+.2f dB)\n",
+        ctx->rdlambda, psnr, bestpsnr, psnr - bestpsnr);
+}
 
 /* use CCIR 601 luminosity to get closest color in current palette */
 /* based on palette that has been selected for conversion */
-uchar GetClosest256Color(uchar r, uchar g, uchar b, int palno)
+uchar GetClosest256Color(A2BCONTEXT *ctx, uchar r, uchar g, uchar b, int palno)
 {
-    uchar drawcolor;
-    double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
     int i,j=palno;
 
-    globaldistance = 0.0;
+    ctx->globaldistance = 0.0;
 
     /* look for exact match */
     for (i=0;i<16;i++) {
         if (palno == 999) {
-            if (r == rgbArray[i][0] && g == rgbArray[i][1] && b == rgbArray[i][2]) return (uchar)i;
+            if (r == ctx->rgbArray[i][0] && g == ctx->rgbArray[i][1] && b == ctx->rgbArray[i][2]) return (uchar)i;
         }
         else {
-            if (r == rgb256Arrays[j][i][0] && g == rgb256Arrays[j][i][1] && b == rgb256Arrays[j][i][2]) return (uchar)i;
+            if (r == ctx->rgb256Arrays[j][i][0] && g == ctx->rgb256Arrays[j][i][1] && b == ctx->rgb256Arrays[j][i][2]) return (uchar)i;
         }
     }
 
     /* if no exact match use nearest color */
-    dr = (double)r;
-    dg = (double)g;
-    db = (double)b;
-    luma = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
-    lumadiff = rgbLuma[0]-luma;
-
     /* Compare the difference of RGB values, weigh by CCIR 601 luminosity */
-    /* set palette index to color with shortest distance */
-
-    /* get color distance to first palette color */
-    diffR = (rgbDouble[0][0]-dr)/255.0;
-    diffG = (rgbDouble[0][1]-dg)/255.0;
-    diffB = (rgbDouble[0][2]-db)/255.0;
-
-    prevdistance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
-         + lumadiff*lumadiff;
-
-      /* set palette index to first color */
-    drawcolor = 0;
-
-    /* get color distance to rest of palette colors */
-    for (i=1;i<16;i++) {
-
-        /* get color distance of this index */
-        lumadiff = rgbLuma[i]-luma;
-        diffR = (rgbDouble[i][0]-dr)/255.0;
-        diffG = (rgbDouble[i][1]-dg)/255.0;
-        diffB = (rgbDouble[i][2]-db)/255.0;
-        distance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*0.114)*0.75
-            + lumadiff*lumadiff;
-
-        /* if distance is smaller use this index */
-        if (distance < prevdistance) {
-           prevdistance = distance;
-           drawcolor = (uchar)i;
-        }
-
-    }
-    globaldistance = prevdistance;
-    return drawcolor;
+    return GetKernelColor(ctx,r,g,b,DIST_256,0xffff,&ctx->globaldistance);
 }
 
 
@@ -2392,7 +2909,7 @@ uchar GetClosest256Color(uchar r, uchar g, uchar b, int palno)
 /* a double hi-res pixel can occur at any one of 7 positions */
 /* in a 4 byte block which spans aux and main screen memory */
 /* the horizontal resolution is 140 pixels */
-void dhrplot(int x,int y,uchar drawcolor)
+void dhrplot(A2BCONTEXT *ctx, int x,int y,uchar drawcolor)
 {
     int xoff, pattern;
     uchar *ptraux, *ptrmain;
@@ -2403,8 +2920,8 @@ void dhrplot(int x,int y,uchar drawcolor)
 
     pattern = (x%7);
     xoff = HB[y] + ((x/7) * 2);
-    ptraux  = (uchar *) &dhrbuf[xoff-0x2000];
-    ptrmain = (uchar *) &dhrbuf[xoff];
+    ptraux  = (uchar *) &ctx->dhrbuf[xoff-0x2000];
+    ptrmain = (uchar *) &ctx->dhrbuf[xoff];
 
 
     switch(pattern)
@@ -2456,7 +2973,7 @@ void dhrplot(int x,int y,uchar drawcolor)
 unsigned char dhbmono[] = {0x7e,0x7d,0x7b,0x77,0x6f,0x5f,0x3f};
 unsigned char dhwmono[] = {0x1,0x2,0x4,0x8,0x10,0x20,0x40};
 
-void dhrmonoplot(int x, int y, uchar drawcolor)
+void dhrmonoplot(A2BCONTEXT *ctx, int x, int y, uchar drawcolor)
 {
 
     int xoff, pixel;
@@ -2469,11 +2986,11 @@ void dhrmonoplot(int x, int y, uchar drawcolor)
     if (pixel > 6) {
         /* main memory */
         pixel -= 7;
-        ptr = (uchar *) &dhrbuf[xoff];
+        ptr = (uchar *) &ctx->dhrbuf[xoff];
     }
     else {
         /* auxiliary memory */
-        ptr  = (uchar *) &dhrbuf[xoff-0x2000];
+        ptr  = (uchar *) &ctx->dhrbuf[xoff-0x2000];
     }
 
     if (drawcolor != 0) {
@@ -2488,17 +3005,6 @@ void dhrmonoplot(int x, int y, uchar drawcolor)
 }
 
 
-sshort redDither[640],greenDither[640],blueDither[640];
-/* seed values from previous line */
-sshort redSeed[640],greenSeed[640],blueSeed[640];
-sshort redSeed2[640],greenSeed2[640],blueSeed2[640];
-/* save and restore values for SHR palette matching */
-sshort redSave[640],greenSave[640], blueSave[640];
-
-/* in this implementation color bleed is fixed for my dither */
-/* it will be either full (8/8) like Floyd-Steinberg or reduced 20% (8/10) */
-int bleed = 8;
-
 /* setting clip to 0 increases the potential amount of retained error */
 /* error is accumulated in a short integer and may be negative or positive */
 uchar AdjustShortPixel(int clip,sshort *buf,sshort value)
@@ -2516,202 +3022,298 @@ uchar AdjustShortPixel(int clip,sshort *buf,sshort value)
     return (uchar) value;
 }
 
-/* this is set-up to handle image fragments as well as full-screen dithering */
-/* nominal DHGR resolutions supported are:
-   140 x 192 - 4-bit pixels - same as Bmp2DHR and tohgr DHGR color
-   280 x 192 - 2-bit pixels - same as Bmp2DHR HGR monochrome (not sure about Outlaw Editor HGR color)
-   560 x 192 - 1-bit pixels - same as Bmp2DHR DHGR monochrome and Outlaw Editor DHGR color
+/* ------------------------------------------------------------------------ */
+/* Error Diffusion                                                          */
+/* ------------------------------------------------------------------------ */
 
-   This is somewhat confusing I admit.
+/* BuckelsDither, BrooksDither, PicDither and BrooksPicDither each pick the
+   palette for the scanline their own way and then diffuse the error with one
+   of the kernels below. a kernel is DiffuseKernel() with its pattern and
+   color matching fixed. DiffuseKernel() has a pixel loop for each pattern
+   and spreads the red, green and blue errors one after the other, so there
+   is no switch on the pattern or the channel in a pixel loop even when the
+   compiler does not inline it.
+
+   the three channels are diffused together into the red, green and blue
+   error rows. the taps are (error * weight) / bleed, which is looked up for
+   each of the 511 possible errors instead of divided out for each tap. the
+   table is rebuilt when the bleed or error summing changes. */
+
+/* diffusion patterns */
+#define DIFFUSE_FLOYD    0 /* Floyd-Steinberg */
+#define DIFFUSE_ATKINSON 1 /* Atkinson and Atkinson 2 */
+#define DIFFUSE_BUCKELS  2 /* Buckels - and the other dither types with their own bleed */
+
+/* color matching */
+#define MATCH_CLOSEST 0 /* GetClosestColor() on the current palette */
+#define MATCH_256     1 /* GetClosest256Color() on palette palno */
+
+/* add a tap to the current line and clip it like AdjustShortPixel(1,...) */
+#define DIFFUSE_CLIP(ptr,value) { sshort v_ = (sshort)((ptr)[0] + (sshort)(value)); \
+                                  (ptr)[0] = (sshort)(v_ < 0 ? 0 : (v_ > 255 ? 255 : v_)); }
+/* add a tap to a line below and keep all of it like AdjustShortPixel(0,...) */
+#define DIFFUSE_ADD(ptr,value) { (ptr)[0] = (sshort)((ptr)[0] + (sshort)(value)); }
+
+void SetDitherTaps(DITHERTAPS *taps, int error, int bleed, int errorsum)
+{
+    taps->one   = (sshort)(error / bleed);
+    taps->two   = (sshort)((error * 2) / bleed);
+    taps->three = (sshort)((error * 3) / bleed);
+    taps->five  = (sshort)((error * 5) / bleed);
+    taps->seven = (sshort)((error * 7) / bleed);
+
+    if (errorsum == 0) {
+        taps->floydrest = taps->rest = 0;
+        return;
+    }
+    /* the rounding error lost by the taps */
+    taps->floydrest = (sshort)((error * 16) / bleed -
+        ((error * 3) / bleed + (error * 5) / bleed + (error * 1) / bleed + (error * 7) / bleed));
+    taps->rest = (sshort)((error * 8) / bleed - ((error * 2) / bleed * 2 + (error / bleed) * 4));
+}
 
-   To make things even more confusing this also handles LGR and DLGR, and SHR PIC files
-*/
+void InitDitherTaps(A2BCONTEXT *ctx)
+{
+    int error;
+
+    for (error = -255; error < 256; error++)
+        SetDitherTaps(&ctx->dithertaps[error + 255],error,ctx->bleed,ctx->errorsum);
+    ctx->tapsbleed = ctx->bleed;
+    ctx->tapserrorsum = ctx->errorsum;
+}
 
-void BuckelsDither(int y, int width, int pixels)
+/* the diffusion pattern of the selected dither type */
+int DiffusePattern(A2BCONTEXT *ctx)
 {
+    switch(ctx->dithertype) {
+        case FLOYDSTEINBERG: return DIFFUSE_FLOYD;
+        case ATKINSON:
+        case ATKINSON2:      return DIFFUSE_ATKINSON;
+    }
+    return DIFFUSE_BUCKELS;
+}
 
-    sshort *colorptr, *seedptr, *seed2ptr, color_error, random_error, errbuf[6];
-    sshort red, green, blue, red_error, green_error, blue_error;
-    int i,x,x1,x2;
-    int total_difference, total_error, total_used;
-    uchar drawcolor,r,g,b,idx;
+/* the taps for one channel's error */
+/* the current line is clipped so the error is too - other errors only come
+   from a palette color outside 0-255 and get taps of their own */
+DIFFUSEINLINE DITHERTAPS *DiffuseTaps(A2BCONTEXT *ctx, sshort error, DITHERTAPS *outside)
+{
+    if (error > -256 && error < 256) return &ctx->dithertaps[error + 255];
+    SetDitherTaps(outside,error,ctx->bleed,ctx->errorsum);
+    return outside;
+}
 
-    /* bits per pixel */
-    switch(pixels) {
-        case 4: if (width > 280) pixels = 1;
-                else if (width > 140) pixels = 2;
-                break;
-        case 2: if (width > 280) pixels = 1;
-                break;
-        default: pixels = 1;
+/* match pixel x of the current line, leave the palette color in its place
+   and give the error of each channel */
+DIFFUSEINLINE void DiffuseMatch(A2BCONTEXT *ctx, int x, int y, uchar pal[16][3], int palno, int match,
+                                sshort errors[3])
+{
+    sshort red, green, blue;
+    uchar drawcolor;
 
-    }
+    red   = ctx->redDither[x];
+    green = ctx->greenDither[x];
+    blue  = ctx->blueDither[x];
 
-    for (x=0;x<width;x++) {
+    if (match == MATCH_256) drawcolor = GetClosest256Color(ctx, (uchar)red,(uchar)green,(uchar)blue,palno);
+    else drawcolor = GetClosestColor(ctx, (uchar)red,(uchar)green,(uchar)blue);
+    drawcolor = GetRunColor(ctx,red,green,blue,drawcolor,pal,x,y);
 
-        red   = redDither[x];
-        green = greenDither[x];
-        blue  = blueDither[x];
+    ctx->redDither[x]   = pal[drawcolor][0];
+    ctx->greenDither[x] = pal[drawcolor][1];
+    ctx->blueDither[x]  = pal[drawcolor][2];
 
-        drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
+    /* the error is linear in this implementation */
+    /* - an integer is used so round-off of errors occurs
+     - also clipping of the error occurs under some circumstances
+     - no luminance consideration
+     - no gamma correction
+    */
+    errors[0] = red - pal[drawcolor][0];
+    errors[1] = green - pal[drawcolor][1];
+    errors[2] = blue - pal[drawcolor][2];
+}
 
-        if (brooks == 0) {
-            r = rgbArray[drawcolor][0];
-            g = rgbArray[drawcolor][1];
-            b = rgbArray[drawcolor][2];
-        }
-        else {
-            r = rgbArrays[y][drawcolor][0];
-            g = rgbArrays[y][drawcolor][1];
-            b = rgbArrays[y][drawcolor][2];
-        }
+/* spread one channel's error from pixel x */
+DIFFUSEINLINE void DiffuseFloydTaps(DITHERTAPS *taps, sshort *colorptr, sshort *seedptr, int x)
+{
+    /*
+        *   7
+    3   5   1   (1/16)
+    */
 
-        redDither[x]   = (int)r;
-        greenDither[x] = (int)g;
-        blueDither[x]  = (int)b;
+    /* finish this line - with the rounding error if error summing is on */
+    DIFFUSE_CLIP(&colorptr[x+1],taps->seven + taps->floydrest);
+    /* seed next line forward */
+    if (x>0) DIFFUSE_ADD(&seedptr[x-1],taps->three);
+    DIFFUSE_ADD(&seedptr[x+1],taps->one);
+    DIFFUSE_ADD(&seedptr[x],taps->five);
+}
 
-        /* the error is linear in this implementation */
-        /* - an integer is used so round-off of errors occurs
-         - also clipping of the error occurs under some circumstances
-         - no luminance consideration
-         - no gamma correction
-        */
+DIFFUSEINLINE void DiffuseAtkinsonTaps(DITHERTAPS *taps, sshort *colorptr, sshort *seedptr, sshort *seed2ptr, int x)
+{
+    /*
+        *   1   1
+    1   1   1
+        1           (1/8 - reduced bleed) or (1/6 full bleed even diffusion)
 
-        red_error   = red - r;
-        green_error = green - g;
-        blue_error  = blue - b;
-
-        for (i=0;i<3;i++) {
-
-            /* loop through all 3 RGB channels */
-            switch(i) {
-                case 0: colorptr = (sshort *)&redDither[0];
-                        seedptr   = (sshort *)&redSeed[0];
-                        seed2ptr  = (sshort *)&redSeed2[0];
-                        color_error = red_error;
-                        break;
-                case 1: colorptr = (sshort *)&greenDither[0];
-                        seedptr   = (sshort *)&greenSeed[0];
-                        seed2ptr  = (sshort *)&greenSeed2[0];
-                        color_error = green_error;
-                        break;
-                case 2: colorptr = (sshort *)&blueDither[0];
-                        seedptr   = (sshort *)&blueSeed[0];
-                        seed2ptr  = (sshort *)&blueSeed2[0];
-                        color_error = blue_error;
-                        break;
-            }
-
-            /* diffuse the error based on the dither */
-            switch(dithertype)
-            {
-
-            case FLOYDSTEINBERG:
-                /*
-                    *   7
-                3   5   1   (1/16)
-                */
-
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 16) / bleed;
-                    total_used =  (color_error * 3)/bleed;
-                    total_used += (color_error * 5)/bleed;
-                    total_used += (color_error * 1)/bleed;
-                    total_used += (color_error * 7)/bleed;
-                    total_difference = total_error - total_used;
-                }
+    */
 
+    /* finish this line */
+    DIFFUSE_CLIP(&colorptr[x+1],taps->one);
+    DIFFUSE_CLIP(&colorptr[x+2],taps->one);
 
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 7)/bleed)+total_difference);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)((color_error * 3)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)((color_error * 1)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error * 5)/bleed));
-                break;
+    /* seed next line forward */
+    if (x>0) DIFFUSE_ADD(&seedptr[x-1],taps->one);
+    DIFFUSE_ADD(&seedptr[x],taps->one);
+    DIFFUSE_ADD(&seedptr[x+1],taps->one);
+
+    /* seed furthest line forward */
+    DIFFUSE_ADD(&seed2ptr[x],taps->one);
+}
+
+DIFFUSEINLINE void DiffuseBuckelsTaps(A2BCONTEXT *ctx, DITHERTAPS *taps, sshort *colorptr, sshort *seedptr,
+                                      sshort *seed2ptr, int x, int random)
+{
+    sshort errbuf[6];
+    uchar idx;
+
+   /* buckels dither */
+   /* uses the same weighting pattern as Atkinson but with full weighting */
+   /*
+      * 2 1
+    1 2 1
+      1          (1/8)
+
+    */
+    /* if error summing is turned-on add the accumulated rounding error
+       to the next pixel */
+    /* random dither automatically turns error summing on in which case
+       rounding errors are placed at random within the atkinson pattern */
+    errbuf[0] = errbuf[1] = errbuf[2] = errbuf[3] = errbuf[4] = errbuf[5] = 0;
+    if (random != 0 && ctx->errorsum != 0) {
+        /* random pixel */
+        idx = RandomRange(ctx, 6) - 1;
+        errbuf[idx] = taps->rest;
+    }
+    else {
+        /* next pixel */
+        errbuf[0] = taps->rest;
+    }
+
+    /* finish this line */
+    DIFFUSE_CLIP(&colorptr[x+1],taps->two + errbuf[0]);
+    DIFFUSE_CLIP(&colorptr[x+2],taps->one + errbuf[1]);
+    /* seed next line forward */
+    if (x>0) DIFFUSE_ADD(&seedptr[x-1],taps->one + errbuf[2]);
+    DIFFUSE_ADD(&seedptr[x],taps->two + errbuf[3]);
+    DIFFUSE_ADD(&seedptr[x+1],taps->one + errbuf[4]);
+    /* seed furthest line forward */
+    DIFFUSE_ADD(&seed2ptr[x],taps->one);
+}
+
+/* dither a scanline to pal and diffuse the error */
+/* the dithered colors are left in the current line */
+/* random places the rounding error of the Buckels pattern at random */
+DIFFUSEINLINE void DiffuseKernel(A2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random,
+                                  int pattern, int match)
+{
+    sshort *red = ctx->redDither, *green = ctx->greenDither, *blue = ctx->blueDither;
+    sshort *redseed = ctx->redSeed, *greenseed = ctx->greenSeed, *blueseed = ctx->blueSeed;
+    sshort *redseed2 = ctx->redSeed2, *greenseed2 = ctx->greenSeed2, *blueseed2 = ctx->blueSeed2;
+    sshort errors[3];
+    DITHERTAPS outside;
+    int x;
+
+    if (ctx->tapsbleed != ctx->bleed || ctx->tapserrorsum != ctx->errorsum) InitDitherTaps(ctx);
+
+    switch(pattern) {
+        case DIFFUSE_FLOYD:
+            for (x=0;x<width;x++) {
+                DiffuseMatch(ctx,x,y,pal,palno,match,errors);
+                DiffuseFloydTaps(DiffuseTaps(ctx,errors[0],&outside),red,redseed,x);
+                DiffuseFloydTaps(DiffuseTaps(ctx,errors[1],&outside),green,greenseed,x);
+                DiffuseFloydTaps(DiffuseTaps(ctx,errors[2],&outside),blue,blueseed,x);
+            }
+            break;
 
-            case ATKINSON:
-            case ATKINSON2:
-                /*
-                    *   1   1
-                1   1   1
-                    1           (1/8 - reduced bleed) or (1/6 full bleed even diffusion)
+        case DIFFUSE_ATKINSON:
+            for (x=0;x<width;x++) {
+                DiffuseMatch(ctx,x,y,pal,palno,match,errors);
+                DiffuseAtkinsonTaps(DiffuseTaps(ctx,errors[0],&outside),red,redseed,redseed2,x);
+                DiffuseAtkinsonTaps(DiffuseTaps(ctx,errors[1],&outside),green,greenseed,greenseed2,x);
+                DiffuseAtkinsonTaps(DiffuseTaps(ctx,errors[2],&outside),blue,blueseed,blueseed2,x);
+            }
+            break;
+
+        default:
+            /* the random rounding error is placed for red, green and blue in turn */
+            for (x=0;x<width;x++) {
+                DiffuseMatch(ctx,x,y,pal,palno,match,errors);
+                DiffuseBuckelsTaps(ctx,DiffuseTaps(ctx,errors[0],&outside),red,redseed,redseed2,x,random);
+                DiffuseBuckelsTaps(ctx,DiffuseTaps(ctx,errors[1],&outside),green,greenseed,greenseed2,x,random);
+                DiffuseBuckelsTaps(ctx,DiffuseTaps(ctx,errors[2],&outside),blue,blueseed,blueseed2,x,random);
+            }
+            break;
+    }
+}
 
-                */
+void DiffuseFloyd(A2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random)
+{
+    DiffuseKernel(ctx,y,width,pal,palno,random,DIFFUSE_FLOYD,MATCH_CLOSEST);
+}
 
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)(color_error/bleed));
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
+void DiffuseAtkinson(A2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random)
+{
+    DiffuseKernel(ctx,y,width,pal,palno,random,DIFFUSE_ATKINSON,MATCH_CLOSEST);
+}
 
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
+void DiffuseBuckels(A2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random)
+{
+    DiffuseKernel(ctx,y,width,pal,palno,random,DIFFUSE_BUCKELS,MATCH_CLOSEST);
+}
 
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-                break;
+void DiffuseBuckels256(A2BCONTEXT *ctx, int y, int width, uchar pal[16][3], int palno, int random)
+{
+    DiffuseKernel(ctx,y,width,pal,palno,random,DIFFUSE_BUCKELS,MATCH_256);
+}
 
-            default:
-
-               /* buckels dither */
-               /* uses the same weighting pattern as Atkinson but with full weighting */
-               /*
-                  * 2 1
-                1 2 1
-                  1          (1/8)
-
-                */
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                /* random dither automatically turns error summing on in which case
-                   rounding errors are placed at random within the atkinson pattern */
-                errbuf[0] = errbuf[1] = errbuf[2] = errbuf[3] = errbuf[4] = errbuf[5] = 0;
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 8) / bleed;
-                    total_used =  (color_error * 2)/bleed;
-                    total_used += (color_error * 2)/bleed;
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_difference = total_error - total_used;
-
-                    if (randomdither == 0) {
-                        /* next pixel */
-                        errbuf[0] = total_difference;
-                    }
-                    else {
-                        /* random pixel */
-                        idx = RandomRange(6) - 1;
-                        errbuf[idx] = total_difference;
+/* the GetClosestColor() kernels in DIFFUSE_ order */
+DIFFUSEKERNEL diffusekernels[3] = {DiffuseFloyd, DiffuseAtkinson, DiffuseBuckels};
 
-                    }
-                }
+/* this is set-up to handle image fragments as well as full-screen dithering */
+/* nominal DHGR resolutions supported are:
+   140 x 192 - 4-bit pixels - same as Bmp2DHR and tohgr DHGR color
+   280 x 192 - 2-bit pixels - same as Bmp2DHR HGR monochrome (not sure about Outlaw Editor HGR color)
+   560 x 192 - 1-bit pixels - same as Bmp2DHR DHGR monochrome and Outlaw Editor DHGR color
+
+   This is somewhat confusing I admit.
+
+   To make things even more confusing this also handles LGR and DLGR, and SHR PIC files
+*/
+
+void BuckelsDither(A2BCONTEXT *ctx, int y, int width, int pixels)
+{
+
+    int i,x,x1,x2;
+    uchar drawcolor,r,g,b,idx;
 
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*2)/bleed)+errbuf[0]);
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed)+errbuf[1]);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed)+errbuf[2]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error*2)/bleed)+errbuf[3]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed)+errbuf[4]);
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
+    /* bits per pixel */
+    switch(pixels) {
+        case 4: if (width > 280) pixels = 1;
+                else if (width > 140) pixels = 2;
                 break;
-            }
+        case 2: if (width > 280) pixels = 1;
+                break;
+        default: pixels = 1;
 
-        }
     }
 
+    if (ctx->brooks == 0)
+        diffusekernels[DiffusePattern(ctx)](ctx,y,width,ctx->rgbArray,0,ctx->randomdither);
+    else
+        diffusekernels[DiffusePattern(ctx)](ctx,y,width,ctx->rgbArrays[y],0,ctx->randomdither);
+
    /* for DHGR */
    /* plot dithered scanline in DHGR buffer using selected conversion palette */
    /* this supports single-bit, double-bit and 4-bit per pixel dithering */
@@ -2724,21 +3326,21 @@ void BuckelsDither(int y, int width, int pixels)
    /* SHR output is also supported in 320 x 200 only */
    for (x=0,x1=0,x2=0;x<width;x++) {
 
-        r = (uchar)redDither[x];
-        g = (uchar)greenDither[x];
-        b = (uchar)blueDither[x];
+        r = (uchar)ctx->redDither[x];
+        g = (uchar)ctx->greenDither[x];
+        b = (uchar)ctx->blueDither[x];
 
-        idx = GetClosestColor(r,g,b);
+        idx = GetClosestColor(ctx, r,g,b);
 
-        if (lores == 1) {
+        if (ctx->lores == 1) {
             /* LGR and DLGR use a 1:1 verbatim dithering only */
             /* SHR output is based on LGR and DLGR dithering so is verbatim also */
-            setlopixel((uchar)idx,x,y);
+            setlopixel(ctx, (uchar)idx,x,y);
             /* the code below is used only for DHGR dithering */
             continue;
         }
 
-        if (outline == 1) {
+        if (ctx->outline == 1) {
             if (idx != 0) idx = 15;
         }
 
@@ -2746,7 +3348,7 @@ void BuckelsDither(int y, int width, int pixels)
             drawcolor = dhrbits[idx][x1];
             if (x1 > 26) x1 = 0;
             else x1++;
-            dhrmonoplot(x2,y,drawcolor);
+            dhrmonoplot(ctx, x2,y,drawcolor);
             x2++;
         }
 
@@ -2754,28 +3356,26 @@ void BuckelsDither(int y, int width, int pixels)
 
 }
 
-void BrooksDither(int y, int width)
+void BrooksDither(A2BCONTEXT *ctx, int y, int width)
 {
 
-    sshort *colorptr, *seedptr, *seed2ptr, color_error, random_error, errbuf[6];
-    sshort red, green, blue, red_error, green_error, blue_error, heavy_error;
-    int i,x,x1,x2,y1,y2;
-    int total_difference, total_error, total_used;
+    sshort red, green, blue;
+    int x,x1,x2,y1,y2;
     uchar drawcolor,r,g,b,idx;
     double besttotal, thistotal;
 
    /* find the palette with the least total error */
    for (y1 = 0; y1 < 200; y1++) {
         thistotal = 0.0;
-        InitDoubleLineArrays(y1);
+        InitDoubleLineArrays(ctx, y1);
         for (x=0;x<width;x++) {
 
-            red   = redDither[x];
-            green = greenDither[x];
-            blue  = blueDither[x];
+            red   = ctx->redDither[x];
+            green = ctx->greenDither[x];
+            blue  = ctx->blueDither[x];
 
-            drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-            thistotal += globaldistance;
+            drawcolor = GetClosestColor(ctx, (uchar)red,(uchar)green,(uchar)blue);
+            thistotal += ctx->globaldistance;
         }
         if (y1 == 0) {
             y2 = y1;
@@ -2790,185 +3390,28 @@ void BrooksDither(int y, int width)
     }
 
     /* set the palette with the least total error as the dithering palette */
-    memcpy(&savepalettes[y][0][0],&rgbArrays[y2][0][0],48);
-    InitDoubleLineArrays(y2);
-
-    for (x=0;x<width;x++) {
-
-        red   = redDither[x];
-        green = greenDither[x];
-        blue  = blueDither[x];
-
-        drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-
-        r = rgbArrays[y2][drawcolor][0];
-        g = rgbArrays[y2][drawcolor][1];
-        b = rgbArrays[y2][drawcolor][2];
-
-        redDither[x]   = (int)r;
-        greenDither[x] = (int)g;
-        blueDither[x]  = (int)b;
-
-        /* the error is linear in this implementation */
-        /* - an integer is used so round-off of errors occurs
-         - also clipping of the error occurs under some circumstances
-         - no luminance consideration
-         - no gamma correction
-        */
+    memcpy(&ctx->savepalettes[y][0][0],&ctx->rgbArrays[y2][0][0],48);
+    InitDoubleLineArrays(ctx, y2);
 
-        red_error   = red - r;
-        green_error = green - g;
-        blue_error  = blue - b;
-
-        for (i=0;i<3;i++) {
-
-            /* loop through all 3 RGB channels */
-            switch(i) {
-                case 0: colorptr = (sshort *)&redDither[0];
-                        seedptr   = (sshort *)&redSeed[0];
-                        seed2ptr  = (sshort *)&redSeed2[0];
-                        color_error = red_error;
-                        break;
-                case 1: colorptr = (sshort *)&greenDither[0];
-                        seedptr   = (sshort *)&greenSeed[0];
-                        seed2ptr  = (sshort *)&greenSeed2[0];
-                        color_error = green_error;
-                        break;
-                case 2: colorptr = (sshort *)&blueDither[0];
-                        seedptr   = (sshort *)&blueSeed[0];
-                        seed2ptr  = (sshort *)&blueSeed2[0];
-                        color_error = blue_error;
-                        break;
-            }
-
-            /* diffuse the error based on the dither */
-            switch(dithertype)
-            {
-
-            case FLOYDSTEINBERG:
-                /*
-                    *   7
-                3   5   1   (1/16)
-                */
-
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 16) / bleed;
-                    total_used =  (color_error * 3)/bleed;
-                    total_used += (color_error * 5)/bleed;
-                    total_used += (color_error * 1)/bleed;
-                    total_used += (color_error * 7)/bleed;
-                    total_difference = total_error - total_used;
-                }
-
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 7)/bleed)+total_difference);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)((color_error * 3)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)((color_error * 1)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error * 5)/bleed));
-                break;
-
-            case ATKINSON:
-            case ATKINSON2:
-                /*
-                    *   1   1
-                1   1   1
-                    1           (1/8 - reduced bleed) or (1/6 full bleed even diffusion)
-
-                */
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)(color_error/bleed));
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
-
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-                break;
-
-            default:
-
-               /* buckels dither */
-               /* uses the same weighting pattern as Atkinson but with full weighting */
-               /*
-                  * 2 1
-                1 2 1
-                  1          (1/8)
-
-                */
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                /* random dither automatically turns error summing on in which case
-                   rounding errors are placed at random within the atkinson pattern */
-                errbuf[0] = errbuf[1] = errbuf[2] = errbuf[3] = errbuf[4] = errbuf[5] = 0;
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 8) / bleed;
-                    total_used =  (color_error * 2)/bleed;
-                    total_used += (color_error * 2)/bleed;
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_difference = total_error - total_used;
-
-                    if (randomdither == 0) {
-                        /* next pixel */
-                        errbuf[0] = total_difference;
-                    }
-                    else {
-                        /* random pixel */
-                        idx = RandomRange(6) - 1;
-                        errbuf[idx] = total_difference;
-
-                    }
-                }
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*2)/bleed)+errbuf[0]);
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed)+errbuf[1]);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed)+errbuf[2]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error*2)/bleed)+errbuf[3]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed)+errbuf[4]);
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-
-            }
-        }
-    }
+    diffusekernels[DiffusePattern(ctx)](ctx,y,width,ctx->rgbArrays[y2],0,ctx->randomdither);
 
    /* SHR output in 320 x 200 only */
    for (x=0,x1=0,x2=0;x<width;x++) {
-        r = (uchar)redDither[x];
-        g = (uchar)greenDither[x];
-        b = (uchar)blueDither[x];
-        idx = GetClosestColor(r,g,b);
-        setlopixel((uchar)idx,x,y);
+        r = (uchar)ctx->redDither[x];
+        g = (uchar)ctx->greenDither[x];
+        b = (uchar)ctx->blueDither[x];
+        idx = GetClosestColor(ctx, r,g,b);
+        setlopixel(ctx, (uchar)idx,x,y);
    }
 
 }
 
 
-void PicDither(int y, int width)
+void PicDither(A2BCONTEXT *ctx, int y, int width)
 {
 
-    sshort *colorptr, *seedptr, *seed2ptr, color_error, random_error, errbuf[6];
-    sshort red, green, blue, red_error, green_error, blue_error;
-    int i,x,x1,x2,y1,y2,saveline, maxpal = 16;
-    int total_difference, total_error, total_used;
+    sshort red, green, blue;
+    int x,x1,x2,y1,y2,saveline, maxpal = 16;
     uchar drawcolor,r,g,b,idx;
     double besttotal, thistotal;
 
@@ -2980,217 +3423,60 @@ void PicDither(int y, int width)
     memcpy(&blueSave[0],&blueDither[0],width * sizeof(sshort));
     */
 
-   if (imnumpalettes == 8) maxpal = 8;
-   else if (imnumpalettes == 1) maxpal = 1;
+   if (ctx->imnumpalettes == 8) maxpal = 8;
+   else if (ctx->imnumpalettes == 1) maxpal = 1;
 
    /* find the palette with the least total error */
    for (y1 = 0; y1 < maxpal; y1++) {
         thistotal = 0.0;
-        InitDoubleLine256Arrays(y1);
+        InitDoubleLine256Arrays(ctx, y1);
         for (x=0;x<width;x++) {
 
-            red   = redDither[x];
-            green = greenDither[x];
-            blue  = blueDither[x];
+            red   = ctx->redDither[x];
+            green = ctx->greenDither[x];
+            blue  = ctx->blueDither[x];
 
-            drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-            thistotal += globaldistance;
+            drawcolor = GetClosestColor(ctx, (uchar)red,(uchar)green,(uchar)blue);
+            thistotal += ctx->globaldistance;
         }
         if (y1 == 0) {
             y2 = y1;
             besttotal = thistotal;
-            saveline = brooksline;
+            saveline = ctx->brooksline;
             continue;
         }
 
         if (thistotal < besttotal) {
             besttotal = thistotal;
             y2 = y1;
-            saveline = brooksline;
+            saveline = ctx->brooksline;
         }
     }
 
     /* set the palette with the least total error as the dithering palette */
-    memcpy(&savepalettes[y][0][0],&rgb256Arrays[y2][0][0],48);
-    savescb[y] = y2;
-    InitDoubleLineArrays(saveline);
-
-    for (x=0;x<width;x++) {
-
-        red   = redDither[x];
-        green = greenDither[x];
-        blue  = blueDither[x];
-
-        drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-
-        r = rgbArrays[saveline][drawcolor][0];
-        g = rgbArrays[saveline][drawcolor][1];
-        b = rgbArrays[saveline][drawcolor][2];
-
-        redDither[x]   = (int)r;
-        greenDither[x] = (int)g;
-        blueDither[x]  = (int)b;
-
-        /* the error is linear in this implementation */
-        /* - an integer is used so round-off of errors occurs
-         - also clipping of the error occurs under some circumstances
-         - no luminance consideration
-         - no gamma correction
-        */
+    memcpy(&ctx->savepalettes[y][0][0],&ctx->rgb256Arrays[y2][0][0],48);
+    ctx->savescb[y] = y2;
+    InitDoubleLineArrays(ctx, saveline);
 
-        red_error   = red - r;
-        green_error = green - g;
-        blue_error  = blue - b;
-
-        for (i=0;i<3;i++) {
-
-            /* loop through all 3 RGB channels */
-            switch(i) {
-                case 0: colorptr = (sshort *)&redDither[0];
-                        seedptr   = (sshort *)&redSeed[0];
-                        seed2ptr  = (sshort *)&redSeed2[0];
-                        color_error = red_error;
-                        break;
-                case 1: colorptr = (sshort *)&greenDither[0];
-                        seedptr   = (sshort *)&greenSeed[0];
-                        seed2ptr  = (sshort *)&greenSeed2[0];
-                        color_error = green_error;
-                        break;
-                case 2: colorptr = (sshort *)&blueDither[0];
-                        seedptr   = (sshort *)&blueSeed[0];
-                        seed2ptr  = (sshort *)&blueSeed2[0];
-                        color_error = blue_error;
-                        break;
-            }
-
-
-            /* diffuse the error based on the dither */
-            switch(dithertype)
-            {
-
-            case FLOYDSTEINBERG:
-                /*
-                    *   7
-                3   5   1   (1/16)
-                */
-
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 16) / bleed;
-                    total_used =  (color_error * 3)/bleed;
-                    total_used += (color_error * 5)/bleed;
-                    total_used += (color_error * 1)/bleed;
-                    total_used += (color_error * 7)/bleed;
-                    total_difference = total_error - total_used;
-                }
-
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 7)/bleed)+total_difference);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)((color_error * 3)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)((color_error * 1)/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error * 5)/bleed));
-                break;
-
-            case ATKINSON:
-            case ATKINSON2:
-                /*
-                    *   1   1
-                1   1   1
-                    1           (1/8 - reduced bleed) or (1/6 full bleed even diffusion)
-
-                */
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)(color_error/bleed));
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
-
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)(color_error/bleed));
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-                break;
-
-            default:
-
-               /* buckels dither */
-               /* uses the same weighting pattern as Atkinson but with full weighting */
-               /*
-                  * 2 1
-                1 2 1
-                  1          (1/8)
-
-                */
-                /* if error summing is turned-on add the accumulated rounding error
-                   to the next pixel */
-                /* random dither automatically turns error summing on in which case
-                   rounding errors are placed at random within the atkinson pattern */
-                errbuf[0] = errbuf[1] = errbuf[2] = errbuf[3] = errbuf[4] = errbuf[5] = 0;
-                if (errorsum == 0) {
-                    total_difference = 0;
-                }
-                else {
-                    total_error = (color_error * 8) / bleed;
-                    total_used =  (color_error * 2)/bleed;
-                    total_used += (color_error * 2)/bleed;
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_used += (color_error /bleed);
-                    total_difference = total_error - total_used;
-
-                    if (randomdither == 0) {
-                        /* next pixel */
-                        errbuf[0] = total_difference;
-                    }
-                    else {
-                        /* random pixel */
-                        idx = RandomRange(6) - 1;
-                        errbuf[idx] = total_difference;
-
-                    }
-                }
-
-                /* finish this line */
-                AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*2)/bleed)+errbuf[0]);
-                AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed)+errbuf[1]);
-                /* seed next line forward */
-                if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed)+errbuf[2]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error*2)/bleed)+errbuf[3]);
-                AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed)+errbuf[4]);
-                /* seed furthest line forward */
-                AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-            }
-        }
-    }
+    diffusekernels[DiffusePattern(ctx)](ctx,y,width,ctx->rgbArrays[saveline],0,ctx->randomdither);
 
    /* SHR output in 320 x 200 only */
    for (x=0,x1=0,x2=0;x<width;x++) {
-        r = (uchar)redDither[x];
-        g = (uchar)greenDither[x];
-        b = (uchar)blueDither[x];
-        idx = GetClosestColor(r,g,b);
-        setlopixel((uchar)idx,x,y);
+        r = (uchar)ctx->redDither[x];
+        g = (uchar)ctx->greenDither[x];
+        b = (uchar)ctx->blueDither[x];
+        idx = GetClosestColor(ctx, r,g,b);
+        setlopixel(ctx, (uchar)idx,x,y);
    }
 
 }
 
 
-void BrooksPicDither(int y, int width)
+void BrooksPicDither(A2BCONTEXT *ctx, int y, int width)
 {
 
-    sshort *colorptr, *seedptr, *seed2ptr, color_error;
-    sshort red, green, blue, red_error, green_error, blue_error;
-    int i,x,x1,x2,y1,y2,savepalette,usepalettemethod;
-    int total_difference, total_error, total_used;
+    sshort red, green, blue;
+    int x,x1,x2,y1,y2,savepalette,usepalettemethod;
     uchar drawcolor,r,g,b,idx;
     double besttotal, thistotal;
     double pictotal;
@@ -3206,15 +3492,15 @@ void BrooksPicDither(int y, int width)
    /* find the palette with the least total error */
    for (y1 = 0; y1 < 16; y1++) {
         thistotal = 0.0;
-        InitDoubleLine256Arrays(y1);
+        InitDoubleLine256Arrays(ctx, y1);
         for (x=0;x<width;x++) {
 
-            red   = redDither[x];
-            green = greenDither[x];
-            blue  = blueDither[x];
+            red   = ctx->redDither[x];
+            green = ctx->greenDither[x];
+            blue  = ctx->blueDither[x];
 
-            drawcolor = GetClosest256Color((uchar)red,(uchar)green,(uchar)blue,y1);
-            thistotal += globaldistance;
+            drawcolor = GetClosest256Color(ctx, (uchar)red,(uchar)green,(uchar)blue,y1);
+            thistotal += ctx->globaldistance;
         }
         if (y1 == 0) {
             savepalette = y2 = y1;
@@ -3229,20 +3515,20 @@ void BrooksPicDither(int y, int width)
     }
 
     /* set the palette with the least total error as the initial dithering palette */
-    memcpy(&savepalettes[y][0][0],&rgb256Arrays[y2][0][0],48);
+    memcpy(&ctx->savepalettes[y][0][0],&ctx->rgb256Arrays[y2][0][0],48);
 
    /* find the palette with the least total error */
    for (y1 = 0; y1 < 200; y1++) {
         thistotal = 0.0;
-        InitDoubleLineArrays(y1);
+        InitDoubleLineArrays(ctx, y1);
         for (x=0;x<width;x++) {
 
-            red   = redDither[x];
-            green = greenDither[x];
-            blue  = blueDither[x];
+            red   = ctx->redDither[x];
+            green = ctx->greenDither[x];
+            blue  = ctx->blueDither[x];
 
-            drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-            thistotal += globaldistance;
+            drawcolor = GetClosestColor(ctx, (uchar)red,(uchar)green,(uchar)blue);
+            thistotal += ctx->globaldistance;
         }
         if (y1 == 0) {
             y2 = y1;
@@ -3260,134 +3546,41 @@ void BrooksPicDither(int y, int width)
     /* hopefully this decreases banding and doesn't increase banding */
     if (pictotal < besttotal) {
         /* if the palette for image sections is closer then use it */
-        memcpy(&savepalettes[y][0][0],&rgb256Arrays[savepalette][0][0],48);
-        InitDoubleLine256Arrays(savepalette);
+        memcpy(&ctx->savepalettes[y][0][0],&ctx->rgb256Arrays[savepalette][0][0],48);
+        InitDoubleLine256Arrays(ctx, savepalette);
         usepalettemethod = 1;
-        if (quietmode == 0) printf("pictotal %f is greater than besttotal %f for line %d\n",pictotal,besttotal,y);
+        if (ctx->quietmode == 0) printf("pictotal %f is greater than besttotal %f for line %d\n",pictotal,besttotal,y);
     }
     else {
         /* if the individual line palette is closer then use that instead */
-        memcpy(&savepalettes[y][0][0],&rgbArrays[y2][0][0],48);
-        InitDoubleLineArrays(y2);
+        memcpy(&ctx->savepalettes[y][0][0],&ctx->rgbArrays[y2][0][0],48);
+        InitDoubleLineArrays(ctx, y2);
         usepalettemethod = 0;
     }
 
-
-    for (x=0;x<width;x++) {
-
-        red   = redDither[x];
-        green = greenDither[x];
-        blue  = blueDither[x];
-
-        if (usepalettemethod == 1) {
-            drawcolor = GetClosest256Color((uchar)red,(uchar)green,(uchar)blue,savepalette);
-
-            r = rgbArrays[savepalette][drawcolor][0];
-            g = rgbArrays[savepalette][drawcolor][1];
-            b = rgbArrays[savepalette][drawcolor][2];
-        }
-        else {
-            drawcolor = GetClosestColor((uchar)red,(uchar)green,(uchar)blue);
-
-            r = rgbArrays[y2][drawcolor][0];
-            g = rgbArrays[y2][drawcolor][1];
-            b = rgbArrays[y2][drawcolor][2];
-        }
-
-        redDither[x]   = (int)r;
-        greenDither[x] = (int)g;
-        blueDither[x]  = (int)b;
-
-        /* the error is linear in this implementation */
-        /* - an integer is used so round-off of errors occurs
-         - also clipping of the error occurs under some circumstances
-         - no luminance consideration
-         - no gamma correction
-        */
-
-        red_error   = red - r;
-        green_error = green - g;
-        blue_error  = blue - b;
-
-        for (i=0;i<3;i++) {
-
-            /* loop through all 3 RGB channels */
-            switch(i) {
-                case 0: colorptr = (sshort *)&redDither[0];
-                        seedptr   = (sshort *)&redSeed[0];
-                        seed2ptr  = (sshort *)&redSeed2[0];
-                        color_error = red_error;
-                        break;
-                case 1: colorptr = (sshort *)&greenDither[0];
-                        seedptr   = (sshort *)&greenSeed[0];
-                        seed2ptr  = (sshort *)&greenSeed2[0];
-                        color_error = green_error;
-                        break;
-                case 2: colorptr = (sshort *)&blueDither[0];
-                        seedptr   = (sshort *)&blueSeed[0];
-                        seed2ptr  = (sshort *)&blueSeed2[0];
-                        color_error = blue_error;
-                        break;
-            }
-
-           /* buckels dither */
-           /* uses the same weighting pattern as Atkinson but with full weighting */
-           /*
-              * 2 1
-            1 2 1
-              1          (1/8)
-
-            */
-
-            /* if error summing is turned-on add the accumulated rounding error
-               to the next pixel */
-            if (errorsum == 0) {
-                total_difference = 0;
-            }
-            else {
-                total_error = (color_error * 8) / bleed;
-                total_used =  (color_error * 2)/bleed;
-                total_used += (color_error * 2)/bleed;
-                total_used += (color_error /bleed);
-                total_used += (color_error /bleed);
-                total_used += (color_error /bleed);
-                total_used += (color_error /bleed);
-                total_difference = total_error - total_used;
-            }
-
-            /* finish this line */
-            AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*2)/bleed)+total_difference);
-            AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
-
-            /* seed next line forward */
-            if (x>0)AdjustShortPixel(0,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-            AdjustShortPixel(0,(sshort *)&seedptr[x],(sshort)((color_error*2)/bleed));
-            AdjustShortPixel(0,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-
-            /* seed furthest line forward */
-            AdjustShortPixel(0,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-
-        }
-    }
+    /* always the buckels pattern with the rounding error to the next pixel */
+    if (usepalettemethod == 1) DiffuseBuckels256(ctx,y,width,ctx->rgbArrays[savepalette],savepalette,0);
+    else DiffuseBuckels(ctx,y,width,ctx->rgbArrays[y2],0,0);
 
    /* SHR output in 320 x 200 only */
    for (x=0,x1=0,x2=0;x<width;x++) {
-        r = (uchar)redDither[x];
-        g = (uchar)greenDither[x];
-        b = (uchar)blueDither[x];
+        r = (uchar)ctx->redDither[x];
+        g = (uchar)ctx->greenDither[x];
+        b = (uchar)ctx->blueDither[x];
         if (usepalettemethod == 1) {
             /* use the line palettes if they're better */
-            idx = GetClosestColor(r,g,b);
+            idx = GetClosestColor(ctx, r,g,b);
         }
         else {
             /* use the section palettes if they're better */
-            idx = GetClosest256Color(r,g,b,savepalette);
+            idx = GetClosest256Color(ctx, r,g,b,savepalette);
         }
-        setlopixel((uchar)idx,x,y);
+        setlopixel(ctx, (uchar)idx,x,y);
    }
 
 }
 
+
 /* save raster oriented DHGR image fragment
 
    file format is 5 byte header
@@ -3421,7 +3614,7 @@ void BrooksPicDither(int y, int width)
 
 
  */
-int savesprite(char *spritefile)
+int savesprite(A2BCONTEXT *ctx, char *spritefile)
 {
 
     FILE *fp;
@@ -3430,7 +3623,7 @@ int savesprite(char *spritefile)
     uchar *ptraux, *ptrmain, ch;
 
     /* start at the beginning of a 7-pixel block (based on a color image fragment) */
-    while (fragx%7 != 0) fragx--;
+    while (ctx->fragx%7 != 0) ctx->fragx--;
 
     /* color image fragments must finish at the end of a 7-pixel block */
     /* for monochrome image fragments this is a 28-pixel block */
@@ -3439,25 +3632,26 @@ int savesprite(char *spritefile)
        didn't give monochrome much thought when I developed the DHM masking file variation
        in Bmp2DHR. nor did I write my cc65 loader to handle a monochrome sprite
        so I am just sticking with the color sprite format for now */
-    while (fragwidth%7 != 0) fragwidth++;
-    x1 = fragx + fragwidth;
-    y1 = fragy + fragheight;
+    while (ctx->fragwidth%7 != 0) ctx->fragwidth++;
+    x1 = ctx->fragx + ctx->fragwidth;
+    y1 = ctx->fragy + ctx->fragheight;
 
     if (x1 > 140) {
         /* cursory check */
-        printf("Width %d is out of range for %s!\n",fragwidth, spritefile);
+        printf("Width %d is out of range for %s!\n",ctx->fragwidth, spritefile);
         return INVALID;
     }
 
     if (y1 > 192) {
         /* cursory check */
-        printf("Height %d is out of range for %s!\n",fragheight, spritefile);
+        printf("Height %d is out of range for %s!\n",ctx->fragheight, spritefile);
         return INVALID;
     }
 
-    width = (int)((fragwidth / 7) * 4); /* 4 bytes = 7 pixels */
+    width = (int)((ctx->fragwidth / 7) * 4); /* 4 bytes = 7 pixels */
     packet = (int)width / 2;
 
+    StatsOutput(ctx->stats,spritefile);
     fp = fopen(spritefile,"wb");
     if (NULL == fp) {
         printf("Error Opening %s for writing!\n",spritefile);
@@ -3471,16 +3665,16 @@ int savesprite(char *spritefile)
     fputc('R',fp);
 
     fputc((uchar)width,fp);      /* width in bytes */
-    fputc((uchar)fragheight,fp); /* height in scanlines */
+    fputc((uchar)ctx->fragheight,fp); /* height in scanlines */
 
-    width = (int)((fragx / 7) * 4);     /* 4 bytes = 7 pixels */
+    width = (int)((ctx->fragx / 7) * 4);     /* 4 bytes = 7 pixels */
     x1 = (int)width / 2; /* starting byte in DHGR buffer */
-    y1 = (int)fragy;     /* starting scanline in DHGR buffer */
+    y1 = (int)ctx->fragy;     /* starting scanline in DHGR buffer */
 
-    for (y = 0; y < fragheight; y++,y1++) {
+    for (y = 0; y < ctx->fragheight; y++,y1++) {
         xoff = HB[y1] + x1;
-        ptraux  = (uchar *) &dhrbuf[xoff-0x2000];
-        ptrmain = (uchar *) &dhrbuf[xoff];
+        ptraux  = (uchar *) &ctx->dhrbuf[xoff-0x2000];
+        ptrmain = (uchar *) &ctx->dhrbuf[xoff];
         /* aux raster */
         c = fwrite((char *)&ptraux[0],1,packet,fp);
         if (c!= packet) break;
@@ -3491,20 +3685,20 @@ int savesprite(char *spritefile)
     }
     fclose(fp);
 
-    y1 = fragy + fragheight -1;
-    x1 = fragx + fragwidth;
-    if (vbmp == 1) {
+    y1 = ctx->fragy + ctx->fragheight -1;
+    x1 = ctx->fragx + ctx->fragwidth;
+    if (ctx->vbmp == 1) {
         /* for preview (aka VBMP output) black-out the area around the fragment */
         for (y = 0;y < 192; y++) {
-            if (y < fragy || y > y1) {
+            if (y < ctx->fragy || y > y1) {
                 /* blank whole line above and below fragment */
-                for (x = 0; x < 140; x++) dhrplot(x,y,0);
+                for (x = 0; x < 140; x++) dhrplot(ctx, x,y,0);
                 continue;
             }
             /* blank left pillar before fragment */
-            for (x = 0; x < fragx; x++) dhrplot(x,y,0);
+            for (x = 0; x < ctx->fragx; x++) dhrplot(ctx, x,y,0);
             /* blank right pillar after fragment */
-            for (x = x1; x < 140; x++) dhrplot(x,y,0);
+            for (x = x1; x < 140; x++) dhrplot(ctx, x,y,0);
         }
 
     }
@@ -3552,22 +3746,22 @@ uchar gsColor (uchar c)
 uchar LegalColor[16] = {0x00,0x11,0x22,0x33,0x44,0x55,0x66,0x77,0x88,0x99,0xaa,0xbb,0xcc,0xdd,0xee,0xff};
 
 /* promote monochrome bmp lines to 24-bit bmp lines */
-void ReformatMonoLine(ushort packet)
+void ReformatMonoLine(A2BCONTEXT *ctx, ushort packet)
 {
      int i,j,k;
      uchar b = 0, w = 255;
 
-     memcpy(&bmpscanline2[0],&bmpscanline[0],packet);
+     memcpy(&ctx->bmpscanline2[0],&ctx->bmpscanline[0],packet);
 
      for(i=0,j=0;i<packet;i++)
      {
         for(k=0;k<8;k++)
         {
-            if (bmpscanline2[i]&msk[k]) {
-                bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] = w;
+            if (ctx->bmpscanline2[i]&msk[k]) {
+                ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] = w;
             }
             else {
-                bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] = b;
+                ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] = b;
             }
             j+=3;
         }
@@ -3575,95 +3769,90 @@ void ReformatMonoLine(ushort packet)
 }
 
 /* promote 16 color and 256 color bmp lines to 24-bit bmp lines */
-void ReformatVGALine()
+void ReformatVGALine(A2BCONTEXT *ctx)
 {
     sshort i, j, packet;
     uchar ch;
 
-    memset(&bmpscanline2[0],0,1680);
-    if (bmi.biBitCount == 8) {
-       memcpy(&bmpscanline2[0],&bmpscanline[0],bmi.biWidth);
+    memset(&ctx->bmpscanline2[0],0,1680);
+    if (ctx->bmi.biBitCount == 8) {
+       memcpy(&ctx->bmpscanline2[0],&ctx->bmpscanline[0],ctx->bmi.biWidth);
     }
     else {
-        packet = bmi.biWidth /2;
-        if (bmi.biWidth%2 != 0) packet++;
+        packet = ctx->bmi.biWidth /2;
+        if (ctx->bmi.biWidth%2 != 0) packet++;
         for (i=0,j=0;i<packet;i++) {
-            ch = bmpscanline[i] >> 4;
-            bmpscanline2[j] = ch; j++;
-            ch = bmpscanline[i] & 0xf;
-            bmpscanline2[j] = ch; j++;
-        }
-    }
-    memset(&bmpscanline[0],0,1680);
-    for (i=0,j=0;i<bmi.biWidth;i++) {
-          ch = bmpscanline2[i];
-          bmpscanline[j] = sbmp[ch].rgbBlue; j++;
-          bmpscanline[j] = sbmp[ch].rgbGreen; j++;
-          bmpscanline[j] = sbmp[ch].rgbRed; j++;
+            ch = ctx->bmpscanline[i] >> 4;
+            ctx->bmpscanline2[j] = ch; j++;
+            ch = ctx->bmpscanline[i] & 0xf;
+            ctx->bmpscanline2[j] = ch; j++;
+        }
+    }
+    memset(&ctx->bmpscanline[0],0,1680);
+    for (i=0,j=0;i<ctx->bmi.biWidth;i++) {
+          ch = ctx->bmpscanline2[i];
+          ctx->bmpscanline[j] = ctx->sbmp[ch].rgbBlue; j++;
+          ctx->bmpscanline[j] = ctx->sbmp[ch].rgbGreen; j++;
+          ctx->bmpscanline[j] = ctx->sbmp[ch].rgbRed; j++;
      }
 }
 
-uchar rgbColorCount[16][3];
-sshort rgbColorCounter = 0;
-
-void ClearPalette16()
+void ClearPalette16(A2BCONTEXT *ctx)
 {
 
-    if (shr == 320) {
+    if (ctx->shr == 320) {
         /* clear the memory for the shr trailer buffer */
-        memset((char *)&mypic.scb[0],0,sizeof(PICFILE));
+        memset((char *)&ctx->mypic.scb[0],0,sizeof(PICFILE));
 
-        shrmode = 4096;
-        if (bmi.biBitCount == 8) shrmode = 256;
-        if (bmi.biBitCount == 1 || mono == 1) {
-            shrmode = 2;
+        ctx->shrmode = 4096;
+        if (ctx->bmi.biBitCount == 8) ctx->shrmode = 256;
+        if (ctx->bmi.biBitCount == 1 || ctx->mono == 1) {
+            ctx->shrmode = 2;
             /* disable brooks if set */
-            brooks = 0;
+            ctx->brooks = 0;
         }
-        if (bmi.biBitCount == 4 || shrgrey == 1) {
-            shrmode = 16;
+        if (ctx->bmi.biBitCount == 4 || ctx->shrgrey == 1) {
+            ctx->shrmode = 16;
             /* disable brooks if set */
-            brooks = 0;
+            ctx->brooks = 0;
         }
     }
     else {
         /* disable brooks if set */
-        brooks = 0;
+        ctx->brooks = 0;
     }
 
-    if (shr == 0 || mono == 1 || bmi.biBitCount == 4 || bmi.biBitCount == 1) {
-        rgbColorCounter = -1;
+    if (ctx->shr == 0 || ctx->mono == 1 || ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 1) {
+        ctx->rgbColorCounter = -1;
     }
     else {
-        rgbColorCounter = 0;
-        memset(&rgbColorCount[0][0],0,48);
+        ctx->rgbColorCounter = 0;
+        memset(&ctx->rgbColorCount[0][0],0,48);
     }
 }
 
-int shr2=0;
-
-void SetPalette16()
+void SetPalette16(A2BCONTEXT *ctx)
 {
-    sshort i, count = rgbColorCounter;
+    sshort i, count = ctx->rgbColorCounter;
     /* if not setting a 16 color conversion palette for shr conversion return immediately */
     /* if the line has more than 16 colors return immediately */
     if (count == -1)  {
         return;
     }
-    shrmode = 16;
+    ctx->shrmode = 16;
     /* disable brooks if set */
-    brooks = shr2 = 0;
-    memset(&rgbArray[0][0],0,48);
+    ctx->brooks = ctx->shr2 = 0;
+    memset(&ctx->rgbArray[0][0],0,48);
     for (i = 0; i < count; i++) {
-        rgbArray[i][0] = rgbColorCount[i][0];
-        rgbArray[i][1] = rgbColorCount[i][1];
-        rgbArray[i][2] = rgbColorCount[i][2];
+        ctx->rgbArray[i][0] = ctx->rgbColorCount[i][0];
+        ctx->rgbArray[i][1] = ctx->rgbColorCount[i][1];
+        ctx->rgbArray[i][2] = ctx->rgbColorCount[i][2];
     }
 }
 
-sshort BuildPalette16(uchar r, uchar g, uchar b)
+sshort BuildPalette16(A2BCONTEXT *ctx, uchar r, uchar g, uchar b)
 {
-    sshort i, count = rgbColorCounter;
+    sshort i, count = ctx->rgbColorCounter;
 
     /* if not building a 16 color conversion palette for shr conversion return immediately */
     /* if the line has more than 16 colors return immediately */
@@ -3672,28 +3861,28 @@ sshort BuildPalette16(uchar r, uchar g, uchar b)
     /* if the color is already in the palette
        return the index */
     for (i = 0; i < count; i++) {
-        if (r == rgbColorCount[i][0] &&
-            g == rgbColorCount[i][1] &&
-            b == rgbColorCount[i][2]) return i;
+        if (r == ctx->rgbColorCount[i][0] &&
+            g == ctx->rgbColorCount[i][1] &&
+            b == ctx->rgbColorCount[i][2]) return i;
     }
 
     /* if we are out of colors then fail */
     if (count > 15) {
-        rgbColorCounter = -1;
+        ctx->rgbColorCounter = -1;
         return -1;
     }
 
      /* add the color to the palette
        since it wasn't already in there */
-    rgbColorCount[count][0] = r;
-    rgbColorCount[count][1] = g;
-    rgbColorCount[count][2] = b;
+    ctx->rgbColorCount[count][0] = r;
+    ctx->rgbColorCount[count][1] = g;
+    ctx->rgbColorCount[count][2] = b;
 
     /* increment the palette count to the next
         available color */
     i = count;
     count++;
-    rgbColorCounter = count;
+    ctx->rgbColorCounter = count;
 
     /* return the color index for the entry
        that was just added */
@@ -3701,150 +3890,251 @@ sshort BuildPalette16(uchar r, uchar g, uchar b)
 }
 
 
+/* reformatted bmp input is kept in memory as a 24-bit bmp with the scanlines
+   in file order. the converters read it with SeekBmpLines and ReadBmpLine,
+   which read from the input file directly if the input was not reformatted. */
+void FreeReformatBuffer(A2BCONTEXT *ctx)
+{
+    if (NULL != ctx->reformatbuf) free(ctx->reformatbuf);
+    ctx->reformatbuf = NULL;
+    ctx->reformatpacket = ctx->reformatheight = ctx->reformatline = 0;
+    if (NULL != ctx->indexbuf) free(ctx->indexbuf);
+    ctx->indexbuf = NULL;
+    ctx->indexcolors = 0;
+}
+
+ushort AllocReformatBuffer(A2BCONTEXT *ctx)
+{
+    ushort outpacket;
+
+    FreeReformatBuffer(ctx);
+
+    outpacket = SetDIBHeader(ctx, (ushort)ctx->bmi.biWidth,(ushort)ctx->bmi.biHeight);
+    ctx->reformatbuf = (uchar *)malloc((ulong)outpacket * (ushort)ctx->bmi.biHeight);
+    if (NULL == ctx->reformatbuf) {
+        puts("Not enough memory to reformat bmp!");
+        return 0;
+    }
+    ctx->reformatpacket = outpacket;
+    ctx->reformatheight = (ushort)ctx->bmi.biHeight;
+    ctx->reformatline = 0;
+
+    return outpacket;
+}
+
+/* the headers are the same as if the reformatted bmp had been read from disk */
+void SetReformatHeader(A2BCONTEXT *ctx)
+{
+    memcpy((char *)&ctx->BitMapFileHeader.bfType[0],(char *)&ctx->mybmp.bfi.bfType[0],sizeof(BITMAPFILEHEADER));
+    memcpy((char *)&ctx->bmi.biSize,(char *)&ctx->mybmp.bmi.biSize,sizeof(BITMAPINFOHEADER));
+}
+
+void SeekBmpLines(A2BCONTEXT *ctx, FILE *fp)
+{
+    if (NULL != ctx->reformatbuf) ctx->reformatline = 0;
+    else fseek(fp,ctx->BitMapFileHeader.bfOffBits,SEEK_SET);
+}
+
+void ReadBmpLine(A2BCONTEXT *ctx, FILE *fp, uchar *scanline, ushort packet)
+{
+    if (NULL == ctx->reformatbuf) {
+        fread((char *)&scanline[0],1,packet,fp);
+        return;
+    }
+    /* like fread, nothing is read past the end of the image */
+    if (ctx->reformatline >= ctx->reformatheight) return;
+    if (packet > ctx->reformatpacket) packet = ctx->reformatpacket;
+    memcpy(&scanline[0],&ctx->reformatbuf[(ulong)ctx->reformatline * ctx->reformatpacket],packet);
+    ctx->reformatline++;
+}
+
+/* 16 color and 256 color bmps also keep the palette index of each pixel.
+   when the conversion palette is the same for every scanline and nothing
+   is dithered, the closest color is only found once for each entry in the
+   bmp palette and the pixels are mapped through indexremap instead. */
+int InitIndexRemap(A2BCONTEXT *ctx)
+{
+    uchar bgr[768];
+    int i;
+
+    if (NULL == ctx->indexbuf || ctx->indexcolors == 0) return INVALID;
+
+    /* the reformatted pixels are the bmp palette entries */
+    for (i = 0; i < (int)ctx->indexcolors; i++) {
+        bgr[i*3] = ctx->sbmp[i].rgbBlue;
+        bgr[i*3+1] = ctx->sbmp[i].rgbGreen;
+        bgr[i*3+2] = ctx->sbmp[i].rgbRed;
+    }
+    GetClosestColorRow(ctx, bgr, ctx->indexremap, (int)ctx->indexcolors);
+    return SUCCESS;
+}
+
+/* palette indices of the scanline that ReadBmpLine just read */
+uchar *ReadIndexLine(A2BCONTEXT *ctx)
+{
+    if (NULL == ctx->indexbuf || ctx->reformatline < 1) return NULL;
+    return &ctx->indexbuf[(ulong)(ctx->reformatline - 1) * ctx->reformatpacket];
+}
+
+/* write the reformatted bmp */
+int WriteReformatBMP(A2BCONTEXT *ctx, char *name)
+{
+    FILE *fp;
+    ulong size;
+    int c;
+
+    if (NULL == ctx->reformatbuf) return INVALID;
+
+    StatsOutput(ctx->stats,name);
+    if((fp=fopen(name,"wb"))==NULL) return INVALID;
+
+    SetDIBHeader(ctx, (ushort)ctx->bmi.biWidth, ctx->reformatheight);
+    c = fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    size = (ulong)ctx->reformatpacket * ctx->reformatheight;
+    if (c == 1 && fwrite((char *)&ctx->reformatbuf[0],1,size,fp) != size) c = 0;
+    fclose(fp);
+
+    if (c != 1) {
+        remove(name);
+        return INVALID;
+    }
+    return SUCCESS;
+}
+
 /* convert 16 color and 256 color bmps to 24 bit bmps */
 /* convert Monochrome bmps to 24 bit bmps */
 /* convert 24 bit bmps using IIgs color thresholds from tohgr */
-FILE *ReformatBMP(FILE *fp)
+FILE *ReformatBMP(A2BCONTEXT *ctx, FILE *fp)
 {
 
-    FILE *fp2;
     ushort packet,outpacket,y,x,x1;
     sshort count = 0;
 
     /* 16 color palette for verbatim SHR conversion */
-    ClearPalette16();
+    ClearPalette16(ctx);
 
     /* seek past extraneous info in header if any */
-    fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
+    fseek(fp,ctx->BitMapFileHeader.bfOffBits,SEEK_SET);
 
     /* align on 4 byte boundaries */
-    if (bmi.biBitCount == 1) {
-        packet = bmi.biWidth / 8;
-        if (bmi.biWidth%8 != 0)packet++;
+    if (ctx->bmi.biBitCount == 1) {
+        packet = ctx->bmi.biWidth / 8;
+        if (ctx->bmi.biWidth%8 != 0)packet++;
     }
-    else if (bmi.biBitCount == 4) {
-        packet = bmi.biWidth / 2;
-        if (bmi.biWidth%2 != 0)packet++;
+    else if (ctx->bmi.biBitCount == 4) {
+        packet = ctx->bmi.biWidth / 2;
+        if (ctx->bmi.biWidth%2 != 0)packet++;
     }
-    else if (bmi.biBitCount == 8) {
-        packet = bmi.biWidth;
+    else if (ctx->bmi.biBitCount == 8) {
+        packet = ctx->bmi.biWidth;
     }
     else {
-        packet = bmi.biWidth * 3;
+        packet = ctx->bmi.biWidth * 3;
     }
     while ((packet % 4)!=0)packet++;
 
-    if((fp2=fopen("Reformat.bmp","wb"))==NULL) {
-        printf("Error Opening %s for writing!\n","Reformat.bmp");
+    outpacket = AllocReformatBuffer(ctx);
+    if (outpacket < 1) {
         fclose(fp);
-        return fp;
+        return NULL;
     }
 
-    outpacket = WriteDIBHeader(fp2,(ushort)bmi.biWidth,(ushort)bmi.biHeight);
-
-    if (outpacket < 1) {
-        fclose(fp2);
-        remove("Reformat.bmp");
-        printf("Error writing header to %s!\n","Reformat.bmp");
-        return fp;
+    /* the index plane has the same scanline length as the 24-bit buffer */
+    if (ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 8) {
+        ctx->indexbuf = (uchar *)malloc((ulong)outpacket * ctx->reformatheight);
+        if (NULL != ctx->indexbuf) ctx->indexcolors = (ushort)(1 << ctx->bmi.biBitCount);
     }
 
     /* 16 color palette for verbatim SHR conversion of 8 bit and 24 bit BMPs if only 16 colors */
-    count = rgbColorCounter;
+    count = ctx->rgbColorCounter;
 
-    for (y=0;y<bmi.biHeight;y++) {
-        fread((char *)&bmpscanline[0],1,packet,fp);
+    for (y=0;y<ctx->bmi.biHeight;y++) {
+        fread((char *)&ctx->bmpscanline[0],1,packet,fp);
 
-        if (bmi.biBitCount == 1) {
-            ReformatMonoLine(packet);
+        if (ctx->bmi.biBitCount == 1) {
+            ReformatMonoLine(ctx, packet);
         }
-        else if (bmi.biBitCount == 4 || bmi.biBitCount == 8) {
-            ReformatVGALine();
+        else if (ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 8) {
+            ReformatVGALine(ctx);
+            if (NULL != ctx->indexbuf)
+                memcpy(&ctx->indexbuf[(ulong)y * outpacket],&ctx->bmpscanline2[0],ctx->bmi.biWidth);
         }
-        else if (usegscolors == 1) {
+        else if (ctx->usegscolors == 1) {
             /* apply IIgs threshold colors from tohgr to 24-bit scanline */
             /* this is not required for lower color depths because the palette colors
                have already been adjusted */
-            for (x = 0; x < packet; x++) bmpscanline[x] = gsColor(bmpscanline[x]);
+            for (x = 0; x < packet; x++) ctx->bmpscanline[x] = gsColor(ctx->bmpscanline[x]);
         }
 
         if (count != -1) {
             /* 16 color palette for verbatim SHR conversion of 8 bit and 24 bit BMPs if only 16 colors */
             /* line color count could be here as well */
-            for (x = 0,x1 = 0; x < bmi.biWidth; x++,x1+=3) {
-                count = BuildPalette16(bmpscanline[x1+2],bmpscanline[x1+1],bmpscanline[x1]);
+            for (x = 0,x1 = 0; x < ctx->bmi.biWidth; x++,x1+=3) {
+                count = BuildPalette16(ctx, ctx->bmpscanline[x1+2],ctx->bmpscanline[x1+1],ctx->bmpscanline[x1]);
                 if (count == -1) break;
             }
         }
-        fwrite((char *)&bmpscanline[0],1,outpacket,fp2);
+        memcpy(&ctx->reformatbuf[(ulong)y * outpacket],&ctx->bmpscanline[0],outpacket);
     }
-    fclose(fp2);
-    fclose(fp);
 
-    if((fp=fopen("Reformat.bmp","rb"))==NULL) {
-        printf("Error Opening %s for reading!\n","Reformat.bmp");
-        return fp;
-    }
-    /* read the header stuff into the appropriate structures */
-    fread((char *)&BitMapFileHeader.bfType[0],
-                 sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+    /* from here on the input is read as a 24-bit bmp from the memory buffer */
+    SetReformatHeader(ctx);
 
     /* 16 color palette for verbatim SHR conversion of 8 bit and 24 bit BMPs if only 16 colors */
-    SetPalette16();
+    SetPalette16(ctx);
     return fp;
 }
 
 
 
-int ReadHybrid(unsigned char *basename, unsigned char *newname)
+int ReadHybrid(A2BCONTEXT *ctx, unsigned char *basename, unsigned char *newname)
 {
 
     FILE *fp;
     int packet = INVALID, y,y1,x,x1,x2,j,k,width,height,pixels,bmpversion;
-    int reformat = bmp3;
+    int reformat = ctx->bmp3, indexed = 0;
     float hue,saturation,luminance;
 
     char bmpfile[256], outfile[256];
-    uchar r,g,b,drawcolor,idx;
+    uchar r,g,b,drawcolor,idx,*indexline;
     ushort temp;
 
     sprintf(bmpfile,"%s.bmp",basename);
 
+    StatsBegin(ctx->stats,STATS_HEADER);
     if((fp=fopen(bmpfile,"rb"))==NULL) return INVALID;
 
     /* read the header stuff into the appropriate structures,
        it's likely a bmp file */
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
 
-    fread((char *)&BitMapFileHeader.bfType,
+    fread((char *)&ctx->BitMapFileHeader.bfType,
                  sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
+    fread((char *)&ctx->bmi.biSize,
                  sizeof(BITMAPINFOHEADER),1,fp);
 
 
-    if (bmi.biSize != sizeof(BITMAPINFOHEADER)) {
-		if (bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+    if (ctx->bmi.biSize != sizeof(BITMAPINFOHEADER)) {
+		if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,(unsigned)bmi.biSize,1,fp);
+            fread((char *)&ctx->bmiV5.biSize,(unsigned)ctx->bmi.biSize,1,fp);
             bmpversion = 3;
             reformat = 1;
 		}
-		else if (bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+		else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
             bmpversion = 4;
             reformat = 1;
         }
-        else if (bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
+        else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
             /* https://msdn.microsoft.com/en-us/library/windows/desktop/dd183386%28v=vs.85%29.aspx */
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
             bmpversion = 5;
             /*
             Profile data refers to either the profile file name (linked profile)
@@ -3871,12 +4161,12 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
         return SUCCESS;
     }
 
-    if (bmi.biCompression==BI_RGB &&
-        BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && (bmi.biBitCount == 24 || bmi.biBitCount == 8 || bmi.biBitCount == 4 || bmi.biBitCount == 1)) {
+    if (ctx->bmi.biCompression==BI_RGB &&
+        ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M' &&
+        ctx->bmi.biPlanes==1 && (ctx->bmi.biBitCount == 24 || ctx->bmi.biBitCount == 8 || ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 1)) {
 
-            height = (int) bmi.biHeight;
-            width = (int) bmi.biWidth;
+            height = (int) ctx->bmi.biHeight;
+            width = (int) ctx->bmi.biWidth;
 
             switch(width) {
                 case 560: if (height == 192 || height == 384) {
@@ -3910,34 +4200,37 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
         return SUCCESS;
     }
 
-    if (bmi.biBitCount == 8 || bmi.biBitCount == 4 || bmi.biBitCount == 1) {
+    if (ctx->bmi.biBitCount == 8 || ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 1) {
 
-       memset((char *)&sbmp[0].rgbBlue,0,sizeof(RGBQUAD)*256);
+       memset((char *)&ctx->sbmp[0].rgbBlue,0,sizeof(RGBQUAD)*256);
 
-       if (bmi.biBitCount == 1) fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*2,1,fp);
-       else if (bmi.biBitCount == 4) fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
-       else fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+       if (ctx->bmi.biBitCount == 1) fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*2,1,fp);
+       else if (ctx->bmi.biBitCount == 4) fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+       else fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
 
 
-       if (bmi.biBitCount == 8 && width == 560 && height == 384) {
+       if (ctx->bmi.biBitCount == 8 && width == 560 && height == 384) {
             /* Legacy AppleWin screen-capture support for backward compatibility */
-            if (sbmp[17].rgbRed == 255 && sbmp[17].rgbGreen == 255 && sbmp[17].rgbBlue == 254) {
+            if (ctx->sbmp[17].rgbRed == 255 && ctx->sbmp[17].rgbGreen == 255 && ctx->sbmp[17].rgbBlue == 254) {
                 fclose(fp);
                 /* pass-through to old routine */
                 return INVALID;
             }
        }
 
-        fp = ReformatBMP(fp);
+        StatsNext(ctx->stats,STATS_HEADER,STATS_REFORMAT);
+        fp = ReformatBMP(ctx, fp);
+        StatsNext(ctx->stats,STATS_REFORMAT,STATS_HEADER);
         if (NULL == fp) return SUCCESS;
         reformat = 1;
     }
 
-    if (mono == 1) {
+    StatsNext(ctx->stats,STATS_HEADER,STATS_PALETTE);
+    if (ctx->mono == 1) {
         /* create a black and white palette */
-        memset(&rgbArray[0][0],0,45);
-        memset(&rgbArray[15][0],255,3);
-        if (hsl == 1) {
+        memset(&ctx->rgbArray[0][0],0,45);
+        memset(&ctx->rgbArray[15][0],255,3);
+        if (ctx->hsl == 1) {
             puts("achromatic hsl monochrome using hue channel de-saturation.");
         }
         else {
@@ -3946,80 +4239,89 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
     }
 
     /* initialize nearest color arrays */
-    InitDoubleArrays();
+    InitDoubleArrays(ctx);
 
-    memset(&dhrbuf[0],0,16384); /* clear write buffer */
+    memset(&ctx->dhrbuf[0],0,16384); /* clear write buffer */
 
-    if (dither != 0) {
+    if (ctx->dither != 0) {
         /* sizeof(sshort) * 640 */
-        memset(&redDither[0],0,1280);
-        memset(&greenDither[0],0,1280);
-        memset(&blueDither[0],0,1280);
-        memset(&redSeed[0],0,1280);
-        memset(&greenSeed[0],0,1280);
-        memset(&blueSeed[0],0,1280);
-        memset(&redSeed2[0],0,1280);
-        memset(&greenSeed2[0],0,1280);
-        memset(&blueSeed2[0],0,1280);
+        memset(&ctx->redDither[0],0,1280);
+        memset(&ctx->greenDither[0],0,1280);
+        memset(&ctx->blueDither[0],0,1280);
+        memset(&ctx->redSeed[0],0,1280);
+        memset(&ctx->greenSeed[0],0,1280);
+        memset(&ctx->blueSeed[0],0,1280);
+        memset(&ctx->redSeed2[0],0,1280);
+        memset(&ctx->greenSeed2[0],0,1280);
+        memset(&ctx->blueSeed2[0],0,1280);
+    }
+
+    /* 16 color and 256 color bmps map each palette entry once */
+    if (ctx->dither == 0 && ctx->mono == 0 && height != 384) {
+        if (InitIndexRemap(ctx) == SUCCESS) indexed = 1;
     }
 
-    fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
+    StatsNext(ctx->stats,STATS_PALETTE,STATS_DITHER);
+    SeekBmpLines(ctx, fp);
 
-    if (dither == 0) puts("non-dithered output");
+    if (ctx->dither == 0) puts("non-dithered output");
     else puts("dithered output");
 
     /* bmp's are upside-down so conversion of scanlines is in
        reverse order */
     for(y=0,y1=191;y<192;y++,y1--)
     {
-          fread((char *)&bmpscanline[0],1,packet,fp);
+          ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
 
           /* unconditional merging */
           if (height == 384) {
-              fread((char *)&bmpscanline2[0],1,packet,fp);
+              ReadBmpLine(ctx, fp, ctx->bmpscanline2, packet);
               for (j = 0; j < packet; j++) {
-                 temp = (ushort)bmpscanline[j];
-                 temp += bmpscanline2[j];
+                 temp = (ushort)ctx->bmpscanline[j];
+                 temp += ctx->bmpscanline2[j];
                  if ((temp % 2)!=0) temp++;
-                 bmpscanline[j] = (uchar) (temp/2);
+                 ctx->bmpscanline[j] = (uchar) (temp/2);
               }
 
           }
 
-          if (mono == 1) {
+          if (ctx->mono == 1) {
             /* work from a greyscale if mono */
             for (j = 0;j < width;j+=3) {
-                if (hsl == 1) {
+                if (ctx->hsl == 1) {
                     /* achromatic greyscale */
                     /* de-saturate using the hsl color model */
-                    rgb2hsl(bmpscanline[j+2],bmpscanline[j+1],bmpscanline[j],&hue,&saturation,&luminance);
-                    bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] =(uchar)(float)(luminance * 255);
+                    rgb2hsl(ctx->bmpscanline[j+2],ctx->bmpscanline[j+1],ctx->bmpscanline[j],&hue,&saturation,&luminance);
+                    ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] =(uchar)(float)(luminance * 255);
                 }
                 else {
                     /* average RGB greyscale */
-                    temp = (ushort)bmpscanline[j];
-                    temp += bmpscanline[j+1];
-                    temp += bmpscanline[j+2];
+                    temp = (ushort)ctx->bmpscanline[j];
+                    temp += ctx->bmpscanline[j+1];
+                    temp += ctx->bmpscanline[j+2];
                     while ((temp % 3)!=0) temp++;
-                    bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] = (uchar) (temp/3);
+                    ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] = (uchar) (temp/3);
                 }
             }
           }
 
-          if (dither == 0) {
+          if (ctx->dither == 0) {
             /* if not dithering use direct pixel mapping */
             /* this is especially useful when a pixel graphics image has been hand-built and
                requires precise positioning */
             j = 0;
+            indexline = (indexed == 1 ? ReadIndexLine(ctx) : NULL);
+            if (NULL != indexline) StatsCount(ctx->stats,STATS_TABLE,(long)width);
             for (x=0,x1=0,x2=0;x<width;x++) {
 
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
+                b = ctx->bmpscanline[j]; j++;
+                g = ctx->bmpscanline[j]; j++;
+                r = ctx->bmpscanline[j]; j++;
 
-                idx = GetClosestColor(r,g,b);
+                if (NULL != indexline) idx = ctx->indexremap[indexline[x]];
+                else idx = GetClosestColor(ctx, r,g,b);
 
-                if (outline == 1) {
+                if (ctx->outline == 1) {
                     if (idx != 0) idx = 15;
                 }
 
@@ -4027,7 +4329,7 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
                     drawcolor = dhrbits[idx][x1];
                     if (x1 > 26) x1 = 0;
                     else x1++;
-                    dhrmonoplot(x2,y1,drawcolor);
+                    dhrmonoplot(ctx, x2,y1,drawcolor);
                     x2++;
                 }
             }
@@ -4036,77 +4338,75 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
           {
               /* add the current line to the r,g,b line buffers used for dithering */
               for (x=0, x1 = 0; x1 < width; x1++) {
-                    b = bmpscanline[x]; x++;
-                    g = bmpscanline[x]; x++;
-                    r = bmpscanline[x]; x++;
+                    b = ctx->bmpscanline[x]; x++;
+                    g = ctx->bmpscanline[x]; x++;
+                    r = ctx->bmpscanline[x]; x++;
 
                     /* values are already seeded from previous 2 - line(s) */
-                    AdjustShortPixel(1,(sshort *)&redDither[x1],(sshort)r);
-                    AdjustShortPixel(1,(sshort *)&greenDither[x1],(sshort)g);
-                    AdjustShortPixel(1,(sshort *)&blueDither[x1],(sshort)b);
+                    AdjustShortPixel(1,(sshort *)&ctx->redDither[x1],(sshort)r);
+                    AdjustShortPixel(1,(sshort *)&ctx->greenDither[x1],(sshort)g);
+                    AdjustShortPixel(1,(sshort *)&ctx->blueDither[x1],(sshort)b);
               }
 
                /* dithering */
-               BuckelsDither(y1,width,pixels);
+               BuckelsDither(ctx, y1,width,pixels);
 
                /* seed next line - promote nearest forward array to
                   current line */
-               memcpy(&redDither[0],&redSeed[0],1280);
-               memcpy(&greenDither[0],&greenSeed[0],1280);
-               memcpy(&blueDither[0],&blueSeed[0],1280);
+               memcpy(&ctx->redDither[0],&ctx->redSeed[0],1280);
+               memcpy(&ctx->greenDither[0],&ctx->greenSeed[0],1280);
+               memcpy(&ctx->blueDither[0],&ctx->blueSeed[0],1280);
 
                /* seed first seed - promote furthest forward array
                   to nearest forward array */
-               memcpy(&redSeed[0],&redSeed2[0],1280);
-               memcpy(&greenSeed[0],&greenSeed2[0],1280);
-               memcpy(&blueSeed[0],&blueSeed2[0],1280);
+               memcpy(&ctx->redSeed[0],&ctx->redSeed2[0],1280);
+               memcpy(&ctx->greenSeed[0],&ctx->greenSeed2[0],1280);
+               memcpy(&ctx->blueSeed[0],&ctx->blueSeed2[0],1280);
 
                /* clear last seed - furthest forward array */
-               memset(&redSeed2[0],0,1280);
-               memset(&greenSeed2[0],0,1280);
-               memset(&blueSeed2[0],0,1280);
+               memset(&ctx->redSeed2[0],0,1280);
+               memset(&ctx->greenSeed2[0],0,1280);
+               memset(&ctx->blueSeed2[0],0,1280);
          }
 
     }
     fclose(fp);
+    StatsNext(ctx->stats,STATS_DITHER,STATS_WRITE);
 
-    if (reformat == 1) {
-		if (bmp3 == 0) {
-			remove("Reformat.bmp");
-		}
-		else {
-			sprintf(outfile,"%s.bm3", newname);
-			remove(outfile);
-			rename("Reformat.bmp",outfile);
-		}
-	}
+    /* optionally keep the 24-bit version of the input file */
+    if (reformat == 1 && ctx->bmp3 == 1) {
+        sprintf(outfile,"%s.bm3", newname);
+        WriteReformatBMP(ctx, outfile);
+    }
+    FreeReformatBuffer(ctx);
 
     /* keep output files to a minimum */
     /* output Apple II files in one of 3 formats */
-    if (frag == 1) {
+    if (ctx->frag == 1) {
         /* raster oriented top-down */
         /* for C programs */
         sprintf(outfile,"%s.DHR",newname);
-        ucase((char *)&outfile[0]);
-        savesprite(outfile);
+        ucase(ctx,(char *)&outfile[0]);
+        savesprite(ctx, outfile);
     }
     else {
-        if (applesoft == 0) {
-            if (longnames == 0)sprintf(outfile,"%s.2FC", newname);
+        if (ctx->applesoft == 0) {
+            if (ctx->longnames == 0)sprintf(outfile,"%s.2FC", newname);
             else {
-                if (mono == 1)
+                if (ctx->mono == 1)
                     sprintf(outfile,"%s.A2FM", newname);
                 else
                     sprintf(outfile,"%s.A2FC", newname);
             }
-            ucase((char *)&outfile[0]);
+            ucase(ctx,(char *)&outfile[0]);
+            StatsOutput(ctx->stats,outfile);
             fp = fopen(outfile,"wb");
             if (NULL == fp) {
                 puts(szTextTitle);
                 printf("%s cannot be created.\n", outfile);
                 return SUCCESS;
             }
-            fwrite(dhrbuf,1,16384,fp);
+            fwrite(ctx->dhrbuf,1,16384,fp);
             fclose(fp);
             printf("%s created.\n", outfile);
         }
@@ -4115,20 +4415,22 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
             /* the bsaved images are split into two files
             the first file is loaded into aux mem */
             sprintf(outfile,"%s.AUX",newname);
-            ucase((char *)&outfile[0]);
+            ucase(ctx,(char *)&outfile[0]);
+            StatsOutput(ctx->stats,outfile);
             fp = fopen(outfile,"wb");
             if (NULL == fp) {
                 puts(szTextTitle);
                 printf("%s cannot be created.\n", outfile);
                 return SUCCESS;
             }
-            fwrite(dhrbuf,1,8192,fp);
+            fwrite(ctx->dhrbuf,1,8192,fp);
             fclose(fp);
             printf("%s created.\n", outfile);
 
             /* the second file is loaded into main mem */
             sprintf(outfile,"%s.BIN",newname);
-            ucase((char *)&outfile[0]);
+            ucase(ctx,(char *)&outfile[0]);
+            StatsOutput(ctx->stats,outfile);
             fp = fopen(outfile,"wb");
             if (NULL == fp) {
                 puts(szTextTitle);
@@ -4138,17 +4440,17 @@ int ReadHybrid(unsigned char *basename, unsigned char *newname)
                 printf("removed %s.\n", outfile);
                 return SUCCESS;
             }
-            fwrite(&dhrbuf[8192],1,8192,fp);
+            fwrite(&ctx->dhrbuf[8192],1,8192,fp);
             fclose(fp);
             printf("%s created.\n", outfile);
 
         }
     }
 
-    if (vbmp == 1) {
-        if (longnames == 0)sprintf(outfile,"%s.vmp", newname);
+    if (ctx->vbmp == 1) {
+        if (ctx->longnames == 0)sprintf(outfile,"%s.vmp", newname);
         else sprintf(outfile,"%s_VBMP.bmp", newname);
-        if (WriteVBMPFile(outfile) == SUCCESS) printf("%s created.\n", outfile);
+        if (WriteVBMPFile(ctx, outfile) == SUCCESS) printf("%s created.\n", outfile);
     }
 
 return SUCCESS;
@@ -4160,54 +4462,54 @@ return SUCCESS;
 /* Writes an Apple II Compatible DHGR A2FC file (or optionally AUX, BIN file pair) */
 /* Renames AppleWin Screen Capture from BMP to BM2 */
 /* The Apple II Compatible Output is then processed normally. */
-int ReadAppleWin(unsigned char *basename, unsigned char *newname)
+int ReadAppleWin(A2BCONTEXT *ctx, unsigned char *basename, unsigned char *newname)
 {
 
     FILE *fp;
     int packet = INVALID, y,i,j;
     char bmpfile[256], outfile[256];
 
-    if (bm2 == 1) sprintf(bmpfile,"%s.bm2",basename);
+    if (ctx->bm2 == 1) sprintf(bmpfile,"%s.bm2",basename);
     else sprintf(bmpfile,"%s.bmp",basename);
 
     if((fp=fopen(bmpfile,"rb"))==NULL) {
-        if (bm2 == 1) return INVALID;
+        if (ctx->bm2 == 1) return INVALID;
         sprintf(bmpfile,"%s.bm2",basename);
         if((fp=fopen(bmpfile,"rb"))==NULL) {
             return INVALID;
         }
-        bm2 = 1;
+        ctx->bm2 = 1;
     }
 
     /* read the header stuff into the appropriate structures,
        it's likely a bmp file */
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
 
-    fread((char *)&BitMapFileHeader.bfType,
+    fread((char *)&ctx->BitMapFileHeader.bfType,
                  sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
+    fread((char *)&ctx->bmi.biSize,
                  sizeof(BITMAPINFOHEADER),1,fp);
 
     /* check for an applewin bmp */
-    if (bmi.biCompression==BI_RGB &&
-        BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && bmi.biBitCount == 8 &&
-        bmi.biWidth == 560 &&  bmi.biHeight == 384)  {
-        fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
-        if (sbmp[17].rgbRed == 255 && sbmp[17].rgbGreen == 255 && sbmp[17].rgbBlue == 254) packet = 560;
+    if (ctx->bmi.biCompression==BI_RGB &&
+        ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M' &&
+        ctx->bmi.biPlanes==1 && ctx->bmi.biBitCount == 8 &&
+        ctx->bmi.biWidth == 560 &&  ctx->bmi.biHeight == 384)  {
+        fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+        if (ctx->sbmp[17].rgbRed == 255 && ctx->sbmp[17].rgbGreen == 255 && ctx->sbmp[17].rgbBlue == 254) packet = 560;
     }
 
     if(packet == INVALID){
         puts(szTextTitle);
         printf("%s is not a Supported 560 x 384 AppleWin Screen Capture.\n", bmpfile);
         fclose(fp);
-        free(dhrbuf);
+        free(ctx->dhrbuf);
         exit(1);
     }
 
 
-    memset(&dhrbuf[0],0,16384); /* clear write buffer */
+    memset(&ctx->dhrbuf[0],0,16384); /* clear write buffer */
 
 
     i = 191; /* bmp's are upside-down
@@ -4215,13 +4517,13 @@ int ReadAppleWin(unsigned char *basename, unsigned char *newname)
                 reverse order */
     for(y=192;y>0;y--)
     {
-      fread((char *)&bmpscanline[0],1,560,fp);
+      fread((char *)&ctx->bmpscanline[0],1,560,fp);
       /* skip every second scanline  */
-      fread((char *)&bmpscanline[0],1,560,fp);
+      fread((char *)&ctx->bmpscanline[0],1,560,fp);
       for (j=0;j<560;j++) {
-        if (bmpscanline[j] != 0)bmpscanline[j] = 1;
+        if (ctx->bmpscanline[j] != 0)ctx->bmpscanline[j] = 1;
       }
-      applewinbits(i); /* encode 7 bit mono line */
+      applewinbits(ctx, i); /* encode 7 bit mono line */
       i--;
       if (i< 0) break;
     }
@@ -4229,17 +4531,18 @@ int ReadAppleWin(unsigned char *basename, unsigned char *newname)
 
     /* keep output files to a minimum */
     /* output Apple II files in one of 2 formats */
-    if (applesoft == 0) {
-        if (longnames == 0)sprintf(outfile,"%s.2FC", newname);
+    if (ctx->applesoft == 0) {
+        if (ctx->longnames == 0)sprintf(outfile,"%s.2FC", newname);
         else sprintf(outfile,"%s.A2FC", newname);
+        StatsOutput(ctx->stats,outfile);
         fp = fopen(outfile,"wb");
         if (NULL == fp) {
             puts(szTextTitle);
             printf("%s cannot be created.\n", outfile);
-            free(dhrbuf);
+            free(ctx->dhrbuf);
             exit(1);
         }
-        fwrite(dhrbuf,1,16384,fp);
+        fwrite(ctx->dhrbuf,1,16384,fp);
         fclose(fp);
     }
     else {
@@ -4247,31 +4550,33 @@ int ReadAppleWin(unsigned char *basename, unsigned char *newname)
         /* the bsaved images are split into two files
         the first file is loaded into aux mem */
         sprintf(outfile,"%s.AUX",newname);
+        StatsOutput(ctx->stats,outfile);
         fp = fopen(outfile,"wb");
         if (NULL == fp) {
             puts(szTextTitle);
             printf("%s cannot be created.\n", outfile);
             exit(1);
         }
-        fwrite(dhrbuf,1,8192,fp);
+        fwrite(ctx->dhrbuf,1,8192,fp);
         fclose(fp);
 
         /* the second file is loaded into main mem */
         sprintf(outfile,"%s.BIN",newname);
+        StatsOutput(ctx->stats,outfile);
         fp = fopen(outfile,"wb");
         if (NULL == fp) {
             puts(szTextTitle);
             printf("%s cannot be created.\n", outfile);
-            free(dhrbuf);
+            free(ctx->dhrbuf);
             exit(1);
         }
-        fwrite(&dhrbuf[8192],1,8192,fp);
+        fwrite(&ctx->dhrbuf[8192],1,8192,fp);
         fclose(fp);
     }
 
     /* save a back-up of the original AppleWin file */
     /* if we are not already processing the back-up */
-    if (bm2 == 0) {
+    if (ctx->bm2 == 0) {
         sprintf(outfile,"%s.bm2",basename);
         remove(outfile);
         rename(bmpfile,outfile);
@@ -4419,7 +4724,7 @@ char *AldusVersion = "100";
 #define NEO 4
 #define ALDUS 5
 
-sshort GetUserPalette(char *name)
+sshort GetUserPalette(A2BCONTEXT *ctx, char *name)
 {
     FILE *fp;
     char buf[128];
@@ -4472,14 +4777,14 @@ sshort GetUserPalette(char *name)
         }
         if (status == INVALID) break;
 
-        memset(&rgbUser[0][0],0,48);
+        memset(&ctx->rgbUser[0][0],0,48);
         cnt = 0;
         while (fgets(buf,128,fp) != NULL) {
             if (buf[0] == '#') continue;
             if (strlen(buf) < 5) continue;
             nocr(buf);
             SqueezeLine(buf);
-            if (INVALID == ReadPaletteLine(buf,(uchar *)&rgbUser[cnt][0],colordepth)) continue;
+            if (INVALID == ReadPaletteLine(buf,(uchar *)&ctx->rgbUser[cnt][0],colordepth)) continue;
             cnt++;
             if (cnt > 15)break;
         }
@@ -4503,7 +4808,7 @@ sshort GetUserPalette(char *name)
 /* Color Output Helper Function */
 /* select conversion palette based on command-line options */
 /* matches Bmp2DHR */
-int GetBuiltinPalette(uchar cmd, uchar value, int palidx)
+int GetBuiltinPalette(A2BCONTEXT *ctx, uchar cmd, uchar value, int palidx)
 {
     int i,j, singlegrey = 0;
     uchar r,g,b;
@@ -4516,119 +4821,119 @@ int GetBuiltinPalette(uchar cmd, uchar value, int palidx)
     switch(palidx) {
         case 16:/* HGR conversion - optional palette from tohgr */
                 for (i=0;i<16;i++) {
-                    rgbArray[i][0] = hgrpal[i][0];
-                    rgbArray[i][1] = hgrpal[i][1];
-                    rgbArray[i][2] = hgrpal[i][2];
+                    ctx->rgbArray[i][0] = hgrpal[i][0];
+                    ctx->rgbArray[i][1] = hgrpal[i][1];
+                    ctx->rgbArray[i][2] = hgrpal[i][2];
                 }
                 break;
         case 15: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = PseudoPalette[i][0];
-                    rgbArray[i][1] = PseudoPalette[i][1];
-                    rgbArray[i][2] = PseudoPalette[i][2];
+                    ctx->rgbArray[i][0] = PseudoPalette[i][0];
+                    ctx->rgbArray[i][1] = PseudoPalette[i][1];
+                    ctx->rgbArray[i][2] = PseudoPalette[i][2];
                 }
                 break;
         /* Cybernesto */
         case 14: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = Cybernesto[i][0];
-                    rgbArray[i][1] = Cybernesto[i][1];
-                    rgbArray[i][2] = Cybernesto[i][2];
+                    ctx->rgbArray[i][0] = Cybernesto[i][0];
+                    ctx->rgbArray[i][1] = Cybernesto[i][1];
+                    ctx->rgbArray[i][2] = Cybernesto[i][2];
                 }
                 singlegrey = 1;
                 break;
         /* Jace */
         case 13: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = Jace[i][0];
-                    rgbArray[i][1] = Jace[i][1];
-                    rgbArray[i][2] = Jace[i][2];
+                    ctx->rgbArray[i][0] = Jace[i][0];
+                    ctx->rgbArray[i][1] = Jace[i][1];
+                    ctx->rgbArray[i][2] = Jace[i][2];
                 }
                 singlegrey = 1;
                 break;
         /* Super Convert */
         case 12: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = SuperConvert[i][0];
-                    rgbArray[i][1] = SuperConvert[i][1];
-                    rgbArray[i][2] = SuperConvert[i][2];
+                    ctx->rgbArray[i][0] = SuperConvert[i][0];
+                    ctx->rgbArray[i][1] = SuperConvert[i][1];
+                    ctx->rgbArray[i][2] = SuperConvert[i][2];
                 }
                 break;
         /* 5 legacy palettes from BMPA2FC */
         case 11: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbPcxArray[i][0];
-                    rgbArray[i][1] = rgbPcxArray[i][1];
-                    rgbArray[i][2] = rgbPcxArray[i][2];
+                    ctx->rgbArray[i][0] = rgbPcxArray[i][0];
+                    ctx->rgbArray[i][1] = rgbPcxArray[i][1];
+                    ctx->rgbArray[i][2] = rgbPcxArray[i][2];
                 }
                 break;
         case 10: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbVgaArray[i][0];
-                    rgbArray[i][1] = rgbVgaArray[i][1];
-                    rgbArray[i][2] = rgbVgaArray[i][2];
+                    ctx->rgbArray[i][0] = rgbVgaArray[i][0];
+                    ctx->rgbArray[i][1] = rgbVgaArray[i][1];
+                    ctx->rgbArray[i][2] = rgbVgaArray[i][2];
                 }
                 break;
         case 9: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbXmpArray[i][0];
-                    rgbArray[i][1] = rgbXmpArray[i][1];
-                    rgbArray[i][2] = rgbXmpArray[i][2];
+                    ctx->rgbArray[i][0] = rgbXmpArray[i][0];
+                    ctx->rgbArray[i][1] = rgbXmpArray[i][1];
+                    ctx->rgbArray[i][2] = rgbXmpArray[i][2];
                 }
                 break;
         case 8: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbBmpArray[i][0];
-                    rgbArray[i][1] = rgbBmpArray[i][1];
-                    rgbArray[i][2] = rgbBmpArray[i][2];
+                    ctx->rgbArray[i][0] = rgbBmpArray[i][0];
+                    ctx->rgbArray[i][1] = rgbBmpArray[i][1];
+                    ctx->rgbArray[i][2] = rgbBmpArray[i][2];
                 }
                 break;
         case 7: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbCanvasArray[i][0];
-                    rgbArray[i][1] = rgbCanvasArray[i][1];
-                    rgbArray[i][2] = rgbCanvasArray[i][2];
+                    ctx->rgbArray[i][0] = rgbCanvasArray[i][0];
+                    ctx->rgbArray[i][1] = rgbCanvasArray[i][1];
+                    ctx->rgbArray[i][2] = rgbCanvasArray[i][2];
                 }
                 break;
 
         /* user definable palette file */
         case 6:
                 for (i=0;i<16;i++) {
-                    rgbArray[i][0] = rgbUser[i][0];
-                    rgbArray[i][1] = rgbUser[i][1];
-                    rgbArray[i][2] = rgbUser[i][2];
+                    ctx->rgbArray[i][0] = ctx->rgbUser[i][0];
+                    ctx->rgbArray[i][1] = ctx->rgbUser[i][1];
+                    ctx->rgbArray[i][2] = ctx->rgbUser[i][2];
                 }
                 break;
         /* tohgr*/
         case 5: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = grpal[i][0];
-                    rgbArray[i][1] = grpal[i][1];
-                    rgbArray[i][2] = grpal[i][2];
+                    ctx->rgbArray[i][0] = grpal[i][0];
+                    ctx->rgbArray[i][1] = grpal[i][1];
+                    ctx->rgbArray[i][2] = grpal[i][2];
                 }
                 singlegrey = 1;
                 break;
         /* wikipedia */
         case 4: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = wikipedia[i][0];
-                    rgbArray[i][1] = wikipedia[i][1];
-                    rgbArray[i][2] = wikipedia[i][2];
+                    ctx->rgbArray[i][0] = wikipedia[i][0];
+                    ctx->rgbArray[i][1] = wikipedia[i][1];
+                    ctx->rgbArray[i][2] = wikipedia[i][2];
                 }
                 singlegrey = 1;
                 break;
 
         case 3: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = awinnewcolors[i][0];
-                    rgbArray[i][1] = awinnewcolors[i][1];
-                    rgbArray[i][2] = awinnewcolors[i][2];
+                    ctx->rgbArray[i][0] = awinnewcolors[i][0];
+                    ctx->rgbArray[i][1] = awinnewcolors[i][1];
+                    ctx->rgbArray[i][2] = awinnewcolors[i][2];
                 }
                 break;
         case 2: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = awinoldcolors[i][0];
-                    rgbArray[i][1] = awinoldcolors[i][1];
-                    rgbArray[i][2] = awinoldcolors[i][2];
+                    ctx->rgbArray[i][0] = awinoldcolors[i][0];
+                    ctx->rgbArray[i][1] = awinoldcolors[i][1];
+                    ctx->rgbArray[i][2] = awinoldcolors[i][2];
                 }
                 break;
         case 1: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = ciderpresscolors[i][0];
-                    rgbArray[i][1] = ciderpresscolors[i][1];
-                    rgbArray[i][2] = ciderpresscolors[i][2];
+                    ctx->rgbArray[i][0] = ciderpresscolors[i][0];
+                    ctx->rgbArray[i][1] = ciderpresscolors[i][1];
+                    ctx->rgbArray[i][2] = ciderpresscolors[i][2];
                 }
                 break;
         case 0: for (i=0;i<16;i++) {
-                    rgbArray[i][0] = kegs32colors[i][0];
-                    rgbArray[i][1] = kegs32colors[i][1];
-                    rgbArray[i][2] = kegs32colors[i][2];
+                    ctx->rgbArray[i][0] = kegs32colors[i][0];
+                    ctx->rgbArray[i][1] = kegs32colors[i][1];
+                    ctx->rgbArray[i][2] = kegs32colors[i][2];
                 }
                 break;
         default: return -1;
@@ -4636,14 +4941,14 @@ int GetBuiltinPalette(uchar cmd, uchar value, int palidx)
 
         /* grey conversion may be necessary if the Apple II Image
            uses light grey and dark grey. */
-        if (doublegrey == 1) {
-            if (singlegrey != 0 && rgbArray[5][0] != 0) {
+        if (ctx->doublegrey == 1) {
+            if (singlegrey != 0 && ctx->rgbArray[5][0] != 0) {
                /* grey 1 = 5, grey2 = 10 */
                /* use the median between the existing grey and white */
                /* to approximate the color distance for this palette */
                temp = 255;
-               temp += rgbArray[5][0];
-               rgbArray[10][0] = rgbArray[10][1] = rgbArray[10][2] = (uchar) (temp/2);
+               temp += ctx->rgbArray[5][0];
+               ctx->rgbArray[10][0] = ctx->rgbArray[10][1] = ctx->rgbArray[10][2] = (uchar) (temp/2);
             }
         }
 
@@ -4656,37 +4961,37 @@ int GetBuiltinPalette(uchar cmd, uchar value, int palidx)
 
 /* Monochrome Output Helper Function */
 /* decodes apple II dhgr buffer into 8 bit monochrome scanline buffer */
-int applebites(int y)
+int applebites(A2BCONTEXT *ctx, int y)
 {
         int xoff,idx;
         unsigned char *ptraux, *ptrmain, ch;
 
         xoff = HB[y];
-        ptraux  = (unsigned char *) &dhrbuf[xoff-0x2000];
-        ptrmain = (unsigned char *) &dhrbuf[xoff];
+        ptraux  = (unsigned char *) &ctx->dhrbuf[xoff-0x2000];
+        ptrmain = (unsigned char *) &ctx->dhrbuf[xoff];
 
         xoff = 0;
         for (idx = 0; idx < 40; idx++) {
 
             ch = ptraux[idx];
 
-            buf560[xoff] = ((ch) &1); xoff++;
-            buf560[xoff] = ((ch >> 1) &1); xoff++;
-            buf560[xoff] = ((ch >> 2) &1); xoff++;
-            buf560[xoff] = ((ch >> 3) &1); xoff++;
-            buf560[xoff] = ((ch >> 4) &1); xoff++;
-            buf560[xoff] = ((ch >> 5) &1); xoff++;
-            buf560[xoff] = ((ch >> 6) &1); xoff++;
+            ctx->buf560[xoff] = ((ch) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 1) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 2) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 3) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 4) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 5) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 6) &1); xoff++;
 
             ch = ptrmain[idx];
 
-            buf560[xoff] = ((ch) &1); xoff++;
-            buf560[xoff] = ((ch >> 1) &1); xoff++;
-            buf560[xoff] = ((ch >> 2) &1); xoff++;
-            buf560[xoff] = ((ch >> 3) &1); xoff++;
-            buf560[xoff] = ((ch >> 4) &1); xoff++;
-            buf560[xoff] = ((ch >> 5) &1); xoff++;
-            buf560[xoff] = ((ch >> 6) &1); xoff++;
+            ctx->buf560[xoff] = ((ch) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 1) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 2) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 3) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 4) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 5) &1); xoff++;
+            ctx->buf560[xoff] = ((ch >> 6) &1); xoff++;
 
         }
         return SUCCESS;
@@ -4695,7 +5000,7 @@ int applebites(int y)
 
 /* Monochrome Output Helper Function */
 /* encodes monochrome bmp scanline from 8 bit monochrome scanline buffer */
-int ibmbites()
+int ibmbites(A2BCONTEXT *ctx)
 {
      int i,j,k;
      unsigned char bits[8];
@@ -4705,9 +5010,9 @@ int ibmbites()
      {
         for(k=0;k<8;k++)
         {
-          bits[k] = buf560[j]; j++;
+          bits[k] = ctx->buf560[j]; j++;
         }
-        bmpscanline[i] = (bits[0]<<7|bits[1]<<6|bits[2]<<5|bits[3]<<4|
+        ctx->bmpscanline[i] = (bits[0]<<7|bits[1]<<6|bits[2]<<5|bits[3]<<4|
                           bits[4]<<3|bits[5]<<2|bits[6]<<1|bits[7]);
      }
      return SUCCESS;
@@ -4716,7 +5021,7 @@ int ibmbites()
 
 /* Monochrome Output Helper Function */
 /* save a monochrome bmp file in either supported resolution */
-int save_to_bmp(unsigned char *basename, int doublepixel)
+int save_to_bmp(A2BCONTEXT *ctx, unsigned char *basename, int doublepixel)
 {
 
     FILE *fp;
@@ -4726,8 +5031,9 @@ int save_to_bmp(unsigned char *basename, int doublepixel)
 
     sprintf(outfile,"%s.bmp",basename);
 
-    if (vbmp == 1) return WriteVBMPFile(outfile);
+    if (ctx->vbmp == 1) return WriteVBMPFile(ctx, outfile);
 
+    StatsOutput(ctx->stats,outfile);
     fp = fopen(outfile,"wb");
     if (NULL == fp)return INVALID;
 
@@ -4739,14 +5045,14 @@ int save_to_bmp(unsigned char *basename, int doublepixel)
 
     /* write scanlines */
     y2 = 191;
-    bmpscanline[70] = bmpscanline[71] = 0xff; /* white padding */
+    ctx->bmpscanline[70] = ctx->bmpscanline[71] = 0xff; /* white padding */
     for (y = 0; y< 192; y++) {
-       applebites(y2);
-       ibmbites();
-       fwrite(bmpscanline,1,72,fp);
+       applebites(ctx, y2);
+       ibmbites(ctx);
+       fwrite(ctx->bmpscanline,1,72,fp);
        /* double-up */
        if (doublepixel == 1)
-            fwrite(bmpscanline,1,72,fp);
+            fwrite(ctx->bmpscanline,1,72,fp);
        y2 -= 1;
     }
 
@@ -4755,27 +5061,74 @@ int save_to_bmp(unsigned char *basename, int doublepixel)
 }
 
 
-uchar greyoveride[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-
-/* creates a IIgs mode320 PIC file with a single active palette */
-/* also creates a IIgs mode320 PIC file with up to 16 active palettes */
-/* also creates a IIgs mode3200 Brooks PIC file with 200 active palettes */
-int SHR320_Output(char *outfile)
+/* packed SHR output (option "pnt" or "3201") replaces the raw SHR file */
+/* mode3200 can be written as either, mode320 is always written as APF */
+void SHRPackedName(A2BCONTEXT *ctx, char *outfile, char *newname)
 {
+    if (ctx->packedshr == 0) return;
 
-    FILE *fp;
-    sshort i,j,k;
-    uchar r,g,b,idx;
-    int x, y;
-    float hue, saturation,luminance;
+    if (ctx->packedshr == 2 && ctx->shrpalettes == 200) {
+        sprintf(outfile,"%s.3201", newname);
+        ucase(ctx,(char *)&outfile[0]);
+        return;
+    }
 
-    fp = fopen(outfile,"wb");
-    if (NULL == fp) return INVALID;
+    sprintf(outfile,"%s.PNT", newname);
+    ucase(ctx,(char *)&outfile[0]);
+    if (ctx->tags == 1) strcat(outfile,"#C00002");
+}
 
-    if (shrpalettes == 200 || shrpalettes == 16) {
+/* writes the APF or 3201 file from the SHR pixels and the palettes in mypic */
+/* this saves the m2s round trip through the _proc.bmp and _palette.bmp files */
+int SHRPackedOutput(A2BCONTEXT *ctx, FILE *fp, uchar *shrpixels)
+{
+    uchar tables[200][32];
+    int y, i;
+    long len;
+
+    if (ctx->shrpalettes == 200) {
+        /* mypic holds the palettes in Brooks order - color 15 first */
+        for (y = 0; y < 200; y++) {
+            for (i = 0; i < 16; i++) {
+                tables[y][i*2] = ctx->mypic.pal[y][(15-i)*2];
+                tables[y][i*2+1] = ctx->mypic.pal[y][(15-i)*2+1];
+            }
+        }
+        if (ctx->packedshr == 2) len = Write3201(fp, &shrpixels[0], &tables[0][0], NULL);
+        else len = WriteAPF(fp, &shrpixels[0], &ctx->mypic.scb[0], &tables[0][0], 200, NULL, 0);
+    }
+    else {
+        len = WriteAPF(fp, &shrpixels[0], &ctx->mypic.scb[0], &ctx->mypic.pal[0][0], 16, NULL, 0);
+    }
+
+    if (len < 0) return INVALID;
+    return SUCCESS;
+}
+
+/* creates a IIgs mode320 PIC file with a single active palette */
+/* also creates a IIgs mode320 PIC file with up to 16 active palettes */
+/* also creates a IIgs mode3200 Brooks PIC file with 200 active palettes */
+int SHR320_Output(A2BCONTEXT *ctx, char *outfile)
+{
+
+    FILE *fp;
+    sshort i,j,k;
+    uchar r,g,b,idx,shrpixels[200][160];
+    int x, y;
+    float hue, saturation,luminance;
+
+    StatsOutput(ctx->stats,outfile);
+    fp = fopen(outfile,"wb");
+    if (NULL == fp) return INVALID;
+
+    /* the palettes and pixels are packed here and written below */
+    /* the packed formats are encoded as they are written */
+    StatsNext(ctx->stats,STATS_WRITE,STATS_ENCODE);
+
+    if (ctx->shrpalettes == 200 || ctx->shrpalettes == 16) {
 
         for (i = 0; i < 16; i++) {
-            if (greyoveride[i] == 1 && quietmode == 0) printf("%s will be replaced with %d percent saturated equivalent!\n",colornames[i],(int)desaturate[i]);
+            if (ctx->greyoveride[i] == 1 && ctx->quietmode == 0) printf("%s will be replaced with %d percent saturated equivalent!\n",colornames[i],(int)ctx->desaturate[i]);
         }
 
 
@@ -4783,54 +5136,54 @@ int SHR320_Output(char *outfile)
         for (y = 0; y < 200; y++) {
             for (i = 0; i < 16; i++) {
 
-                if (usegspalette == 1) {
-                    rgbArrays[y][i][0] = gsColor(rgbArrays[y][i][0]);
-                    rgbArrays[y][i][1] = gsColor(rgbArrays[y][i][1]);
-                    rgbArrays[y][i][2] = gsColor(rgbArrays[y][i][2]);
+                if (ctx->usegspalette == 1) {
+                    ctx->rgbArrays[y][i][0] = gsColor(ctx->rgbArrays[y][i][0]);
+                    ctx->rgbArrays[y][i][1] = gsColor(ctx->rgbArrays[y][i][1]);
+                    ctx->rgbArrays[y][i][2] = gsColor(ctx->rgbArrays[y][i][2]);
                 }
 
 
-                if (greyoveride[i] != 1) continue;
+                if (ctx->greyoveride[i] != 1) continue;
                 /* desaturate palette color if grey over-ride is in effect */
-                rgb2hsl(rgbArrays[y][i][0],rgbArrays[y][i][1],rgbArrays[y][i][2],&hue,&saturation,&luminance);
-                saturation = (saturation * desaturate[i]) / 100;
-                hsl2rgb(hue,saturation,luminance,&rgbArrays[y][i][0],&rgbArrays[y][i][1],&rgbArrays[y][i][2]);
+                rgb2hsl(ctx->rgbArrays[y][i][0],ctx->rgbArrays[y][i][1],ctx->rgbArrays[y][i][2],&hue,&saturation,&luminance);
+                saturation = (saturation * ctx->desaturate[i]) / 100;
+                hsl2rgb(hue,saturation,luminance,&ctx->rgbArrays[y][i][0],&ctx->rgbArrays[y][i][1],&ctx->rgbArrays[y][i][2]);
             }
         }
-        if (shrpalettes == 16) {
+        if (ctx->shrpalettes == 16) {
             /* palette is used only for 16 palette pic */
             for (y = 0; y < 16; y++) {
                 for (i = 0; i < 16; i++) {
 
-                    if (usegspalette == 1) {
-                        rgb256Arrays[y][i][0] = gsColor(rgb256Arrays[y][i][0]);
-                        rgb256Arrays[y][i][1] = gsColor(rgb256Arrays[y][i][1]);
-                        rgb256Arrays[y][i][2] = gsColor(rgb256Arrays[y][i][2]);
+                    if (ctx->usegspalette == 1) {
+                        ctx->rgb256Arrays[y][i][0] = gsColor(ctx->rgb256Arrays[y][i][0]);
+                        ctx->rgb256Arrays[y][i][1] = gsColor(ctx->rgb256Arrays[y][i][1]);
+                        ctx->rgb256Arrays[y][i][2] = gsColor(ctx->rgb256Arrays[y][i][2]);
                     }
 
 
-                    if (greyoveride[i] != 1) continue;
+                    if (ctx->greyoveride[i] != 1) continue;
                     /* desaturate palette color if grey over-ride is in effect */
-                    rgb2hsl(rgb256Arrays[y][i][0],rgbArrays[y][i][1],rgbArrays[y][i][2],&hue,&saturation,&luminance);
-                    saturation = (saturation * desaturate[i]) / 100;
-                    hsl2rgb(hue,saturation,luminance,&rgb256Arrays[y][i][0],&rgb256Arrays[y][i][1],&rgb256Arrays[y][i][2]);
+                    rgb2hsl(ctx->rgb256Arrays[y][i][0],ctx->rgbArrays[y][i][1],ctx->rgbArrays[y][i][2],&hue,&saturation,&luminance);
+                    saturation = (saturation * ctx->desaturate[i]) / 100;
+                    hsl2rgb(hue,saturation,luminance,&ctx->rgb256Arrays[y][i][0],&ctx->rgb256Arrays[y][i][1],&ctx->rgb256Arrays[y][i][2]);
                 }
             }
         }
 
     }
     else {
-        if (usegspalette == 1) {
+        if (ctx->usegspalette == 1) {
             for (i=0;i<16;i++) {
-                rgbArray[i][0] = gsColor(rgbArray[i][0]);
-                rgbArray[i][1] = gsColor(rgbArray[i][1]);
-                rgbArray[i][2] = gsColor(rgbArray[i][2]);
+                ctx->rgbArray[i][0] = gsColor(ctx->rgbArray[i][0]);
+                ctx->rgbArray[i][1] = gsColor(ctx->rgbArray[i][1]);
+                ctx->rgbArray[i][2] = gsColor(ctx->rgbArray[i][2]);
             }
         }
     }
 
     /* creates brooks files, and 16 palette and single-palette SHR PIC files */
-    switch (shrpalettes) {
+    switch (ctx->shrpalettes) {
         case 200:
             /* brooks palettes - 1 for each line */
             /* in sequential order - no scb's */
@@ -4839,14 +5192,14 @@ int SHR320_Output(char *outfile)
                 for (i = 0,j=30; i < 16;i++,j-=2) {
 
                     /* read BGR triples */
-                    b = (uchar) (rgbArrays[y][i][2] >> 4);
-                    g = (uchar) (rgbArrays[y][i][1] >> 4);
-                    r = (uchar) (rgbArrays[y][i][0] >> 4);
+                    b = (uchar) (ctx->rgbArrays[y][i][2] >> 4);
+                    g = (uchar) (ctx->rgbArrays[y][i][1] >> 4);
+                    r = (uchar) (ctx->rgbArrays[y][i][0] >> 4);
 
                     /* encode $0RGB motorola unsigned short (LSB, MSB) for pic file into 2 bytes */
                     g = (uchar) (g << 4);
-                    mypic.pal[y][j] = (uchar) (g | b);
-                    mypic.pal[y][j+1] = r;
+                    ctx->mypic.pal[y][j] = (uchar) (g | b);
+                    ctx->mypic.pal[y][j+1] = r;
                 }
             }
             break;
@@ -4857,17 +5210,17 @@ int SHR320_Output(char *outfile)
                 /* palettes 0 - 16 */
                 for (i=0;i< 16;i++) {
                     /* read BGR triples */
-                    b = (uchar) (rgb256Arrays[j][i][2] >> 4);
-                    g = (uchar) (rgb256Arrays[j][i][1] >> 4);
-                    r = (uchar) (rgb256Arrays[j][i][0] >> 4);
+                    b = (uchar) (ctx->rgb256Arrays[j][i][2] >> 4);
+                    g = (uchar) (ctx->rgb256Arrays[j][i][1] >> 4);
+                    r = (uchar) (ctx->rgb256Arrays[j][i][0] >> 4);
 
                     /* offset from char to short */
                     k = i*2;
 
                     /* encode $0RGB motorola unsigned short (LSB, MSB) for pic file into 2 bytes */
                     g = (uchar) (g << 4);
-                    mypic.pal[j][k] = (uchar) (g | b);
-                    mypic.pal[j][k+1] = r;
+                    ctx->mypic.pal[j][k] = (uchar) (g | b);
+                    ctx->mypic.pal[j][k+1] = r;
                 }
             }
             break;
@@ -4880,71 +5233,71 @@ int SHR320_Output(char *outfile)
             for (i=0;i< 16;i++) {
 
                 /* read BGR triples */
-                b = (uchar) (rgbArray[i][2] >> 4);
-                g = (uchar) (rgbArray[i][1] >> 4);
-                r = (uchar) (rgbArray[i][0] >> 4);
+                b = (uchar) (ctx->rgbArray[i][2] >> 4);
+                g = (uchar) (ctx->rgbArray[i][1] >> 4);
+                r = (uchar) (ctx->rgbArray[i][0] >> 4);
 
                 /* offset from char to short */
                 k = i*2;
 
                 /* encode $0RGB motorola unsigned short (LSB, MSB) for pic file into 2 bytes */
                 g = (uchar) (g << 4);
-                mypic.pal[0][k] = (uchar) (g | b);
-                mypic.pal[0][k+1] = r;
+                ctx->mypic.pal[0][k] = (uchar) (g | b);
+                ctx->mypic.pal[0][k+1] = r;
             }
 
     }
 
     /* 200 lines of image data */
-    memset(&bmpscanline[0],0,160);
     for(y=0;y<200;y++) {
         /* build a packed pixel scanline */
         /* this is the same as for Windows 16 color BMPs */
         for (x = 0, i=0; x < 320; x++) {
-            idx = getlopixel(x,y);
+            idx = getlopixel(ctx, x,y);
             /* range check */
             if (idx > 15)idx = 0; /* default black */
             if (x%2 == 0) {
                 r = (uchar)idx << 4;
             }
             else {
-                bmpscanline[i] = r | (uchar) idx; i++;
+                shrpixels[y][i] = r | (uchar) idx; i++;
             }
         }
-        fwrite((char *)&bmpscanline[0],1,160,fp);
     }
-    if (shrpalettes == 200) {
+
+    RDReport(ctx, &shrpixels[0][0]);
+
+    /* palette slots that repeat a color in the same palette */
+    if (ctx->stats != NULL) {
+        for (y = 0; y < ctx->shrpalettes && y < 200; y++) {
+            if (ctx->shrpalettes == 200) StatsCollisions(ctx->stats,&ctx->rgbArrays[y][0][0],16);
+            else if (ctx->shrpalettes == 16) StatsCollisions(ctx->stats,&ctx->rgb256Arrays[y][0][0],16);
+            else StatsCollisions(ctx->stats,&ctx->rgbArray[0][0],16);
+        }
+    }
+    StatsNext(ctx->stats,STATS_ENCODE,STATS_WRITE);
+
+    /* packed output straight from the pixels and palettes */
+    if (ctx->packedshr != 0) {
+        x = SHRPackedOutput(ctx, fp, &shrpixels[0][0]);
+        fclose(fp);
+        return x;
+    }
+
+    fwrite((char *)&shrpixels[0][0],1,32000,fp);
+    if (ctx->shrpalettes == 200) {
         /* brooks */
-        fwrite((char *)&mypic.pal[0],6400,1,fp);
+        fwrite((char *)&ctx->mypic.pal[0],6400,1,fp);
     }
     else {
         /* PIC - scbs required  followed by palettes only */
-        fwrite((char *)&mypic.scb[0],768,1,fp);
+        fwrite((char *)&ctx->mypic.scb[0],768,1,fp);
     }
     fclose(fp);
 
     return SUCCESS;
 }
 
-/* brooks output is experimental at this point */
-int brooks2 = 0, brooks3 = 0, brooks4 = 0, brooks5 = 0;
-
-int useoriginalcolors = 0;
-int usesixteencolors = 0, usefourteencolors = 0, useegacolors = 0;
-
-/* brooks4 and brooks5 arrays */
-uchar linecolors[320][4];
-ushort linecount[320];
-double linedistance[320];
-
-uchar linepalette[16][4];  /* r,g,b,used */
-ushort linecolorindex[16]; /* index in linecolors array for color info */
-
-uchar brooks5colors[] = {2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2};
-
-
-char pcxheader[66], pcxfile[256];
-
 /* this solves the problem of creating image specific conversion palettes especially for
     single palette output of SHR files - it takes too long to create a palette file so I just
     create a second image reduced to 16 colors and use that instead */
@@ -4953,7 +5306,7 @@ char pcxheader[66], pcxfile[256];
 /* reads the palette from the BMP named on the option P - command line */
 /* these can be created in the GIMP or any other editor that writes a compatible BMP file */
 /* alternately, reads the palette from an 8-bit PCX file created by ImageMagick */
-sshort GetBmpOrPcxPalette(char *name)
+sshort GetBmpOrPcxPalette(A2BCONTEXT *ctx, char *name)
 {
     FILE *fp;
     sshort status = INVALID, i, j, bmpversion;
@@ -4970,18 +5323,18 @@ sshort GetBmpOrPcxPalette(char *name)
 
     */
 
-    strcpy(pcxfile,name);
+    strcpy(ctx->pcxfile,name);
 
     j=999;
-    for (i=0;pcxfile[i]!=(char)0;i++) {
-       if (pcxfile[i] == '.') j = i;
+    for (i=0;ctx->pcxfile[i]!=(char)0;i++) {
+       if (ctx->pcxfile[i] == '.') j = i;
     }
     if (j!=999) {
-        pcxfile[j] = 0;
-        strcat(pcxfile,".pcx");
+        ctx->pcxfile[j] = 0;
+        strcat(ctx->pcxfile,".pcx");
         for (;;) {
 
-            fp = fopen(pcxfile,"rb");
+            fp = fopen(ctx->pcxfile,"rb");
 
             if (fp == NULL) break;
 
@@ -4997,12 +5350,12 @@ sshort GetBmpOrPcxPalette(char *name)
 
             /* read the PCX header for compatibility */
             rewind(fp);
-            fread(pcxheader,66,1,fp);
+            fread(ctx->pcxheader,66,1,fp);
 
             /* PCX version 5 with 8-bits per pixel, run-length encoded with one color plane */
             /* PCX version 5 with 1-bit  per pixel, run-length encoded with one color plane */
-            if (pcxheader[0] != (char)10 || pcxheader[1] != (char)5 ||
-                pcxheader[2] != (char)1 || pcxheader[65] != (char)1) {
+            if (ctx->pcxheader[0] != (char)10 || ctx->pcxheader[1] != (char)5 ||
+                ctx->pcxheader[2] != (char)1 || ctx->pcxheader[65] != (char)1) {
                 fclose(fp);
                 break;
             }
@@ -5010,13 +5363,13 @@ sshort GetBmpOrPcxPalette(char *name)
             /* seek to end of file and read the first sixteen palette entries */
             fseek(fp,flen,SEEK_SET);
             /* first check the palette header (it must be a formfeed character) */
-            fread(pcxheader, 1, 1, fp);
-            if (pcxheader[0] != (char) 12) {
+            fread(ctx->pcxheader, 1, 1, fp);
+            if (ctx->pcxheader[0] != (char) 12) {
                 fclose(fp);
                 break;
             }
             /* read the palette */
-            fread(&rgbUser[0][0],48,1,fp);
+            fread(&ctx->rgbUser[0][0],48,1,fp);
             fclose(fp);
             status = SUCCESS;
             break;
@@ -5029,53 +5382,53 @@ sshort GetBmpOrPcxPalette(char *name)
     if (fp == NULL) {
         /* try to open an m2s palette file */
         j=999;
-        for (i=0;pcxfile[i]!=(char)0;i++) {
-            if (pcxfile[i] == '.') j = i;
-            if (pcxfile[i] == '_') {
+        for (i=0;ctx->pcxfile[i]!=(char)0;i++) {
+            if (ctx->pcxfile[i] == '.') j = i;
+            if (ctx->pcxfile[i] == '_') {
                 /* allow re-rendering of Simplifly output */
-                if (cmpstr((char *)&pcxfile[i],"_proc.bmp") == SUCCESS) {
+                if (cmpstr((char *)&ctx->pcxfile[i],"_proc.bmp") == SUCCESS) {
                     j = i;
                     break;
                 }
             }
         }
         if (j==999) return status;
-        pcxfile[j] = 0;
-        strcat(pcxfile,"_palette.bmp");
-        fp = fopen(pcxfile,"rb");
+        ctx->pcxfile[j] = 0;
+        strcat(ctx->pcxfile,"_palette.bmp");
+        fp = fopen(ctx->pcxfile,"rb");
         /* if we have tried everything that makes sense, then give it up */
         if (fp == NULL)return status;
     }
 
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
 
-    fread((char *)&BitMapFileHeader.bfType,
+    fread((char *)&ctx->BitMapFileHeader.bfType,
                  sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
+    fread((char *)&ctx->bmi.biSize,
                  sizeof(BITMAPINFOHEADER),1,fp);
 
     /* version 4 and version 5 BMP's use a different header than a version 3 bmp and may be incompatible */
     /* but initial tests show no sign of incompatibility */
-    if (bmi.biSize != sizeof(BITMAPINFOHEADER)) {
-		if (bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+    if (ctx->bmi.biSize != sizeof(BITMAPINFOHEADER)) {
+		if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,(unsigned)bmi.biSize,1,fp);
+            fread((char *)&ctx->bmiV5.biSize,(unsigned)ctx->bmi.biSize,1,fp);
             bmpversion = 3;
 		}
-		else if (bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+		else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
             bmpversion = 4;
 
         }
-        else if (bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
+        else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
             /* https://msdn.microsoft.com/en-us/library/windows/desktop/dd183386%28v=vs.85%29.aspx */
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
             fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
             bmpversion = 5;
             /*
             Profile data refers to either the profile file name (linked profile)
@@ -5097,28 +5450,28 @@ sshort GetBmpOrPcxPalette(char *name)
 
     if (bmpversion != 0) {
         /* use any size at all - 16-color, 256-color, and 24-bit Version 3 BMP's are all supported here */
-        if (bmi.biCompression==BI_RGB && BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M') {
+        if (ctx->bmi.biCompression==BI_RGB && ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M') {
 
-            if (bmi.biBitCount == 4 || bmi.biBitCount == 8) {
+            if (ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 8) {
                 status = SUCCESS;
-                fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+                fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
                 for (j=0;j<16;j++) {
-                    rgbUser[j][0] = sbmp[j].rgbRed;
-                    rgbUser[j][1] = sbmp[j].rgbGreen;
-                    rgbUser[j][2] = sbmp[j].rgbBlue;
+                    ctx->rgbUser[j][0] = ctx->sbmp[j].rgbRed;
+                    ctx->rgbUser[j][1] = ctx->sbmp[j].rgbGreen;
+                    ctx->rgbUser[j][2] = ctx->sbmp[j].rgbBlue;
                 }
 
            }
-           else if (bmi.biBitCount == 24) {
+           else if (ctx->bmi.biBitCount == 24) {
                 /* last of all, check for an m2s palette file */
                 /* or something similar */
                 status = SUCCESS;
-                fread(&rgbUser[0][0],48,1,fp);
+                fread(&ctx->rgbUser[0][0],48,1,fp);
                 /* reverse the Windows BGR triples to RGB triples */
                 for (j=0;j<16;j++) {
-                    temp = rgbUser[j][0];
-                    rgbUser[j][0] = rgbUser[j][2];
-                    rgbUser[j][2] = temp;
+                    temp = ctx->rgbUser[j][0];
+                    ctx->rgbUser[j][0] = ctx->rgbUser[j][2];
+                    ctx->rgbUser[j][2] = temp;
                 }
            }
 
@@ -5130,2798 +5483,4511 @@ sshort GetBmpOrPcxPalette(char *name)
 }
 
 
-/* converts to lores and double lo-res image fragments and backgrounds (primarily targeted at game development) */
-/* also converts to SHR mode320 full-screen PIC files - Single Palette, 16-Palette, and 200 Palette (Brooks) format*/
-int ConvertLoResAndSHR(unsigned char *basename, unsigned char *newname)
-{
+/* ------------------------------------------------------------------------ */
+/* Built-in Segment Palettes                                                */
+/* ------------------------------------------------------------------------ */
 
-    FILE *fp;
-    int packet = INVALID, y,y1,y2,x,i,j,k,width,height,reformat = bmp3, bmpversion =0,lidx,didx,count;
-    int outpacket, outputwidth, outputheight, offset;
-    char bmpfile[256], outfile[256];
-    uchar r,g,b,lr,lg,lb,red,green,blue,drawcolor,idx,toneindex;
-    ushort temp, fl, darkest,lightest,found,unused;
-    float hue,saturation,luminance;
-    sshort jdx;
+/* option "pim" followed by 1, 8, 16 or 200 builds the same kinds of
+   segmented palettes that slicer.sh makes with ImageMagick, but in-process
+   and without the PCX files. each segment of the image gets a 16 color
+   palette from a median cut of its colors. the segments don't depend on
+   each other so they are cut in parallel. */
 
-    sprintf(bmpfile,"%s.bmp",basename);
+typedef struct tagSEGMENT
+{
+    uchar *pixels;   /* 24-bit rgb pixels of this segment */
+    int count;       /* number of pixels */
+    uchar *palette;  /* 16 rgb triples */
+} SEGMENT;
 
-    if((fp=fopen(bmpfile,"rb"))==NULL) {
-        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n");
-        return INVALID;
-    }
+typedef struct tagSEGMENTS
+{
+    SEGMENT seg[200];
+    int numsegs, nextseg;
+    pthread_mutex_t lock;
+} SEGMENTS;
 
-    /* read the header stuff into the appropriate structures,
-       it's likely a bmp file */
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+int NumberOfProcessors()
+{
+    int cpus = 1;
+#ifdef _WIN32
+    char *ptr = getenv("NUMBER_OF_PROCESSORS");
+    if (NULL != ptr) cpus = atoi(ptr);
+#else
+    cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cpus < 1) cpus = 1;
+    return cpus;
+}
 
-    fread((char *)&BitMapFileHeader.bfType,
-                 sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+/* read a 24-bit bmp top-down in rgb order */
+/* reduce is for "4play" which works in IIgs colors */
+uchar *ReadRGBImage(A2BCONTEXT *ctx, FILE *fp, int packet, int width, int reduce)
+{
+    uchar *image, *ptr;
+    int x, y, k;
 
-    if (bmi.biSize != sizeof(BITMAPINFOHEADER)) {
-		if (bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,(unsigned)bmi.biSize,1,fp);
-            bmpversion = 3;
-            reformat = 1;
-		}
-		else if (bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
-            bmpversion = 4;
-            reformat = 1;
+    image = (uchar *)malloc(width * 200 * 3);
+    if (NULL == image) {
+        puts("No memory...");
+        return NULL;
+    }
 
+    SeekBmpLines(ctx, fp);
+    for (y = 199; y > -1; y--) {
+        ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
+        if (reduce == 1) {
+            for (k=0;k<packet;k++) ctx->bmpscanline[k] = gsColor(ctx->bmpscanline[k]);
         }
-        else if (bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
-            bmpversion = 5;
-            reformat = 1;
-            /*
-            Profile data refers to either the profile file name (linked profile)
-            or the actual profile bits (embedded profile).
-            The file format places the profile data at the end of the file.
-            The profile data is placed just after the color table (if present).
-            */
-        }
-        else {
-            bmpversion = 0;
+        ptr = &image[y * width * 3];
+        for (x = 0; x < width * 3; x += 3) {
+            ptr[x]   = ctx->bmpscanline[x+2];
+            ptr[x+1] = ctx->bmpscanline[x+1];
+            ptr[x+2] = ctx->bmpscanline[x];
         }
-
-    }
-    else {
-        bmpversion = 3;
-    }
-
-    if (bmpversion == 0) {
-        fclose(fp);
-        puts("BMP version not recognized!");
-        printf("bmi.biSize = %d - BITMAPINFOHEADER = %d\n",bmi.biSize, sizeof(BITMAPINFOHEADER));
-        return INVALID;
     }
+    return image;
+}
 
+/* sort the pixels of a box on one gun (0 = red, 1 = green, 2 = blue) */
+/* a counting sort - the guns are only 8 bits */
+void SortSegmentBox(uchar *pixels, uchar *work, int count, int gun)
+{
+    int i, pos, total[256];
 
-    if (shr == 320) {
-        lores = 1;
-        doublelores = 0;
+    memset(total,0,sizeof(total));
+    for (i = 0; i < count; i++) total[pixels[i*3+gun]]++;
+    for (i = 0, pos = 0; i < 256; i++) {
+        pos += total[i];
+        total[i] = pos - total[i];
     }
-    else {
-        usegscolors = shrgrey = 0;
+    for (i = 0; i < count; i++) {
+        pos = total[pixels[i*3+gun]]++;
+        memcpy(&work[pos*3],&pixels[i*3],3);
     }
+    memcpy(pixels,work,count*3);
+}
 
-    if (bmi.biCompression==BI_RGB &&
-        BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && (bmi.biBitCount == 24 || bmi.biBitCount == 8 || bmi.biBitCount == 4 || bmi.biBitCount == 1)) {
+/* median cut of one segment into up to 16 colors */
+/* unused palette entries are left black like the ImageMagick palettes */
+void CutSegmentPalette(SEGMENT *seg, uchar *work)
+{
+    int first[16], count[16], range[16], gun[16];
+    int numboxes = 1, box, i, j, lo, hi, best, half;
+    ulong sum[3];
+    uchar *ptr;
 
-            if (shr == 320) {
-                if (bmi.biWidth != 320 || bmi.biHeight != 200) {
-                    fclose(fp);
-                    puts(szTextTitle);
-                    printf("%s is not in a supported size for SHR mode320 file output.\nExiting!\n", bmpfile);
-                    return INVALID;
-                }
-            }
+    first[0] = 0;
+    count[0] = seg->count;
+    memset(seg->palette,0,48);
+    if (seg->count == 0) return;
 
-            if (bmi.biWidth > 320 || bmi.biHeight > 200) {
-                fclose(fp);
-                puts(szTextTitle);
-                printf("%s is not in a supported size for LGR or DLGR file output.\nExiting!\n", bmpfile);
-                return INVALID;
+    for (;;) {
+        /* the range and widest gun of each box */
+        best = -1;
+        for (box = 0; box < numboxes; box++) {
+            range[box] = gun[box] = 0;
+            for (j = 0; j < 3; j++) {
+                lo = 255; hi = 0;
+                ptr = &seg->pixels[first[box]*3+j];
+                for (i = 0; i < count[box]; i++, ptr += 3) {
+                    if (*ptr < lo) lo = *ptr;
+                    if (*ptr > hi) hi = *ptr;
+                }
+                if (hi - lo > range[box]) {
+                    range[box] = hi - lo;
+                    gun[box] = j;
+                }
             }
+            /* split the widest box next and the biggest of those */
+            if (range[box] == 0) continue;
+            if (best == -1 || range[box] > range[best] ||
+               (range[box] == range[best] && count[box] > count[best])) best = box;
+        }
+        if (best == -1 || numboxes == 16) break;
 
+        /* split at the median of the widest gun */
+        SortSegmentBox(&seg->pixels[first[best]*3],work,count[best],gun[best]);
+        half = count[best] / 2;
+        first[numboxes] = first[best] + half;
+        count[numboxes] = count[best] - half;
+        count[best] = half;
+        numboxes++;
+    }
 
-            outputheight = height = (int) bmi.biHeight;
-            outputwidth = width = (int) bmi.biWidth;
+    /* each palette color is the average of its box */
+    for (box = 0; box < numboxes; box++) {
+        sum[0] = sum[1] = sum[2] = 0;
+        ptr = &seg->pixels[first[box]*3];
+        for (i = 0; i < count[box]; i++, ptr += 3) {
+            sum[0] += ptr[0];
+            sum[1] += ptr[1];
+            sum[2] += ptr[2];
+        }
+        for (j = 0; j < 3; j++) seg->palette[box*3+j] = (uchar)((sum[j] + count[box]/2) / count[box]);
+    }
+}
 
-            if (outputheight%2 != 0) outputheight++;
-            outputheight = outputheight/2;
+/* worker thread - cuts the next segment until none are left */
+void *SegmentWorker(void *arg)
+{
+    SEGMENTS *segs = (SEGMENTS *)arg;
+    uchar *work;
+    int idx;
 
-            if (doublelores == 1) {
-                /* double lo-res files are paired-pixels */
-                /* they don't need to be and I may rethink this later */
-                /* they must also be loaded on paired origins because auxiliary memory
-                   uses different color mapping than main memory
-                   */
-                if (outputwidth%2 != 0) outputwidth++;
-                outpacket = outputwidth / 2;
-            }
-            else outpacket = outputwidth;
+    work = (uchar *)malloc(320*200*3);
 
-            packet = width * 3;
-            while (packet%4 != 0)packet++; /* BMP scanlines align on DWORD boundaries */
+    for (;;) {
+        pthread_mutex_lock(&segs->lock);
+        idx = segs->nextseg;
+        if (idx < segs->numsegs && NULL != work) segs->nextseg++;
+        pthread_mutex_unlock(&segs->lock);
+        if (idx >= segs->numsegs || NULL == work) break;
+        CutSegmentPalette(&segs->seg[idx],work);
     }
 
-    if (packet == INVALID) {
-        fclose(fp);
-        if (shr == 320) printf("%s is not in a supported format for SHR or BROOKS file output.\nExiting!\n", bmpfile);
-        else printf("%s is not in a supported format for LGR or DLGR file output.\nExiting!\n", bmpfile);
+    if (NULL != work) free(work);
+    return NULL;
+}
+
+/* build ctx->imnumpalettes segment palettes from a 320 x 200 24-bit bmp */
+/* the palettes go where GetPIMPalettes() would have put them */
+sshort BuildPIMPalettes(A2BCONTEXT *ctx, FILE *fp, int packet)
+{
+    SEGMENTS *segs;
+    pthread_t *workers;
+    uchar *image;
+    int threads, y, i, lines;
+
+    segs = (SEGMENTS *)malloc(sizeof(SEGMENTS));
+    if (NULL == segs) {
+        puts("No memory...");
+        return INVALID;
+    }
+    image = ReadRGBImage(ctx, fp, packet, 320, 0);
+    if (NULL == image) {
+        free(segs);
+        return INVALID;
+    }
+    memset(segs,0,sizeof(SEGMENTS));
+
+    /* the segments cover the same lines that ConvertPIM() uses each palette for */
+    segs->numsegs = ctx->imnumpalettes;
+    for (i = 0; i < segs->numsegs; i++) {
+        switch(segs->numsegs) {
+            case 200: y = i; lines = 1; break;
+            case 16:  y = (i/2)*25 + (i%2)*13; lines = 13 - (i%2); break;
+            case 8:   y = i*25; lines = 25; break;
+            default:  y = 0; lines = 200; break;
+        }
+        segs->seg[i].pixels = &image[y*960];
+        segs->seg[i].count = lines * 320;
+        if (segs->numsegs == 200) segs->seg[i].palette = &ctx->rgbArrays[i][0][0];
+        else segs->seg[i].palette = &ctx->rgb256Arrays[i][0][0];
+    }
+    /* black-out the palettes if less than 16 are active */
+    if (segs->numsegs < 16) memset(&ctx->rgb256Arrays[8][0][0],0,768);
+
+    threads = ctx->segmentthreads;
+    if (threads < 1) threads = NumberOfProcessors();
+    if (threads > segs->numsegs) threads = segs->numsegs;
+
+    pthread_mutex_init(&segs->lock,NULL);
+    workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if (NULL == workers) threads = 0;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i],NULL,SegmentWorker,segs) != 0) break;
+    }
+    threads = i;
+    /* if no threads could be started cut the segments here */
+    if (threads == 0) SegmentWorker(segs);
+    for (i = 0; i < threads; i++) pthread_join(workers[i],NULL);
+    if (NULL != workers) free(workers);
+    pthread_mutex_destroy(&segs->lock);
+
+    i = segs->nextseg;
+    free(image);
+    free(segs);
+    if (i < ctx->imnumpalettes) {
+        puts("No memory...");
         return INVALID;
     }
 
-    if (shr == 320 || bmi.biBitCount == 8 || bmi.biBitCount == 4 || bmi.biBitCount == 1 || usegscolors == 1) {
+    printf("%d Palettes successfully built!\n",ctx->imnumpalettes);
+    return SUCCESS;
+}
 
-       memset((char *)&sbmp[0].rgbBlue,0,sizeof(RGBQUAD)*256);
 
-       if (bmi.biBitCount == 1) {
-           fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*2,1,fp);
-           if (shr == 320) dither = 0;
-       }
-       else if (bmi.biBitCount == 4) {
-           fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
-           if (shr == 320) {
-               /* for SHR output, 16 color BMP's are assumed to be palette matched and are
-                  converted using the colors they were created with */
-               for (j=0;j<16;j++) {
-                    if (usegscolors == 1) {
-                        sbmp[j].rgbRed = gsColor(sbmp[j].rgbRed);
-                        sbmp[j].rgbGreen = gsColor(sbmp[j].rgbGreen);
-                        sbmp[j].rgbBlue = gsColor(sbmp[j].rgbBlue);
-                    }
-                    rgbArray[j][0] = sbmp[j].rgbRed;
-                    rgbArray[j][1] = sbmp[j].rgbGreen;
-                    rgbArray[j][2] = sbmp[j].rgbBlue;
-               }
-           }
-       }
-       else if (bmi.biBitCount == 8) {
-           /* for SHR no special consideration is provided for 256 color BMP's in this utility.
-              they are assumed to be converted GIF files or the equivalent and since we
-              are providing only a single palette they get the same treatment as a 24-bit BMP.
+/* ------------------------------------------------------------------------ */
+/* Line Palettes                                                            */
+/* ------------------------------------------------------------------------ */
 
-              a color count routine is really required here to weed-out 16 color BMP's that
-              have been promoted to 256 color BMP's and 24-bit BMP's.
+/* the brooks line palettes are built from the image in memory, 25 bands of
+   8 lines at a time in parallel. each worker has its own copy of the context
+   for the closest color scratch values and the line color arrays and copies
+   each finished line palette back.
+   brooks4 and brooks5 only collect the line colors in parallel. brooks5
+   carries its unused color list from one line to the next, so their palettes
+   are picked afterwards, one line at a time, from the bottom up like before.
+   the palettes are the same for any number of threads. */
 
-              to do more for 256 color BMP's and 24-bit BMP's, palette routines that can be supported
-              by the standard SHR format's 16 colors per line and 16 palettes per PIC would be needed. */
-           fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
-           if (usegscolors == 1) {
-                for (j=0;j<256;j++) {
-                    sbmp[j].rgbRed = gsColor(sbmp[j].rgbRed);
-                    sbmp[j].rgbGreen = gsColor(sbmp[j].rgbGreen);
-                    sbmp[j].rgbBlue = gsColor(sbmp[j].rgbBlue);
-                }
-           }
-       }
+#define LINE_BANDS 25
+#define LINE_LINES 8
 
-       fp = ReformatBMP(fp);
-       if (NULL == fp) return SUCCESS;
-       if (shr == 1) {
-           if (shrmode < 17) {
-               puts("Fixed palette (16 color) mapping will be used for conversion.");
-               if (mono == 0) puts("Dithering will have no effect.");
-           }
-       }
-       reformat = 1;
+typedef struct tagLINECOLORS
+{
+    uchar colors[320][4];  /* r,g,b,closest color index */
+    ushort count[320];
+    double distance[320];
+    int numcolors;
+} LINECOLORS;
+
+typedef struct tagLINEPALETTES
+{
+    A2BCONTEXT *ctx;
+    uchar *image;       /* 320 x 200 rgb pixels top-down */
+    int width, nextband;
+    LINECOLORS *lines;  /* for brooks4 and brooks5 */
+    pthread_mutex_t lock;
+} LINEPALETTES;
+
+typedef struct tagLINEWORKER
+{
+    LINEPALETTES *lp;
+    A2BCONTEXT *ctx;    /* private copy, or the main context when serial */
+} LINEWORKER;
+
+/* the line colors are found by a hash of their 24-bit value. a slot holds
+   the line colors index + 1 of the first color with that key, 0 if empty. */
+#define LINE_SLOTS 1024
+#define LINE_SLOT(key) ((((key) * 2654435761U) >> 22) & (LINE_SLOTS - 1))
+
+/* the slot for key - empty if no line color has the key yet */
+ushort *LineColorSlot(ushort *slots, unsigned *keys, unsigned key)
+{
+    unsigned slot = LINE_SLOT(key);
+
+    while (slots[slot] != 0 && keys[slots[slot] - 1] != key) slot = (slot + 1) & (LINE_SLOTS - 1);
+    return &slots[slot];
+}
+
+/* brooks4 and brooks5 step 1 */
+/* accumulate all original colors of the line into the line colors array */
+/* returns the number of colors */
+int CollectLineColors(A2BCONTEXT *ctx, uchar *pixels, int width)
+{
+    int j,x,count;
+    uchar r,g,b;
+    ushort slots[LINE_SLOTS], *slot;
+    unsigned keys[320], key;
+
+    /* first get closest color by population for 16 indexes */
+    /* this is different than brooks, brooks2, and brooks3 (grey replacement) which do not consider population */
+
+    /* this a large working palette for the current line of all the original colors and their values */
+    memset(slots,0,sizeof(slots));
+    for (j=0, x = 0, count = 0; x < width; x++) {
+        r = pixels[j]; j++;
+        g = pixels[j]; j++;
+        b = pixels[j]; j++;
+
+        key = ((unsigned)r << 16) | ((unsigned)g << 8) | b;
+        slot = LineColorSlot(slots,keys,key);
+        if (*slot != 0) {
+            /* if color matches, update color count for this index entry */
+            ctx->linecount[*slot - 1] += 1;
+            continue;
+        }
 
+        /* if no matching colors found in line colors add a new entry */
+        /* store r,g,b, color index and color distance */
+        *slot = (ushort)(count + 1);
+        keys[count] = key;
+        ctx->linecolors[count][0] = r;
+        ctx->linecolors[count][1] = g;
+        ctx->linecolors[count][2] = b;
+        ctx->linecolors[count][3] = GetClosestColor(ctx, r,g,b);
+        ctx->linedistance[count] = ctx->globaldistance;
+        ctx->linecount[count] = 1;
+        count++;
     }
+    return count;
+}
 
-    if (mono == 1) {
-        shr2 = 0;
 
-        if (hsl == 1) {
-            puts("achromatic hsl monochrome using hue channel de-saturation.");
+/* brooks4 and brooks5 step 2 */
+/* pick the palette for line y1 from the count colors in the line colors array */
+void PickBrooksPalette(A2BCONTEXT *ctx, int count, int y1)
+{
+    int i,j,x;
+    uchar idx;
+    ushort found,unused;
+
+    /* build initial palette of most used colors in each of our sixteen ranges */
+    memset(&ctx->linepalette[0][0],0,64);
+    memset(&ctx->linecolorindex[0],0,32);
+    for (j = 0; j < count; j++) {
+        idx = ctx->linecolors[j][3];
+        if (ctx->linepalette[idx][3] == 1) {
+            /* index is already in use so update if count is higher */
+            i = ctx->linecolorindex[idx];
+            /* reset index used to zero to force update if count is higher */
+            if (ctx->linecount[j] > ctx->linecount[i]) ctx->linepalette[idx][3] = 0;
+        }
+
+        if (ctx->linepalette[idx][3] == 0) {
+            /* initial palette entry */
+            ctx->linepalette[idx][0] = ctx->linecolors[j][0];
+            ctx->linepalette[idx][1] = ctx->linecolors[j][1];
+            ctx->linepalette[idx][2] = ctx->linecolors[j][2];
+            ctx->linepalette[idx][3] = 1; /* mark palette index as used */
+            ctx->linecolorindex[idx] = j; /* store the linecolors index */
+            continue;
         }
-        else {
-            puts("average rgb monochrome using color channel scaling.");
+    }
+
+    /* mark used colors in the linecolors array */
+    for (idx=0,unused=0;idx<16;idx++) {
+        if (ctx->linepalette[idx][3] == 0) {
+            unused++;
+            continue;
         }
-        if (shrgrey == 1) {
-            /* for SHR mode320 mono we use 16 levels of grey */
-            for (j=0;j<16;j++) {
-                rgbArray[j][0] = rgbArray[j][1] = rgbArray[j][2] = LegalColor[j];
+        ctx->brooks5colors[idx] = 1;
+        i = ctx->linecolorindex[idx];
+        ctx->linecount[i] = 0;
+    }
+
+    if (unused > 0) {
+        for (idx=0;idx<16;idx++) {
+            if (ctx->linepalette[idx][3] == 1) continue;
+            found = x = 0;
+            if (ctx->brooks5 == 1) x = 1;
+            for (j = 0; j < count; j++) {
+                if (ctx->linecount[j] > x) {
+                    if (ctx->brooks5 == 1) {
+                        i = ctx->linecolors[j][3];
+                        /* restrict greys, blacks and whites to one entry */
+                        if (i == LOBLACK || i == LOWHITE ||
+                            i == LOGRAY || i == LOGREY) continue;
+                        if (ctx->brooks5colors[i] < 1) continue;
+                    }
+                    i = j;
+                    x = ctx->linecount[j];
+                    found = 1;
+                }
+            }
+            if (found == 1) {
+                j = ctx->linecolors[i][3];
+                ctx->brooks5colors[j] = 0;
+                ctx->linepalette[idx][0] = ctx->linecolors[i][0];
+                ctx->linepalette[idx][1] = ctx->linecolors[i][1];
+                ctx->linepalette[idx][2] = ctx->linecolors[i][2];
+                ctx->linepalette[idx][3] = 1; /* mark palette index as used */
+                ctx->linecolorindex[idx] = i; /* store the linecolors index */
+                ctx->linecount[i] = 0;        /* mark color used */
+                unused--;
+            }
+        }
+    }
+
+    /* if we still need colors just add them */
+    if (ctx->brooks5 == 1 && unused > 0) {
+        for (idx=0;idx<16;idx++) {
+            if (ctx->linepalette[idx][3] == 1) continue;
+            found = x = 0;
+            for (j = 0; j < count; j++) {
+                if (ctx->linecount[j] > x) {
+                    i = j;
+                    x = ctx->linecount[j];
+                    found = 1;
+                }
+            }
+            if (found == 1) {
+                j = ctx->linecolors[i][3];
+                ctx->brooks5colors[j] = 0;
+                ctx->linepalette[idx][0] = ctx->linecolors[i][0];
+                ctx->linepalette[idx][1] = ctx->linecolors[i][1];
+                ctx->linepalette[idx][2] = ctx->linecolors[i][2];
+                ctx->linepalette[idx][3] = 1; /* mark palette index as used */
+                ctx->linecolorindex[idx] = i; /* store the linecolors index */
+                ctx->linecount[i] = 0;        /* mark color used */
+                unused--;
             }
-            puts("16 color greyscale conversion!");
-        }
-        else {
-            /* for LGR and DLGR fixed palette output and SHR 320 true monochrome */
-            /* create a black and white palette */
-            memset(&rgbArray[0][0],0,45);
-            memset(&rgbArray[15][0],255,3);
-            if(shr == 320) puts("2 color monochrome conversion!");
         }
     }
 
 
-    /* hard to say how this will work out */
-    if (mono == 0 && shrmode > 16) {
-        if (fourpal == 1) {
-            /* group on GS colors */
-            for (k=0;k<16;k++) {
-                rgbArray[k][0] = gsColor(rgbArray[k][0]);
-                rgbArray[k][1] = gsColor(rgbArray[k][1]);
-                rgbArray[k][2] = gsColor(rgbArray[k][2]);
-            }
-        }
+    for (idx=0;idx<16;idx++) {
+        ctx->rgbArrays[y1][idx][0] = ctx->linepalette[idx][0];
+        ctx->rgbArrays[y1][idx][1] = ctx->linepalette[idx][1];
+        ctx->rgbArrays[y1][idx][2] = ctx->linepalette[idx][2];
 
     }
+}
 
-    /* initialize nearest color arrays */
-    /* for SHR this array will be used no matter what kind of output we eventually end-up with */
-    /* for LGR and DLGR there is only one fixed palette of Lo-Res colors so there are no additional palettes */
-    InitDoubleArrays();
-
-    if (mono == 0 && shr == 320 && useimagetone == 1) {
-        /* build initial palette of most used colors in each of our sixteen ranges */
-
-        for (j=0;j<16;j++) {
-            rgbArrays[0][j][0] = rgbArray[j][0];
-            rgbArrays[0][j][1] = rgbArray[j][1];
-            rgbArrays[0][j][2] = rgbArray[j][2];
-            rgbUsed[0][j] = 0; /* not used yet */
-            rgbDistance[0][j] = 0.0; /* initialize */
+/* option "original" - the darkest, lightest and most used colors of the line */
+void PickOriginalColors(A2BCONTEXT *ctx, uchar *pixels, int width, int y1)
+{
+    int i,j,x,count,used,lidx,didx,first[321];
+    uchar r,g,b,red,green,blue,idx;
+    ushort temp,darkest,lightest,slots[LINE_SLOTS],*slot,order[320];
+    unsigned keys[320], key;
+
+    count = 0;
+    memset(slots,0,sizeof(slots));
+    for (j=0, x = 0; x < width; x++) {
+        /* store original colors and working colors */
+        red = r = pixels[j]; j++;
+        green = g = pixels[j]; j++;
+        blue = b = pixels[j]; j++;
+
+        /* if we are using a threshold color, assign it to our working colors */
+        if (ctx->useegacolors == 1) {
+            r = sethold(r,ctx->rhold);
+            g = sethold(g,ctx->rhold);
+            b = sethold(b,ctx->rhold);
+        }
+
+        if (ctx->usefourteencolors == 1) {
+            /* force black and white into palette */
+            idx = GetClosestColor(ctx, r,g,b);
+            if (idx == 15) r = g = b = red = blue = green = 255;
+            else if (idx == 0) r = g = b = red = green = blue = 0;
+        }
+
+        /* the line colors are keyed on their threshold colors (or their
+           full original color value) and the first one that matches the
+           working color is counted */
+        key = ((unsigned)r << 16) | ((unsigned)g << 8) | b;
+        slot = LineColorSlot(slots,keys,key);
+        if (*slot != 0) {
+            ctx->linecount[*slot - 1] += 1;
+            continue;
         }
 
+        ctx->linecolors[count][0] = red;
+        ctx->linecolors[count][1] = green;
+        ctx->linecolors[count][2] = blue;
+        ctx->linecolors[count][3] = GetClosestColor(ctx, red,green,blue);
+        ctx->linedistance[count] = ctx->globaldistance;
+        ctx->linecount[count] = 1;
+
+        if (ctx->useegacolors == 1) {
+            /* the new color may not match its own working color */
+            key = ((unsigned)sethold(red,ctx->rhold) << 16) |
+                  ((unsigned)sethold(green,ctx->ghold) << 8) | sethold(blue,ctx->bhold);
+            slot = LineColorSlot(slots,keys,key);
+        }
+        /* an earlier color with the same key keeps the slot */
+        if (*slot == 0) *slot = (ushort)(count + 1);
+        keys[count] = key;
+        count++;
+    }
+
+    if (ctx->usesixteencolors == 0 && ctx->usefourteencolors == 0) {
+        /* get darkest original color */
+        /* get lightest original color */
+        darkest = (ushort)ctx->linecolors[0][0];
+        darkest += ctx->linecolors[0][1];
+        darkest += ctx->linecolors[0][2];
+        lightest = darkest;
+        lidx = didx = 0;
+        for (i=1;i<count;i++) {
+            /* walk through the colors and find darkest and lightest colors */
+            temp = (ushort)ctx->linecolors[i][0];
+            temp += ctx->linecolors[i][1];
+            temp += ctx->linecolors[i][2];
+            if (temp < darkest) {
+                darkest = temp;
+                didx = i;
+            }
+            else if (temp > lightest) {
+                lightest = temp;
+                lidx = i;
+            }
+        }
+        for (i=0;i<15;i++) {
+            /* set the first 15 colors to the darkest color initially */
+            ctx->rgbArrays[y1][i][0] = ctx->linecolors[didx][0];
+            ctx->rgbArrays[y1][i][1] = ctx->linecolors[didx][1];
+            ctx->rgbArrays[y1][i][2] = ctx->linecolors[didx][2];
+        }
+        /* set the last color to the lightest color initially */
+        ctx->rgbArrays[y1][15][0] = ctx->linecolors[lidx][0];
+        ctx->rgbArrays[y1][15][1] = ctx->linecolors[lidx][1];
+        ctx->rgbArrays[y1][15][2] = ctx->linecolors[lidx][2];
+
+        ctx->linecount[lidx] = ctx->linecount[didx] = 0;
+    }
+
+    /* add up to 14 (or 16) most-used colors between the darkest and lightest to this palette */
+
+    /* most used first and in line order when the counts are the same (a
+       counting sort), then all the colors again in line order to fill the
+       rest of the palette with the colors already used */
+    for (i=0;i<=width;i++) first[i] = 0;
+    for (x=0;x<count;x++) first[ctx->linecount[x]]++;
+    for (i=width,used=0;i>0;i--) {
+        j = first[i];
+        first[i] = used;
+        used += j;
+    }
+    for (x=0;x<count;x++) {
+        if (ctx->linecount[x] > 0) order[first[ctx->linecount[x]]++] = (ushort)x;
+    }
+
+    if (ctx->usesixteencolors == 1) j = 0;
+    else j = 1;
+    for (i = 0; i < used + count && j < 15; i++) {
+        if (i < used) x = order[i];
+        else x = i - used;
+        if (ctx->usefourteencolors == 1) {
+            /* if palette is already preset for black and white no point in adding again */
+            if (ctx->linecolors[x][0] == 0 && ctx->linecolors[x][1] == 0 && ctx->linecolors[x][2] == 0) continue;
+            if (ctx->linecolors[x][0] == 255 && ctx->linecolors[x][1] == 255 && ctx->linecolors[x][2] == 255) continue;
+        }
+        ctx->rgbArrays[y1][j][0] = ctx->linecolors[x][0];
+        ctx->rgbArrays[y1][j][1] = ctx->linecolors[x][1];
+        ctx->rgbArrays[y1][j][2] = ctx->linecolors[x][2];
+        j++;
+    }
+}
 
-        fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
-        for(y=0,y1=height-1;y<height;y++,y1--)
-        {
-            fread((char *)&bmpscanline[0],1,packet,fp);
-            if (fourplay == 1) {
-                /* reduce palette */
-                for (k=0;k<packet;k++) bmpscanline[k] = gsColor(bmpscanline[k]);
-            }
 
-            for (j=0, x = 0; x < width; x++) {
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
-                idx = GetClosestColor(r,g,b);
-                for (toneindex = 0; toneindex < 16;toneindex++) {
+/* brooks, brooks2 and brooks3 - the line colors closest to each palette entry */
+void PickClosestColors(A2BCONTEXT *ctx, uchar *pixels, int width, int y1)
+{
+    int j,x;
+    uchar r,g,b,idx;
 
-                    idx = GetColorDistance(r,g,b,toneindex);
-                    if (idx != toneindex) continue;
+    for (j=0, x = 0; x < width; x++) {
+        r = pixels[j]; j++;
+        g = pixels[j]; j++;
+        b = pixels[j]; j++;
 
-                    if (rgbUsed[0][toneindex] == 0) {
-                        /* set initial value if this palette index has been used */
-                        rgbUsed[0][toneindex] = 1;
-                        rgbDistance[0][toneindex] = indexdistance;
-                        rgbArrays[0][toneindex][0] = r;
-                        rgbArrays[0][toneindex][1] = g;
-                        rgbArrays[0][toneindex][2] = b;
-                        continue;
-                    }
+        idx = GetClosestColor(ctx, r,g,b);
 
-                    /* if the new color is closer to the currently selected palette color
-                       than the previously stored color, then replace the previously stored
-                       color with the new color */
-                    if (indexdistance < rgbDistance[0][toneindex]) {
-                        rgbDistance[0][toneindex] = indexdistance;
-                        rgbArrays[0][toneindex][0] = r;
-                        rgbArrays[0][toneindex][1] = g;
-                        rgbArrays[0][toneindex][2] = b;
-                    }
-                }
-            }
+        if (ctx->rgbUsed[y1][idx] == 0) {
+            /* set initial value if this palette index has been used */
+            ctx->rgbUsed[y1][idx] = 1;
+            ctx->rgbDistance[y1][idx] = ctx->globaldistance;
+            ctx->rgbArrays[y1][idx][0] = r;
+            ctx->rgbArrays[y1][idx][1] = g;
+            ctx->rgbArrays[y1][idx][2] = b;
+            continue;
         }
 
-        for (j=0;j<16;j++) {
-            rgbArray[j][0] = rgbArrays[0][j][0];
-            rgbArray[j][1] = rgbArrays[0][j][1];
-            rgbArray[j][2] = rgbArrays[0][j][2];
+        /* if the new color is closer to the currently selected palette color
+           than the previously stored color, then replace the previously stored
+           color with the new color */
+        if (ctx->globaldistance < ctx->rgbDistance[y1][idx]) {
+            ctx->rgbDistance[y1][idx] = ctx->globaldistance;
+            ctx->rgbArrays[y1][idx][0] = r;
+            ctx->rgbArrays[y1][idx][1] = g;
+            ctx->rgbArrays[y1][idx][2] = b;
         }
-
-        InitDoubleArrays();
-        /* end of image tone */
-
     }
+}
 
-    if (shr2 != 0) {
-        brooks = 0;
-        /* build initial palette of most used colors in each of our sixteen ranges */
-
-        for (j=0;j<16;j++) {
-            rgbArrays[0][j][0] = rgbArray[j][0];
-            rgbArrays[0][j][1] = rgbArray[j][1];
-            rgbArrays[0][j][2] = rgbArray[j][2];
-            rgbUsed[0][j] = 0; /* not used yet */
-            rgbDistance[0][j] = 0.0; /* initialize */
-        }
+/* build the palette for line y1 from its rgb pixels */
+void BuildLinePalette(A2BCONTEXT *ctx, uchar *pixels, int width, int y1)
+{
+    if (ctx->brooks4 == 1 || ctx->brooks5 == 1) {
+        /* this is a combination of population and original closest color */
+        PickBrooksPalette(ctx, CollectLineColors(ctx, pixels, width), y1);
+    }
+    else if (ctx->useoriginalcolors == 1) PickOriginalColors(ctx, pixels, width, y1);
+    else PickClosestColors(ctx, pixels, width, y1);
+}
 
+/* worker thread - builds the palettes of the next band until none are left */
+/* the bands and their lines go from the bottom up */
+void *LinePaletteWorker(void *arg)
+{
+    LINEWORKER *lw = (LINEWORKER *)arg;
+    LINEPALETTES *lp = lw->lp;
+    A2BCONTEXT *ctx = lw->ctx, *shared = lp->ctx;
+    LINECOLORS *lc;
+    uchar *pixels;
+    int band, y1, count;
 
-        fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
-        for(y=0,y1=height-1;y<height;y++,y1--)
-        {
-            fread((char *)&bmpscanline[0],1,packet,fp);
-            if (fourplay == 1) {
-                /* reduce palette */
-                for (k=0;k<packet;k++) bmpscanline[k] = gsColor(bmpscanline[k]);
+    for (;;) {
+        pthread_mutex_lock(&lp->lock);
+        band = lp->nextband;
+        if (band < LINE_BANDS) lp->nextband++;
+        pthread_mutex_unlock(&lp->lock);
+        if (band >= LINE_BANDS) break;
+
+        for (y1 = 199 - band * LINE_LINES; y1 > 199 - (band + 1) * LINE_LINES; y1--) {
+            pixels = &lp->image[y1 * lp->width * 3];
+
+            if (NULL != lp->lines) {
+                /* the palettes are picked when all the colors are in */
+                lc = &lp->lines[y1];
+                count = lc->numcolors = CollectLineColors(ctx, pixels, lp->width);
+                memcpy(&lc->colors[0][0],&ctx->linecolors[0][0],count * 4);
+                memcpy(&lc->count[0],&ctx->linecount[0],count * sizeof(ushort));
+                memcpy(&lc->distance[0],&ctx->linedistance[0],count * sizeof(double));
+                continue;
             }
 
-            for (j=0, x = 0; x < width; x++) {
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
-                idx = GetClosestColor(r,g,b);
-
-                if (rgbUsed[0][idx] == 0) {
-                    /* set initial value if this palette index has been used */
-                    rgbUsed[0][idx] = 1;
-                    rgbDistance[0][idx] = globaldistance;
-                    rgbArrays[0][idx][0] = r;
-                    rgbArrays[0][idx][1] = g;
-                    rgbArrays[0][idx][2] = b;
-                    continue;
-                }
-
-                /* if the new color is closer to the currently selected palette color
-                   than the previously stored color, then replace the previously stored
-                   color with the new color */
-                if (globaldistance < rgbDistance[0][idx]) {
-                    rgbDistance[0][idx] = globaldistance;
-                    rgbArrays[0][idx][0] = r;
-                    rgbArrays[0][idx][1] = g;
-                    rgbArrays[0][idx][2] = b;
-                }
+            BuildLinePalette(ctx, pixels, lp->width, y1);
+            if (ctx != shared) {
+                memcpy(&shared->rgbArrays[y1][0][0],&ctx->rgbArrays[y1][0][0],48);
+                memcpy(&shared->rgbUsed[y1][0],&ctx->rgbUsed[y1][0],16);
+                memcpy(&shared->rgbDistance[y1][0],&ctx->rgbDistance[y1][0],16 * sizeof(double));
             }
         }
+    }
 
-        for (j=0;j<16;j++) {
+    return NULL;
+}
 
-            if (useimagetone == 0) {
-                if (rgbArray[j][0] == rgbArrays[0][j][0] &&
-                    rgbArray[j][1] == rgbArrays[0][j][1] &&
-                    rgbArray[j][2] == rgbArrays[0][j][2]) greyoveride[j] = 1;
+/* build the 200 line palettes of a 320 x 200 24-bit bmp */
+sshort BuildLinePalettes(A2BCONTEXT *ctx, FILE *fp, int packet, int width)
+{
+    LINEPALETTES lp;
+    LINEWORKER lw[LINE_BANDS];
+    pthread_t workers[LINE_BANDS];
+    LINECOLORS *lc;
+    int threads, k, y1;
+
+    memset(&lp,0,sizeof(LINEPALETTES));
+    lp.ctx = ctx;
+    lp.width = width;
+    lp.image = ReadRGBImage(ctx, fp, packet, width, ctx->fourplay);
+    if (NULL == lp.image) return INVALID;
+
+    threads = ctx->segmentthreads;
+    if (threads < 1) threads = NumberOfProcessors();
+    if (threads > LINE_BANDS) threads = LINE_BANDS;
+    /* a line palette in use for closest colors changes as the lines are built */
+    if (ctx->brooksline != 999) threads = 0;
+
+    if (threads > 0 && (ctx->brooks4 == 1 || ctx->brooks5 == 1)) {
+        lp.lines = (LINECOLORS *)malloc(sizeof(LINECOLORS) * 200);
+        if (NULL == lp.lines) threads = 0;
+    }
+
+    pthread_mutex_init(&lp.lock,NULL);
+    for (k = 0; k < threads; k++) {
+        lw[k].lp = &lp;
+        lw[k].ctx = (A2BCONTEXT *)malloc(sizeof(A2BCONTEXT));
+        if (NULL == lw[k].ctx) break;
+        memcpy(lw[k].ctx,ctx,sizeof(A2BCONTEXT));
+        lw[k].ctx->distlookups = lw[k].ctx->distmismatches = 0;
+        if (NULL != ctx->stats) {
+            lw[k].ctx->stats = (STATS *)calloc(1,sizeof(STATS));
+            if (NULL == lw[k].ctx->stats) {
+                free(lw[k].ctx);
+                break;
             }
-
-            rgbArray[j][0] = rgbArrays[0][j][0];
-            rgbArray[j][1] = rgbArrays[0][j][1];
-            rgbArray[j][2] = rgbArrays[0][j][2];
         }
-
-        InitDoubleArrays();
-        /* end of shr2 */
+        if (pthread_create(&workers[k],NULL,LinePaletteWorker,&lw[k]) != 0) {
+            if (NULL != ctx->stats) free(lw[k].ctx->stats);
+            free(lw[k].ctx);
+            break;
+        }
     }
+    threads = k;
+    /* if no threads could be started build the palettes here */
+    if (threads == 0) {
+        if (NULL != lp.lines) {
+            free(lp.lines);
+            lp.lines = NULL;
+        }
+        lw[0].lp = &lp;
+        lw[0].ctx = ctx;
+        LinePaletteWorker(&lw[0]);
+    }
+    for (k = 0; k < threads; k++) {
+        pthread_join(workers[k],NULL);
+        ctx->distlookups += lw[k].ctx->distlookups;
+        ctx->distmismatches += lw[k].ctx->distmismatches;
+        if (NULL != ctx->stats) {
+            StatsMerge(ctx->stats,lw[k].ctx->stats);
+            free(lw[k].ctx->stats);
+        }
+        free(lw[k].ctx);
+    }
+    pthread_mutex_destroy(&lp.lock);
 
-    /* if we are converting to SHR we now must decide on a conversion plan */
-    /* for SHR since all input is now 24-bit we need to build some palettes */
-    if (brooks != 0) {
-
-        if (useoriginalcolors == 0 && quietmode == 0 && mix256 == 0) {
-            puts("Initial Palette Color Values:");
-            for (i=0;i<16;i++) {
-                printf("Index %-2d: %-3d %-3d %-3d %s\n",i,rgbArray[i][0],rgbArray[i][1],rgbArray[i][2],colornames[i]);
-            }
+    if (NULL != lp.lines) {
+        for (y1 = 199; y1 > -1; y1--) {
+            lc = &lp.lines[y1];
+            memcpy(&ctx->linecolors[0][0],&lc->colors[0][0],lc->numcolors * 4);
+            memcpy(&ctx->linecount[0],&lc->count[0],lc->numcolors * sizeof(ushort));
+            memcpy(&ctx->linedistance[0],&lc->distance[0],lc->numcolors * sizeof(double));
+            PickBrooksPalette(ctx, lc->numcolors, y1);
         }
+        free(lp.lines);
+    }
 
-        shrpalettes = 200;
+    free(lp.image);
+    return SUCCESS;
+}
 
-        /* set initial values for conversion palettes */
-        /* use color space of currently selected DHGR palette for color grouping of 16 colors */
-        for (i=0;i<shrpalettes;i++) {
-            for (j=0;j<16;j++) {
-                if (useoriginalcolors == 0) {
-                    rgbArrays[i][j][0] = rgbArray[j][0];
-                    rgbArrays[i][j][1] = rgbArray[j][1];
-                    rgbArrays[i][j][2] = rgbArray[j][2];
-                    rgbUsed[i][j] = 0; /* not used */
-                    rgbDistance[i][j] = 0.0; /* initialize */
 
-                }
-                else {
-                    if (usefourteencolors == 1 && j==15) {
-                        rgbArrays[i][j][0] = rgbArrays[i][j][1] = rgbArrays[i][j][2] = 255;
-                    }
-                    else {
-                        rgbArrays[i][j][0] = rgbArrays[i][j][1] = rgbArrays[i][j][2] = 0;
-                    }
-                }
-            }
-        }
+/* ------------------------------------------------------------------------ */
+/* K-Means Line Palettes                                                    */
+/* ------------------------------------------------------------------------ */
 
-        fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
-        for(y=0,y1=height-1;y<height;y++,y1--)
-        {
-            fread((char *)&bmpscanline[0],1,packet,fp);
-            if (fourplay == 1) {
-                /* reduce palette */
-                for (k=0;k<packet;k++) bmpscanline[k] = gsColor(bmpscanline[k]);
-            }
-
-            if (brooks4 == 1 || brooks5 == 1) {
-                /* this is a combination of population and original closest color */
-
-                /* step 1 */
-                /* first get closest color by population for 16 indexes */
-                /* this is different than brooks, brooks2, and brooks3 (grey replacement) which do not consider population */
-                count = 0;
-
-                /* accumulate all original colors into line array */
-                /* this a large working palette for the current line of all the original colors and their values */
-                for (j=0, x = 0, count = 0; x < width; x++) {
-                    b = bmpscanline[j]; j++;
-                    g = bmpscanline[j]; j++;
-                    r = bmpscanline[j]; j++;
-
-                    found = 0;
-                    for (i=0;i<count;i++) {
-                        /* compare to original color value */
-                        if (linecolors[i][0] == r && linecolors[i][1] == g && linecolors[i][2] == b) {
-                            /* if color matches, update color count for this index entry */
-                            linecount[i] += 1;
-                            found = 1;
-                            break;
-                        }
-                    }
-                    if (found != 1) {
-                        /* if no matching colors found in line colors add a new entry */
-                        /* store r,g,b, color index and color distance */
-                        linecolors[count][0] = r;
-                        linecolors[count][1] = g;
-                        linecolors[count][2] = b;
-                        linecolors[count][3] = GetClosestColor(r,g,b);
-                        linedistance[count] = globaldistance;
-                        linecount[count] = 1;
-                        count++;
-                    }
-                }
+/* option "kmeans" refines the brooks line palettes with a few k-means
+   (Lloyd) iterations. palette colors are kept in the 12-bit color space of
+   the IIgs so no two entries in a line palette end up as the same IIgs color.
+   each line starts from whichever fits it better, its own palette or the
+   line above, so most lines settle in one or two iterations.
+   the image is refined in 8 bands of 25 lines in parallel. the bands are the
+   same for any number of threads so the output is too (unless a time budget
+   runs out). */
 
-                /* step 2 */
-                /* build initial palette of most used colors in each of our sixteen ranges */
-                memset(&linepalette[0][0],0,64);
-                memset(&linecolorindex[0],0,32);
-                for (j = 0; j < count; j++) {
-                    idx = linecolors[j][3];
-                    if (linepalette[idx][3] == 1) {
-                        /* index is already in use so update if count is higher */
-                        i = linecolorindex[idx];
-                        /* reset index used to zero to force update if count is higher */
-                        if (linecount[j] > linecount[i]) linepalette[idx][3] = 0;
-                    }
+#define KMEANS_BANDS 8
+#define KMEANS_LINES 25
 
-                    if (linepalette[idx][3] == 0) {
-                        /* initial palette entry */
-                        linepalette[idx][0] = linecolors[j][0];
-                        linepalette[idx][1] = linecolors[j][1];
-                        linepalette[idx][2] = linecolors[j][2];
-                        linepalette[idx][3] = 1; /* mark palette index as used */
-                        linecolorindex[idx] = j; /* store the linecolors index */
-                        continue;
-                    }
-                }
+typedef struct tagKMEANS
+{
+    A2BCONTEXT *ctx;
+    uchar *image;       /* 320 x 200 rgb pixels top-down */
+    int width, nextband, iterations;
+    long long deadline; /* in microseconds, 0 if no time budget */
+    pthread_mutex_t lock;
+} KMEANS;
+
+long long GetMicroseconds()
+{
+    struct timeval tv;
 
-                /* mark used colors in the linecolors array */
-                for (idx=0,unused=0;idx<16;idx++) {
-                    if (linepalette[idx][3] == 0) {
-                        unused++;
-                        continue;
-                    }
-                    brooks5colors[idx] = 1;
-                    i = linecolorindex[idx];
-                    linecount[i] = 0;
-                }
+    gettimeofday(&tv,NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-                if (unused > 0) {
-                    for (idx=0;idx<16;idx++) {
-                        if (linepalette[idx][3] == 1) continue;
-                        found = x = 0;
-                        if (brooks5 == 1) x = 1;
-                        for (j = 0; j < count; j++) {
-                            if (linecount[j] > x) {
-                                if (brooks5 == 1) {
-                                    i = linecolors[j][3];
-                                    /* restrict greys, blacks and whites to one entry */
-                                    if (i == LOBLACK || i == LOWHITE ||
-                                        i == LOGRAY || i == LOGREY) continue;
-                                    if (brooks5colors[i] < 1) continue;
-                                }
-                                i = j;
-                                x = linecount[j];
-                                found = 1;
-                            }
-                        }
-                        if (found == 1) {
-                            j = linecolors[i][3];
-                            brooks5colors[j] = 0;
-                            linepalette[idx][0] = linecolors[i][0];
-                            linepalette[idx][1] = linecolors[i][1];
-                            linepalette[idx][2] = linecolors[i][2];
-                            linepalette[idx][3] = 1; /* mark palette index as used */
-                            linecolorindex[idx] = i; /* store the linecolors index */
-                            linecount[i] = 0;        /* mark color used */
-                            unused--;
-                        }
-                    }
-                }
+/* nearest IIgs 4-bit level of a gun, scaled back to 8 bits */
+uchar KMeansLevel(long value)
+{
+    value = (value + 8) / 17;
+    if (value > 15) value = 15;
+    return (uchar)(value * 17);
+}
 
-                /* if we still need colors just add them */
-                if (brooks5 == 1 && unused > 0) {
-                    for (idx=0;idx<16;idx++) {
-                        if (linepalette[idx][3] == 1) continue;
-                        found = x = 0;
-                        for (j = 0; j < count; j++) {
-                            if (linecount[j] > x) {
-                                i = j;
-                                x = linecount[j];
-                                found = 1;
-                            }
-                        }
-                        if (found == 1) {
-                            j = linecolors[i][3];
-                            brooks5colors[j] = 0;
-                            linepalette[idx][0] = linecolors[i][0];
-                            linepalette[idx][1] = linecolors[i][1];
-                            linepalette[idx][2] = linecolors[i][2];
-                            linepalette[idx][3] = 1; /* mark palette index as used */
-                            linecolorindex[idx] = i; /* store the linecolors index */
-                            linecount[i] = 0;        /* mark color used */
-                            unused--;
-                        }
-                    }
-                }
+/* the 12-bit IIgs color of a palette entry */
+#define KMEANS_KEY(rgb) ((((rgb)[0]/17)<<8)|(((rgb)[1]/17)<<4)|((rgb)[2]/17))
 
+/* map each pixel of a line to its nearest palette entry */
+/* returns the sum of the squared distances */
+long long KMeansAssign(uchar *pixels, int width, uchar palette[16][3], uchar *assign, long *error)
+{
+    long long total = 0;
+    long dr, dg, db, dist, best;
+    int x, i;
 
-                for (idx=0;idx<16;idx++) {
-                    rgbArrays[y1][idx][0] = linepalette[idx][0];
-                    rgbArrays[y1][idx][1] = linepalette[idx][1];
-                    rgbArrays[y1][idx][2] = linepalette[idx][2];
+    for (x = 0; x < width; x++, pixels += 3) {
+        best = -1;
+        for (i = 0; i < 16; i++) {
+            dr = (long)pixels[0] - palette[i][0];
+            dg = (long)pixels[1] - palette[i][1];
+            db = (long)pixels[2] - palette[i][2];
+            dist = dr*dr + dg*dg + db*db;
+            if (best < 0 || dist < best) {
+                best = dist;
+                assign[x] = (uchar)i;
+            }
+        }
+        if (NULL != error) error[x] = best;
+        total += best;
+    }
+    return total;
+}
 
-                }
+/* refine a line palette - returns the number of iterations used */
+int KMeansLine(uchar *pixels, int width, uchar palette[16][3], int iterations)
+{
+    uchar assign[320], next[16][3], level[3], used[4096], reseed[16];
+    long error[320], sum[16][3], count[16], worst;
+    int iter, x, i, j, key, pick;
+
+    for (iter = 0; iter < iterations;) {
+        KMeansAssign(pixels,width,palette,assign,error);
+        memset(sum,0,sizeof(sum));
+        memset(count,0,sizeof(count));
+        for (x = 0; x < width; x++) {
+            i = assign[x];
+            sum[i][0] += pixels[x*3];
+            sum[i][1] += pixels[x*3+1];
+            sum[i][2] += pixels[x*3+2];
+            count[i]++;
+        }
+        iter++;
+
+        /* move each entry to the middle of its pixels */
+        memset(used,0,sizeof(used));
+        for (i = 0; i < 16; i++) {
+            reseed[i] = 0;
+            if (count[i] == 0) memcpy(next[i],palette[i],3);
+            else {
+                for (j = 0; j < 3; j++) next[i][j] = KMeansLevel((sum[i][j] + count[i]/2) / count[i]);
+            }
+            key = KMEANS_KEY(next[i]);
+            if (count[i] == 0 || used[key] != 0) reseed[i] = 1;
+            else used[key] = 1;
+        }
 
-                continue;
+        /* empty and duplicate entries take the worst fitting pixels */
+        for (i = 0; i < 16; i++) {
+            if (reseed[i] == 0) continue;
+            worst = -1;
+            pick = -1;
+            for (x = 0; x < width; x++) {
+                if (error[x] <= worst) continue;
+                for (j = 0; j < 3; j++) level[j] = KMeansLevel(pixels[x*3+j]);
+                if (used[KMEANS_KEY(level)] != 0) continue;
+                worst = error[x];
+                pick = x;
+            }
+            if (pick != -1) {
+                for (j = 0; j < 3; j++) next[i][j] = KMeansLevel(pixels[pick*3+j]);
+                error[pick] = -1;
             }
+            else {
+                /* fewer colors in the line than entries - any unused color will do */
+                for (key = 0; used[key] != 0; key++);
+                next[i][0] = (uchar)((key >> 8) * 17);
+                next[i][1] = (uchar)(((key >> 4) & 15) * 17);
+                next[i][2] = (uchar)((key & 15) * 17);
+            }
+            used[KMEANS_KEY(next[i])] = 1;
+        }
 
-            if (useoriginalcolors == 1) {
-                count = 0;
-                for (j=0, x = 0; x < width; x++) {
-                    /* store original colors and working colors */
-                    blue = b = bmpscanline[j]; j++;
-                    green = g = bmpscanline[j]; j++;
-                    red = r = bmpscanline[j]; j++;
+        if (memcmp(next,palette,48) == 0) break;
+        memcpy(palette,next,48);
+    }
 
-                    /* if we are using a threshold color, assign it to our working colors */
-                    if (useegacolors == 1) {
-                        r = sethold(r,rhold);
-                        g = sethold(g,rhold);
-                        b = sethold(b,rhold);
-                    }
+    return iter;
+}
 
-                    found = 0;
-                    if (usefourteencolors == 1) {
-                        /* force black and white into palette */
-                        idx = GetClosestColor(r,g,b);
-                        if (idx == 15) r = g = b = red = blue = green = 255;
-                        else if (idx == 0) r = g = b = red = green = blue = 0;
-                    }
-                    for (i=0;i<count;i++) {
+/* worker thread - refines the next band until none are left */
+void *KMeansWorker(void *arg)
+{
+    KMEANS *km = (KMEANS *)arg;
+    A2BCONTEXT *ctx = km->ctx;
+    uchar palette[16][3], seed[16][3], assign[320], *pixels;
+    int band, y, i, j, iterations, total;
 
-                        if (useegacolors == 1) {
-                            /* compare on threshold colors */
-                            lr = sethold(linecolors[i][0],rhold);
-                            lg = sethold(linecolors[i][1],ghold);
-                            lb = sethold(linecolors[i][2],bhold);
-                        }
-                        else {
-                            /* compare on full original color value */
-                            lr = linecolors[i][0];
-                            lg = linecolors[i][1];
-                            lb = linecolors[i][2];
-                        }
+    for (;;) {
+        pthread_mutex_lock(&km->lock);
+        band = km->nextband;
+        if (band < KMEANS_BANDS) km->nextband++;
+        pthread_mutex_unlock(&km->lock);
+        if (band >= KMEANS_BANDS) break;
 
-                        if (lr == r && lg == g && lb == b) {
-                            if (useegacolors == 1) {
-                                idx = GetClosestColor(red,green,blue);
-                                if (globaldistance < linedistance[i]) {
-                                    /* update rgb values if closer to current palette than first values added */
-                                    linecolors[count][0] = red;
-                                    linecolors[count][1] = green;
-                                    linecolors[count][2] = blue;
-                                    linecolors[count][3] = GetClosestColor(red,green,blue);
-                                    linedistance[count] = globaldistance;
-                                }
-                            }
-                            linecount[i] += 1;
-                            found = 1;
-                            break;
-                        }
-                    }
-                    if (found != 1) {
-                        linecolors[count][0] = red;
-                        linecolors[count][1] = green;
-                        linecolors[count][2] = blue;
-                        linecolors[count][3] = GetClosestColor(red,green,blue);
-                        linedistance[count] = globaldistance;
-                        linecount[count] = 1;
-                        count++;
-                    }
-                }
+        total = 0;
+        for (y = band * KMEANS_LINES; y < (band + 1) * KMEANS_LINES; y++) {
+            pixels = &km->image[y * km->width * 3];
 
-                if (usesixteencolors == 0 && usefourteencolors == 0) {
-                    /* get darkest original color */
-                    /* get lightest original color */
-                    darkest = (ushort)linecolors[0][0];
-                    darkest += linecolors[0][1];
-                    darkest += linecolors[0][2];
-                    lightest = darkest;
-                    lidx = didx = 0;
-                    for (i=1;i<count;i++) {
-                        /* walk through the colors and find darkest and lightest colors */
-                        temp = (ushort)linecolors[i][0];
-                        temp += linecolors[i][1];
-                        temp += linecolors[i][2];
-                        if (temp < darkest) {
-                            darkest = temp;
-                            didx = i;
-                        }
-                        else if (temp > lightest) {
-                            lightest = temp;
-                            lidx = i;
-                        }
-                    }
-                    for (i=0;i<15;i++) {
-                        /* set the first 15 colors to the darkest color initially */
-                        rgbArrays[y1][i][0] = linecolors[didx][0];
-                        rgbArrays[y1][i][1] = linecolors[didx][1];
-                        rgbArrays[y1][i][2] = linecolors[didx][2];
-                    }
-                    /* set the last color to the lightest color initially */
-                    rgbArrays[y1][15][0] = linecolors[lidx][0];
-                    rgbArrays[y1][15][1] = linecolors[lidx][1];
-                    rgbArrays[y1][15][2] = linecolors[lidx][2];
+            for (i = 0; i < 16; i++) {
+                for (j = 0; j < 3; j++) seed[i][j] = KMeansLevel(ctx->rgbArrays[y][i][j]);
+            }
+            /* start from the line above if it fits better */
+            if (y == band * KMEANS_LINES ||
+                KMeansAssign(pixels,km->width,seed,assign,NULL) < KMeansAssign(pixels,km->width,palette,assign,NULL))
+                memcpy(palette,seed,48);
 
-                    linecount[lidx] = linecount[didx] = 0;
-                }
+            /* out of time - one pass still removes the duplicates */
+            iterations = ctx->kmeans;
+            if (km->deadline != 0 && GetMicroseconds() > km->deadline) iterations = 1;
 
-                /* add up to 14 (or 16) most-used colors between the darkest and lightest to this palette */
+            total += KMeansLine(pixels,km->width,palette,iterations);
+            memcpy(&ctx->rgbArrays[y][0][0],palette,48);
+        }
 
-                if (usesixteencolors == 1) {
-                    j = 0;
-                    lidx = 15;
-                }
-                else {
-                    j = 1;
-                    lidx = 14;
-                }
-                for (i = width;i > -1; i--) {
-                    for (x=0;x<count;x++) {
-                        if (linecount[x] == i) {
-                            linecount[x] = 0;
-                            if (usefourteencolors == 1) {
-                                /* if palette is already preset for black and white no point in adding again */
-                                if (linecolors[x][0] == 0 && linecolors[x][1] == 0 && linecolors[x][2] == 0) continue;
-                                if (linecolors[x][0] == 255 && linecolors[x][1] == 255 && linecolors[x][2] == 255) continue;
-                            }
-                            rgbArrays[y1][j][0] = linecolors[x][0];
-                            rgbArrays[y1][j][1] = linecolors[x][1];
-                            rgbArrays[y1][j][2] = linecolors[x][2];
-                            j++;
-                            if (j>14) break;
-                        }
-                    }
-                    if (j>14) break;
-                }
-                continue;
-                /* original colors continues the loop */
-            }
+        pthread_mutex_lock(&km->lock);
+        km->iterations += total;
+        pthread_mutex_unlock(&km->lock);
+    }
 
+    return NULL;
+}
 
-            for (j=0, x = 0; x < width; x++) {
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
+/* refine the 200 line palettes of a 320 x 200 24-bit bmp */
+sshort RefineLinePalettes(A2BCONTEXT *ctx, FILE *fp, int packet, int width)
+{
+    KMEANS km;
+    pthread_t workers[KMEANS_BANDS];
+    int threads, k;
+
+    memset(&km,0,sizeof(KMEANS));
+    km.ctx = ctx;
+    km.width = width;
+    km.image = ReadRGBImage(ctx, fp, packet, width, ctx->fourplay);
+    if (NULL == km.image) return INVALID;
+    if (ctx->kmeanstime > 0) km.deadline = GetMicroseconds() + (long long)ctx->kmeanstime * 1000;
+
+    threads = ctx->segmentthreads;
+    if (threads < 1) threads = NumberOfProcessors();
+    if (threads > KMEANS_BANDS) threads = KMEANS_BANDS;
+
+    pthread_mutex_init(&km.lock,NULL);
+    for (k = 0; k < threads; k++) {
+        if (pthread_create(&workers[k],NULL,KMeansWorker,&km) != 0) break;
+    }
+    threads = k;
+    /* if no threads could be started refine the bands here */
+    if (threads == 0) KMeansWorker(&km);
+    for (k = 0; k < threads; k++) pthread_join(workers[k],NULL);
+    pthread_mutex_destroy(&km.lock);
+
+    free(km.image);
+
+    if (ctx->quietmode == 0) printf("200 line palettes refined in %d k-means iterations.\n",km.iterations);
+    return SUCCESS;
+}
 
-                idx = GetClosestColor(r,g,b);
 
-                if (rgbUsed[y1][idx] == 0) {
-                    /* set initial value if this palette index has been used */
-                    rgbUsed[y1][idx] = 1;
-                    rgbDistance[y1][idx] = globaldistance;
-                    rgbArrays[y1][idx][0] = r;
-                    rgbArrays[y1][idx][1] = g;
-                    rgbArrays[y1][idx][2] = b;
-                    continue;
-                }
+/* ------------------------------------------------------------------------ */
+/* Adaptive SCB Palettes                                                    */
+/* ------------------------------------------------------------------------ */
 
-                /* if the new color is closer to the currently selected palette color
-                   than the previously stored color, then replace the previously stored
-                   color with the new color */
-                if (globaldistance < rgbDistance[y1][idx]) {
-                    rgbDistance[y1][idx] = globaldistance;
-                    rgbArrays[y1][idx][0] = r;
-                    rgbArrays[y1][idx][1] = g;
-                    rgbArrays[y1][idx][2] = b;
+/* option "scb" lets the 16 palettes of SH2 output (shr256 and mix256) and
+   the 8 and 16 palettes of PIM output follow the image instead of fixed bands
+   of 13 and 12 lines. the fixed bands are the starting point. then every line
+   is scored against every palette, each line goes to the palette that maps
+   its pixels with the least error and each palette is rebuilt from its own
+   lines, until no line changes palettes (k-means over the lines).
+   the scoring uses the fixed-point color distance and is done in parallel.
+   palettes loaded from ImageMagick files are not rebuilt - the lines just go
+   to their best palette. */
+
+#define SCB_PASSES 8
+#define SCB_LINES 25
+
+/* how a palette is rebuilt from the lines that use it */
+#define SCB_FIXED 0  /* palettes are not rebuilt */
+#define SCB_MERGE 1  /* merge the brooks palettes of the lines like the fixed bands do */
+#define SCB_CUT   2  /* median cut of the pixels of the lines */
+
+typedef struct tagSCBLINES
+{
+    uchar *image;         /* 320 x 200 rgb pixels top-down */
+    int width, numpalettes, nextband;
+    DISTWEIGHTS weights;
+    DISTPALETTE palettes[16];
+    long long cost[200][16];
+    pthread_mutex_t lock;
+} SCBLINES;
+
+/* worker thread - scores the lines of the next band until none are left */
+void *SCBWorker(void *arg)
+{
+    SCBLINES *scb = (SCBLINES *)arg;
+    uchar *pixels;
+    long long distance, total;
+    int band, y, x, p;
+
+    for (;;) {
+        pthread_mutex_lock(&scb->lock);
+        band = scb->nextband;
+        if (band < 200 / SCB_LINES) scb->nextband++;
+        pthread_mutex_unlock(&scb->lock);
+        if (band >= 200 / SCB_LINES) break;
+
+        for (y = band * SCB_LINES; y < (band + 1) * SCB_LINES; y++) {
+            for (p = 0; p < scb->numpalettes; p++) {
+                pixels = &scb->image[y * scb->width * 3];
+                for (x = 0, total = 0; x < scb->width; x++, pixels += 3) {
+                    GetDistColor(&scb->palettes[p],&scb->weights,pixels[0],pixels[1],pixels[2],0xffff,&distance);
+                    /* keep the total for a line of white on black in range */
+                    total += distance >> 16;
                 }
+                scb->cost[y][p] = total;
             }
         }
+    }
 
-        /* fill-in actual image colors in the unused range */
-        if (useoriginalcolors == 0 && (brooks2 == 1 || brooks3 == 1)) {
-            /* go through each scanline in the image looking for palette entries that have not been set */
-            /* the theory is that colors from the original image will match more closely than the colors
-               from the currently selected DHGR palette */
-
-            /* go through these in index order */
-            for (i=0;i<16;i++) {
-                /* found = 1; */
-                for (y = 0; y < 200; y++) {
-                    /* if no image color check the other lines */
-                    if (rgbUsed[y][i] == 0) {
-                        found = 1;
-                        y1 = y2 = y;
-                        for (;;)
-                        {
-                            /* expand upwards and downwards looking for an actual image color */
-                            y1--;
-                            y2++;
-                            /* if we have expanded past the bottom and top of the image then give-up
-                               for all the scanlines because this means that this color is not in
-                               the image */
-                            if (y1 < 0 && y2 > 200) {
-                                found = 0;
-                                break;
+    return NULL;
+}
 
-                            }
-                            /* if one of the lines above has this palette entry then use it */
-                            if (y1 > -1 && rgbUsed[y1][i] != 0) {
-                                rgbUsed[y][i] = 1;
-                                rgbArrays[y][i][0]=rgbArrays[y1][i][0];
-                                rgbArrays[y][i][1]=rgbArrays[y1][i][1];
-                                rgbArrays[y][i][2]=rgbArrays[y1][i][2];
-                                break;
-                            }
-                            /* if one of the lines below has this palette entry then use it */
-                            if (y2 < 200 && rgbUsed[y2][i] != 0) {
-                                rgbUsed[y][i] = 1;
-                                rgbArrays[y][i][0]=rgbArrays[y2][i][0];
-                                rgbArrays[y][i][1]=rgbArrays[y2][i][1];
-                                rgbArrays[y][i][2]=rgbArrays[y2][i][2];
-                                break;
-                            }
+/* score all the lines against all the palettes in rgb256Arrays */
+void ScoreSCBLines(A2BCONTEXT *ctx, SCBLINES *scb)
+{
+    pthread_t workers[200 / SCB_LINES];
+    double rgb[16][3];
+    int threads, p, i;
 
-                        }
-                    }
-                    if (found == 0) {
-                        if (brooks3 == 1 || brooks2 == 1) {
-                            if (useimagetone == 1) break;
-                            if (brooks3 == 1) greyoveride[i] = 1;
-                            break;
-                        }
-                    }
-                }
-            }
+    for (p = 0; p < scb->numpalettes; p++) {
+        for (i = 0; i < 16; i++) {
+            rgb[i][0] = (double)ctx->rgb256Arrays[p][i][0];
+            rgb[i][1] = (double)ctx->rgb256Arrays[p][i][1];
+            rgb[i][2] = (double)ctx->rgb256Arrays[p][i][2];
         }
+        SetDistPalette(&scb->palettes[p],rgb,&scb->weights);
+    }
 
-        if (shr256 == 1) {
+    threads = ctx->segmentthreads;
+    if (threads < 1) threads = NumberOfProcessors();
+    if (threads > 200 / SCB_LINES) threads = 200 / SCB_LINES;
 
-            shrpalettes = 16;
-            mix256 = 0;
+    scb->nextband = 0;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i],NULL,SCBWorker,scb) != 0) break;
+    }
+    threads = i;
+    /* if no threads could be started score the lines here */
+    if (threads == 0) SCBWorker(scb);
+    for (i = 0; i < threads; i++) pthread_join(workers[i],NULL);
+}
 
-            for (i=0;i<shrpalettes;i++) {
-                for (j=0;j<16;j++) {
-                    rgb256Arrays[i][j][0] = rgbArray[j][0];
-                    rgb256Arrays[i][j][1] = rgbArray[j][1];
-                    rgb256Arrays[i][j][2] = rgbArray[j][2];
-                    rgbUsed[i][j] = 0; /* not used */
-                    rgbDistance[i][j] = 0.0; /* initialize */
-                }
+/* rebuild a palette from the brooks palettes of its lines */
+/* like the fixed bands, the line color closest to each entry of the
+   current palette is kept for that entry */
+void MergeSCBPalette(A2BCONTEXT *ctx, uchar *linepalettes, uchar *assign, int p)
+{
+    double distance[16];
+    uchar used[16], r, g, b, drawcolor, *ptr;
+    int y, idx;
+
+    for (idx = 0; idx < 16; idx++) {
+        ctx->rgb256Arrays[p][idx][0] = ctx->rgbArray[idx][0];
+        ctx->rgb256Arrays[p][idx][1] = ctx->rgbArray[idx][1];
+        ctx->rgb256Arrays[p][idx][2] = ctx->rgbArray[idx][2];
+        used[idx] = 0;
+    }
+
+    for (y = 0; y < 200; y++) {
+        if (assign[y] != p) continue;
+        ptr = &linepalettes[y * 48];
+        for (idx = 0; idx < 16; idx++, ptr += 3) {
+            r = ptr[0];
+            g = ptr[1];
+            b = ptr[2];
+            drawcolor = GetClosestColor(ctx, r,g,b);
+            if (used[drawcolor] == 0 || ctx->globaldistance < distance[drawcolor]) {
+                used[drawcolor] = 1;
+                distance[drawcolor] = ctx->globaldistance;
+                ctx->rgb256Arrays[p][drawcolor][0] = r;
+                ctx->rgb256Arrays[p][drawcolor][1] = g;
+                ctx->rgb256Arrays[p][drawcolor][2] = b;
             }
+        }
+    }
+}
 
+/* rebuild a palette from a median cut of the pixels of its lines */
+void CutSCBPalette(A2BCONTEXT *ctx, SCBLINES *scb, uchar *assign, int p, uchar *pixels, uchar *work)
+{
+    SEGMENT seg;
+    int y, linesize = scb->width * 3;
+
+    seg.pixels = pixels;
+    seg.count = 0;
+    seg.palette = &ctx->rgb256Arrays[p][0][0];
+    for (y = 0; y < 200; y++) {
+        if (assign[y] != p) continue;
+        memcpy(&pixels[seg.count * 3],&scb->image[y * linesize],linesize);
+        seg.count += scb->width;
+    }
+    CutSegmentPalette(&seg,work);
+}
 
-            /* first pass */
-            for (i = 0, y = 0; i < 8; i++, y+=25) {
-                y1 = y;
-                y2 = y + 13;
-                j = i * 2;
-                /* temporary - hard-coded palette assignment */
-                /* temporary ends */
+/* every palette needs at least one line - the dithering routines find the
+   line palette of each of the 16 palettes from the scbs */
+/* rebuilt palettes take the worst fitting line, fixed palettes the line
+   that loses least by moving */
+void FillSCBPalettes(SCBLINES *scb, uchar *assign, int rebuild)
+{
+    long long cost, pick;
+    int lines[16], p, y, line;
 
-                /* palette for 13 lines */
-                for (x = y1; x < y2; x++) {
-                    for (idx = 0; idx < 16; idx++) {
-                        r = rgbArrays[x][idx][0];
-                        g = rgbArrays[x][idx][1];
-                        b = rgbArrays[x][idx][2];
+    memset(lines,0,sizeof(lines));
+    for (y = 0; y < 200; y++) lines[assign[y]]++;
 
-                        drawcolor  = GetClosestColor(r,g,b);
+    for (p = 0; p < scb->numpalettes; p++) {
+        if (lines[p] != 0) continue;
+        line = -1;
+        for (y = 0; y < 200; y++) {
+            if (lines[assign[y]] < 2) continue;
+            if (rebuild == SCB_FIXED) cost = scb->cost[y][assign[y]] - scb->cost[y][p];
+            else cost = scb->cost[y][assign[y]];
+            if (line == -1 || cost > pick) {
+                pick = cost;
+                line = y;
+            }
+        }
+        if (line == -1) break;
+        lines[assign[line]]--;
+        assign[line] = (uchar)p;
+        lines[p] = 1;
+    }
+}
 
-                        if (rgbUsed[j][drawcolor] == 0) {
-                            /* set initial value if this palette index has been used */
-                            rgbUsed[j][drawcolor] = 1;
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                            continue;
-                        }
+/* give each of the 200 lines its best palette of the first numpalettes in rgb256Arrays */
+/* linepalettes are the brooks palettes of each line for SCB_MERGE */
+/* the palette for each line is returned in assign */
+sshort AssignSCBPalettes(A2BCONTEXT *ctx, uchar *image, int width, int numpalettes, int rebuild,
+                         uchar *linepalettes, uchar *assign)
+{
+    SCBLINES *scb;
+    uchar *pixels = NULL, *work = NULL, best, previous[200], bestassign[200], bestpalettes[16][16][3];
+    long long total, besttotal = -1;
+    int pass, y, p, moved, lines[16];
 
-                        /* if the new color is closer to the currently selected palette color
-                           than the previously stored color, then replace the previously stored
-                           color with the new color */
-                        if (globaldistance < rgbDistance[j][drawcolor]) {
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                        }
-                    }
-                }
+    scb = (SCBLINES *)malloc(sizeof(SCBLINES));
+    if (NULL == scb) {
+        puts("No memory...");
+        return INVALID;
+    }
+    memset(scb,0,sizeof(SCBLINES));
+    scb->image = image;
+    scb->width = width;
+    scb->numpalettes = numpalettes;
+    SetDistWeights(&scb->weights,ctx->lumaRED,ctx->lumaGREEN,ctx->lumaBLUE,
+                   ctx->dlumaRED,ctx->dlumaGREEN,ctx->dlumaGREEN,ctx->dlumaBLUE);
+
+    if (rebuild == SCB_CUT) {
+        pixels = (uchar *)malloc(width * 200 * 3);
+        work = (uchar *)malloc(width * 200 * 3);
+        if (NULL == pixels || NULL == work) {
+            if (NULL != pixels) free(pixels);
+            if (NULL != work) free(work);
+            free(scb);
+            puts("No memory...");
+            return INVALID;
+        }
+    }
 
-                for (idx = 0; idx < 16; idx++) {
-                    /* put new palette back in old palette */
-                    rgbArrays[y1][idx][0] = rgb256Arrays[j][idx][0];
-                    rgbArrays[y1][idx][1] = rgb256Arrays[j][idx][1];
-                    rgbArrays[y1][idx][2] = rgb256Arrays[j][idx][2];
-                }
+    pthread_mutex_init(&scb->lock,NULL);
+    for (pass = 0; ; pass++) {
+        ScoreSCBLines(ctx, scb);
 
-                /* palette for 12 lines */
-                y1 = y + 13;
-                y2 = y + 25;
-                j = (i*2) + 1;
+        /* each line goes to the palette that costs least */
+        memcpy(previous,assign,200);
+        for (y = 0; y < 200; y++) {
+            for (p = 1, best = 0; p < numpalettes; p++) {
+                if (scb->cost[y][p] < scb->cost[y][best]) best = (uchar)p;
+            }
+            assign[y] = best;
+        }
+        FillSCBPalettes(scb, assign, rebuild);
+        for (y = 0, moved = 0, total = 0; y < 200; y++) {
+            if (assign[y] != previous[y]) moved++;
+            total += scb->cost[y][assign[y]];
+        }
 
-                for (x = y1; x < y2; x++) {
-                    for (idx = 0; idx < 16; idx++) {
-                        r = rgbArrays[x][idx][0];
-                        g = rgbArrays[x][idx][1];
-                        b = rgbArrays[x][idx][2];
+        /* the rebuilt palettes don't always do better so stop at the first pass
+           that doesn't and keep the best */
+        if (besttotal >= 0 && total >= besttotal) break;
+        besttotal = total;
+        memcpy(bestassign,assign,200);
+        memcpy(&bestpalettes[0][0][0],&ctx->rgb256Arrays[0][0][0],numpalettes * 48);
+        if (moved == 0 || pass == SCB_PASSES || rebuild == SCB_FIXED) break;
 
-                        drawcolor  = GetClosestColor(r,g,b);
+        /* rebuild the palettes - palettes without lines are left alone */
+        memset(lines,0,sizeof(lines));
+        for (y = 0; y < 200; y++) lines[assign[y]]++;
+        for (p = 0; p < numpalettes; p++) {
+            if (lines[p] == 0) continue;
+            if (rebuild == SCB_MERGE) MergeSCBPalette(ctx, linepalettes, assign, p);
+            else CutSCBPalette(ctx, scb, assign, p, pixels, work);
+        }
+    }
+    pthread_mutex_destroy(&scb->lock);
 
-                        if (rgbUsed[j][drawcolor] == 0) {
-                            /* set initial value if this palette index has been used */
-                            rgbUsed[j][drawcolor] = 1;
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                            continue;
-                        }
-
-                        /* if the new color is closer to the currently selected palette color
-                           than the previously stored color, then replace the previously stored
-                           color with the new color */
-                        if (globaldistance < rgbDistance[j][drawcolor]) {
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                        }
-                    }
-                }
-
-                for (idx = 0; idx < 16; idx++) {
-                    /* put new palette back in old palette */
-                    rgbArrays[y1][idx][0] = rgb256Arrays[j][idx][0];
-                    rgbArrays[y1][idx][1] = rgb256Arrays[j][idx][1];
-                    rgbArrays[y1][idx][2] = rgb256Arrays[j][idx][2];
-                }
-
-            }
-
-
-            /* second pass */
-            for (i = 0, y = 0; i < 8; i++, y+=25) {
-                y1 = y;
-                y2 = y + 13;
-                j = i * 2;
-                /* temporary - hard-coded palette assignment */
-                for (idx = 0; idx < 16; idx++) {
-                    /* palettes from 25 scanlines */
-                    /* every 1st of 13 palettes */
-                    rgb256Arrays[j][idx][0] = rgbArrays[y1][idx][0];
-                    rgb256Arrays[j][idx][1] = rgbArrays[y1][idx][1];
-                    rgb256Arrays[j][idx][2] = rgbArrays[y1][idx][2];
-                    /* every 1st of 12 palettes */
-                    rgb256Arrays[j+1][idx][0] = rgbArrays[y2][idx][0];
-                    rgb256Arrays[j+1][idx][1] = rgbArrays[y2][idx][1];
-                    rgb256Arrays[j+1][idx][2] = rgbArrays[y2][idx][2];
-                }
-                /* temporary ends */
-                /* palette for 13 lines */
-                for (x = y1; x < y2; x++) {
-                    mypic.scb[x] = j;
-                    for (idx = 0; idx < 16; idx++) {
-                        rgbArrays[x][idx][0] = rgb256Arrays[j][idx][0];
-                        rgbArrays[x][idx][1] = rgb256Arrays[j][idx][1];
-                        rgbArrays[x][idx][2] = rgb256Arrays[j][idx][2];
-                    }
-                }
-                /* palettte for 12 lines */
-                y1 = y + 13;
-                y2 = y + 25;
-                j = (i*2) + 1;
-                for (x = y1; x < y2; x++) {
-                    mypic.scb[x] = j;
-                    for (idx = 0; idx < 16; idx++) {
-                        rgbArrays[x][idx][0] = rgb256Arrays[j][idx][0];
-                        rgbArrays[x][idx][1] = rgb256Arrays[j][idx][1];
-                        rgbArrays[x][idx][2] = rgb256Arrays[j][idx][2];
-                    }
-                }
-            }
-        } /* shr256 ends */
-        else if (mix256 == 1) {
-
-            if (quietmode == 0) puts("mixing colors");
+    memcpy(assign,bestassign,200);
+    memcpy(&ctx->rgb256Arrays[0][0][0],&bestpalettes[0][0][0],numpalettes * 48);
 
-            /* if we are also adding zone palettes to the mix then we build these here */
-            /* this just gives us some additional palettes to work with */
-            /* I have no clear thoughts on whether this will work better or worse */
-            for (i=0;i<16;i++) {
-                /* just initialize with the current palette values */
-                for (j=0;j<16;j++) {
-                    rgb256Arrays[i][j][0] = rgbArray[j][0];
-                    rgb256Arrays[i][j][1] = rgbArray[j][1];
-                    rgb256Arrays[i][j][2] = rgbArray[j][2];
-                    rgbUsed[i][j] = 0; /* not used */
-                    rgbDistance[i][j] = 0.0; /* initialize */
-                }
-            }
+    if (ctx->quietmode == 0) printf("%d palettes assigned to lines in %d passes.\n",numpalettes,pass + 1);
 
+    if (NULL != pixels) free(pixels);
+    if (NULL != work) free(work);
+    free(scb);
+    return SUCCESS;
+}
 
-            /* only one pass is used - we don't use scbs for brooks */
-            /* and we also need to keep the brooks palette intact */
-            /* like the initial 16 - paletttes used by plain old SHR just divides the image into
-               sections and builds composite palettes that more closely match our initial palettes */
-            for (i = 0, y = 0; i < 8; i++, y+=25) {
-                y1 = y;
-                y2 = y + 13;
-                j = i * 2;
 
-                /* palette for 13 lines */
-                for (x = y1; x < y2; x++) {
-                    for (idx = 0; idx < 16; idx++) {
-                        r = rgbArrays[x][idx][0];
-                        g = rgbArrays[x][idx][1];
-                        b = rgbArrays[x][idx][2];
+/* adaptive scbs for shr256 and mix256 - the fixed bands are already built */
+/* linepalettes are the brooks palettes of each line before the bands were built */
+sshort AdaptiveBrooksSCB(A2BCONTEXT *ctx, FILE *fp, int packet, int width, uchar *linepalettes)
+{
+    uchar assign[200], *image;
+    int y;
+    sshort status;
+
+    image = ReadRGBImage(ctx, fp, packet, width, ctx->fourplay);
+    if (NULL == image) return INVALID;
+    /* start from the bands of 13 and 12 lines */
+    for (y = 0; y < 200; y++) assign[y] = (uchar)((y / 25) * 2 + (y % 25 < 13 ? 0 : 1));
+    status = AssignSCBPalettes(ctx, image, width, 16, SCB_MERGE, linepalettes, assign);
+    free(image);
+    if (status != SUCCESS) return status;
+
+    /* mix256 keeps the brooks palettes - the 16 palettes are just more choices */
+    if (ctx->shr256 == 1) {
+        for (y = 0; y < 200; y++) {
+            ctx->mypic.scb[y] = assign[y];
+            memcpy(&ctx->rgbArrays[y][0][0],&ctx->rgb256Arrays[assign[y]][0][0],48);
+        }
+    }
+    return SUCCESS;
+}
 
-                        drawcolor  = GetClosestColor(r,g,b);
+/* adaptive scbs for 8 and 16 palette PIM output */
+/* palettes built by "pim8" and "pim16" are rebuilt, ImageMagick palettes are not */
+sshort AdaptivePIMSCB(A2BCONTEXT *ctx, FILE *fp, int packet)
+{
+    uchar assign[200], *image;
+    int y;
+    sshort status;
+
+    image = ReadRGBImage(ctx, fp, packet, 320, 0);
+    if (NULL == image) return INVALID;
+    for (y = 0; y < 200; y++) assign[y] = ctx->mypic.scb[y];
+    status = AssignSCBPalettes(ctx, image, 320, ctx->imnumpalettes,
+                               (ctx->pimquantize == 1 ? SCB_CUT : SCB_FIXED), NULL, assign);
+    free(image);
+    if (status != SUCCESS) return status;
+
+    for (y = 0; y < 200; y++) {
+        ctx->mypic.scb[y] = assign[y];
+        memcpy(&ctx->rgbArrays[y][0][0],&ctx->rgb256Arrays[assign[y]][0][0],48);
+    }
+    return SUCCESS;
+}
 
-                        if (rgbUsed[j][drawcolor] == 0) {
-                            /* set initial value if this palette index has been used */
-                            rgbUsed[j][drawcolor] = 1;
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                            continue;
-                        }
 
-                        /* if the new color is closer to the currently selected palette color
-                           than the previously stored color, then replace the previously stored
-                           color with the new color */
-                        if (globaldistance < rgbDistance[j][drawcolor]) {
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                        }
-                    }
-                }
+/* converts to lores and double lo-res image fragments and backgrounds (primarily targeted at game development) */
+/* also converts to SHR mode320 full-screen PIC files - Single Palette, 16-Palette, and 200 Palette (Brooks) format*/
+int ConvertLoResAndSHR(A2BCONTEXT *ctx, unsigned char *basename, unsigned char *newname)
+{
 
+    FILE *fp;
+    int packet = INVALID, y,y1,y2,x,i,j,k,width,height,reformat = ctx->bmp3, bmpversion =0,lidx,didx,count;
+    int outpacket, outputwidth, outputheight, offset;
+    int usescb = 0, indexed = 0;
+    uchar linepalettes[200][16][3];
+    char bmpfile[256], outfile[256];
+    uchar r,g,b,lr,lg,lb,red,green,blue,drawcolor,idx,toneindex,*indexline;
+    ushort temp, fl, darkest,lightest,found,unused;
+    float hue,saturation,luminance;
+    sshort jdx;
 
-                /* palettte for 12 lines */
-                y1 = y + 13;
-                y2 = y + 25;
-                j = (i*2) + 1;
+    sprintf(bmpfile,"%s.bmp",basename);
 
-                for (x = y1; x < y2; x++) {
-                    for (idx = 0; idx < 16; idx++) {
-                        r = rgbArrays[x][idx][0];
-                        g = rgbArrays[x][idx][1];
-                        b = rgbArrays[x][idx][2];
+    StatsBegin(ctx->stats,STATS_HEADER);
+    if((fp=fopen(bmpfile,"rb"))==NULL) {
+        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n",bmpfile);
+        return INVALID;
+    }
 
-                        drawcolor  = GetClosestColor(r,g,b);
+    /* read the header stuff into the appropriate structures,
+       it's likely a bmp file */
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
 
-                        if (rgbUsed[j][drawcolor] == 0) {
-                            /* set initial value if this palette index has been used */
-                            rgbUsed[j][drawcolor] = 1;
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                            continue;
-                        }
+    fread((char *)&ctx->BitMapFileHeader.bfType,
+                 sizeof(BITMAPFILEHEADER),1,fp);
+    fread((char *)&ctx->bmi.biSize,
+                 sizeof(BITMAPINFOHEADER),1,fp);
 
-                        /* if the new color is closer to the currently selected palette color
-                           than the previously stored color, then replace the previously stored
-                           color with the new color */
-                        if (globaldistance < rgbDistance[j][drawcolor]) {
-                            rgbDistance[j][drawcolor] = globaldistance;
-                            rgb256Arrays[j][drawcolor][0] = r;
-                            rgb256Arrays[j][drawcolor][1] = g;
-                            rgb256Arrays[j][drawcolor][2] = b;
-                        }
-                    }
-                }
+    if (ctx->bmi.biSize != sizeof(BITMAPINFOHEADER)) {
+		if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,(unsigned)ctx->bmi.biSize,1,fp);
+            bmpversion = 3;
+            reformat = 1;
+		}
+		else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
+            bmpversion = 4;
+            reformat = 1;
 
-            }
+        }
+        else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
+            bmpversion = 5;
+            reformat = 1;
+            /*
+            Profile data refers to either the profile file name (linked profile)
+            or the actual profile bits (embedded profile).
+            The file format places the profile data at the end of the file.
+            The profile data is placed just after the color table (if present).
+            */
+        }
+        else {
+            bmpversion = 0;
+        }
 
-        } /* mix256 ends */
+    }
+    else {
+        bmpversion = 3;
+    }
 
+    if (bmpversion == 0) {
+        fclose(fp);
+        puts("BMP version not recognized!");
+        printf("bmi.biSize = %d - BITMAPINFOHEADER = %d\n",ctx->bmi.biSize, sizeof(BITMAPINFOHEADER));
+        return INVALID;
     }
 
-    memset(&dhrbuf[0],0,32000); /* clear write buffer */
 
-    if (dither != 0) {
-        /* sizeof(sshort) * 640 */
-        memset(&redDither[0],0,1280);
-        memset(&greenDither[0],0,1280);
-        memset(&blueDither[0],0,1280);
-        memset(&redSeed[0],0,1280);
-        memset(&greenSeed[0],0,1280);
-        memset(&blueSeed[0],0,1280);
-        memset(&redSeed2[0],0,1280);
-        memset(&greenSeed2[0],0,1280);
-        memset(&blueSeed2[0],0,1280);
+    if (ctx->shr == 320) {
+        ctx->lores = 1;
+        ctx->doublelores = 0;
     }
     else {
-        usepalettedistance = 0;
+        ctx->usegscolors = ctx->shrgrey = 0;
     }
 
-    /* seek to beginning of input file and process */
-    fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
-
-    if (dither == 0) puts("non-dithered output");
-    else puts("dithered output");
-
-    /* bmp's are upside-down so conversion of scanlines is in
-       reverse order */
-    for(y=0,y1=height-1;y<height;y++,y1--)
-    {
-          fread((char *)&bmpscanline[0],1,packet,fp);
+    if (ctx->bmi.biCompression==BI_RGB &&
+        ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M' &&
+        ctx->bmi.biPlanes==1 && (ctx->bmi.biBitCount == 24 || ctx->bmi.biBitCount == 8 || ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 1)) {
 
-          if (mono == 1) {
-            /* work from a greyscale if mono - LGR and DLGR have no mono */
-            /* SHR can have either mono or 16 levels of grey  in dithered or non-dithered output */
-            for (x = 0,j=0;x<width;x++,j+=3) {
-                if (hsl == 1) {
-                    /* achromatic greyscale */
-                    /* de-saturate using the hsl color model */
-                    rgb2hsl(bmpscanline[j+2],bmpscanline[j+1],bmpscanline[j],&hue,&saturation,&luminance);
-                    bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] =(uchar)(float)(luminance * 255);
-                }
-                else {
-                    /* average RGB greyscale */
-                    temp = (ushort)bmpscanline[j];
-                    temp += bmpscanline[j+1];
-                    temp += bmpscanline[j+2];
-                    while ((temp % 3)!=0) temp++;
-                    bmpscanline[j] = bmpscanline[j+1] = bmpscanline[j+2] = (uchar) (temp/3);
+            if (ctx->shr == 320) {
+                if (ctx->bmi.biWidth != 320 || ctx->bmi.biHeight != 200) {
+                    fclose(fp);
+                    puts(szTextTitle);
+                    printf("%s is not in a supported size for SHR mode320 file output.\nExiting!\n", bmpfile);
+                    return INVALID;
                 }
             }
-          }
-          else if (shrpalettes > 1) {
-             /* if doing brooks or 256 colors set the palette for this line */
-             InitDoubleLineArrays(y1);
-          }
-
-          if (dither == 0) {
-            /* if not dithering use direct pixel mapping */
-            for (x=0,j=0;x<width;x++) {
 
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
-
-                idx = GetClosestColor(r,g,b);
-                setlopixel((uchar)idx,x,y1);
+            if (ctx->bmi.biWidth > 320 || ctx->bmi.biHeight > 200) {
+                fclose(fp);
+                puts(szTextTitle);
+                printf("%s is not in a supported size for LGR or DLGR file output.\nExiting!\n", bmpfile);
+                return INVALID;
             }
-          }
-          else
-          {
-              /* add the current line to the r,g,b line buffers used for dithering */
-              for (j=0, x = 0; x < width; x++) {
-                    b = bmpscanline[j]; j++;
-                    g = bmpscanline[j]; j++;
-                    r = bmpscanline[j]; j++;
-
-                    /* values are already seeded from previous 2 - line(s) */
-                    /* the idea here is to add a full value to whatever bleed values have been added */
-                    AdjustShortPixel(1,(sshort *)&redDither[x],(sshort)r);
-                    AdjustShortPixel(1,(sshort *)&greenDither[x],(sshort)g);
-                    AdjustShortPixel(1,(sshort *)&blueDither[x],(sshort)b);
-              }
 
-              if (usepalettedistance == 1 && shrpalettes > 1) {
-                  if (shrpalettes == 200) {
-                    if (mix256 == 1) BrooksPicDither(y1,width);
-                    else BrooksDither(y1,width);
-                  }
-                  else {
-                    PicDither(y1,width);
-                  }
-              }
-              else {
-                /* dithering - "pixels" is just a "placeholder" */
-                BuckelsDither(y1,width,1);
-              }
 
-               /* seed next line - promote nearest forward array to
-                  current line */
-               memcpy(&redDither[0],&redSeed[0],1280);
-               memcpy(&greenDither[0],&greenSeed[0],1280);
-               memcpy(&blueDither[0],&blueSeed[0],1280);
+            outputheight = height = (int) ctx->bmi.biHeight;
+            outputwidth = width = (int) ctx->bmi.biWidth;
 
-               /* seed first seed - promote furthest forward array
-                  to nearest forward array */
-               memcpy(&redSeed[0],&redSeed2[0],1280);
-               memcpy(&greenSeed[0],&greenSeed2[0],1280);
-               memcpy(&blueSeed[0],&blueSeed2[0],1280);
+            if (outputheight%2 != 0) outputheight++;
+            outputheight = outputheight/2;
 
-               /* clear last seed - furthest forward array */
-               memset(&redSeed2[0],0,1280);
-               memset(&greenSeed2[0],0,1280);
-               memset(&blueSeed2[0],0,1280);
-         }
+            if (ctx->doublelores == 1) {
+                /* double lo-res files are paired-pixels */
+                /* they don't need to be and I may rethink this later */
+                /* they must also be loaded on paired origins because auxiliary memory
+                   uses different color mapping than main memory
+                   */
+                if (outputwidth%2 != 0) outputwidth++;
+                outpacket = outputwidth / 2;
+            }
+            else outpacket = outputwidth;
 
+            packet = width * 3;
+            while (packet%4 != 0)packet++; /* BMP scanlines align on DWORD boundaries */
     }
-    fclose(fp);
 
-	if (reformat == 1) {
-		if (bmp3 == 0) {
-			remove("Reformat.bmp");
-		}
-		else {
-			sprintf(outfile,"%s.bm3", newname);
-			remove(outfile);
-			rename("Reformat.bmp",outfile);
-		}
-	}
+    if (packet == INVALID) {
+        fclose(fp);
+        if (ctx->shr == 320) printf("%s is not in a supported format for SHR or BROOKS file output.\nExiting!\n", bmpfile);
+        else printf("%s is not in a supported format for LGR or DLGR file output.\nExiting!\n", bmpfile);
+        return INVALID;
+    }
 
-    if (shr == 0) {
-        /* create output files */
-        /* stay with old full-screen naming convention for these */
-        if (doublelores == 1) {
-            if (outputwidth == 80 && outputheight == 20) sprintf(outfile,"%s.DTO", newname);
-            else if (outputwidth == 80 && outputheight == 24) sprintf(outfile,"%s.DLO", newname);
-            else sprintf(outfile,"%s.DLR", newname);
-        }
-        else {
-            if (outputwidth == 40 && outputheight == 20) sprintf(outfile,"%s.STO", newname);
-            else if (outputwidth == 40 && outputheight == 24) sprintf(outfile,"%s.SLO", newname);
-            else sprintf(outfile,"%s.SLR", newname);
-        }
+    if (ctx->shr == 320 || ctx->bmi.biBitCount == 8 || ctx->bmi.biBitCount == 4 || ctx->bmi.biBitCount == 1 || ctx->usegscolors == 1) {
 
-        ucase((char *)&outfile[0]);
+       memset((char *)&ctx->sbmp[0].rgbBlue,0,sizeof(RGBQUAD)*256);
 
-        if (longnames == 0) tags = 0;
+       if (ctx->bmi.biBitCount == 1) {
+           fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*2,1,fp);
+           if (ctx->shr == 320) ctx->dither = 0;
+       }
+       else if (ctx->bmi.biBitCount == 4) {
+           fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+           if (ctx->shr == 320) {
+               /* for SHR output, 16 color BMP's are assumed to be palette matched and are
+                  converted using the colors they were created with */
+               for (j=0;j<16;j++) {
+                    if (ctx->usegscolors == 1) {
+                        ctx->sbmp[j].rgbRed = gsColor(ctx->sbmp[j].rgbRed);
+                        ctx->sbmp[j].rgbGreen = gsColor(ctx->sbmp[j].rgbGreen);
+                        ctx->sbmp[j].rgbBlue = gsColor(ctx->sbmp[j].rgbBlue);
+                    }
+                    ctx->rgbArray[j][0] = ctx->sbmp[j].rgbRed;
+                    ctx->rgbArray[j][1] = ctx->sbmp[j].rgbGreen;
+                    ctx->rgbArray[j][2] = ctx->sbmp[j].rgbBlue;
+               }
+           }
+       }
+       else if (ctx->bmi.biBitCount == 8) {
+           /* for SHR no special consideration is provided for 256 color BMP's in this utility.
+              they are assumed to be converted GIF files or the equivalent and since we
+              are providing only a single palette they get the same treatment as a 24-bit BMP.
 
-        if (tags == 1) {
-            strcat(outfile,"#060400");
-            dosheader = 0;
-        }
+              a color count routine is really required here to weed-out 16 color BMP's that
+              have been promoted to 256 color BMP's and 24-bit BMP's.
 
-        fp = fopen(outfile,"wb");
-        if (NULL == fp) {
-            puts(szTextTitle);
-            printf("%s cannot be created.\n", outfile);
-            return INVALID;
-        }
+              to do more for 256 color BMP's and 24-bit BMP's, palette routines that can be supported
+              by the standard SHR format's 16 colors per line and 16 palettes per PIC would be needed. */
+           fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+           if (ctx->usegscolors == 1) {
+                for (j=0;j<256;j++) {
+                    ctx->sbmp[j].rgbRed = gsColor(ctx->sbmp[j].rgbRed);
+                    ctx->sbmp[j].rgbGreen = gsColor(ctx->sbmp[j].rgbGreen);
+                    ctx->sbmp[j].rgbBlue = gsColor(ctx->sbmp[j].rgbBlue);
+                }
+           }
+       }
 
-        if (dosheader == 1) {
-            fl = (ushort) outputwidth;
-            fl *= outputheight;
-            if (outputwidth < 256) fl += 2;
-            else fl += 7;
-            WriteDosHeader(fp,fl,1024);
-        }
+       StatsNext(ctx->stats,STATS_HEADER,STATS_REFORMAT);
+       fp = ReformatBMP(ctx, fp);
+       StatsNext(ctx->stats,STATS_REFORMAT,STATS_HEADER);
+       if (NULL == fp) return SUCCESS;
+       if (ctx->shr == 1) {
+           if (ctx->shrmode < 17) {
+               puts("Fixed palette (16 color) mapping will be used for conversion.");
+               if (ctx->mono == 0) puts("Dithering will have no effect.");
+           }
+       }
+       reformat = 1;
 
+    }
 
-        /* for most files a 2 byte header is all that is needed */
-        /* these are exactly the same format as SLO,STO and DLO,DTO */
-        if (outputwidth < 256) {
-            fputc((uchar)outputwidth,fp);    /* width in bytes */
-            fputc((uchar)outputheight,fp);   /* height in scanlines */
+    StatsNext(ctx->stats,STATS_HEADER,STATS_PALETTE);
+    if (ctx->mono == 1) {
+        ctx->shr2 = 0;
+
+        if (ctx->hsl == 1) {
+            puts("achromatic hsl monochrome using hue channel de-saturation.");
         }
         else {
-            /* for files wider than 255 bytes */
-            /* 7 byte header */
-            /* 3 - bytes - some kind of identifier */
-            if (doublelores == 1) fputc('D',fp);
-            else fputc('S',fp);
-            fputc('L',fp);
-            fputc('R',fp);
-            WriteDosHeader(fp,(ushort)outputwidth,(ushort)outputheight);
-        }
-
-        /* raster oriented top-down */
-        for (y = 0; y < outputheight;y++) {
-          offset = y * 320;
-          fwrite(&dhrbuf[offset],1,outpacket,fp);
-          if (doublelores == 1) fwrite(&dhrbuf[offset+160],1,outpacket,fp);
+            puts("average rgb monochrome using color channel scaling.");
         }
-        fclose(fp);
-        printf("%s created.\n", outfile);
-
-    }
-    else if (shr == 320) {
-
-        if (usepalettedistance == 1 && shrpalettes > 1) {
-            /* if we shuffled the palettes based on the best total distance then we need
-               to put our new palettes in place before writing our output file(s) */
-            for (y= 0;y<200;y++) {
-                memcpy(&rgbArrays[y][0][0],&savepalettes[y][0][0],48);
+        if (ctx->shrgrey == 1) {
+            /* for SHR mode320 mono we use 16 levels of grey */
+            for (j=0;j<16;j++) {
+                ctx->rgbArray[j][0] = ctx->rgbArray[j][1] = ctx->rgbArray[j][2] = LegalColor[j];
             }
-            memcpy(&mypic.scb[0],&savescb[0],200);
-        }
-
-
-        /* SHR output file naming convention for the occasion */
-        /* using different extensions to tell them apart */
-        if (mono == 1) {
-            if (shrgrey == 1) sprintf(outfile,"%s.SHG", newname);
-            else sprintf(outfile,"%s.SHM", newname);
+            puts("16 color greyscale conversion!");
         }
         else {
-            if (brooks == 0) sprintf(outfile,"%s.SHR", newname);
-            else {
-                if (shr256 == 1) sprintf(outfile,"%s.SH2", newname);
-                else sprintf(outfile,"%s.SH3", newname);
-            }
+            /* for LGR and DLGR fixed palette output and SHR 320 true monochrome */
+            /* create a black and white palette */
+            memset(&ctx->rgbArray[0][0],0,45);
+            memset(&ctx->rgbArray[15][0],255,3);
+            if(ctx->shr == 320) puts("2 color monochrome conversion!");
         }
-        ucase((char *)&outfile[0]);
-        if (longnames == 0) tags = 0;
+    }
 
-        /* Ciderpress File Attribute Preservation Tags */
-        if (tags == 1){
-            if (brooks == 0) strcat(outfile,"#C10000");
-            else {
-                if (shr256 == 1) strcat(outfile,"#C10000");
-                else strcat(outfile,"#C10002");
+
+    /* hard to say how this will work out */
+    if (ctx->mono == 0 && ctx->shrmode > 16) {
+        if (ctx->fourpal == 1) {
+            /* group on GS colors */
+            for (k=0;k<16;k++) {
+                ctx->rgbArray[k][0] = gsColor(ctx->rgbArray[k][0]);
+                ctx->rgbArray[k][1] = gsColor(ctx->rgbArray[k][1]);
+                ctx->rgbArray[k][2] = gsColor(ctx->rgbArray[k][2]);
             }
         }
 
-        if (SHR320_Output(outfile) != SUCCESS) {
-            printf("%s cannot be created.\n", outfile);
-            return INVALID;
-        }
-        printf("%s created.\n", outfile);
     }
 
+    /* initialize nearest color arrays */
+    /* for SHR this array will be used no matter what kind of output we eventually end-up with */
+    /* for LGR and DLGR there is only one fixed palette of Lo-Res colors so there are no additional palettes */
+    InitDoubleArrays(ctx);
 
-    /* vbmp output is not available for LGR, DLGR, or SHR output because
-       vbmp works only with DHGR color and monochrome and HGR monochrome.
-       but I just use the same "option V" for preview output or M2S output here */
-    if (vbmp == 1) {
-
-        /* Magick2SHR palette output and Magick2SHR naming convention for round-trip editing */
-        /* this applies only to 16 palette and brooks output */
-        /* single palette files are output as 16-color BMPs and can be edited and reprocessed without using M2S */
-        if (m2s == 1 && shrpalettes < 2) m2s = 0;
+    if (ctx->mono == 0 && ctx->shr == 320 && ctx->useimagetone == 1) {
+        /* build initial palette of most used colors in each of our sixteen ranges */
 
-        if (m2s == 0) {
-            /* for MS-DOS output we use short (and different) names */
-            if (longnames == 0)sprintf(outfile,"%s.pmp", newname);
-            else sprintf(outfile,"%s_Preview.bmp", newname);
+        for (j=0;j<16;j++) {
+            ctx->rgbArrays[0][j][0] = ctx->rgbArray[j][0];
+            ctx->rgbArrays[0][j][1] = ctx->rgbArray[j][1];
+            ctx->rgbArrays[0][j][2] = ctx->rgbArray[j][2];
+            ctx->rgbUsed[0][j] = 0; /* not used yet */
+            ctx->rgbDistance[0][j] = 0.0; /* initialize */
         }
-        else {
-            if (longnames == 0)sprintf(outfile,"%s.dib", newname);
-            else sprintf(outfile,"%s_palette.bmp", newname);
-            /* open M2S palette file */
-            fp = fopen(outfile,"wb");
-            if (NULL == fp) {
-                puts(szTextTitle);
-                printf("%s cannot be created.\n", outfile);
-                return INVALID;
-            }
-
-            memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
-
-            /* create the info header */
-            mybmp.bmi.biSize = (ulong)40;
-            mybmp.bmi.biWidth  = (ulong)16;
-            mybmp.bmi.biHeight = (ulong)shrpalettes;
-            mybmp.bmi.biPlanes = 1;
-            mybmp.bmi.biBitCount = 24;
-            mybmp.bmi.biCompression = (ulong) BI_RGB;
 
-            outpacket = 48;
-            mybmp.bmi.biSizeImage = (ulong)outpacket;
-            mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
 
-            /* create the file header */
-            mybmp.bfi.bfType[0] = 'B';
-            mybmp.bfi.bfType[1] = 'M';
-            mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-            mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+        SeekBmpLines(ctx, fp);
+        for(y=0,y1=height-1;y<height;y++,y1--)
+        {
+            ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
+            if (ctx->fourplay == 1) {
+                /* reduce palette */
+                for (k=0;k<packet;k++) ctx->bmpscanline[k] = gsColor(ctx->bmpscanline[k]);
+            }
 
-            /* write the header for the M2S palette BMP */
-            fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+            for (j=0, x = 0; x < width; x++) {
+                b = ctx->bmpscanline[j]; j++;
+                g = ctx->bmpscanline[j]; j++;
+                r = ctx->bmpscanline[j]; j++;
+                idx = GetClosestColor(ctx, r,g,b);
+                for (toneindex = 0; toneindex < 16;toneindex++) {
 
-            memset(&bmpscanline[0],0,outpacket);
+                    idx = GetColorDistance(ctx, r,g,b,toneindex);
+                    if (idx != toneindex) continue;
 
-            /* write a BMP scanline for each SHR palette entry */
-            for(y=0,y1=shrpalettes-1;y<shrpalettes;y++,y1--) {
-                /* build a scanline of each palette entry */
-                for (x = 0, j=0; x < 16; x++) {
-                    if (shrpalettes == 200) {
-                        /* brooks palettes */
-                        bmpscanline[j] = rgbArrays[y1][x][2]; j++;
-                        bmpscanline[j] = rgbArrays[y1][x][1]; j++;
-                        bmpscanline[j] = rgbArrays[y1][x][0]; j++;
+                    if (ctx->rgbUsed[0][toneindex] == 0) {
+                        /* set initial value if this palette index has been used */
+                        ctx->rgbUsed[0][toneindex] = 1;
+                        ctx->rgbDistance[0][toneindex] = ctx->indexdistance;
+                        ctx->rgbArrays[0][toneindex][0] = r;
+                        ctx->rgbArrays[0][toneindex][1] = g;
+                        ctx->rgbArrays[0][toneindex][2] = b;
+                        continue;
                     }
-                    else {
-                        /* pic palettes */
-                        bmpscanline[j] = rgb256Arrays[y1][x][2]; j++;
-                        bmpscanline[j] = rgb256Arrays[y1][x][1]; j++;
-                        bmpscanline[j] = rgb256Arrays[y1][x][0]; j++;
 
+                    /* if the new color is closer to the currently selected palette color
+                       than the previously stored color, then replace the previously stored
+                       color with the new color */
+                    if (ctx->indexdistance < ctx->rgbDistance[0][toneindex]) {
+                        ctx->rgbDistance[0][toneindex] = ctx->indexdistance;
+                        ctx->rgbArrays[0][toneindex][0] = r;
+                        ctx->rgbArrays[0][toneindex][1] = g;
+                        ctx->rgbArrays[0][toneindex][2] = b;
                     }
                 }
-                /* write a scanline of each palette entry */
-                fwrite((char *)&bmpscanline[0],1,outpacket,fp);
             }
-            fclose(fp);
-            printf("%s created.\n", outfile);
-            /* now that the M2S palette file is written, the M2S proc file is exactly the same as the SHR preview file
-               except that the naming convention follows M2S naming unless in MS-DOS */
-            /* for MS-DOS output we use short names - MS-DOS users will need to rename the pmp file to a bmp file */
-
-            if (longnames == 0)sprintf(outfile,"%s.pmp", newname);
-            else sprintf(outfile,"%s_proc.bmp", newname);
         }
 
-        fp = fopen(outfile,"wb");
-        if (NULL == fp) {
-            puts(szTextTitle);
-            printf("%s cannot be created.\n", outfile);
-            return INVALID;
+        for (j=0;j<16;j++) {
+            ctx->rgbArray[j][0] = ctx->rgbArrays[0][j][0];
+            ctx->rgbArray[j][1] = ctx->rgbArrays[0][j][1];
+            ctx->rgbArray[j][2] = ctx->rgbArrays[0][j][2];
         }
 
-        /* monochrome preview is promoted to 16 color BMP format */
-        if (shrpalettes == 1) {
-            /* 16 color BMP preview */
-            outpacket = width/2;
-        }
-        else {
-            /* 256 color preview is promoted to */
-            /* 24-bit BMP format */
-            outpacket = width * 3;
-        }
+        InitDoubleArrays(ctx);
+        /* end of image tone */
 
-        if (width%2 != 0) outpacket++;
-        while (outpacket%4 != 0)outpacket++;
+    }
 
-        memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+    if (ctx->shr2 != 0) {
+        ctx->brooks = 0;
+        /* build initial palette of most used colors in each of our sixteen ranges */
 
-        /* create the info header */
-        mybmp.bmi.biSize = (ulong)40;
-        mybmp.bmi.biWidth  = (ulong)width;
-        mybmp.bmi.biHeight = (ulong)height;
-        mybmp.bmi.biPlanes = 1;
+        for (j=0;j<16;j++) {
+            ctx->rgbArrays[0][j][0] = ctx->rgbArray[j][0];
+            ctx->rgbArrays[0][j][1] = ctx->rgbArray[j][1];
+            ctx->rgbArrays[0][j][2] = ctx->rgbArray[j][2];
+            ctx->rgbUsed[0][j] = 0; /* not used yet */
+            ctx->rgbDistance[0][j] = 0.0; /* initialize */
+        }
 
-        if (shrpalettes == 1) mybmp.bmi.biBitCount = 4;
-        else mybmp.bmi.biBitCount = 24;
 
-        mybmp.bmi.biCompression = (ulong) BI_RGB;
+        SeekBmpLines(ctx, fp);
+        for(y=0,y1=height-1;y<height;y++,y1--)
+        {
+            ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
+            if (ctx->fourplay == 1) {
+                /* reduce palette */
+                for (k=0;k<packet;k++) ctx->bmpscanline[k] = gsColor(ctx->bmpscanline[k]);
+            }
 
-        mybmp.bmi.biSizeImage = (ulong)outpacket;
-        mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+            for (j=0, x = 0; x < width; x++) {
+                b = ctx->bmpscanline[j]; j++;
+                g = ctx->bmpscanline[j]; j++;
+                r = ctx->bmpscanline[j]; j++;
+                idx = GetClosestColor(ctx, r,g,b);
 
-        /* create the file header */
-        mybmp.bfi.bfType[0] = 'B';
-        mybmp.bfi.bfType[1] = 'M';
+                if (ctx->rgbUsed[0][idx] == 0) {
+                    /* set initial value if this palette index has been used */
+                    ctx->rgbUsed[0][idx] = 1;
+                    ctx->rgbDistance[0][idx] = ctx->globaldistance;
+                    ctx->rgbArrays[0][idx][0] = r;
+                    ctx->rgbArrays[0][idx][1] = g;
+                    ctx->rgbArrays[0][idx][2] = b;
+                    continue;
+                }
 
-        if (shrpalettes == 1) {
-            mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER) + sizeof(RGBQUAD) * 16;
+                /* if the new color is closer to the currently selected palette color
+                   than the previously stored color, then replace the previously stored
+                   color with the new color */
+                if (ctx->globaldistance < ctx->rgbDistance[0][idx]) {
+                    ctx->rgbDistance[0][idx] = ctx->globaldistance;
+                    ctx->rgbArrays[0][idx][0] = r;
+                    ctx->rgbArrays[0][idx][1] = g;
+                    ctx->rgbArrays[0][idx][2] = b;
+                }
+            }
         }
-        else {
-            mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+
+        for (j=0;j<16;j++) {
+
+            if (ctx->useimagetone == 0) {
+                if (ctx->rgbArray[j][0] == ctx->rgbArrays[0][j][0] &&
+                    ctx->rgbArray[j][1] == ctx->rgbArrays[0][j][1] &&
+                    ctx->rgbArray[j][2] == ctx->rgbArrays[0][j][2]) ctx->greyoveride[j] = 1;
+            }
+
+            ctx->rgbArray[j][0] = ctx->rgbArrays[0][j][0];
+            ctx->rgbArray[j][1] = ctx->rgbArrays[0][j][1];
+            ctx->rgbArray[j][2] = ctx->rgbArrays[0][j][2];
         }
 
-        mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+        InitDoubleArrays(ctx);
+        /* end of shr2 */
+    }
 
-        /* write the header for the output BMP */
-        fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    /* if we are converting to SHR we now must decide on a conversion plan */
+    /* for SHR since all input is now 24-bit we need to build some palettes */
+    if (ctx->brooks != 0) {
 
-        if (shrpalettes == 1) {
-            /* 4 bit bmp */
-            for (j=0;j<16;j++) {
-                sbmp[j].rgbRed   = rgbArray[j][0];
-                sbmp[j].rgbGreen = rgbArray[j][1];
-                sbmp[j].rgbBlue  = rgbArray[j][2];
-                sbmp[j].rgbReserved = 0;
+        if (ctx->useoriginalcolors == 0 && ctx->quietmode == 0 && ctx->mix256 == 0) {
+            puts("Initial Palette Color Values:");
+            for (i=0;i<16;i++) {
+                printf("Index %-2d: %-3d %-3d %-3d %s\n",i,ctx->rgbArray[i][0],ctx->rgbArray[i][1],ctx->rgbArray[i][2],colornames[i]);
             }
-            /* write the palette for the output bmp */
-            fwrite((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
         }
 
-        memset(&bmpscanline[0],0,outpacket);
-        for(y=0,y1=height-1;y<height;y++,y1--) {
-            /* build a packed scanline */
-            /* this is the same as for Apple IIgs SHR mode
-               providing of course we use the same palette */
-            for (x = 0, j=0; x < width; x++) {
-                idx = getlopixel(x,y1);
-                /* range check */
-                if (idx > 15)idx = 0; /* default black */
+        ctx->shrpalettes = 200;
+
+        /* set initial values for conversion palettes */
+        /* use color space of currently selected DHGR palette for color grouping of 16 colors */
+        for (i=0;i<ctx->shrpalettes;i++) {
+            for (j=0;j<16;j++) {
+                if (ctx->useoriginalcolors == 0) {
+                    ctx->rgbArrays[i][j][0] = ctx->rgbArray[j][0];
+                    ctx->rgbArrays[i][j][1] = ctx->rgbArray[j][1];
+                    ctx->rgbArrays[i][j][2] = ctx->rgbArray[j][2];
+                    ctx->rgbUsed[i][j] = 0; /* not used */
+                    ctx->rgbDistance[i][j] = 0.0; /* initialize */
 
-                if (shrpalettes != 1) {
-                    /* brooks palettes are scanline oriented */
-                    /* the 256 color palette has been copied to the brooks palette */
-                    bmpscanline[j] = rgbArrays[y1][idx][2]; j++;
-                    bmpscanline[j] = rgbArrays[y1][idx][1]; j++;
-                    bmpscanline[j] = rgbArrays[y1][idx][0]; j++;
                 }
                 else {
-                    if (x%2 == 0) {
-                        r = (uchar)idx << 4;
-                        bmpscanline[j] = r;
+                    if (ctx->usefourteencolors == 1 && j==15) {
+                        ctx->rgbArrays[i][j][0] = ctx->rgbArrays[i][j][1] = ctx->rgbArrays[i][j][2] = 255;
                     }
                     else {
-                        bmpscanline[j] = r | (uchar) idx; j++;
+                        ctx->rgbArrays[i][j][0] = ctx->rgbArrays[i][j][1] = ctx->rgbArrays[i][j][2] = 0;
                     }
                 }
             }
-            fwrite((char *)&bmpscanline[0],1,outpacket,fp);
         }
-        fclose(fp);
-        printf("%s created.\n", outfile);
-    }
 
+        if (BuildLinePalettes(ctx, fp, packet, width) != SUCCESS) {
+            fclose(fp);
+            return INVALID;
+        }
 
-return SUCCESS;
-}
+        /* fill-in actual image colors in the unused range */
+        if (ctx->useoriginalcolors == 0 && (ctx->brooks2 == 1 || ctx->brooks3 == 1)) {
+            /* go through each scanline in the image looking for palette entries that have not been set */
+            /* the theory is that colors from the original image will match more closely than the colors
+               from the currently selected DHGR palette */
 
+            /* go through these in index order */
+            for (i=0;i<16;i++) {
+                /* found = 1; */
+                for (y = 0; y < 200; y++) {
+                    /* if no image color check the other lines */
+                    if (ctx->rgbUsed[y][i] == 0) {
+                        found = 1;
+                        y1 = y2 = y;
+                        for (;;)
+                        {
+                            /* expand upwards and downwards looking for an actual image color */
+                            y1--;
+                            y2++;
+                            /* if we have expanded past the bottom and top of the image then give-up
+                               for all the scanlines because this means that this color is not in
+                               the image */
+                            if (y1 < 0 && y2 > 200) {
+                                found = 0;
+                                break;
 
-/* PIM routines start here */
+                            }
+                            /* if one of the lines above has this palette entry then use it */
+                            if (y1 > -1 && ctx->rgbUsed[y1][i] != 0) {
+                                ctx->rgbUsed[y][i] = 1;
+                                ctx->rgbArrays[y][i][0]=ctx->rgbArrays[y1][i][0];
+                                ctx->rgbArrays[y][i][1]=ctx->rgbArrays[y1][i][1];
+                                ctx->rgbArrays[y][i][2]=ctx->rgbArrays[y1][i][2];
+                                break;
+                            }
+                            /* if one of the lines below has this palette entry then use it */
+                            if (y2 < 200 && ctx->rgbUsed[y2][i] != 0) {
+                                ctx->rgbUsed[y][i] = 1;
+                                ctx->rgbArrays[y][i][0]=ctx->rgbArrays[y2][i][0];
+                                ctx->rgbArrays[y][i][1]=ctx->rgbArrays[y2][i][1];
+                                ctx->rgbArrays[y][i][2]=ctx->rgbArrays[y2][i][2];
+                                break;
+                            }
 
-/* helper function for GetPCXPalettes */
-sshort GetPIMPalette(int palnum, int numpalettes)
-{
-    FILE *fp;
-    sshort status = INVALID, idx, i;
-    ulong flen;
+                        }
+                    }
+                    if (found == 0) {
+                        if (ctx->brooks3 == 1 || ctx->brooks2 == 1) {
+                            if (ctx->useimagetone == 1) break;
+                            if (ctx->brooks3 == 1) ctx->greyoveride[i] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
 
+        if (ctx->kmeans > 0) {
+            if (RefineLinePalettes(ctx, fp, packet, width) != SUCCESS) {
+                fclose(fp);
+                return INVALID;
+            }
+        }
 
-    for (;;) {
-        /* open file - global filename is created in calling function */
-        fp = fopen(pcxfile,"rb");
-        if (fp == NULL) break;
-
-        /* get the length of the file */
-        fseek(fp, 0L, 2);
-        flen = ftell(fp) - 769;
-
-        /* avoid empty files - file must have a header and a palette */
-        if (flen < (ulong)128) {
-            fclose(fp);
-            break;
+        /* adaptive scbs start from the brooks palettes of each line */
+        if (ctx->adaptivescb == 1 && (ctx->shr256 == 1 || ctx->mix256 == 1)) {
+            memcpy(&linepalettes[0][0][0],&ctx->rgbArrays[0][0][0],9600);
+            usescb = 1;
         }
 
-        /* read the PCX header for compatibility */
-        rewind(fp);
-        fread(pcxheader,66,1,fp);
+        if (ctx->shr256 == 1) {
 
-        /* PCX version 5 with 8-bits per pixel, run-length encoded with one color plane */
-        /* PCX version 5 with 1-bit  per pixel, run-length encoded with one color plane */
-        if (pcxheader[0] != (char)10 || pcxheader[1] != (char)5) {
-            /* if (pcxheader[0] != (char)10 || pcxheader[1] != (char)5 || pcxheader[2] != (char)1 || pcxheader[65] != (char)1) { */
-            fclose(fp);
-            puts("pcx file header problem");
-            break;
-        }
+            ctx->shrpalettes = 16;
+            ctx->mix256 = 0;
 
-        /* seek to end of file and read the first sixteen palette entries */
-        fseek(fp,flen,SEEK_SET);
-        /* first check the palette header (it must be a formfeed character) */
-        fread(pcxheader, 1, 1, fp);
-        if (pcxheader[0] != (char) 12) {
-            puts("pcx palette header problem");
-            fclose(fp);
-            break;
-        }
+            for (i=0;i<ctx->shrpalettes;i++) {
+                for (j=0;j<16;j++) {
+                    ctx->rgb256Arrays[i][j][0] = ctx->rgbArray[j][0];
+                    ctx->rgb256Arrays[i][j][1] = ctx->rgbArray[j][1];
+                    ctx->rgb256Arrays[i][j][2] = ctx->rgbArray[j][2];
+                    ctx->rgbUsed[i][j] = 0; /* not used */
+                    ctx->rgbDistance[i][j] = 0.0; /* initialize */
+                }
+            }
 
-        /* if PIM palette debugging is turned-on and 24-bit colors create duplicate 12-bit colors
-           then print the details to the console */
-        if (shrdupedebug == 1) clearcolorsused(); /* clear dupe count */
 
-        /* read the palette */
-        idx = (numpalettes - 1) - palnum;
-        if (numpalettes == 200) {
-            fread(&rgbArrays[idx][0][0],48,1,fp);
-            if (shrdupedebug == 1) {
-            	for (i = 0; i < 16; i++) shrcolorsused(rgbArrays[idx][i][0],rgbArrays[idx][i][1],rgbArrays[idx][i][2]);
-			}
-        }
-        else {
-            fread(&rgb256Arrays[idx][0][0],48,1,fp);
-            if (shrdupedebug == 1) {
-            	for (i = 0; i < 16; i++) shrcolorsused(rgb256Arrays[idx][i][0],rgb256Arrays[idx][i][1],rgb256Arrays[idx][i][2]);
-			}
-        }
-        fclose(fp);
-        status = SUCCESS;
-        if (shrdupedebug == 1 && shrdupes == 1) {
-			printf("24-bit palette %s has %d duplicate 12-bit color(s).\n",pcxfile,shrdupecount);
-		}
-        break;
-    }
+            /* first pass */
+            for (i = 0, y = 0; i < 8; i++, y+=25) {
+                y1 = y;
+                y2 = y + 13;
+                j = i * 2;
+                /* temporary - hard-coded palette assignment */
+                /* temporary ends */
 
-    return status;
+                /* palette for 13 lines */
+                for (x = y1; x < y2; x++) {
+                    for (idx = 0; idx < 16; idx++) {
+                        r = ctx->rgbArrays[x][idx][0];
+                        g = ctx->rgbArrays[x][idx][1];
+                        b = ctx->rgbArrays[x][idx][2];
 
+                        drawcolor  = GetClosestColor(ctx, r,g,b);
 
-}
+                        if (ctx->rgbUsed[j][drawcolor] == 0) {
+                            /* set initial value if this palette index has been used */
+                            ctx->rgbUsed[j][drawcolor] = 1;
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                            continue;
+                        }
 
-/* iterates through SHR segments in PCX format produced by ImageMagick Convert */
-/* each segment has a 16 color palette that is used for SHR conversion. The PCX Image data is ignored */
-/* this is just a simple way to use the ImageMagick Convert utility to provide a palette in a format that is easy for
-   me to read and use in this converter */
+                        /* if the new color is closer to the currently selected palette color
+                           than the previously stored color, then replace the previously stored
+                           color with the new color */
+                        if (ctx->globaldistance < ctx->rgbDistance[j][drawcolor]) {
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                        }
+                    }
+                }
 
-/* seedfile is the full pathname of one of the pcx images */
-sshort GetPIMPalettes(char *seedfile)
-{
-    FILE *fp;
-    sshort status = INVALID;
-    char seedbase[256], ext[10];
-    int i, j;
+                for (idx = 0; idx < 16; idx++) {
+                    /* put new palette back in old palette */
+                    ctx->rgbArrays[y1][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                    ctx->rgbArrays[y1][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                    ctx->rgbArrays[y1][idx][2] = ctx->rgb256Arrays[j][idx][2];
+                }
+
+                /* palette for 12 lines */
+                y1 = y + 13;
+                y2 = y + 25;
+                j = (i*2) + 1;
 
-    imnumpalettes = 0;
+                for (x = y1; x < y2; x++) {
+                    for (idx = 0; idx < 16; idx++) {
+                        r = ctx->rgbArrays[x][idx][0];
+                        g = ctx->rgbArrays[x][idx][1];
+                        b = ctx->rgbArrays[x][idx][2];
 
-    strcpy(seedbase,seedfile);
+                        drawcolor  = GetClosestColor(ctx, r,g,b);
 
-    j=999;
-    for (i=0;seedbase[i]!=(char)0;i++) {
-       /* support both forward and back slash for compatibility */
-       if (seedbase[i] == (char)92 || seedbase[i] == (char)47) j = i+1;
-    }
-    if (j==999) {
-        printf("%s is an invalid IM seed file name!\n",seedfile);
-        return status;
-    }
-    seedbase[j] = 0;
+                        if (ctx->rgbUsed[j][drawcolor] == 0) {
+                            /* set initial value if this palette index has been used */
+                            ctx->rgbUsed[j][drawcolor] = 1;
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                            continue;
+                        }
 
+                        /* if the new color is closer to the currently selected palette color
+                           than the previously stored color, then replace the previously stored
+                           color with the new color */
+                        if (ctx->globaldistance < ctx->rgbDistance[j][drawcolor]) {
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                        }
+                    }
+                }
 
-    /* test for brooks mode first */
-    strcpy(pcxfile,seedbase);
-    strcat(pcxfile,"199.pcx");
-    fp = fopen(pcxfile,"rb");
-    if (NULL == fp) {
-        /* if brooks test failed, test for multipalette */
-        strcpy(pcxfile,seedbase);
-        strcat(pcxfile,"15.pcx");
-        fp = fopen(pcxfile,"rb");
-        if (NULL == fp) {
-            /* if multipalette test failed check for 8-palette  */
-            strcpy(pcxfile,seedbase);
-            strcat(pcxfile,"7.pcx");
-            fp = fopen(pcxfile,"rb");
-            if (NULL == fp) {
-                strcpy(pcxfile,seedbase);
-                strcat(pcxfile,"0.pcx");
-                fp = fopen(pcxfile,"rb");
-                if (NULL == fp) {
-                    printf("%s is an invalid IM seed file!\n",seedfile);
-                    return status;
+                for (idx = 0; idx < 16; idx++) {
+                    /* put new palette back in old palette */
+                    ctx->rgbArrays[y1][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                    ctx->rgbArrays[y1][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                    ctx->rgbArrays[y1][idx][2] = ctx->rgb256Arrays[j][idx][2];
                 }
-                imnumpalettes = 1;
+
             }
-            else {
-                imnumpalettes = 8;
+
+
+            /* second pass */
+            for (i = 0, y = 0; i < 8; i++, y+=25) {
+                y1 = y;
+                y2 = y + 13;
+                j = i * 2;
+                /* temporary - hard-coded palette assignment */
+                for (idx = 0; idx < 16; idx++) {
+                    /* palettes from 25 scanlines */
+                    /* every 1st of 13 palettes */
+                    ctx->rgb256Arrays[j][idx][0] = ctx->rgbArrays[y1][idx][0];
+                    ctx->rgb256Arrays[j][idx][1] = ctx->rgbArrays[y1][idx][1];
+                    ctx->rgb256Arrays[j][idx][2] = ctx->rgbArrays[y1][idx][2];
+                    /* every 1st of 12 palettes */
+                    ctx->rgb256Arrays[j+1][idx][0] = ctx->rgbArrays[y2][idx][0];
+                    ctx->rgb256Arrays[j+1][idx][1] = ctx->rgbArrays[y2][idx][1];
+                    ctx->rgb256Arrays[j+1][idx][2] = ctx->rgbArrays[y2][idx][2];
+                }
+                /* temporary ends */
+                /* palette for 13 lines */
+                for (x = y1; x < y2; x++) {
+                    ctx->mypic.scb[x] = j;
+                    for (idx = 0; idx < 16; idx++) {
+                        ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                        ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                        ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[j][idx][2];
+                    }
+                }
+                /* palettte for 12 lines */
+                y1 = y + 13;
+                y2 = y + 25;
+                j = (i*2) + 1;
+                for (x = y1; x < y2; x++) {
+                    ctx->mypic.scb[x] = j;
+                    for (idx = 0; idx < 16; idx++) {
+                        ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                        ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                        ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[j][idx][2];
+                    }
+                }
             }
-            /* black-out the palettes if less than 16 are active */
-            memset(&rgb256Arrays[8][0][0],0,768);
-        }
-        else {
-            imnumpalettes = 16;
-        }
-    }
-    else {
-        imnumpalettes = 200;
-    }
-    fclose(fp);
-    if (quietmode == 0) shrdupedebug = 1;
+        } /* shr256 ends */
+        else if (ctx->mix256 == 1) {
 
-    /* all the pcx files must be present and accounted for */
-    for (i = 0; i < imnumpalettes; i++) {
-        strcpy(pcxfile,seedbase);
-        sprintf(ext,"%d.pcx",i);
-        strcat(pcxfile,ext);
-        status = GetPIMPalette(i,imnumpalettes);
-        if (status == INVALID) {
-            imnumpalettes = 0;
-            printf("Unable to open IM palette %s!\n",pcxfile);
-            return status;
-        }
-    }
-    printf("%d IM Palettes successfully loaded!\n",imnumpalettes);
+            if (ctx->quietmode == 0) puts("mixing colors");
 
-    return SUCCESS;
-}
+            /* if we are also adding zone palettes to the mix then we build these here */
+            /* this just gives us some additional palettes to work with */
+            /* I have no clear thoughts on whether this will work better or worse */
+            for (i=0;i<16;i++) {
+                /* just initialize with the current palette values */
+                for (j=0;j<16;j++) {
+                    ctx->rgb256Arrays[i][j][0] = ctx->rgbArray[j][0];
+                    ctx->rgb256Arrays[i][j][1] = ctx->rgbArray[j][1];
+                    ctx->rgb256Arrays[i][j][2] = ctx->rgbArray[j][2];
+                    ctx->rgbUsed[i][j] = 0; /* not used */
+                    ctx->rgbDistance[i][j] = 0.0; /* initialize */
+                }
+            }
 
 
-/* convert 256 color bmps to 24 bit bmps */
-/* convert 24 bit bmps */
-FILE *ReformatPIMBMP(FILE *fp)
-{
+            /* only one pass is used - we don't use scbs for brooks */
+            /* and we also need to keep the brooks palette intact */
+            /* like the initial 16 - paletttes used by plain old SHR just divides the image into
+               sections and builds composite palettes that more closely match our initial palettes */
+            for (i = 0, y = 0; i < 8; i++, y+=25) {
+                y1 = y;
+                y2 = y + 13;
+                j = i * 2;
 
-    FILE *fp2;
-    ushort packet,outpacket,y,x,x1;
-    sshort count = 0;
+                /* palette for 13 lines */
+                for (x = y1; x < y2; x++) {
+                    for (idx = 0; idx < 16; idx++) {
+                        r = ctx->rgbArrays[x][idx][0];
+                        g = ctx->rgbArrays[x][idx][1];
+                        b = ctx->rgbArrays[x][idx][2];
 
+                        drawcolor  = GetClosestColor(ctx, r,g,b);
 
-    /* seek past extraneous info in header if any */
-    fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
+                        if (ctx->rgbUsed[j][drawcolor] == 0) {
+                            /* set initial value if this palette index has been used */
+                            ctx->rgbUsed[j][drawcolor] = 1;
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                            continue;
+                        }
 
-    if (bmi.biBitCount == 8) {
-        packet = bmi.biWidth;
-    }
-    else {
-        packet = bmi.biWidth * 3;
-    }
-    while ((packet % 4)!=0)packet++;
+                        /* if the new color is closer to the currently selected palette color
+                           than the previously stored color, then replace the previously stored
+                           color with the new color */
+                        if (ctx->globaldistance < ctx->rgbDistance[j][drawcolor]) {
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                        }
+                    }
+                }
 
 
-    if((fp2=fopen("Reformat.bmp","wb"))==NULL) {
-        printf("Error Opening %s for writing!\n","Reformat.bmp");
-        fclose(fp);
-        return fp;
-    }
+                /* palettte for 12 lines */
+                y1 = y + 13;
+                y2 = y + 25;
+                j = (i*2) + 1;
 
-    outpacket = WriteDIBHeader(fp2,(ushort)bmi.biWidth,(ushort)bmi.biHeight);
+                for (x = y1; x < y2; x++) {
+                    for (idx = 0; idx < 16; idx++) {
+                        r = ctx->rgbArrays[x][idx][0];
+                        g = ctx->rgbArrays[x][idx][1];
+                        b = ctx->rgbArrays[x][idx][2];
 
-    if (outpacket < 1) {
-        fclose(fp2);
-        remove("Reformat.bmp");
-        printf("Error writing header to %s!\n","Reformat.bmp");
-        return fp;
-    }
+                        drawcolor  = GetClosestColor(ctx, r,g,b);
 
-    for (y=0;y<bmi.biHeight;y++) {
-        fread((char *)&bmpscanline[0],1,packet,fp);
-        if (bmi.biBitCount == 8) {
-            ReformatVGALine();
-        }
-        if (fourbit == 1) {
-            for (x=0;x<outpacket;x++) bmpscanline[x] = gsColor(bmpscanline[x]);
-        }
-        fwrite((char *)&bmpscanline[0],1,outpacket,fp2);
-    }
-    fclose(fp2);
-    fclose(fp);
+                        if (ctx->rgbUsed[j][drawcolor] == 0) {
+                            /* set initial value if this palette index has been used */
+                            ctx->rgbUsed[j][drawcolor] = 1;
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                            continue;
+                        }
 
-    if((fp=fopen("Reformat.bmp","rb"))==NULL) {
-        printf("Error Opening %s for reading!\n","Reformat.bmp");
-        return fp;
-    }
-    /* read the header stuff into the appropriate structures */
-    fread((char *)&BitMapFileHeader.bfType[0],
-                 sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+                        /* if the new color is closer to the currently selected palette color
+                           than the previously stored color, then replace the previously stored
+                           color with the new color */
+                        if (ctx->globaldistance < ctx->rgbDistance[j][drawcolor]) {
+                            ctx->rgbDistance[j][drawcolor] = ctx->globaldistance;
+                            ctx->rgb256Arrays[j][drawcolor][0] = r;
+                            ctx->rgb256Arrays[j][drawcolor][1] = g;
+                            ctx->rgb256Arrays[j][drawcolor][2] = b;
+                        }
+                    }
+                }
 
-    return fp;
-}
+            }
 
+        } /* mix256 ends */
 
-/* uses ImageMagick to build the palettes */
-/* todo - for raw output add functionality to use the image data from the palette pcx files */
-/* also clean-up unused vars at some point */
-int ConvertPIM(unsigned char *basename, unsigned char *newname)
-{
+        if (usescb == 1) {
+            if (AdaptiveBrooksSCB(ctx, fp, packet, width, &linepalettes[0][0][0]) != SUCCESS) {
+                fclose(fp);
+                return INVALID;
+            }
+        }
 
-    FILE *fp;
-    int packet = INVALID, y,y1,y2,x,i,j,width,height,reformat = bmp3, bmpversion =0,lidx,didx,count;
-    int outpacket, outputwidth, outputheight, offset;
-    char bmpfile[256], outfile[256];
-    uchar r,g,b,lr,lg,lb,red,green,blue,drawcolor,idx,toneindex;
-    ushort temp, fl, darkest,lightest,found,unused;
-    float hue,saturation,luminance;
-    sshort jdx;
+    }
 
-    sprintf(bmpfile,"%s.bmp",basename);
+    memset(&ctx->dhrbuf[0],0,32000); /* clear write buffer */
 
-    if((fp=fopen(bmpfile,"rb"))==NULL) {
-        puts(szTextTitle);
-        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n");
-        return INVALID;
+    if (ctx->dither != 0) {
+        /* sizeof(sshort) * 640 */
+        memset(&ctx->redDither[0],0,1280);
+        memset(&ctx->greenDither[0],0,1280);
+        memset(&ctx->blueDither[0],0,1280);
+        memset(&ctx->redSeed[0],0,1280);
+        memset(&ctx->greenSeed[0],0,1280);
+        memset(&ctx->blueSeed[0],0,1280);
+        memset(&ctx->redSeed2[0],0,1280);
+        memset(&ctx->greenSeed2[0],0,1280);
+        memset(&ctx->blueSeed2[0],0,1280);
+    }
+    else {
+        ctx->usepalettedistance = 0;
+        /* 16 color and 256 color bmps with a single palette map each palette entry once */
+        if (ctx->mono == 0 && ctx->shrpalettes < 2) {
+            if (InitIndexRemap(ctx) == SUCCESS) indexed = 1;
+        }
     }
 
-    /* read the header stuff into the appropriate structures,
-       it's likely a bmp file */
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+    StatsNext(ctx->stats,STATS_PALETTE,STATS_DITHER);
+    /* seek to beginning of input file and process */
+    SeekBmpLines(ctx, fp);
 
-    fread((char *)&BitMapFileHeader.bfType,
-                 sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
-
-    if (bmi.biSize != sizeof(BITMAPINFOHEADER)) {
-		if (bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,(unsigned)bmi.biSize,1,fp);
-            bmpversion = 3;
-            reformat = 1;
-		}
-		else if (bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
-            bmpversion = 4;
-            reformat = 1;
-
-        }
-        else if (bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
-            bmpversion = 5;
-            reformat = 1;
-            /*
-            Profile data refers to either the profile file name (linked profile)
-            or the actual profile bits (embedded profile).
-            The file format places the profile data at the end of the file.
-            The profile data is placed just after the color table (if present).
-            */
-        }
-        else {
-            bmpversion = 0;
-        }
-
-    }
-    else {
-        bmpversion = 3;
-    }
-
-    if (bmpversion == 0) {
-        fclose(fp);
-        puts(szTextTitle);
-        puts("BMP version not recognized!");
-        return INVALID;
-    }
-
-    if (bmi.biCompression==BI_RGB &&
-        BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && (bmi.biBitCount == 24 || bmi.biBitCount == 8)) {
-
-        if (bmi.biWidth != 320 || bmi.biHeight != 200) {
-            fclose(fp);
-            puts(szTextTitle);
-            printf("%s is not in a supported size for SHR file output.\nExiting!\n", bmpfile);
-            return INVALID;
-        }
-
-            outputheight = height = (int) bmi.biHeight;
-            outputwidth = width = (int) bmi.biWidth;
-
-            if (outputheight%2 != 0) outputheight++;
-            outputheight = outputheight/2;
-
-            outpacket = outputwidth;
-
-            packet = width * 3;
-            while (packet%4 != 0)packet++; /* BMP scanlines align on DWORD boundaries */
-    }
-
-    if (packet == INVALID) {
-        fclose(fp);
-        puts(szTextTitle);
-        printf("%s is not in a supported format for SHR or BROOKS file output.\nExiting!\n", bmpfile);
-        if (bmi.biCompression==BI_RGB) puts("compression ok");
-        return INVALID;
-    }
-
-    if (bmi.biBitCount == 8) {
-       fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
-       reformat = 1;
-    }
-
-    if (reformat == 1) {
-       fp = ReformatPIMBMP(fp);
-       if (NULL == fp) return SUCCESS;
-    }
-
-    if (imnumpalettes != 200) shrpalettes = 16;
-    else shrpalettes = 200;
-    shr = 320;
-
-    /* errorsum = 1; error summing is not forced but maybe it should be */
-
-    /* initialize nearest color arrays */
-    /* todo - probably not needed because setting nearest color arrays on a line by line basis */
-    InitDoubleArrays();
-
-    if (imnumpalettes == 16) {
-
-        /* populate 200 palettes from 16-palettes */
-        /* and set initial scbs */
-        /* this allows most of the same line oriented routines to be re-used for either
-           16-palette or 200-palette processing */
-        shr256 = 1;
-        for (i = 0, y = 0; i < 8; i++, y+=25) {
-            y1 = y;
-            y2 = y + 13;
-            j = i * 2;
-            /* palette for 13 lines */
-            for (x = y1; x < y2; x++) {
-                mypic.scb[x] = j;
-                for (idx = 0; idx < 16; idx++) {
-                    rgbArrays[x][idx][0] = rgb256Arrays[j][idx][0];
-                    rgbArrays[x][idx][1] = rgb256Arrays[j][idx][1];
-                    rgbArrays[x][idx][2] = rgb256Arrays[j][idx][2];
-                }
-            }
-            /* palettte for 12 lines */
-            y1 = y + 13;
-            y2 = y + 25;
-            j = (i*2) + 1;
-            for (x = y1; x < y2; x++) {
-                mypic.scb[x] = j;
-                for (idx = 0; idx < 16; idx++) {
-                    rgbArrays[x][idx][0] = rgb256Arrays[j][idx][0];
-                    rgbArrays[x][idx][1] = rgb256Arrays[j][idx][1];
-                    rgbArrays[x][idx][2] = rgb256Arrays[j][idx][2];
-                }
-            }
-        }
-    }
-    else if (imnumpalettes == 8) {
-        /* populate 200 palettes from 8-palettes */
-        /* and set initial scbs */
-        /* this allows most of the same line oriented routines to be re-used for either
-           8-palette, 16-palette or 200-palette processing */
-        shr256 = 1;
-        for (i = 0, y = 0; i < 8; i++, y+=25) {
-            y1 = y;
-            y2 = y + 13;
-            /* palette for 13 lines */
-            for (x = y1; x < y2; x++) {
-                mypic.scb[x] = i;
-                for (idx = 0; idx < 16; idx++) {
-                    rgbArrays[x][idx][0] = rgb256Arrays[i][idx][0];
-                    rgbArrays[x][idx][1] = rgb256Arrays[i][idx][1];
-                    rgbArrays[x][idx][2] = rgb256Arrays[i][idx][2];
-                }
-            }
-            /* same palettte for 12 lines */
-            y1 = y + 13;
-            y2 = y + 25;
-            for (x = y1; x < y2; x++) {
-                mypic.scb[x] = i;
-                for (idx = 0; idx < 16; idx++) {
-                    rgbArrays[x][idx][0] = rgb256Arrays[i][idx][0];
-                    rgbArrays[x][idx][1] = rgb256Arrays[i][idx][1];
-                    rgbArrays[x][idx][2] = rgb256Arrays[i][idx][2];
-                }
-            }
-        }
-    }
-    else if (imnumpalettes == 1) {
-        for (x=0;x<200;x++) {
-            shr256 = 1;
-            mypic.scb[x] = 0;
-            for (idx = 0; idx < 16; idx++) {
-                rgbArrays[x][idx][0] = rgb256Arrays[0][idx][0];
-                rgbArrays[x][idx][1] = rgb256Arrays[0][idx][1];
-                rgbArrays[x][idx][2] = rgb256Arrays[0][idx][2];
-            }
-        }
-    }
-    else {
-        shr256 = 0;
-    }
-    /* shr256 ends */
-
-
-    memset(&dhrbuf[0],0,32000); /* clear write buffer */
-
-    if (dither != 0) {
-        usepalettedistance = 1;
-        /* sizeof(sshort) * 640 */
-        memset(&redDither[0],0,1280);
-        memset(&greenDither[0],0,1280);
-        memset(&blueDither[0],0,1280);
-        memset(&redSeed[0],0,1280);
-        memset(&greenSeed[0],0,1280);
-        memset(&blueSeed[0],0,1280);
-        memset(&redSeed2[0],0,1280);
-        memset(&greenSeed2[0],0,1280);
-        memset(&blueSeed2[0],0,1280);
-    }
-    else {
-        usepalettedistance = 0;
-    }
-
-    /* seek to beginning of input file and process */
-    fseek(fp,BitMapFileHeader.bfOffBits,SEEK_SET);
-
-    if (dither == 0) puts("non-dithered output");
+    if (ctx->dither == 0) puts("non-dithered output");
     else puts("dithered output");
 
     /* bmp's are upside-down so conversion of scanlines is in
        reverse order */
     for(y=0,y1=height-1;y<height;y++,y1--)
     {
-          fread((char *)&bmpscanline[0],1,packet,fp);
-
-          /* set the palette for this line */
-          /* todo - probably not needed for dithered output */
-          InitDoubleLineArrays(y1);
-
-          if (dither == 0) {
-            /* if not dithering use direct pixel mapping */
-            for (x=0,j=0;x<width;x++) {
+          ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
 
-                b = bmpscanline[j]; j++;
-                g = bmpscanline[j]; j++;
-                r = bmpscanline[j]; j++;
+          if (indexed == 1 && NULL != (indexline = ReadIndexLine(ctx))) {
+            /* palette indices go straight to the output */
+            for (x=0;x<width;x++) setlopixel(ctx, ctx->indexremap[indexline[x]],x,y1);
+            StatsCount(ctx->stats,STATS_TABLE,(long)width);
+            continue;
+          }
 
-                idx = GetClosestColor(r,g,b);
-                setlopixel((uchar)idx,x,y1);
+          if (ctx->mono == 1) {
+            /* work from a greyscale if mono - LGR and DLGR have no mono */
+            /* SHR can have either mono or 16 levels of grey  in dithered or non-dithered output */
+            for (x = 0,j=0;x<width;x++,j+=3) {
+                if (ctx->hsl == 1) {
+                    /* achromatic greyscale */
+                    /* de-saturate using the hsl color model */
+                    rgb2hsl(ctx->bmpscanline[j+2],ctx->bmpscanline[j+1],ctx->bmpscanline[j],&hue,&saturation,&luminance);
+                    ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] =(uchar)(float)(luminance * 255);
+                }
+                else {
+                    /* average RGB greyscale */
+                    temp = (ushort)ctx->bmpscanline[j];
+                    temp += ctx->bmpscanline[j+1];
+                    temp += ctx->bmpscanline[j+2];
+                    while ((temp % 3)!=0) temp++;
+                    ctx->bmpscanline[j] = ctx->bmpscanline[j+1] = ctx->bmpscanline[j+2] = (uchar) (temp/3);
+                }
             }
           }
+          else if (ctx->shrpalettes > 1) {
+             /* if doing brooks or 256 colors set the palette for this line */
+             InitDoubleLineArrays(ctx, y1);
+          }
+
+          if (ctx->dither == 0) {
+            /* if not dithering use direct pixel mapping */
+            GetClosestColorRow(ctx, ctx->bmpscanline, ctx->lineindex, width);
+            for (x=0;x<width;x++) setlopixel(ctx, ctx->lineindex[x],x,y1);
+          }
           else
           {
               /* add the current line to the r,g,b line buffers used for dithering */
               for (j=0, x = 0; x < width; x++) {
-                    b = bmpscanline[j]; j++;
-                    g = bmpscanline[j]; j++;
-                    r = bmpscanline[j]; j++;
+                    b = ctx->bmpscanline[j]; j++;
+                    g = ctx->bmpscanline[j]; j++;
+                    r = ctx->bmpscanline[j]; j++;
 
                     /* values are already seeded from previous 2 - line(s) */
                     /* the idea here is to add a full value to whatever bleed values have been added */
-                    AdjustShortPixel(1,(sshort *)&redDither[x],(sshort)r);
-                    AdjustShortPixel(1,(sshort *)&greenDither[x],(sshort)g);
-                    AdjustShortPixel(1,(sshort *)&blueDither[x],(sshort)b);
+                    AdjustShortPixel(1,(sshort *)&ctx->redDither[x],(sshort)r);
+                    AdjustShortPixel(1,(sshort *)&ctx->greenDither[x],(sshort)g);
+                    AdjustShortPixel(1,(sshort *)&ctx->blueDither[x],(sshort)b);
               }
 
-
-              if (shrpalettes == 200) BrooksDither(y1,width);
-              else PicDither(y1,width);
+              if (ctx->usepalettedistance == 1 && ctx->shrpalettes > 1) {
+                  if (ctx->shrpalettes == 200) {
+                    if (ctx->mix256 == 1) BrooksPicDither(ctx, y1,width);
+                    else BrooksDither(ctx, y1,width);
+                  }
+                  else {
+                    PicDither(ctx, y1,width);
+                  }
+              }
+              else {
+                /* dithering - "pixels" is just a "placeholder" */
+                BuckelsDither(ctx, y1,width,1);
+              }
 
                /* seed next line - promote nearest forward array to
                   current line */
-               memcpy(&redDither[0],&redSeed[0],1280);
-               memcpy(&greenDither[0],&greenSeed[0],1280);
-               memcpy(&blueDither[0],&blueSeed[0],1280);
+               memcpy(&ctx->redDither[0],&ctx->redSeed[0],1280);
+               memcpy(&ctx->greenDither[0],&ctx->greenSeed[0],1280);
+               memcpy(&ctx->blueDither[0],&ctx->blueSeed[0],1280);
 
                /* seed first seed - promote furthest forward array
                   to nearest forward array */
-               memcpy(&redSeed[0],&redSeed2[0],1280);
-               memcpy(&greenSeed[0],&greenSeed2[0],1280);
-               memcpy(&blueSeed[0],&blueSeed2[0],1280);
+               memcpy(&ctx->redSeed[0],&ctx->redSeed2[0],1280);
+               memcpy(&ctx->greenSeed[0],&ctx->greenSeed2[0],1280);
+               memcpy(&ctx->blueSeed[0],&ctx->blueSeed2[0],1280);
 
                /* clear last seed - furthest forward array */
-               memset(&redSeed2[0],0,1280);
-               memset(&greenSeed2[0],0,1280);
-               memset(&blueSeed2[0],0,1280);
+               memset(&ctx->redSeed2[0],0,1280);
+               memset(&ctx->greenSeed2[0],0,1280);
+               memset(&ctx->blueSeed2[0],0,1280);
          }
 
     }
     fclose(fp);
+    StatsNext(ctx->stats,STATS_DITHER,STATS_WRITE);
 
-    if (reformat == 1) {
-		if (bmp3 == 0) {
-			remove("Reformat.bmp");
-		}
-		else {
-			sprintf(outfile,"%s.bm3", newname);
-			remove(outfile);
-			rename("Reformat.bmp",outfile);
-		}
-	}
+    /* optionally keep the 24-bit version of the input file */
+    if (reformat == 1 && ctx->bmp3 == 1) {
+        sprintf(outfile,"%s.bm3", newname);
+        WriteReformatBMP(ctx, outfile);
+    }
+    FreeReformatBuffer(ctx);
 
-    if (usepalettedistance == 1) {
-        /* if we shuffled the palettes based on the best total distance then we need
-           to put our new palettes in place before writing our output file(s) */
-        for (y= 0;y<200;y++) {
-            memcpy(&rgbArrays[y][0][0],&savepalettes[y][0][0],48);
+    if (ctx->shr == 0) {
+        /* create output files */
+        /* stay with old full-screen naming convention for these */
+        if (ctx->doublelores == 1) {
+            if (outputwidth == 80 && outputheight == 20) sprintf(outfile,"%s.DTO", newname);
+            else if (outputwidth == 80 && outputheight == 24) sprintf(outfile,"%s.DLO", newname);
+            else sprintf(outfile,"%s.DLR", newname);
+        }
+        else {
+            if (outputwidth == 40 && outputheight == 20) sprintf(outfile,"%s.STO", newname);
+            else if (outputwidth == 40 && outputheight == 24) sprintf(outfile,"%s.SLO", newname);
+            else sprintf(outfile,"%s.SLR", newname);
         }
-        memcpy(&mypic.scb[0],&savescb[0],200);
-    }
 
+        ucase(ctx,(char *)&outfile[0]);
 
-    if (shr256 == 1) {
-        /* for SHR motion video prototyping */
-        /* uses only 8 palettes to facilitate slide transition */
+        if (ctx->longnames == 0) ctx->tags = 0;
 
-        if (imnumpalettes == 1) sprintf(outfile,"%s.SHR", newname);
-        else if (imnumpalettes == 8) sprintf(outfile,"%s.SMV", newname);
-        else sprintf(outfile,"%s.SH2", newname);
-    }
-    else {
-        sprintf(outfile,"%s.SH3", newname);
-    }
-    ucase((char *)&outfile[0]);
-    if (longnames == 0) tags = 0;
+        if (ctx->tags == 1) {
+            strcat(outfile,"#060400");
+            ctx->dosheader = 0;
+        }
+
+        StatsOutput(ctx->stats,outfile);
+        fp = fopen(outfile,"wb");
+        if (NULL == fp) {
+            puts(szTextTitle);
+            printf("%s cannot be created.\n", outfile);
+            return INVALID;
+        }
+
+        if (ctx->dosheader == 1) {
+            fl = (ushort) outputwidth;
+            fl *= outputheight;
+            if (outputwidth < 256) fl += 2;
+            else fl += 7;
+            WriteDosHeader(fp,fl,1024);
+        }
+
+
+        /* for most files a 2 byte header is all that is needed */
+        /* these are exactly the same format as SLO,STO and DLO,DTO */
+        if (outputwidth < 256) {
+            fputc((uchar)outputwidth,fp);    /* width in bytes */
+            fputc((uchar)outputheight,fp);   /* height in scanlines */
+        }
+        else {
+            /* for files wider than 255 bytes */
+            /* 7 byte header */
+            /* 3 - bytes - some kind of identifier */
+            if (ctx->doublelores == 1) fputc('D',fp);
+            else fputc('S',fp);
+            fputc('L',fp);
+            fputc('R',fp);
+            WriteDosHeader(fp,(ushort)outputwidth,(ushort)outputheight);
+        }
+
+        /* raster oriented top-down */
+        for (y = 0; y < outputheight;y++) {
+          offset = y * 320;
+          fwrite(&ctx->dhrbuf[offset],1,outpacket,fp);
+          if (ctx->doublelores == 1) fwrite(&ctx->dhrbuf[offset+160],1,outpacket,fp);
+        }
+        fclose(fp);
+        printf("%s created.\n", outfile);
 
-    /* Ciderpress File Attribute Preservation Tags */
-    if (tags == 1){
-        if (shr256 == 1) strcat(outfile,"#C10000");
-        else strcat(outfile,"#C10002");
     }
+    else if (ctx->shr == 320) {
+
+        if (ctx->usepalettedistance == 1 && ctx->shrpalettes > 1) {
+            /* if we shuffled the palettes based on the best total distance then we need
+               to put our new palettes in place before writing our output file(s) */
+            for (y= 0;y<200;y++) {
+                memcpy(&ctx->rgbArrays[y][0][0],&ctx->savepalettes[y][0][0],48);
+            }
+            memcpy(&ctx->mypic.scb[0],&ctx->savescb[0],200);
+        }
+
+
+        /* SHR output file naming convention for the occasion */
+        /* using different extensions to tell them apart */
+        if (ctx->mono == 1) {
+            if (ctx->shrgrey == 1) sprintf(outfile,"%s.SHG", newname);
+            else sprintf(outfile,"%s.SHM", newname);
+        }
+        else {
+            if (ctx->brooks == 0) sprintf(outfile,"%s.SHR", newname);
+            else {
+                if (ctx->shr256 == 1) sprintf(outfile,"%s.SH2", newname);
+                else sprintf(outfile,"%s.SH3", newname);
+            }
+        }
+        ucase(ctx,(char *)&outfile[0]);
+        if (ctx->longnames == 0) ctx->tags = 0;
+
+        /* Ciderpress File Attribute Preservation Tags */
+        if (ctx->tags == 1){
+            if (ctx->brooks == 0) strcat(outfile,"#C10000");
+            else {
+                if (ctx->shr256 == 1) strcat(outfile,"#C10000");
+                else strcat(outfile,"#C10002");
+            }
+        }
+        SHRPackedName(ctx, outfile, newname);
+
+        if (SHR320_Output(ctx, outfile) != SUCCESS) {
+            printf("%s cannot be created.\n", outfile);
+            return INVALID;
+        }
+        printf("%s created.\n", outfile);
+    }
+
+
+    /* vbmp output is not available for LGR, DLGR, or SHR output because
+       vbmp works only with DHGR color and monochrome and HGR monochrome.
+       but I just use the same "option V" for preview output or M2S output here */
+    if (ctx->vbmp == 1) {
+
+        /* Magick2SHR palette output and Magick2SHR naming convention for round-trip editing */
+        /* this applies only to 16 palette and brooks output */
+        /* single palette files are output as 16-color BMPs and can be edited and reprocessed without using M2S */
+        if (ctx->m2s == 1 && ctx->shrpalettes < 2) ctx->m2s = 0;
+
+        if (ctx->m2s == 0) {
+            /* for MS-DOS output we use short (and different) names */
+            if (ctx->longnames == 0)sprintf(outfile,"%s.pmp", newname);
+            else sprintf(outfile,"%s_Preview.bmp", newname);
+        }
+        else {
+            if (ctx->longnames == 0)sprintf(outfile,"%s.dib", newname);
+            else sprintf(outfile,"%s_palette.bmp", newname);
+            /* open M2S palette file */
+            StatsOutput(ctx->stats,outfile);
+            fp = fopen(outfile,"wb");
+            if (NULL == fp) {
+                puts(szTextTitle);
+                printf("%s cannot be created.\n", outfile);
+                return INVALID;
+            }
+
+            memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+            /* create the info header */
+            ctx->mybmp.bmi.biSize = (ulong)40;
+            ctx->mybmp.bmi.biWidth  = (ulong)16;
+            ctx->mybmp.bmi.biHeight = (ulong)ctx->shrpalettes;
+            ctx->mybmp.bmi.biPlanes = 1;
+            ctx->mybmp.bmi.biBitCount = 24;
+            ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+
+            outpacket = 48;
+            ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+            ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+            /* create the file header */
+            ctx->mybmp.bfi.bfType[0] = 'B';
+            ctx->mybmp.bfi.bfType[1] = 'M';
+            ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+            ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+            /* write the header for the M2S palette BMP */
+            fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+            memset(&ctx->bmpscanline[0],0,outpacket);
+
+            /* write a BMP scanline for each SHR palette entry */
+            for(y=0,y1=ctx->shrpalettes-1;y<ctx->shrpalettes;y++,y1--) {
+                /* build a scanline of each palette entry */
+                for (x = 0, j=0; x < 16; x++) {
+                    if (ctx->shrpalettes == 200) {
+                        /* brooks palettes */
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][2]; j++;
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][1]; j++;
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][0]; j++;
+                    }
+                    else {
+                        /* pic palettes */
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][2]; j++;
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][1]; j++;
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][0]; j++;
+
+                    }
+                }
+                /* write a scanline of each palette entry */
+                fwrite((char *)&ctx->bmpscanline[0],1,outpacket,fp);
+            }
+            fclose(fp);
+            printf("%s created.\n", outfile);
+            /* now that the M2S palette file is written, the M2S proc file is exactly the same as the SHR preview file
+               except that the naming convention follows M2S naming unless in MS-DOS */
+            /* for MS-DOS output we use short names - MS-DOS users will need to rename the pmp file to a bmp file */
+
+            if (ctx->longnames == 0)sprintf(outfile,"%s.pmp", newname);
+            else sprintf(outfile,"%s_proc.bmp", newname);
+        }
+
+        StatsOutput(ctx->stats,outfile);
+        fp = fopen(outfile,"wb");
+        if (NULL == fp) {
+            puts(szTextTitle);
+            printf("%s cannot be created.\n", outfile);
+            return INVALID;
+        }
+
+        /* monochrome preview is promoted to 16 color BMP format */
+        if (ctx->shrpalettes == 1) {
+            /* 16 color BMP preview */
+            outpacket = width/2;
+        }
+        else {
+            /* 256 color preview is promoted to */
+            /* 24-bit BMP format */
+            outpacket = width * 3;
+        }
+
+        if (width%2 != 0) outpacket++;
+        while (outpacket%4 != 0)outpacket++;
+
+        memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+        /* create the info header */
+        ctx->mybmp.bmi.biSize = (ulong)40;
+        ctx->mybmp.bmi.biWidth  = (ulong)width;
+        ctx->mybmp.bmi.biHeight = (ulong)height;
+        ctx->mybmp.bmi.biPlanes = 1;
+
+        if (ctx->shrpalettes == 1) ctx->mybmp.bmi.biBitCount = 4;
+        else ctx->mybmp.bmi.biBitCount = 24;
+
+        ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+
+        ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+        ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+        /* create the file header */
+        ctx->mybmp.bfi.bfType[0] = 'B';
+        ctx->mybmp.bfi.bfType[1] = 'M';
+
+        if (ctx->shrpalettes == 1) {
+            ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER) + sizeof(RGBQUAD) * 16;
+        }
+        else {
+            ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+        }
+
+        ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+        /* write the header for the output BMP */
+        fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+        if (ctx->shrpalettes == 1) {
+            /* 4 bit bmp */
+            for (j=0;j<16;j++) {
+                ctx->sbmp[j].rgbRed   = ctx->rgbArray[j][0];
+                ctx->sbmp[j].rgbGreen = ctx->rgbArray[j][1];
+                ctx->sbmp[j].rgbBlue  = ctx->rgbArray[j][2];
+                ctx->sbmp[j].rgbReserved = 0;
+            }
+            /* write the palette for the output bmp */
+            fwrite((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+        }
+
+        memset(&ctx->bmpscanline[0],0,outpacket);
+        for(y=0,y1=height-1;y<height;y++,y1--) {
+            /* build a packed scanline */
+            /* this is the same as for Apple IIgs SHR mode
+               providing of course we use the same palette */
+            for (x = 0, j=0; x < width; x++) {
+                idx = getlopixel(ctx, x,y1);
+                /* range check */
+                if (idx > 15)idx = 0; /* default black */
+
+                if (ctx->shrpalettes != 1) {
+                    /* brooks palettes are scanline oriented */
+                    /* the 256 color palette has been copied to the brooks palette */
+                    ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][2]; j++;
+                    ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][1]; j++;
+                    ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][0]; j++;
+                }
+                else {
+                    if (x%2 == 0) {
+                        r = (uchar)idx << 4;
+                        ctx->bmpscanline[j] = r;
+                    }
+                    else {
+                        ctx->bmpscanline[j] = r | (uchar) idx; j++;
+                    }
+                }
+            }
+            fwrite((char *)&ctx->bmpscanline[0],1,outpacket,fp);
+        }
+        fclose(fp);
+        printf("%s created.\n", outfile);
+    }
+
+
+return SUCCESS;
+}
+
+
+/* PIM routines start here */
+
+/* helper function for GetPCXPalettes */
+sshort GetPIMPalette(A2BCONTEXT *ctx, int palnum, int numpalettes)
+{
+    FILE *fp;
+    sshort status = INVALID, idx, i;
+    ulong flen;
+
+
+    for (;;) {
+        /* open file - global filename is created in calling function */
+        fp = fopen(ctx->pcxfile,"rb");
+        if (fp == NULL) break;
+
+        /* get the length of the file */
+        fseek(fp, 0L, 2);
+        flen = ftell(fp) - 769;
+
+        /* avoid empty files - file must have a header and a palette */
+        if (flen < (ulong)128) {
+            fclose(fp);
+            break;
+        }
+
+        /* read the PCX header for compatibility */
+        rewind(fp);
+        fread(ctx->pcxheader,66,1,fp);
+
+        /* PCX version 5 with 8-bits per pixel, run-length encoded with one color plane */
+        /* PCX version 5 with 1-bit  per pixel, run-length encoded with one color plane */
+        if (ctx->pcxheader[0] != (char)10 || ctx->pcxheader[1] != (char)5) {
+            /* if (pcxheader[0] != (char)10 || pcxheader[1] != (char)5 || pcxheader[2] != (char)1 || pcxheader[65] != (char)1) { */
+            fclose(fp);
+            puts("pcx file header problem");
+            break;
+        }
+
+        /* seek to end of file and read the first sixteen palette entries */
+        fseek(fp,flen,SEEK_SET);
+        /* first check the palette header (it must be a formfeed character) */
+        fread(ctx->pcxheader, 1, 1, fp);
+        if (ctx->pcxheader[0] != (char) 12) {
+            puts("pcx palette header problem");
+            fclose(fp);
+            break;
+        }
+
+        /* if PIM palette debugging is turned-on and 24-bit colors create duplicate 12-bit colors
+           then print the details to the console */
+        if (ctx->shrdupedebug == 1) clearcolorsused(ctx); /* clear dupe count */
+
+        /* read the palette */
+        idx = (numpalettes - 1) - palnum;
+        if (numpalettes == 200) {
+            fread(&ctx->rgbArrays[idx][0][0],48,1,fp);
+            if (ctx->shrdupedebug == 1) {
+            	for (i = 0; i < 16; i++) shrcolorsused(ctx, ctx->rgbArrays[idx][i][0],ctx->rgbArrays[idx][i][1],ctx->rgbArrays[idx][i][2]);
+			}
+        }
+        else {
+            fread(&ctx->rgb256Arrays[idx][0][0],48,1,fp);
+            if (ctx->shrdupedebug == 1) {
+            	for (i = 0; i < 16; i++) shrcolorsused(ctx, ctx->rgb256Arrays[idx][i][0],ctx->rgb256Arrays[idx][i][1],ctx->rgb256Arrays[idx][i][2]);
+			}
+        }
+        fclose(fp);
+        status = SUCCESS;
+        if (ctx->shrdupedebug == 1 && ctx->shrdupes == 1) {
+			printf("24-bit palette %s has %d duplicate 12-bit color(s).\n",ctx->pcxfile,ctx->shrdupecount);
+		}
+        break;
+    }
+
+    return status;
+
+
+}
+
+/* iterates through SHR segments in PCX format produced by ImageMagick Convert */
+/* each segment has a 16 color palette that is used for SHR conversion. The PCX Image data is ignored */
+/* this is just a simple way to use the ImageMagick Convert utility to provide a palette in a format that is easy for
+   me to read and use in this converter */
+
+/* seedfile is the full pathname of one of the pcx images */
+sshort GetPIMPalettes(A2BCONTEXT *ctx, char *seedfile)
+{
+    FILE *fp;
+    sshort status = INVALID;
+    char seedbase[256], ext[10];
+    int i, j;
+
+    ctx->imnumpalettes = 0;
+
+    strcpy(seedbase,seedfile);
+
+    j=999;
+    for (i=0;seedbase[i]!=(char)0;i++) {
+       /* support both forward and back slash for compatibility */
+       if (seedbase[i] == (char)92 || seedbase[i] == (char)47) j = i+1;
+    }
+    if (j==999) {
+        printf("%s is an invalid IM seed file name!\n",seedfile);
+        return status;
+    }
+    seedbase[j] = 0;
+
+
+    /* test for brooks mode first */
+    strcpy(ctx->pcxfile,seedbase);
+    strcat(ctx->pcxfile,"199.pcx");
+    fp = fopen(ctx->pcxfile,"rb");
+    if (NULL == fp) {
+        /* if brooks test failed, test for multipalette */
+        strcpy(ctx->pcxfile,seedbase);
+        strcat(ctx->pcxfile,"15.pcx");
+        fp = fopen(ctx->pcxfile,"rb");
+        if (NULL == fp) {
+            /* if multipalette test failed check for 8-palette  */
+            strcpy(ctx->pcxfile,seedbase);
+            strcat(ctx->pcxfile,"7.pcx");
+            fp = fopen(ctx->pcxfile,"rb");
+            if (NULL == fp) {
+                strcpy(ctx->pcxfile,seedbase);
+                strcat(ctx->pcxfile,"0.pcx");
+                fp = fopen(ctx->pcxfile,"rb");
+                if (NULL == fp) {
+                    printf("%s is an invalid IM seed file!\n",seedfile);
+                    return status;
+                }
+                ctx->imnumpalettes = 1;
+            }
+            else {
+                ctx->imnumpalettes = 8;
+            }
+            /* black-out the palettes if less than 16 are active */
+            memset(&ctx->rgb256Arrays[8][0][0],0,768);
+        }
+        else {
+            ctx->imnumpalettes = 16;
+        }
+    }
+    else {
+        ctx->imnumpalettes = 200;
+    }
+    fclose(fp);
+    if (ctx->quietmode == 0) ctx->shrdupedebug = 1;
+
+    /* all the pcx files must be present and accounted for */
+    for (i = 0; i < ctx->imnumpalettes; i++) {
+        strcpy(ctx->pcxfile,seedbase);
+        sprintf(ext,"%d.pcx",i);
+        strcat(ctx->pcxfile,ext);
+        status = GetPIMPalette(ctx, i,ctx->imnumpalettes);
+        if (status == INVALID) {
+            ctx->imnumpalettes = 0;
+            printf("Unable to open IM palette %s!\n",ctx->pcxfile);
+            return status;
+        }
+    }
+    printf("%d IM Palettes successfully loaded!\n",ctx->imnumpalettes);
+
+    return SUCCESS;
+}
+
+
+/* convert 256 color bmps to 24 bit bmps */
+/* convert 24 bit bmps */
+FILE *ReformatPIMBMP(A2BCONTEXT *ctx, FILE *fp)
+{
+
+    ushort packet,outpacket,y,x,x1;
+    sshort count = 0;
+
+
+    /* seek past extraneous info in header if any */
+    fseek(fp,ctx->BitMapFileHeader.bfOffBits,SEEK_SET);
+
+    if (ctx->bmi.biBitCount == 8) {
+        packet = ctx->bmi.biWidth;
+    }
+    else {
+        packet = ctx->bmi.biWidth * 3;
+    }
+    while ((packet % 4)!=0)packet++;
+
+
+    outpacket = AllocReformatBuffer(ctx);
+    if (outpacket < 1) {
+        fclose(fp);
+        return NULL;
+    }
+
+    for (y=0;y<ctx->bmi.biHeight;y++) {
+        fread((char *)&ctx->bmpscanline[0],1,packet,fp);
+        if (ctx->bmi.biBitCount == 8) {
+            ReformatVGALine(ctx);
+        }
+        if (ctx->fourbit == 1) {
+            for (x=0;x<outpacket;x++) ctx->bmpscanline[x] = gsColor(ctx->bmpscanline[x]);
+        }
+        memcpy(&ctx->reformatbuf[(ulong)y * outpacket],&ctx->bmpscanline[0],outpacket);
+    }
+
+    /* from here on the input is read as a 24-bit bmp from the memory buffer */
+    SetReformatHeader(ctx);
+
+    return fp;
+}
+
+
+/* uses ImageMagick to build the palettes */
+/* todo - for raw output add functionality to use the image data from the palette pcx files */
+/* also clean-up unused vars at some point */
+int ConvertPIM(A2BCONTEXT *ctx, unsigned char *basename, unsigned char *newname)
+{
+
+    FILE *fp;
+    int packet = INVALID, y,y1,y2,x,i,j,width,height,reformat = ctx->bmp3, bmpversion =0,lidx,didx,count;
+    int outpacket, outputwidth, outputheight, offset;
+    char bmpfile[256], outfile[256];
+    uchar r,g,b,lr,lg,lb,red,green,blue,drawcolor,idx,toneindex;
+    ushort temp, fl, darkest,lightest,found,unused;
+    float hue,saturation,luminance;
+    sshort jdx;
+
+    sprintf(bmpfile,"%s.bmp",basename);
+
+    StatsBegin(ctx->stats,STATS_HEADER);
+    if((fp=fopen(bmpfile,"rb"))==NULL) {
+        puts(szTextTitle);
+        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n",bmpfile);
+        return INVALID;
+    }
+
+    /* read the header stuff into the appropriate structures,
+       it's likely a bmp file */
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+
+    fread((char *)&ctx->BitMapFileHeader.bfType,
+                 sizeof(BITMAPFILEHEADER),1,fp);
+    fread((char *)&ctx->bmi.biSize,
+                 sizeof(BITMAPINFOHEADER),1,fp);
+
+    if (ctx->bmi.biSize != sizeof(BITMAPINFOHEADER)) {
+		if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,(unsigned)ctx->bmi.biSize,1,fp);
+            bmpversion = 3;
+            reformat = 1;
+		}
+		else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
+            bmpversion = 4;
+            reformat = 1;
+
+        }
+        else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
+            bmpversion = 5;
+            reformat = 1;
+            /*
+            Profile data refers to either the profile file name (linked profile)
+            or the actual profile bits (embedded profile).
+            The file format places the profile data at the end of the file.
+            The profile data is placed just after the color table (if present).
+            */
+        }
+        else {
+            bmpversion = 0;
+        }
+
+    }
+    else {
+        bmpversion = 3;
+    }
+
+    if (bmpversion == 0) {
+        fclose(fp);
+        puts(szTextTitle);
+        puts("BMP version not recognized!");
+        return INVALID;
+    }
+
+    if (ctx->bmi.biCompression==BI_RGB &&
+        ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M' &&
+        ctx->bmi.biPlanes==1 && (ctx->bmi.biBitCount == 24 || ctx->bmi.biBitCount == 8)) {
+
+        if (ctx->bmi.biWidth != 320 || ctx->bmi.biHeight != 200) {
+            fclose(fp);
+            puts(szTextTitle);
+            printf("%s is not in a supported size for SHR file output.\nExiting!\n", bmpfile);
+            return INVALID;
+        }
+
+            outputheight = height = (int) ctx->bmi.biHeight;
+            outputwidth = width = (int) ctx->bmi.biWidth;
+
+            if (outputheight%2 != 0) outputheight++;
+            outputheight = outputheight/2;
+
+            outpacket = outputwidth;
+
+            packet = width * 3;
+            while (packet%4 != 0)packet++; /* BMP scanlines align on DWORD boundaries */
+    }
+
+    if (packet == INVALID) {
+        fclose(fp);
+        puts(szTextTitle);
+        printf("%s is not in a supported format for SHR or BROOKS file output.\nExiting!\n", bmpfile);
+        if (ctx->bmi.biCompression==BI_RGB) puts("compression ok");
+        return INVALID;
+    }
+
+    if (ctx->bmi.biBitCount == 8) {
+       fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+       reformat = 1;
+    }
+
+    if (reformat == 1) {
+       StatsNext(ctx->stats,STATS_HEADER,STATS_REFORMAT);
+       fp = ReformatPIMBMP(ctx, fp);
+       StatsNext(ctx->stats,STATS_REFORMAT,STATS_HEADER);
+       if (NULL == fp) return SUCCESS;
+    }
+
+    StatsNext(ctx->stats,STATS_HEADER,STATS_PALETTE);
+    if (ctx->pimquantize == 1) {
+       if (BuildPIMPalettes(ctx, fp, packet) != SUCCESS) {
+           fclose(fp);
+           return INVALID;
+       }
+    }
+
+    if (ctx->imnumpalettes != 200) ctx->shrpalettes = 16;
+    else ctx->shrpalettes = 200;
+    ctx->shr = 320;
+
+    /* errorsum = 1; error summing is not forced but maybe it should be */
+
+    /* initialize nearest color arrays */
+    /* todo - probably not needed because setting nearest color arrays on a line by line basis */
+    InitDoubleArrays(ctx);
+
+    if (ctx->imnumpalettes == 16) {
+
+        /* populate 200 palettes from 16-palettes */
+        /* and set initial scbs */
+        /* this allows most of the same line oriented routines to be re-used for either
+           16-palette or 200-palette processing */
+        ctx->shr256 = 1;
+        for (i = 0, y = 0; i < 8; i++, y+=25) {
+            y1 = y;
+            y2 = y + 13;
+            j = i * 2;
+            /* palette for 13 lines */
+            for (x = y1; x < y2; x++) {
+                ctx->mypic.scb[x] = j;
+                for (idx = 0; idx < 16; idx++) {
+                    ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                    ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                    ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[j][idx][2];
+                }
+            }
+            /* palettte for 12 lines */
+            y1 = y + 13;
+            y2 = y + 25;
+            j = (i*2) + 1;
+            for (x = y1; x < y2; x++) {
+                ctx->mypic.scb[x] = j;
+                for (idx = 0; idx < 16; idx++) {
+                    ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[j][idx][0];
+                    ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[j][idx][1];
+                    ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[j][idx][2];
+                }
+            }
+        }
+    }
+    else if (ctx->imnumpalettes == 8) {
+        /* populate 200 palettes from 8-palettes */
+        /* and set initial scbs */
+        /* this allows most of the same line oriented routines to be re-used for either
+           8-palette, 16-palette or 200-palette processing */
+        ctx->shr256 = 1;
+        for (i = 0, y = 0; i < 8; i++, y+=25) {
+            y1 = y;
+            y2 = y + 13;
+            /* palette for 13 lines */
+            for (x = y1; x < y2; x++) {
+                ctx->mypic.scb[x] = i;
+                for (idx = 0; idx < 16; idx++) {
+                    ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[i][idx][0];
+                    ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[i][idx][1];
+                    ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[i][idx][2];
+                }
+            }
+            /* same palettte for 12 lines */
+            y1 = y + 13;
+            y2 = y + 25;
+            for (x = y1; x < y2; x++) {
+                ctx->mypic.scb[x] = i;
+                for (idx = 0; idx < 16; idx++) {
+                    ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[i][idx][0];
+                    ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[i][idx][1];
+                    ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[i][idx][2];
+                }
+            }
+        }
+    }
+    else if (ctx->imnumpalettes == 1) {
+        for (x=0;x<200;x++) {
+            ctx->shr256 = 1;
+            ctx->mypic.scb[x] = 0;
+            for (idx = 0; idx < 16; idx++) {
+                ctx->rgbArrays[x][idx][0] = ctx->rgb256Arrays[0][idx][0];
+                ctx->rgbArrays[x][idx][1] = ctx->rgb256Arrays[0][idx][1];
+                ctx->rgbArrays[x][idx][2] = ctx->rgb256Arrays[0][idx][2];
+            }
+        }
+    }
+    else {
+        ctx->shr256 = 0;
+    }
+    /* shr256 ends */
+
+    if (ctx->adaptivescb == 1 && (ctx->imnumpalettes == 16 || ctx->imnumpalettes == 8)) {
+        if (AdaptivePIMSCB(ctx, fp, packet) != SUCCESS) {
+            fclose(fp);
+            return INVALID;
+        }
+    }
+
+
+    memset(&ctx->dhrbuf[0],0,32000); /* clear write buffer */
+
+    if (ctx->dither != 0) {
+        ctx->usepalettedistance = 1;
+        /* sizeof(sshort) * 640 */
+        memset(&ctx->redDither[0],0,1280);
+        memset(&ctx->greenDither[0],0,1280);
+        memset(&ctx->blueDither[0],0,1280);
+        memset(&ctx->redSeed[0],0,1280);
+        memset(&ctx->greenSeed[0],0,1280);
+        memset(&ctx->blueSeed[0],0,1280);
+        memset(&ctx->redSeed2[0],0,1280);
+        memset(&ctx->greenSeed2[0],0,1280);
+        memset(&ctx->blueSeed2[0],0,1280);
+    }
+    else {
+        ctx->usepalettedistance = 0;
+    }
+
+    StatsNext(ctx->stats,STATS_PALETTE,STATS_DITHER);
+    /* seek to beginning of input file and process */
+    SeekBmpLines(ctx, fp);
+
+    if (ctx->dither == 0) puts("non-dithered output");
+    else puts("dithered output");
+
+    /* bmp's are upside-down so conversion of scanlines is in
+       reverse order */
+    for(y=0,y1=height-1;y<height;y++,y1--)
+    {
+          ReadBmpLine(ctx, fp, ctx->bmpscanline, packet);
+
+          /* set the palette for this line */
+          /* todo - probably not needed for dithered output */
+          InitDoubleLineArrays(ctx, y1);
+
+          if (ctx->dither == 0) {
+            /* if not dithering use direct pixel mapping */
+            GetClosestColorRow(ctx, ctx->bmpscanline, ctx->lineindex, width);
+            for (x=0;x<width;x++) setlopixel(ctx, ctx->lineindex[x],x,y1);
+          }
+          else
+          {
+              /* add the current line to the r,g,b line buffers used for dithering */
+              for (j=0, x = 0; x < width; x++) {
+                    b = ctx->bmpscanline[j]; j++;
+                    g = ctx->bmpscanline[j]; j++;
+                    r = ctx->bmpscanline[j]; j++;
+
+                    /* values are already seeded from previous 2 - line(s) */
+                    /* the idea here is to add a full value to whatever bleed values have been added */
+                    AdjustShortPixel(1,(sshort *)&ctx->redDither[x],(sshort)r);
+                    AdjustShortPixel(1,(sshort *)&ctx->greenDither[x],(sshort)g);
+                    AdjustShortPixel(1,(sshort *)&ctx->blueDither[x],(sshort)b);
+              }
+
+
+              if (ctx->shrpalettes == 200) BrooksDither(ctx, y1,width);
+              else PicDither(ctx, y1,width);
+
+               /* seed next line - promote nearest forward array to
+                  current line */
+               memcpy(&ctx->redDither[0],&ctx->redSeed[0],1280);
+               memcpy(&ctx->greenDither[0],&ctx->greenSeed[0],1280);
+               memcpy(&ctx->blueDither[0],&ctx->blueSeed[0],1280);
+
+               /* seed first seed - promote furthest forward array
+                  to nearest forward array */
+               memcpy(&ctx->redSeed[0],&ctx->redSeed2[0],1280);
+               memcpy(&ctx->greenSeed[0],&ctx->greenSeed2[0],1280);
+               memcpy(&ctx->blueSeed[0],&ctx->blueSeed2[0],1280);
+
+               /* clear last seed - furthest forward array */
+               memset(&ctx->redSeed2[0],0,1280);
+               memset(&ctx->greenSeed2[0],0,1280);
+               memset(&ctx->blueSeed2[0],0,1280);
+         }
+
+    }
+    fclose(fp);
+    StatsNext(ctx->stats,STATS_DITHER,STATS_WRITE);
+
+    /* optionally keep the 24-bit version of the input file */
+    if (reformat == 1 && ctx->bmp3 == 1) {
+        sprintf(outfile,"%s.bm3", newname);
+        WriteReformatBMP(ctx, outfile);
+    }
+    FreeReformatBuffer(ctx);
+
+    if (ctx->usepalettedistance == 1) {
+        /* if we shuffled the palettes based on the best total distance then we need
+           to put our new palettes in place before writing our output file(s) */
+        for (y= 0;y<200;y++) {
+            memcpy(&ctx->rgbArrays[y][0][0],&ctx->savepalettes[y][0][0],48);
+        }
+        memcpy(&ctx->mypic.scb[0],&ctx->savescb[0],200);
+    }
+
+
+    if (ctx->shr256 == 1) {
+        /* for SHR motion video prototyping */
+        /* uses only 8 palettes to facilitate slide transition */
+
+        if (ctx->imnumpalettes == 1) sprintf(outfile,"%s.SHR", newname);
+        else if (ctx->imnumpalettes == 8) sprintf(outfile,"%s.SMV", newname);
+        else sprintf(outfile,"%s.SH2", newname);
+    }
+    else {
+        sprintf(outfile,"%s.SH3", newname);
+    }
+    ucase(ctx,(char *)&outfile[0]);
+    if (ctx->longnames == 0) ctx->tags = 0;
+
+    /* Ciderpress File Attribute Preservation Tags */
+    if (ctx->tags == 1){
+        if (ctx->shr256 == 1) strcat(outfile,"#C10000");
+        else strcat(outfile,"#C10002");
+    }
+    SHRPackedName(ctx, outfile, newname);
+
+    if (SHR320_Output(ctx, outfile) != SUCCESS) {
+        puts(szTextTitle);
+        printf("%s cannot be created.\n", outfile);
+        return INVALID;
+    }
+    printf("%s created.\n", outfile);
+
+    /* "option V" for preview output or M2S output here */
+    if (ctx->vbmp == 1) {
+
+        if (ctx->m2s == 0) {
+            /* for MS-DOS output we use short (and different) names */
+            if (ctx->longnames == 0)sprintf(outfile,"%s.pmp", newname);
+            else sprintf(outfile,"%s_Preview.bmp", newname);
+        }
+        else {
+            /* Magick2SHR palette output and Magick2SHR naming convention for round-trip editing */
+            if (ctx->longnames == 0)sprintf(outfile,"%s.dib", newname);
+            else sprintf(outfile,"%s_palette.bmp", newname);
+            /* open M2S palette file */
+            StatsOutput(ctx->stats,outfile);
+            fp = fopen(outfile,"wb");
+            if (NULL == fp) {
+                puts(szTextTitle);
+                printf("%s cannot be created.\n", outfile);
+                return INVALID;
+            }
+
+            memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+            /* create the info header */
+            ctx->mybmp.bmi.biSize = (ulong)40;
+            ctx->mybmp.bmi.biWidth  = (ulong)16;
+            ctx->mybmp.bmi.biHeight = (ulong)ctx->shrpalettes;
+            ctx->mybmp.bmi.biPlanes = 1;
+            ctx->mybmp.bmi.biBitCount = 24;
+            ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+
+            outpacket = 48;
+            ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+            ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+            /* create the file header */
+            ctx->mybmp.bfi.bfType[0] = 'B';
+            ctx->mybmp.bfi.bfType[1] = 'M';
+            ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+            ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+            /* write the header for the M2S palette BMP */
+            fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+            memset(&ctx->bmpscanline[0],0,outpacket);
+
+            /* write a BMP scanline for each SHR palette entry */
+            for(y=0,y1=ctx->shrpalettes-1;y<ctx->shrpalettes;y++,y1--) {
+                /* build a scanline of each palette entry */
+                for (x = 0, j=0; x < 16; x++) {
+                    if (ctx->shrpalettes == 200) {
+                        /* brooks palettes */
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][2]; j++;
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][1]; j++;
+                        ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][0]; j++;
+                    }
+                    else {
+                        /* pic palettes */
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][2]; j++;
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][1]; j++;
+                        ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][0]; j++;
+
+                    }
+                }
+                /* write a scanline of each palette entry */
+                fwrite((char *)&ctx->bmpscanline[0],1,outpacket,fp);
+            }
+            fclose(fp);
+            printf("%s created.\n", outfile);
+            /* now that the M2S palette file is written, the M2S proc file is exactly the same as the SHR preview file
+               except that the naming convention follows M2S naming unless in MS-DOS */
+            /* for MS-DOS output we use short names - MS-DOS users will need to rename the pmp file to a bmp file */
+
+            if (ctx->longnames == 0)sprintf(outfile,"%s.pmp", newname);
+            else sprintf(outfile,"%s_proc.bmp", newname);
+        }
+
+        StatsOutput(ctx->stats,outfile);
+        fp = fopen(outfile,"wb");
+        if (NULL == fp) {
+            puts(szTextTitle);
+            printf("%s cannot be created.\n", outfile);
+            return INVALID;
+        }
+
+        /* 256 color preview is promoted to */
+        /* 24-bit BMP format */
+        outpacket = width * 3;
+
+        if (width%2 != 0) outpacket++;
+        while (outpacket%4 != 0)outpacket++;
+
+        memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+        /* create the info header */
+        ctx->mybmp.bmi.biSize = (ulong)40;
+        ctx->mybmp.bmi.biWidth  = (ulong)width;
+        ctx->mybmp.bmi.biHeight = (ulong)height;
+        ctx->mybmp.bmi.biPlanes = 1;
+        ctx->mybmp.bmi.biBitCount = 24;
+        ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+        ctx->mybmp.bmi.biSizeImage = (ulong)outpacket;
+        ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+        /* create the file header */
+        ctx->mybmp.bfi.bfType[0] = 'B';
+        ctx->mybmp.bfi.bfType[1] = 'M';
+        ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+        ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+        /* write the header for the output BMP */
+        fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+        memset(&ctx->bmpscanline[0],0,outpacket);
+        for(y=0,y1=height-1;y<height;y++,y1--) {
+            for (x = 0, j=0; x < width; x++) {
+                idx = getlopixel(ctx, x,y1);
+                /* range check */
+                if (idx > 15)idx = 0; /* default black */
+                /* brooks palettes are scanline oriented */
+                /* the 256 color palette has been copied to the brooks palette */
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][2]; j++;
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][1]; j++;
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][idx][0]; j++;
+            }
+            fwrite((char *)&ctx->bmpscanline[0],1,outpacket,fp);
+        }
+        fclose(fp);
+        printf("%s created.\n", outfile);
+    }
+
+
+return SUCCESS;
+}
+
+
+/* uses ImageMagick to build the palettes */
+/* clean-up unused vars at some point */
+int Convertfourbit(A2BCONTEXT *ctx, unsigned char *basename, unsigned char *newname)
+{
+
+    FILE *fp;
+    int packet = INVALID, bmpversion =0, status;
+    char bmpfile[256], outfile[256];
+
+    sprintf(bmpfile,"%s.bmp",basename);
+    sprintf(outfile,"%s.4B",newname);
+
+    StatsBegin(ctx->stats,STATS_HEADER);
+    if((fp=fopen(bmpfile,"rb"))==NULL) {
+        puts(szTextTitle);
+        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n",bmpfile);
+        return INVALID;
+    }
+
+    /* read the header stuff into the appropriate structures,
+       it's likely a bmp file */
+    memset(&ctx->BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
+    memset(&ctx->bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+
+    fread((char *)&ctx->BitMapFileHeader.bfType,
+                 sizeof(BITMAPFILEHEADER),1,fp);
+    fread((char *)&ctx->bmi.biSize,
+                 sizeof(BITMAPINFOHEADER),1,fp);
+
+    if (ctx->bmi.biSize != sizeof(BITMAPINFOHEADER)) {
+		if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,(unsigned)ctx->bmi.biSize,1,fp);
+            bmpversion = 3;
+		}
+		else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
+            bmpversion = 4;
+        }
+        else if (ctx->bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
+            memset(&ctx->bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
+            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
+            fread((char *)&ctx->bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
+            bmpversion = 5;
+            /*
+            Profile data refers to either the profile file name (linked profile)
+            or the actual profile bits (embedded profile).
+            The file format places the profile data at the end of the file.
+            The profile data is placed just after the color table (if present).
+            */
+        }
+        else {
+            bmpversion = 0;
+        }
+
+    }
+    else {
+        bmpversion = 3;
+    }
+
+    if (bmpversion == 0) {
+        fclose(fp);
+        puts(szTextTitle);
+        puts("BMP version not recognized!");
+        return INVALID;
+    }
+
+    if (ctx->bmi.biCompression==BI_RGB &&
+        ctx->BitMapFileHeader.bfType[0] == 'B' && ctx->BitMapFileHeader.bfType[1] == 'M' &&
+        ctx->bmi.biPlanes==1 && (ctx->bmi.biBitCount == 24 || ctx->bmi.biBitCount == 8)) {
+
+        if (ctx->bmi.biWidth != 320 || ctx->bmi.biHeight != 200) {
+            fclose(fp);
+            puts(szTextTitle);
+            printf("%s is not in a supported size for 4-bit file output.\nExiting!\n", bmpfile);
+            return INVALID;
+        }
+
+        packet = SUCCESS;
+    }
+
+    if (packet == INVALID) {
+        fclose(fp);
+        puts(szTextTitle);
+        printf("%s is not in a supported format for 4-bit file output.\nExiting!\n", bmpfile);
+        return INVALID;
+    }
+
+    if (ctx->bmi.biBitCount == 8) {
+       fread((char *)&ctx->sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+    }
+
+    StatsNext(ctx->stats,STATS_HEADER,STATS_REFORMAT);
+    fp = ReformatPIMBMP(ctx, fp);
+    if (NULL == fp) return INVALID;
+    fclose(fp);
+    StatsNext(ctx->stats,STATS_REFORMAT,STATS_WRITE);
+
+    status = WriteReformatBMP(ctx, outfile);
+    FreeReformatBuffer(ctx);
+    if (status != SUCCESS) {
+        printf("%s cannot be created.\n", outfile);
+        return INVALID;
+    }
+    printf("%s created.\n", outfile);
+
+return SUCCESS;
+}
+
+
+/* Command Line Options Helper Function */
+int cmpstr(char *str, char *cmp)
+{
+    int i;
+
+    if (strlen(cmp) != strlen(str)) return INVALID;
+    for (i=0;str[i] != 0;i++) {
+        if (toupper(cmp[i]) != toupper(str[i])) return INVALID;
+    }
+    return SUCCESS;
+}
+
+
+
+
+
+/* the following provides some equivalent functionality for SHR as
+   what A2B provides for producing BMP files from DHGR files.
+
+   SHR Input files must follow one of our naming conventions.
+   mode320 and mode3200 PIC files and the PNT files that m2s writes
+   (PackBytes $C0/$0001 and Apple Preferred Format $C0/$0002) are
+   decoded by shrdecode.h.
+*/
+
+/* converts SHR images to imagedata and palette file pairs in BMP format */
+/* provides a 320 x 200 x 24-bit BMP file for editing stray pixels etc.in converted output */
+/* can also be used to convert SHR files produced by other applications to BMP format */
+
+/* these have lost their original 24-bit precision and should not be re-transformed */
+/* m2s should be used to convert edited files back to PIC or BROOKS files */
+int shrtom2s(A2BCONTEXT *ctx, char *infile, char *basename)
+{
+    FILE *fp;
+    char procfile[256], palfile[256];
+    SHRIMAGE *img;
+    int brooks_format = 0, status;
+    uchar *rgb,r,g,b;
+    sshort x,y,y1,j;
+
+    /* the decoder works out the format from the file itself */
+    img = (SHRIMAGE *)malloc(sizeof(SHRIMAGE));
+    rgb = (uchar *)malloc(320 * 200 * 3);
+    if (NULL == img || NULL == rgb) {
+        if (NULL != img) free(img);
+        if (NULL != rgb) free(rgb);
+        puts("Not enough memory.");
+        return 1;
+    }
+
+    status = DecodeSHRFile(infile,img);
+    if (status < 1) {
+        if (status < 0) printf("Could not open SHR file %s\n",infile);
+        else printf("%s is not a supported 320 x 200 SHR file\n",infile);
+        free(img);
+        free(rgb);
+        return 1;
+    }
+    SHRImageToRGB(img,rgb);
+
+    if (img->numpalettes == 200) {
+        /* the m2s BMP palette file for a BROOKS image contains all 200 palettes
+           (or less)
+        */
+        brooks_format = 1;
+        memcpy(&ctx->rgbArrays[0][0][0],&img->palettes[0][0][0],200*16*3);
+    }
+    else {
+        /* the m2s palette file for a PIC file contains 16 palettes
+           (or less)
+        */
+        memcpy(&ctx->rgb256Arrays[0][0][0],&img->palettes[0][0][0],16*16*3);
+    }
+    free(img);
+
+    /* make output file names from basename */
+    sprintf(procfile,"%s_proc.bmp",basename);
+    sprintf(palfile,"%s_palette.bmp",basename);
+
+    /* write image data in BMP format */
+    StatsOutput(ctx->stats,procfile);
+    fp = fopen(procfile,"wb");
+
+    if (fp == NULL) {
+        printf("Could not open %s for writing.\n",procfile);
+        free(rgb);
+        return 1;
+    }
+
+    clearcolorsused(ctx);
+    memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+    /* create the info header */
+    ctx->mybmp.bmi.biSize = (ulong)40;
+    ctx->mybmp.bmi.biWidth  = (ulong)320;
+    ctx->mybmp.bmi.biHeight = (ulong)200;
+    ctx->mybmp.bmi.biPlanes = 1;
+    ctx->mybmp.bmi.biBitCount = 24;
+    ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+    ctx->mybmp.bmi.biSizeImage = (ulong)960;
+    ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+    /* create the file header */
+    ctx->mybmp.bfi.bfType[0] = 'B';
+    ctx->mybmp.bfi.bfType[1] = 'M';
+    ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+    ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+    /* write the header for the output BMP */
+    fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+    memset(&ctx->bmpscanline[0],0,960);
+    for(y=0,y1=199;y<200;y++,y1--) {
+        for (x = 0, j=0; x < 320; x++) {
+            r = rgb[(y1*320+x)*3];
+            g = rgb[(y1*320+x)*3+1];
+            b = rgb[(y1*320+x)*3+2];
+            ctx->bmpscanline[j] = b; j++;
+            ctx->bmpscanline[j] = g; j++;
+            ctx->bmpscanline[j] = r; j++;
+            shrcolorsused(ctx, r,g,b);
+
+        }
+        fwrite((char *)&ctx->bmpscanline[0],1,960,fp);
+    }
+    fclose(fp);
+    free(rgb);
+    printf("%s created.\n",procfile);
+
+    /* write palette data in BMP format */
+    StatsOutput(ctx->stats,palfile);
+    fp = fopen(palfile,"wb");
+
+    if (fp == NULL) {
+        printf("Could not open %s for writing.\n",palfile);
+        return 1;
+    }
+
+    memset((char *)&ctx->mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+
+    /* create the info header */
+    ctx->mybmp.bmi.biSize = (ulong)40;
+    ctx->mybmp.bmi.biWidth  = (ulong)16;
+
+    if (brooks_format == 0)
+        ctx->mybmp.bmi.biHeight = (ulong)16;
+    else
+        ctx->mybmp.bmi.biHeight = (ulong)200;
+
+    ctx->mybmp.bmi.biPlanes = 1;
+    ctx->mybmp.bmi.biBitCount = 24;
+    ctx->mybmp.bmi.biCompression = (ulong) BI_RGB;
+    ctx->mybmp.bmi.biSizeImage = (ulong)48;
+    ctx->mybmp.bmi.biSizeImage *= ctx->mybmp.bmi.biHeight;
+
+    /* create the file header */
+    ctx->mybmp.bfi.bfType[0] = 'B';
+    ctx->mybmp.bfi.bfType[1] = 'M';
+    ctx->mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
+    ctx->mybmp.bfi.bfSize = ctx->mybmp.bmi.biSizeImage + ctx->mybmp.bfi.bfOffBits;
+
+    /* write the header for the output BMP */
+    fwrite((char *)&ctx->mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+
+    memset(&ctx->bmpscanline[0],0,48);
+
+    if (brooks_format == 0) {
+        for(y=0,y1=15;y<16;y++,y1--) {
+            for (x = 0, j=0; x < 16; x++) {
+                ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][2]; j++;
+                ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][1]; j++;
+                ctx->bmpscanline[j] = ctx->rgb256Arrays[y1][x][0]; j++;
+            }
+            fwrite((char *)&ctx->bmpscanline[0],1,48,fp);
+        }
+    }
+    else {
+        for(y=0,y1=199;y<200;y++,y1--) {
+            for (x = 0, j=0; x < 16; x++) {
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][2]; j++;
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][1]; j++;
+                ctx->bmpscanline[j] = ctx->rgbArrays[y1][x][0]; j++;
+            }
+            fwrite((char *)&ctx->bmpscanline[0],1,48,fp);
+        }
+    }
+
+    fclose(fp);
+    printf("%s created.\n",palfile);
+
+
+    puts("Done!");
+    printf("%d unique SHR palette colors in image.\n",ctx->shrcolorcount);
+
+    return 0;
+
+}
+
+
+/*
+#define GRAVITY_CENTER    0
+#define GRAVITY_EAST      1
+#define GRAVITY_NORTHEAST 2
+#define GRAVITY_NORTH     3
+#define GRAVITY_NORTHWEST 4
+#define GRAVITY_SOUTHEAST 5
+#define GRAVITY_SOUTH     6
+#define GRAVITY_SOUTHWEST 7
+#define GRAVITY_WEST      8
+*/
+#define NUM_GRAVITIES     9
+
+/* gravity options for cropped output - center (typical) */
+char *geometry[] = {
+"Center",
+"East",
+"NorthEast",
+"North",
+"NorthWest",
+"SouthEast",
+"South",
+"SouthWest",
+"West",
+NULL};
+
+char *gravity = "center";
+
+/* command line helper function to set ImageMagick geometry for gravity option */
+void SetMagickAspectScript(char *wordptr)
+{
+	int idx;
+
+	if (wordptr[0] != (char) 0) {
+		for (idx = 0;idx < NUM_GRAVITIES;idx++) {
+			if (cmpstr(wordptr,geometry[idx]) == SUCCESS) {
+				gravity = (char *) &geometry[idx][0];
+				return;
+			}
+		}
+	}
+}
+
+
+/* args are image file name, type of output 0 or 1 (.bat or .sh),
+   and whether output is cropped 0 or padded 1 */
+int MakeMagickAspectScript(char *name,int script, int pad)
+{
+    FILE *fp, *fp2=NULL;
+    char buf[128], c, d, idfile[256], outfile[256];
+    int i, j, status = 1;
+    float fwidth, fheight;
+    int width, height, cropwidth, cropheight, xtent;
+
+    /* use image file base name for id file name and batch file or script file name */
+    strcpy(idfile,name);
+    strcpy(outfile,name);
+    j = 999;
+    for (i=0;name[i]!=(char)0;i++){
+		if (name[i] == '.')j=i;
+	}
+
+	/* the image file name must have an extension */
+	if (j==999) return status;
+	idfile[j] = outfile[j]=(char)0;
+
+	/* the id file must already exist */
+	strcat(idfile,".id");
+    fp = fopen(idfile,"r");
+    if (fp == NULL) return status;
+
+	if (script == 0) strcat(outfile,".bat");
+	else strcat(outfile,".sh");
+
+    for (;;) {
+        if (NULL == fgets(buf, 128, fp)) {
+            fclose(fp);
+            break;
+        }
+        nocr(buf);
+        /* this parser is really simplistic... it uses the first widthxheight string preceded by a space...
+           it will probably usually work since we don't usually put widthxheight strings in filenames */
+        width = height = 0;
+        d = (char)0;
+        for (i=0;buf[i]!=(char)0;i++){
+			if (d == (char)32) {
+				width = atoi((char *)&buf[i]);
+			}
+			c = buf[i];
+			if (c=='x' && width > 0) {
+				if (d > (char)47 && d < (char)58) {
+					height = atoi((char *)&buf[i+1]);
+					if (height > 0) break;
+				}
+			}
+			d = c;
+		}
+		if (width == 0) break;
+        if (height == 0) break;
+        if (pad == 0) {
+			/* cropping (not padding) */
+			/* for widescreen images trim both sides, the height remains the same */
+        	fwidth = (float)1.3334 * height;
+        	cropwidth = (int)fwidth;
+        	if (cropwidth > width) {
+				/* if the cropping width is not 1/3 greater than the height, this is a portrait image
+				   and must be cropped in the vertical axis only */
+				cropwidth = width;
+				fheight = (float)0.75 * width;
+				cropheight = (int)fheight;
+			}
+			else {
+				cropheight = height;
+			}
+		}
+		else {
+			fheight = (float)0.75 * width;
+			cropheight = (int)fheight;
+			if (cropheight == height) {
+			   /* if the height is equal to 75% of the width, the output is verbatim (no padding is needed) */
+			   cropwidth = width;
+			   pad = 0;
+			}
+			else if (height < cropheight) {
+			   /* if the height is less than 75% of the width, the output is letterboxed with padding above and below */
+			   xtent = cropwidth = width;
+			}
+			else {
+			   /* if the height is greater than 75% of the width, the output is pillarboxed with padding on the sides */
+			   cropheight = height;
+        	   fwidth = (float)1.3334 * height;
+        	   xtent = cropwidth = (int)fwidth;
+			}
+		}
+        fp2 = fopen(outfile,"w");
+        if (NULL == fp2) break;
+
+        if (script == 0) {
+			/* batch file output */
+			fprintf(fp2,"@echo off\n");
+			if (pad == 0) {
+				/* %MAGICK% %%f -gravity center -crop 1440x1080+0+0 -define format:BMP %%~nf.bmp */
+				fprintf(fp2,"%%1 %%2 -gravity %s -crop %dx%d+0+0 -define format:BMP %%3.bmp\n",gravity,cropwidth,cropheight);
+			}
+			else {
+			   /* letterbox */
+               /* %MAGICK% %%f -gravity center -background black -extent 1920x1920 -crop 1920x1440+0+0 +repage -define format:BMP %%~nf.bmp */
+               /* pillarbox */
+               /* %MAGICK% %%f -gravity center -background black -extent 2730x2730 -crop 2730x2048+0+0 +repage -define format:BMP %%~nf.bmp */
+               fprintf(fp2,
+               "%%1 %%2 -gravity %s -background black -extent %dx%d -crop %dx%d+0+0 +repage -define format:BMP %%3.bmp\n",
+               gravity,xtent,xtent,cropwidth,cropheight);
+
+			}
+		}
+		else {
+			/* shell script output */
+			fprintf(fp2,"#!/bin/sh\n");
+			if (pad == 0) {
+				/* $MAGICK $src -gravity center -crop 1440x1080+0+0 -define format:BMP $tgt.bmp */
+				fprintf(fp2,"$1 $2 -gravity %s -crop %dx%d+0+0 -define format:BMP $3.bmp\n",gravity,cropwidth,cropheight);
+			}
+			else {
+               fprintf(fp2,
+               "$1 $2 -gravity %s -background black -extent %dx%d -crop %dx%d+0+0 +repage -define format:BMP $3.bmp\n",
+               gravity,xtent,xtent,cropwidth,cropheight);
 
-    if (SHR320_Output(outfile) != SUCCESS) {
-        puts(szTextTitle);
-        printf("%s cannot be created.\n", outfile);
-        return INVALID;
+			}
+		}
+        status = 0;
     }
-    printf("%s created.\n", outfile);
+    fclose(fp);
+    if (NULL != fp2) fclose(fp2);
 
-    /* "option V" for preview output or M2S output here */
-    if (vbmp == 1) {
+    return status;
+}
 
-        if (m2s == 0) {
-            /* for MS-DOS output we use short (and different) names */
-            if (longnames == 0)sprintf(outfile,"%s.pmp", newname);
-            else sprintf(outfile,"%s_Preview.bmp", newname);
-        }
-        else {
-            /* Magick2SHR palette output and Magick2SHR naming convention for round-trip editing */
-            if (longnames == 0)sprintf(outfile,"%s.dib", newname);
-            else sprintf(outfile,"%s_palette.bmp", newname);
-            /* open M2S palette file */
-            fp = fopen(outfile,"wb");
-            if (NULL == fp) {
-                puts(szTextTitle);
-                printf("%s cannot be created.\n", outfile);
-                return INVALID;
-            }
 
-            memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+/* color bleed is fixed for optional dither types for now */
+/* not all these are implemented for now */
+void SetDitherBleed(A2BCONTEXT *ctx)
+{
+   switch(ctx->dithertype) {
+        case  FLOYDSTEINBERG:   ctx->bleed = 16; break;
+        case  JARVIS:           ctx->bleed = 48; break;
+        case  STUCKI:           ctx->bleed = 42; break;
+        case  ATKINSON:         ctx->bleed = 8;  break;
+        case  ATKINSON2:        ctx->bleed = 6;  break;
+        case  BURKES:
+        case  SIERRA:           ctx->bleed = 32; break;
+        case  SIERRATWO:        ctx->bleed = 16; break;
+        case  SIERRALITE:       ctx->bleed = 4;  break;
+    }
+}
 
-            /* create the info header */
-            mybmp.bmi.biSize = (ulong)40;
-            mybmp.bmi.biWidth  = (ulong)16;
-            mybmp.bmi.biHeight = (ulong)shrpalettes;
-            mybmp.bmi.biPlanes = 1;
-            mybmp.bmi.biBitCount = 24;
-            mybmp.bmi.biCompression = (ulong) BI_RGB;
+/* ------------------------------------------------------------------------ */
+/* set a conversion context to the same starting values that the old       */
+/* file-scope variables had                                                 */
+/* ------------------------------------------------------------------------ */
+void InitConversionContext(A2BCONTEXT *ctx)
+{
+    int idx;
 
-            outpacket = 48;
-            mybmp.bmi.biSizeImage = (ulong)outpacket;
-            mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+    memset(ctx,0,sizeof(A2BCONTEXT));
 
-            /* create the file header */
-            mybmp.bfi.bfType[0] = 'B';
-            mybmp.bfi.bfType[1] = 'M';
-            mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-            mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+    ctx->longnames = 1;
+    ctx->doublepixel = 1;
+    ctx->palnumber = 5;
+    ctx->dithertype = 9;
+    ctx->hsl = 1;
+    ctx->shrpalette = 15;
+    ctx->shrpalettes = 1;
+    ctx->quietmode = 1;
 
-            /* write the header for the M2S palette BMP */
-            fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    for (idx = 0; idx < 16; idx++) {
+        ctx->desaturate[idx] = 100.0;
+        ctx->brooks5colors[idx] = 2;
+    }
 
-            memset(&bmpscanline[0],0,outpacket);
+    ctx->fragwidth = 140;
+    ctx->fragheight = 192;
 
-            /* write a BMP scanline for each SHR palette entry */
-            for(y=0,y1=shrpalettes-1;y<shrpalettes;y++,y1--) {
-                /* build a scanline of each palette entry */
-                for (x = 0, j=0; x < 16; x++) {
-                    if (shrpalettes == 200) {
-                        /* brooks palettes */
-                        bmpscanline[j] = rgbArrays[y1][x][2]; j++;
-                        bmpscanline[j] = rgbArrays[y1][x][1]; j++;
-                        bmpscanline[j] = rgbArrays[y1][x][0]; j++;
-                    }
-                    else {
-                        /* pic palettes */
-                        bmpscanline[j] = rgb256Arrays[y1][x][2]; j++;
-                        bmpscanline[j] = rgb256Arrays[y1][x][1]; j++;
-                        bmpscanline[j] = rgb256Arrays[y1][x][0]; j++;
+    memcpy(&ctx->rgbArray[0][0],&rgbDefaultArray[0][0],48);
 
-                    }
-                }
-                /* write a scanline of each palette entry */
-                fwrite((char *)&bmpscanline[0],1,outpacket,fp);
-            }
-            fclose(fp);
-            printf("%s created.\n", outfile);
-            /* now that the M2S palette file is written, the M2S proc file is exactly the same as the SHR preview file
-               except that the naming convention follows M2S naming unless in MS-DOS */
-            /* for MS-DOS output we use short names - MS-DOS users will need to rename the pmp file to a bmp file */
+    ctx->globalthreshold = ctx->rhold = ctx->ghold = ctx->bhold = 4;
 
-            if (longnames == 0)sprintf(outfile,"%s.pmp", newname);
-            else sprintf(outfile,"%s_proc.bmp", newname);
-        }
+    ctx->lumaREQ = 601;
+    ctx->lumaRED = 299;
+    ctx->lumaGREEN = 587;
+    ctx->lumaBLUE = 114;
 
-        fp = fopen(outfile,"wb");
-        if (NULL == fp) {
-            puts(szTextTitle);
-            printf("%s cannot be created.\n", outfile);
-            return INVALID;
-        }
+    ctx->brooksline = 999;
+    ctx->distancekernel = SelectDistanceKernel();
+    ctx->bleed = 8;
+    ctx->RandomSeed = (ushort)0xACE1;
+}
 
-        /* 256 color preview is promoted to */
-        /* 24-bit BMP format */
-        outpacket = width * 3;
+/* ------------------------------------------------------------------------ */
+/* convert a single input file using the options already set in a context   */
+/* outname is an optional output base name                                  */
+/* returns 0 on success and 1 on failure like main()                        */
+/* ------------------------------------------------------------------------ */
+int ConvertInputFile(A2BCONTEXT *ctx, char *infile, char *outname)
+{
+  int status = 0, idx, jdx;
+  char fname[256],sname[256],outfile[256], c, d, e, f;
 
-        if (width%2 != 0) outpacket++;
-        while (outpacket%4 != 0)outpacket++;
+  strcpy(fname, infile);
+  strcpy(outfile, outname);
+  sname[0] = ASCIIZ;
 
-        memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+  /* do not allow extensions in output file base names */
+  jdx = 999;
+  for (idx = 0; outfile[idx] != ASCIIZ; idx++) {
+      if (outfile[idx] == '.') jdx = idx;
+      /* but a directory name can have a dot in it */
+      if (outfile[idx] == (char)92 || outfile[idx] == (char)47) jdx = 999;
+  }
+  if (jdx != 999) outfile[jdx] = ASCIIZ;
 
-        /* create the info header */
-        mybmp.bmi.biSize = (ulong)40;
-        mybmp.bmi.biWidth  = (ulong)width;
-        mybmp.bmi.biHeight = (ulong)height;
-        mybmp.bmi.biPlanes = 1;
-        mybmp.bmi.biBitCount = 24;
-        mybmp.bmi.biCompression = (ulong) BI_RGB;
-        mybmp.bmi.biSizeImage = (ulong)outpacket;
-        mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+  jdx = 999;
+  for (idx = 0; fname[idx] != ASCIIZ; idx++) {
+      if (fname[idx] == '.') jdx = idx;
+  }
 
-        /* create the file header */
-        mybmp.bfi.bfType[0] = 'B';
-        mybmp.bfi.bfType[1] = 'M';
-        mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-        mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+  /* automatic bmp file extension for LGR, DLGR, and SHR output */
+  /* we can't just assume that the input file is a bmp file for DHGR output
+     because the input file extension drives the output type
+     and we run the risk of over-writing the wrong file if the user forgets
+     to put an extension on the input file name */
+  if (jdx == 999 && (ctx->lores == 1 || ctx->shr == 320) && fname[0] != (char)ASCIIZ) {
+      strcat(fname,".bmp");
+      for (idx = 0; fname[idx] != ASCIIZ; idx++) {
+        if (fname[idx] == '.') jdx = idx;
+      }
+  }
 
-        /* write the header for the output BMP */
-        fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+  if (jdx != 999)
+  {
+      strcpy(sname, fname);
+      sname[jdx] = ASCIIZ;
+      if (outfile[0] == ASCIIZ)strcpy(outfile,sname);
 
-        memset(&bmpscanline[0],0,outpacket);
-        for(y=0,y1=height-1;y<height;y++,y1--) {
-            for (x = 0, j=0; x < width; x++) {
-                idx = getlopixel(x,y1);
-                /* range check */
-                if (idx > 15)idx = 0; /* default black */
-                /* brooks palettes are scanline oriented */
-                /* the 256 color palette has been copied to the brooks palette */
-                bmpscanline[j] = rgbArrays[y1][idx][2]; j++;
-                bmpscanline[j] = rgbArrays[y1][idx][1]; j++;
-                bmpscanline[j] = rgbArrays[y1][idx][0]; j++;
-            }
-            fwrite((char *)&bmpscanline[0],1,outpacket,fp);
-        }
-        fclose(fp);
-        printf("%s created.\n", outfile);
-    }
+      c = toupper(fname[jdx + 1]);
+      d = toupper(fname[jdx + 2]);
+      e = toupper(fname[jdx + 3]);
 
+      if (ctx->longnames != 0) {
+        /* full-screen formats */
+        f = toupper(fname[jdx + 4]);
+        if (c == 'A' && d == '2' && e == 'F' && f == 'C') ctx->a2fc = 1;
+        if (c == 'A' && d == '2' && e == 'F' && f == 'M') ctx->a2fc = ctx->mono = 1;
+        /* support for Sheldon Simms tohgr */
+        if (c == 'D' && d == 'H' && e == 'G' && f == 'R') ctx->a2fc = ctx->tohgr = 1;
+      }
 
-return SUCCESS;
-}
+      /* support for our extensions only */
+      /* full-screen formats only */
+      if (c == 'B' && d == 'M' && e == 'P') ctx->bmp = 1;
+      /* process back-up if requested */
+      if (c == 'B' && d == 'M' && e == '2') ctx->bmp = ctx->bm2 = 1;
 
+      /* full-screen formats */
+      if (c == '2' && d == 'F' && e == 'C') ctx->a2fc = 1;
+      if (c == 'B' && d == 'I' && e == 'N') ctx->auxbin = 1;
+      if (c == 'A' && d == 'U' && e == 'X') ctx->auxbin = 1;
+      /* image fragments */
+      if (c == 'D' && d == 'H' && e == 'R') ctx->dhr = 1;
 
-/* uses ImageMagick to build the palettes */
-/* clean-up unused vars at some point */
-int Convertfourbit(unsigned char *basename, unsigned char *newname)
-{
 
-    FILE *fp;
-    int packet = INVALID, bmpversion =0;
-    char bmpfile[256], outfile[256];
+      if (c== 'S' && d == 'H') {
+          /* native SHR to M2S format BMP conversion */
+          if (e == 'R' || e == 'G' || e == '2' || e == '3') ctx->shrinput = 1;
+      }
+      /* packed SHR and APF */
+      if (c == 'P' && d == 'N' && e == 'T') ctx->shrinput = 1;
+      if (c == 'A' && d == 'P' && e == 'F') ctx->shrinput = 1;
+      if (c == '3' && d == '2' && e == '0' && fname[jdx + 4] == '1') ctx->shrinput = 1;
 
-    sprintf(bmpfile,"%s.bmp",basename);
-    sprintf(outfile,"%s.4B",newname);
+   }
 
-    if((fp=fopen(bmpfile,"rb"))==NULL) {
-        puts(szTextTitle);
-        printf("%s cannot be opened for input!\nIt probably does not exist or the filename was mis-spelled...\nExiting!\n");
-        return INVALID;
-    }
+   /* native SHR to M2S format BMP conversion
+      all other options will be ignored */
+   if (ctx->shrinput == 1) return shrtom2s(ctx, fname,outfile);
 
-    /* read the header stuff into the appropriate structures,
-       it's likely a bmp file */
-    memset(&BitMapFileHeader.bfType,0,sizeof(BITMAPFILEHEADER));
-    memset(&bmi.biSize,0,sizeof(BITMAPINFOHEADER));
+   ctx->dhrbuf = (uchar *)malloc(32000);
 
-    fread((char *)&BitMapFileHeader.bfType,
-                 sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+   if (ctx->dhrbuf == NULL) {
+        puts("No memory...");
+        return (1);
+   }
 
-    if (bmi.biSize != sizeof(BITMAPINFOHEADER)) {
-		if (bmi.biSize == sizeof(BITMAPINFOHEADERV2)|| bmi.biSize == sizeof(BITMAPINFOHEADERV3)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,(unsigned)bmi.biSize,1,fp);
-            bmpversion = 3;
-		}
-		else if (bmi.biSize == sizeof(BITMAPINFOHEADERV4)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV4),1,fp);
-            bmpversion = 4;
-        }
-        else if (bmi.biSize == sizeof(BITMAPINFOHEADERV5)) {
-            memset(&bmiV5.biSize,0,sizeof(BITMAPINFOHEADERV5));
-            fseek(fp,sizeof(BITMAPFILEHEADER),SEEK_SET);
-            fread((char *)&bmiV5.biSize,sizeof(BITMAPINFOHEADERV5),1,fp);
-            bmpversion = 5;
-            /*
-            Profile data refers to either the profile file name (linked profile)
-            or the actual profile bits (embedded profile).
-            The file format places the profile data at the end of the file.
-            The profile data is placed just after the color table (if present).
-            */
-        }
-        else {
-            bmpversion = 0;
-        }
+   if (ctx->imnumpalettes == 0 && ctx->fourbit == 0) {
+    if (ctx->mono == 1) {
+        if (ctx->shrgrey == 1) puts("Palette : 16 level Grey Scale");
+        else puts("Palette : Black and White Monochrome");
 
     }
     else {
-        bmpversion = 3;
-    }
-
-    if (bmpversion == 0) {
-        fclose(fp);
-        puts(szTextTitle);
-        puts("BMP version not recognized!");
-        return INVALID;
-    }
-
-    if (bmi.biCompression==BI_RGB &&
-        BitMapFileHeader.bfType[0] == 'B' && BitMapFileHeader.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && (bmi.biBitCount == 24 || bmi.biBitCount == 8)) {
-
-        if (bmi.biWidth != 320 || bmi.biHeight != 200) {
-            fclose(fp);
-            puts(szTextTitle);
-            printf("%s is not in a supported size for 4-bit file output.\nExiting!\n", bmpfile);
-            return INVALID;
-        }
-
-        packet = SUCCESS;
-    }
-
-    if (packet == INVALID) {
-        fclose(fp);
-        puts(szTextTitle);
-        printf("%s is not in a supported format for 4-bit file output.\nExiting!\n", bmpfile);
-        return INVALID;
-    }
-
-    if (bmi.biBitCount == 8) {
-       fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+        printf("Palette : %d - %s\n",ctx->palnumber,palname[ctx->palnumber]);
     }
+  }
 
-    fp = ReformatPIMBMP(fp);
-    if (NULL == fp) return INVALID;
-    fclose(fp);
+  SetDitherBleed(ctx);
 
-    remove(outfile);
-    rename("Reformat.bmp",outfile);
-    printf("%s created.\n", outfile);
+  status = INVALID;
 
-return SUCCESS;
-}
+  if (ctx->bmp == 1) {
 
+      if (ctx->fourbit != 0) {
+          status = Convertfourbit(ctx, sname,outfile);
+          ReportDistanceCheck(ctx, fname);
+          free(ctx->dhrbuf);
+          FreeReformatBuffer(ctx);
+          if (status == SUCCESS) return SUCCESS;
+          return 1;
+      }
 
-/* Command Line Options Helper Function */
-int cmpstr(char *str, char *cmp)
-{
-    int i;
+      if (ctx->imnumpalettes != 0) {
+          status = ConvertPIM(ctx, sname,outfile);
+          ReportDistanceCheck(ctx, fname);
+          free(ctx->dhrbuf);
+          FreeReformatBuffer(ctx);
+          if (status == SUCCESS) return SUCCESS;
+          return 1;
+      }
 
-    if (strlen(cmp) != strlen(str)) return INVALID;
-    for (i=0;str[i] != 0;i++) {
-        if (toupper(cmp[i]) != toupper(str[i])) return INVALID;
-    }
-    return SUCCESS;
-}
+      if (ctx->lores == 1 || ctx->shr == 320) {
+          status = ConvertLoResAndSHR(ctx, sname,outfile);
+          ReportDistanceCheck(ctx, fname);
+          free(ctx->dhrbuf);
+          FreeReformatBuffer(ctx);
+          if (status == SUCCESS) return SUCCESS;
+          return 1;
+      }
+      status = ReadHybrid(ctx, sname,outfile);
+      if (status == SUCCESS) ReportDistanceCheck(ctx, fname);
 
+      if (status == SUCCESS) {
+          free(ctx->dhrbuf);
+          FreeReformatBuffer(ctx);
+          return SUCCESS;
+      }
 
-/* raw SHR structures */
-/* FileType $C1 AuxType $0000 - mode320 and mode640 */
-#ifdef MINGW
-typedef struct __attribute__((__packed__)) tagINPIC
-#else
-typedef struct tagINPIC
-#endif
-{
-    uchar line[200][160]; /* 32000 bytes */
-    uchar scb[200];
-    uchar padding[56];
-    uchar pal[16][32];
-} INPIC;
+      status = ReadAppleWin(ctx, sname,outfile);
+      if (status == SUCCESS) {
+          if (ctx->applesoft == 1) status = read_2fc(ctx, outfile);
+          else status = read_binaux(ctx, outfile);
+      }
+  }
+  StatsBegin(ctx->stats,STATS_HEADER);
+  if (ctx->auxbin == 1) status = read_binaux(ctx, sname);
+  if (ctx->a2fc == 1) status = read_2fc(ctx, sname);
+  if (ctx->dhr == 1) status = read_dhr(ctx, sname);
+  StatsEnd(ctx->stats,STATS_HEADER);
 
-/* FileType $C1 AuxType $0002 - mode3200 */
-#ifdef MINGW
-typedef struct __attribute__((__packed__)) tagINBROOKS
-#else
-typedef struct tagINBROOKS
-#endif
-{
-    uchar line[200][160];
-    uchar pal[200][32]; /* $0RGB table buffer palette entries 0-16 reversed */
-} INBROOKS;
+  if (status) {
+    puts(szTextTitle);
+    printf("%s is an Unsupported Format or cannot be opened.\n", fname);
+    free(ctx->dhrbuf);
+    FreeReformatBuffer(ctx);
+    return 1;
+  }
+
+  StatsBegin(ctx->stats,STATS_WRITE);
+  if (ctx->mono == 1) status = save_to_bmp(ctx, outfile, ctx->doublepixel);
+  else status = save_to_bmp24(ctx, outfile);
+  StatsEnd(ctx->stats,STATS_WRITE);
 
-INPIC *p16 = NULL;
-INBROOKS *p200 = NULL;
-uchar *shrbuf = NULL;
+    if (status == SUCCESS) {
+        printf("%s.BMP Saved!\n",outfile);
+    }
+    else {
+        printf("Error saving %s.BMP!\n",outfile);
+        status = 1;
+    }
+    free(ctx->dhrbuf);
+    FreeReformatBuffer(ctx);
+#ifdef MSDOS
+    puts("Have a Nice Dos!");
+#endif
 
+    return status;
+}
 
 
-sshort getshrindex(int x, int y)
+/* converts one file - with option "stats" the stats for the file are saved
+   beside its output as basename_stats.json or basename_trace.json */
+int ConvertFile(A2BCONTEXT *ctx, char *infile, char *outname)
 {
-     uchar *crt, color;
-     int offset;
+  char basename[256];
+  int status, idx, jdx = 999;
 
-     offset = x / 2;
+  if (ctx->statsformat == 0) return ConvertInputFile(ctx, infile, outname);
 
-     /* each SHR scanline is offset by 160 bytes  */
-     offset += (y * 160);
-     crt = (unsigned char *)&shrbuf[offset];
+  /* the output base name or the input name without its extension */
+  if (outname[0] != ASCIIZ) strcpy(basename, outname);
+  else strcpy(basename, infile);
+  for (idx = 0; basename[idx] != ASCIIZ; idx++) {
+      if (basename[idx] == '.') jdx = idx;
+      if (basename[idx] == (char)92 || basename[idx] == (char)47) jdx = 999;
+  }
+  if (jdx != 999) basename[jdx] = ASCIIZ;
 
-     if (x%2 == 0) {
-         /* even pixels */
-         color = crt[0] >> 4;
-     }
-     else {
-         /* odd pixels */
-         color = crt[0] &0xf;
-     }
+  ctx->stats = StatsOpen(ctx->statsformat, "a2b", infile, basename);
+  status = ConvertInputFile(ctx, infile, outname);
+  StatsClose(ctx->stats);
+  ctx->stats = NULL;
 
-     return (sshort)color;
+  return status;
 }
 
 
+/* ------------------------------------------------------------------------ */
+/* Batch Conversion                                                         */
+/* ------------------------------------------------------------------------ */
 
-/* the following provides some equivalent functionality for SHR as
-   what A2B provides for producing BMP files from DHGR files.
-
-   SHR Input files must follow one of our naming conventions.
-   limited to mode320 and mode3200 PIC files.
-*/
+/* a2b can convert a whole directory, a wildcard or a list of files in one run
+   instead of being started once for each file:
 
-/* converts SHR images to imagedata and palette file pairs in BMP format */
-/* provides a 320 x 200 x 24-bit BMP file for editing stray pixels etc.in converted output */
-/* can also be used to convert SHR files produced by other applications to BMP format */
+   a2b mydir options            all the .bmp files in mydir
+   a2b "mydir/*.bmp" options    the files that match a wildcard (* and ?)
+   a2b @mylist.txt options      the files named in a list file, one per line
 
-/* these have lost their original 24-bit precision and should not be re-transformed */
-/* m2s should be used to convert edited files back to PIC or BROOKS files */
-int shrtom2s(char *infile, char *basename)
-{
-    FILE *fp;
-    char procfile[256], palfile[256];
-    ulong flen;
-    int brooks_format = 0;
-    uchar buf[32],r,g,b;
-    ushort *tmppal = (ushort *)&buf[0], *brookspal;
-    sshort x,y,y1,i,j,k;
+   the options are read once into a template context and every input file
+   is converted with its own copy of that context by a pool of worker threads,
+   so the output is the same as running a2b on each file separately.
 
-    /* use the file length to determine what kind of output we
-       will provide */
+   in batch mode an output name on the command line is taken as the output
+   directory. option j followed by a number sets the number of worker threads.
+   by default there is one for each processor. a "*" in a pim seed file path is
+   replaced with the base name of each input file, so that each input gets its
+   own external segmented palettes.
 
-    fp = fopen(infile,"rb");
+   built with -DNOBATCH there is no batch conversion and a2b does not need
+   dirent.h. a batch source on the command line is then reported and not
+   converted. */
 
-    if (fp == NULL) {
-        printf("Could not open SHR file %s\n",infile);
-        return 1;
-    }
+int IsDirectory(char *name)
+{
+    struct stat st;
 
-    /* get the length of the file */
-    fseek(fp, 0L, 2);
-    flen = ftell(fp);
+    if (stat(name,&st) != 0) return 0;
+    if (S_ISDIR(st.st_mode)) return 1;
+    return 0;
+}
 
-    if (flen == (ulong) sizeof(INPIC)) {
-        /* 16 palettes = 32768 bytes */
-        shrbuf = (uchar *) malloc(sizeof(INPIC));
-    }
-    else if (flen == (ulong) sizeof(INBROOKS)) {
-        /* 200 palettes = 38400 bytes */
-        brooks_format = 1;
-        shrbuf = (uchar *) malloc(sizeof(INBROOKS));
-    }
-    else {
-        fclose(fp);
-        printf("%s is not a supported 320 x 200 SHR file\n",infile);
-        return 1;
-    }
+/* a list file, a directory or a wildcard starts a batch conversion */
+int IsBatchSource(char *source)
+{
+    if (source[0] == '@') return 1;
+    if (strchr(source,'*') != NULL || strchr(source,'?') != NULL) return 1;
+    return IsDirectory(source);
+}
 
-    if (NULL == shrbuf) {
-        puts("Not enough memory.");
-        return 1;
-    }
+#ifndef NOBATCH
 
-    rewind(fp);
-    /* read scanlines */
-    fread((uchar *)&shrbuf[0],sizeof(uchar),32000,fp);
+typedef struct tagBATCHJOB
+{
+    char infile[256];
+    int status;
+} BATCHJOB;
 
+typedef struct tagBATCH
+{
+    A2BCONTEXT *tmpl;
+    char outdir[256];
+    char pimseed[256];
+    BATCHJOB *jobs;
+    int numjobs, maxjobs, nextjob, done;
+    pthread_mutex_t lock;
+} BATCH;
+
+/* case insensitive wildcard match for file names */
+int WildMatch(char *pattern, char *name)
+{
+    while (*pattern != ASCIIZ) {
+        if (*pattern == '*') {
+            while (*pattern == '*') pattern++;
+            if (*pattern == ASCIIZ) return 1;
+            while (*name != ASCIIZ) {
+                if (WildMatch(pattern,name) == 1) return 1;
+                name++;
+            }
+            return 0;
+        }
+        if (*name == ASCIIZ) return 0;
+        if (*pattern != '?' && toupper(*pattern) != toupper(*name)) return 0;
+        pattern++;
+        name++;
+    }
+    if (*name == ASCIIZ) return 1;
+    return 0;
+}
 
-    /* read palettes */
-    if (brooks_format == 1) {
-        fread((uchar *)&shrbuf[32000],sizeof(uchar),6400,fp);
-        fclose(fp);
-        /* convert 12-bit brooks palettes to 24-bit BMP palettes */
-        p200 = (INBROOKS *)&shrbuf[0];
-        for (y=0;y<200;y++) {
-            brookspal = (ushort *)&p200[0].pal[y][0];
-            /* flip the brooks palette end for end */
-            for (i=0,k=15; i < 16; i++,k--) tmppal[i] = brookspal[k];
-            /* place decoded 12 bit colors into 24-bit color array */
-            /* the m2s BMP palette file for a BROOKS image contains all 200 palettes
-               (or less)
-            */
-            for (i=0,k=0;i< 16;i++,k+=2) {
-                /* decode $0RGB */
+int AddBatchJob(BATCH *batch, char *dir, char *name)
+{
+    BATCHJOB *jobs;
 
-                g = b = buf[k];
-                r = buf[k+1];
+    if (batch->numjobs == batch->maxjobs) {
+        batch->maxjobs += 256;
+        jobs = (BATCHJOB *)realloc(batch->jobs, sizeof(BATCHJOB) * batch->maxjobs);
+        if (NULL == jobs) return INVALID;
+        batch->jobs = jobs;
+    }
+    if (strlen(dir) + strlen(name) > 250) {
+        printf("%s%s: path is too long, skipped.\n",dir,name);
+        return SUCCESS;
+    }
+    sprintf(batch->jobs[batch->numjobs].infile,"%s%s",dir,name);
+    batch->jobs[batch->numjobs].status = INVALID;
+    batch->numjobs++;
+    return SUCCESS;
+}
 
-                r = (r &0xf);
-                g = (g >> 4);
-                b = (b &0xf);
+int CompareBatchJobs(const void *a, const void *b)
+{
+    return strcmp(((BATCHJOB *)a)->infile,((BATCHJOB *)b)->infile);
+}
 
-                /* do not truncate the low nibble, use 24-bits */
-                rgbArrays[y][i][0] = (uchar) (r << 4 | r);
-                rgbArrays[y][i][1] = (uchar) (g << 4 | g);
-                rgbArrays[y][i][2] = (uchar) (b << 4 | b);
+/* build the list of input files */
+int GetBatchJobs(BATCH *batch, char *source)
+{
+    FILE *fp;
+    DIR *dp;
+    struct dirent *de;
+    char buf[512], dir[256], pattern[256];
+    int idx, jdx, sorted = 1;
+
+    if (source[0] == '@') {
+        /* list file */
+        fp = fopen((char *)&source[1],"r");
+        if (NULL == fp) {
+            printf("Error Opening list file %s!\n",(char *)&source[1]);
+            return INVALID;
+        }
+        while (NULL != fgets(buf,512,fp)) {
+            for (idx = 0; buf[idx] != ASCIIZ; idx++) {
+                if (buf[idx] == LFEED || buf[idx] == CRETURN) buf[idx] = ASCIIZ;
+            }
+            if (buf[0] == ASCIIZ || buf[0] == '#') continue;
+            if (AddBatchJob(batch,"",buf) == INVALID) {
+                fclose(fp);
+                return INVALID;
             }
         }
-
+        fclose(fp);
+        /* a list file is converted in the order given */
+        sorted = 0;
     }
     else {
-        fread((uchar *)&shrbuf[32000],sizeof(uchar),768,fp);
-        fclose(fp);
-        /* convert 12-bit pic palettes into 24-bit BMP palettes */
-        p16 = (INPIC *)&shrbuf[0];
-
-       /* encode into 16 palettes first
-          this is needed for the m2s BMP palette file for a PIC */
-        /* the m2s palette file for a PIC file contains 16 palettes
-           (or less)
-        */
-        for (j=0;j<16;j++) {
-            /* palette colors 0 - 16 */
-            for (i=0,k=0;i< 16;i++,k+=2) {
-                /* decode $0RGB */
-                g = b = p16[0].pal[j][k];
-                r = p16[0].pal[j][k+1];
-
-                r = (r &0xf);
-                g = (g >> 4);
-                b = (b &0xf);
-
-                /* place decoded 12 bit colors into 24-bit color array */
-                rgb256Arrays[j][i][0] = (uchar) (r << 4 | r);
-                rgb256Arrays[j][i][1] = (uchar) (g << 4 | g);
-                rgb256Arrays[j][i][2] = (uchar) (b << 4 | b);
+        /* split the source into a directory and a wildcard pattern */
+        if (strlen(source) > 250) {
+            printf("%s: path is too long!\n",source);
+            return INVALID;
+        }
+        if (IsDirectory(source) == 1) {
+            strcpy(dir,source);
+            strcpy(pattern,"*.bmp");
+        }
+        else {
+            jdx = 999;
+            for (idx = 0; source[idx] != ASCIIZ; idx++) {
+                /* support both forward and back slash for compatibility */
+                if (source[idx] == (char)92 || source[idx] == (char)47) jdx = idx;
+            }
+            if (jdx == 999) {
+                strcpy(dir,".");
+                strcpy(pattern,source);
+            }
+            else {
+                strcpy(dir,source);
+                dir[jdx] = ASCIIZ;
+                if (dir[0] == ASCIIZ) strcpy(dir,"/");
+                strcpy(pattern,(char *)&source[jdx+1]);
             }
-
         }
 
-        /* copy the corresponding palette to the 200 line output array.
-           this will be used to transform image data from the PIC file
-           to 24-bit colors for the m2s BMP proc file */
-        for (y=0;y<200;y++) {
-            j = (sshort) p16[0].scb[y];
-            /* palette colors 0 - 16 */
-            for (i=0;i< 16;i++) {
-                rgbArrays[y][i][0] = rgb256Arrays[j][i][0];
-                rgbArrays[y][i][1] = rgb256Arrays[j][i][1];
-                rgbArrays[y][i][2] = rgb256Arrays[j][i][2];
+        dp = opendir(dir);
+        if (NULL == dp) {
+            printf("Error Opening directory %s!\n",dir);
+            return INVALID;
+        }
+        /* file names in the job list carry the directory */
+        idx = strlen(dir);
+        if (strcmp(dir,".") == 0) dir[0] = ASCIIZ;
+        else if (dir[idx-1] != (char)92 && dir[idx-1] != (char)47) strcat(dir,"/");
+
+        while (NULL != (de = readdir(dp))) {
+            if (de->d_name[0] == '.') continue;
+            if (WildMatch(pattern,de->d_name) == 0) continue;
+            sprintf(buf,"%s%s",dir,de->d_name);
+            if (IsDirectory(buf) == 1) continue;
+            if (AddBatchJob(batch,dir,de->d_name) == INVALID) {
+                closedir(dp);
+                return INVALID;
             }
         }
-
-
-    }
-
-    /* make output file names from basename */
-    sprintf(procfile,"%s_proc.bmp",basename);
-    sprintf(palfile,"%s_palette.bmp",basename);
-
-    /* write image data in BMP format */
-    fp = fopen(procfile,"wb");
-
-    if (fp == NULL) {
-        printf("Could not open %s for writing.\n",procfile);
-        free(shrbuf);
-        return 1;
+        closedir(dp);
     }
 
-    clearcolorsused();
-    memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
-
-    /* create the info header */
-    mybmp.bmi.biSize = (ulong)40;
-    mybmp.bmi.biWidth  = (ulong)320;
-    mybmp.bmi.biHeight = (ulong)200;
-    mybmp.bmi.biPlanes = 1;
-    mybmp.bmi.biBitCount = 24;
-    mybmp.bmi.biCompression = (ulong) BI_RGB;
-    mybmp.bmi.biSizeImage = (ulong)960;
-    mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+    if (sorted == 1 && batch->numjobs > 1)
+        qsort(batch->jobs,batch->numjobs,sizeof(BATCHJOB),CompareBatchJobs);
 
-    /* create the file header */
-    mybmp.bfi.bfType[0] = 'B';
-    mybmp.bfi.bfType[1] = 'M';
-    mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-    mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+    return SUCCESS;
+}
 
-    /* write the header for the output BMP */
-    fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+/* output base name for an input file */
+void BatchOutName(BATCH *batch, char *infile, char *outfile)
+{
+    char *base;
+    int idx, jdx;
 
-    memset(&bmpscanline[0],0,960);
-    for(y=0,y1=199;y<200;y++,y1--) {
-        for (x = 0, j=0; x < 320; x++) {
-            k = getshrindex(x,y1);
-            /* range check */
-            if (k > 15)k = 0; /* default black */
-            b = bmpscanline[j] = rgbArrays[y1][k][2]; j++;
-            g = bmpscanline[j] = rgbArrays[y1][k][1]; j++;
-            r = bmpscanline[j] = rgbArrays[y1][k][0]; j++;
-            shrcolorsused(r,g,b);
+    base = infile;
+    for (idx = 0; infile[idx] != ASCIIZ; idx++) {
+        if (infile[idx] == (char)92 || infile[idx] == (char)47) base = (char *)&infile[idx+1];
+    }
 
+    if (batch->outdir[0] == ASCIIZ) {
+        /* default is the same directory as the input file */
+        strcpy(outfile,infile);
+        jdx = (int)(base - infile);
+    }
+    else {
+        strcpy(outfile,batch->outdir);
+        jdx = strlen(outfile);
+        if (outfile[jdx-1] != (char)92 && outfile[jdx-1] != (char)47) {
+            strcat(outfile,"/");
+            jdx++;
         }
-        fwrite((char *)&bmpscanline[0],1,960,fp);
+        strcat(outfile,base);
     }
-    fclose(fp);
-    printf("%s created.\n",procfile);
 
-    /* write palette data in BMP format */
-    fp = fopen(palfile,"wb");
+    /* remove the extension */
+    base = NULL;
+    for (idx = jdx; outfile[idx] != ASCIIZ; idx++) {
+        if (outfile[idx] == '.') base = (char *)&outfile[idx];
+    }
+    if (NULL != base) *base = ASCIIZ;
+}
 
-    if (fp == NULL) {
-        printf("Could not open %s for writing.\n",palfile);
-        free(shrbuf);
-        return 1;
+/* worker thread - takes the next input file from the list until none are left */
+void *BatchWorker(void *arg)
+{
+    BATCH *batch = (BATCH *)arg;
+    BATCHJOB *job;
+    A2BCONTEXT *ctx;
+    JOBLOG log;
+    char outfile[256], seed[512], *ptr;
+    int idx, jdx, status;
+
+    ctx = (A2BCONTEXT *)malloc(sizeof(A2BCONTEXT));
+    if (NULL == ctx) {
+        puts("No memory...");
+        return NULL;
     }
 
-    memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        idx = batch->nextjob;
+        if (idx < batch->numjobs) batch->nextjob++;
+        pthread_mutex_unlock(&batch->lock);
+        if (idx >= batch->numjobs) break;
+
+        job = (BATCHJOB *)&batch->jobs[idx];
+        memcpy(ctx,batch->tmpl,sizeof(A2BCONTEXT));
+        /* the files are already converted in parallel */
+        ctx->segmentthreads = 1;
+        ctx->batchjob = 1;
+        BatchOutName(batch,job->infile,outfile);
+
+        /* collect the messages of this file */
+        memset(&log,0,sizeof(JOBLOG));
+        pthread_setspecific(joblogkey,&log);
 
-    /* create the info header */
-    mybmp.bmi.biSize = (ulong)40;
-    mybmp.bmi.biWidth  = (ulong)16;
+        status = SUCCESS;
+        if (batch->pimseed[0] != ASCIIZ) {
+            /* replace the * in the seed file path with the input base name */
+            ptr = job->infile;
+            for (jdx = 0; job->infile[jdx] != ASCIIZ; jdx++) {
+                if (job->infile[jdx] == (char)92 || job->infile[jdx] == (char)47) ptr = (char *)&job->infile[jdx+1];
+            }
+            seed[0] = ASCIIZ;
+            strncat(seed,batch->pimseed,(int)(strchr(batch->pimseed,'*') - batch->pimseed));
+            jdx = strlen(seed);
+            strcat(seed,ptr);
+            ptr = NULL;
+            for (; seed[jdx] != ASCIIZ; jdx++) {
+                if (seed[jdx] == '.') ptr = (char *)&seed[jdx];
+            }
+            if (NULL != ptr) *ptr = ASCIIZ;
+            strcat(seed,(char *)(strchr(batch->pimseed,'*') + 1));
+            if (GetPIMPalettes(ctx,seed) != SUCCESS) status = 1;
+        }
+
+        if (status == SUCCESS) status = ConvertFile(ctx,job->infile,outfile);
+        pthread_setspecific(joblogkey,NULL);
+
+        pthread_mutex_lock(&batch->lock);
+        job->status = status;
+        batch->done++;
+        if (log.len > 0) fputs(log.text,stdout);
+        if (status == SUCCESS) printf("[%d/%d] %s converted.\n",batch->done,batch->numjobs,job->infile);
+        else printf("[%d/%d] %s FAILED!\n",batch->done,batch->numjobs,job->infile);
+        fflush(stdout);
+        pthread_mutex_unlock(&batch->lock);
+        if (NULL != log.text) free(log.text);
+    }
+
+    free(ctx);
+    return NULL;
+}
 
-    if (brooks_format == 0)
-        mybmp.bmi.biHeight = (ulong)16;
-    else
-        mybmp.bmi.biHeight = (ulong)200;
+/* convert all the files in a directory, wildcard or list file */
+/* tmpl holds the options, outdir and pimseed are optional, threads is 0 for the default */
+int BatchConvert(A2BCONTEXT *tmpl, char *source, char *outdir, char *pimseed, int threads)
+{
+    BATCH batch;
+    pthread_t *workers;
+    int idx, failed = 0;
 
-    mybmp.bmi.biPlanes = 1;
-    mybmp.bmi.biBitCount = 24;
-    mybmp.bmi.biCompression = (ulong) BI_RGB;
-    mybmp.bmi.biSizeImage = (ulong)48;
-    mybmp.bmi.biSizeImage *= mybmp.bmi.biHeight;
+    memset(&batch,0,sizeof(BATCH));
+    batch.tmpl = tmpl;
+    strcpy(batch.outdir,outdir);
+    strcpy(batch.pimseed,pimseed);
 
-    /* create the file header */
-    mybmp.bfi.bfType[0] = 'B';
-    mybmp.bfi.bfType[1] = 'M';
-    mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
-    mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
+    if (batch.outdir[0] != ASCIIZ && IsDirectory(batch.outdir) == 0) {
+        printf("Output directory %s does not exist!\n",batch.outdir);
+        return 1;
+    }
 
-    /* write the header for the output BMP */
-    fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
+    if (GetBatchJobs(&batch,source) == INVALID) {
+        free(batch.jobs);
+        return 1;
+    }
+    if (batch.numjobs == 0) {
+        printf("%s: no files to convert.\n",source);
+        free(batch.jobs);
+        return 1;
+    }
 
-    memset(&bmpscanline[0],0,48);
+    if (threads < 1) threads = NumberOfProcessors();
+    if (threads > batch.numjobs) threads = batch.numjobs;
+    if (threads > 64) threads = 64;
 
-    if (brooks_format == 0) {
-        for(y=0,y1=15;y<16;y++,y1--) {
-            for (x = 0, j=0; x < 16; x++) {
-                bmpscanline[j] = rgb256Arrays[y1][x][2]; j++;
-                bmpscanline[j] = rgb256Arrays[y1][x][1]; j++;
-                bmpscanline[j] = rgb256Arrays[y1][x][0]; j++;
-            }
-            fwrite((char *)&bmpscanline[0],1,48,fp);
-        }
-    }
-    else {
-        for(y=0,y1=199;y<200;y++,y1--) {
-            for (x = 0, j=0; x < 16; x++) {
-                bmpscanline[j] = rgbArrays[y1][x][2]; j++;
-                bmpscanline[j] = rgbArrays[y1][x][1]; j++;
-                bmpscanline[j] = rgbArrays[y1][x][0]; j++;
-            }
-            fwrite((char *)&bmpscanline[0],1,48,fp);
-        }
+    workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if (NULL == workers) {
+        puts("No memory...");
+        free(batch.jobs);
+        return 1;
     }
 
-    fclose(fp);
-    printf("%s created.\n",palfile);
+    printf("Converting %d files with %d threads.\n",batch.numjobs,threads);
+    pthread_mutex_init(&batch.lock,NULL);
+    /* without a key the workers print as they go */
+    if (pthread_key_create(&joblogkey,NULL) == 0) joblogs = 1;
 
+    for (idx = 0; idx < threads; idx++) {
+        if (pthread_create(&workers[idx],NULL,BatchWorker,&batch) != 0) {
+            /* carry on with the workers that did start */
+            threads = idx;
+            break;
+        }
+    }
+    /* if no thread could be started do the work on this one */
+    if (threads == 0) BatchWorker(&batch);
+    for (idx = 0; idx < threads; idx++) pthread_join(workers[idx],NULL);
 
-    free(shrbuf);
-    puts("Done!");
-    printf("%d unique SHR palette colors in image.\n",shrcolorcount);
+    if (joblogs == 1) {
+        joblogs = 0;
+        pthread_key_delete(joblogkey);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
 
-    return 0;
+    /* report failures at the end so they are not lost in the output */
+    for (idx = 0; idx < batch.numjobs; idx++) {
+        if (batch.jobs[idx].status != SUCCESS) {
+            if (failed == 0) puts("The following files were not converted:");
+            printf("  %s\n",batch.jobs[idx].infile);
+            failed++;
+        }
+    }
+    printf("%d of %d files converted.\n",batch.numjobs-failed,batch.numjobs);
+    free(batch.jobs);
 
+    if (failed != 0) return 1;
+    return SUCCESS;
 }
 
+#else
 
-/*
-#define GRAVITY_CENTER    0
-#define GRAVITY_EAST      1
-#define GRAVITY_NORTHEAST 2
-#define GRAVITY_NORTH     3
-#define GRAVITY_NORTHWEST 4
-#define GRAVITY_SOUTHEAST 5
-#define GRAVITY_SOUTH     6
-#define GRAVITY_SOUTHWEST 7
-#define GRAVITY_WEST      8
-*/
-#define NUM_GRAVITIES     9
+int BatchConvert(A2BCONTEXT *tmpl, char *source, char *outdir, char *pimseed, int threads)
+{
+    printf("%s: this a2b was built without batch conversion.\n",source);
+    return 1;
+}
 
-/* gravity options for cropped output - center (typical) */
-char *geometry[] = {
-"Center",
-"East",
-"NorthEast",
-"North",
-"NorthWest",
-"SouthEast",
-"South",
-"SouthWest",
-"West",
-NULL};
+#endif
 
-char *gravity = "center";
+/* ------------------------------------------------------------------------ */
+/* kernel micro-benchmarks - see ../src_common/bench.h                      */
+/* ------------------------------------------------------------------------ */
 
-/* command line helper function to set ImageMagick geometry for gravity option */
-void SetMagickAspectScript(char *wordptr)
+#define BENCH_RANDOM 65536L
+
+char *benchdithers[] = {
+    "Floyd-Steinberg",
+    "Jarvis",
+    "Stucki",
+    "Atkinson",
+    "Burkes",
+    "Sierra",
+    "Sierra Two",
+    "Sierra Lite",
+    "Buckels",
+    "Atkinson 2"};
+
+/* dither a bmp into the DHGR buffer the same way as the 4-bit conversion */
+void BenchDitherImage(A2BCONTEXT *ctx, BENCHIMAGE *img)
 {
-	int idx;
+    int x, y, i, width = img->width;
+    uchar *ptr;
 
-	if (wordptr[0] != (char) 0) {
-		for (idx = 0;idx < NUM_GRAVITIES;idx++) {
-			if (cmpstr(wordptr,geometry[idx]) == SUCCESS) {
-				gravity = (char *) &geometry[idx][0];
-				return;
-			}
-		}
-	}
+    memset(ctx->dhrbuf,0,16384);
+    memset(&ctx->redDither[0],0,1280);
+    memset(&ctx->greenDither[0],0,1280);
+    memset(&ctx->blueDither[0],0,1280);
+    memset(&ctx->redSeed[0],0,1280);
+    memset(&ctx->greenSeed[0],0,1280);
+    memset(&ctx->blueSeed[0],0,1280);
+    memset(&ctx->redSeed2[0],0,1280);
+    memset(&ctx->greenSeed2[0],0,1280);
+    memset(&ctx->blueSeed2[0],0,1280);
+
+    for (y = 0; y < img->height; y++) {
+        ptr = (uchar *)&img->bgr[y * width * 3];
+        for (x = 0, i = 0; x < width; x++, i+=3) {
+            AdjustShortPixel(1,(sshort *)&ctx->redDither[x],(sshort)ptr[i+2]);
+            AdjustShortPixel(1,(sshort *)&ctx->greenDither[x],(sshort)ptr[i+1]);
+            AdjustShortPixel(1,(sshort *)&ctx->blueDither[x],(sshort)ptr[i]);
+        }
+        BuckelsDither(ctx, y,width,4);
+        memcpy(&ctx->redDither[0],&ctx->redSeed[0],1280);
+        memcpy(&ctx->greenDither[0],&ctx->greenSeed[0],1280);
+        memcpy(&ctx->blueDither[0],&ctx->blueSeed[0],1280);
+        memcpy(&ctx->redSeed[0],&ctx->redSeed2[0],1280);
+        memcpy(&ctx->greenSeed[0],&ctx->greenSeed2[0],1280);
+        memcpy(&ctx->blueSeed[0],&ctx->blueSeed2[0],1280);
+        memset(&ctx->redSeed2[0],0,1280);
+        memset(&ctx->greenSeed2[0],0,1280);
+        memset(&ctx->blueSeed2[0],0,1280);
+    }
 }
 
-
-/* args are image file name, type of output 0 or 1 (.bat or .sh),
-   and whether output is cropped 0 or padded 1 */
-int MakeMagickAspectScript(char *name,int script, int pad)
+/* times GetClosestColor, GetDistColor, each dither in BuckelsDither and dhrgetpixel on their own */
+int KernelBench(A2BCONTEXT *ctx, int numfiles, char **files)
 {
-    FILE *fp, *fp2=NULL;
-    char buf[128], c, d, idfile[256], outfile[256];
-    int i, j, status = 1;
-    float fwidth, fheight;
-    int width, height, cropwidth, cropheight, xtent;
+    BENCHRUN run;
+    BENCHIMAGE *img;
+    DISTWEIGHTS weights;
+    DISTPALETTE distpalette;
+    double pixels;
+    long long fixed;
+    unsigned long check = 0L;
+    uchar *random, *colors, *ptr;
+    char kernel[32];
+    long i, count;
+    int idx, x, y;
+
+    BenchOpen(&run,"a2b",numfiles,files);
+    for (idx = 0; idx < run.numother; idx++) printf("%s is not a BMP or A2FC file!\n",run.other[idx]);
+
+    /* the dithers plot a full screen at most */
+    for (idx = 0, x = 0; idx < run.numbmp; idx++) {
+        if (run.bmp[idx].width > 140 || run.bmp[idx].height > 192) {
+            printf("%s is larger than 140 x 192!\n",run.bmp[idx].name);
+            free(run.bmp[idx].bgr);
+            continue;
+        }
+        memcpy(&run.bmp[x++],&run.bmp[idx],sizeof(BENCHIMAGE));
+    }
+    run.numbmp = x;
+    if (run.numbmp == 0 && run.numa2fc == 0) {
+        puts("No BMP or A2FC files to bench!");
+        return INVALID;
+    }
 
-    /* use image file base name for id file name and batch file or script file name */
-    strcpy(idfile,name);
-    strcpy(outfile,name);
-    j = 999;
-    for (i=0;name[i]!=(char)0;i++){
-		if (name[i] == '.')j=i;
-	}
+    pixels = BenchPixels(&run);
+    random = (uchar *)malloc(BENCH_RANDOM * 3);
+    colors = (uchar *)malloc((size_t)pixels + 1);
+    ctx->dhrbuf = (uchar *)malloc(32000);
+    if (NULL == random || NULL == colors || NULL == ctx->dhrbuf) {
+        if (NULL != random) free(random);
+        if (NULL != colors) free(colors);
+        if (NULL != ctx->dhrbuf) free(ctx->dhrbuf);
+        BenchClose(&run);
+        puts("Not Enough Memory for Bench...");
+        return INVALID;
+    }
+    for (i = 0; i < BENCH_RANDOM * 3; i++) random[i] = (uchar)BenchRandom(&run);
 
-	/* the image file name must have an extension */
-	if (j==999) return status;
-	idfile[j] = outfile[j]=(char)0;
+    /* the default conversion palette */
+    InitDoubleArrays(ctx);
 
-	/* the id file must already exist */
-	strcat(idfile,".id");
-    fp = fopen(idfile,"r");
-    if (fp == NULL) return status;
+    printf("Kernel benchmarks: %d BMP and %d A2FC files\n",run.numbmp,run.numa2fc);
 
-	if (script == 0) strcat(outfile,".bat");
-	else strcat(outfile,".sh");
+    if (run.numbmp > 0) {
+        for (BenchStart(&run); BenchRunning(&run); ) {
+            for (idx = 0, count = 0L; idx < run.numbmp; idx++) {
+                img = &run.bmp[idx];
+                ptr = img->bgr;
+                for (i = 0; i < (long)img->width * img->height; i++, ptr+=3)
+                    colors[count++] = GetClosestColor(ctx, ptr[2],ptr[1],ptr[0]);
+            }
+        }
+        BenchResult(&run,"GetClosestColor","bmp","ns/pixel",pixels,BenchCheckBuffer(0L,colors,count));
+
+        for (BenchStart(&run); BenchRunning(&run); ) {
+            for (idx = 0, count = 0L; idx < run.numbmp; idx++) {
+                img = &run.bmp[idx];
+                for (y = 0; y < img->height; y++, count += img->width)
+                    GetClosestColorRow(ctx, (uchar *)&img->bgr[y * img->width * 3],(uchar *)&colors[count],img->width);
+            }
+        }
+        BenchResult(&run,"GetClosestColorRow","bmp","ns/pixel",pixels,BenchCheckBuffer(0L,colors,count));
 
-    for (;;) {
-        if (NULL == fgets(buf, 128, fp)) {
-            fclose(fp);
-            break;
+        /* the fixed-point distance that option "scb" scores the lines with */
+        SetDistWeights(&weights,ctx->lumaRED,ctx->lumaGREEN,ctx->lumaBLUE,
+                       ctx->dlumaRED,ctx->dlumaGREEN,ctx->dlumaGREEN,ctx->dlumaBLUE);
+        SetDistPalette(&distpalette,ctx->rgbDouble,&weights);
+        for (BenchStart(&run); BenchRunning(&run); ) {
+            for (idx = 0, count = 0L; idx < run.numbmp; idx++) {
+                img = &run.bmp[idx];
+                ptr = img->bgr;
+                for (i = 0; i < (long)img->width * img->height; i++, ptr+=3)
+                    colors[count++] = GetDistColor(&distpalette,&weights,ptr[2],ptr[1],ptr[0],0xffff,&fixed);
+            }
         }
-        nocr(buf);
-        /* this parser is really simplistic... it uses the first widthxheight string preceded by a space...
-           it will probably usually work since we don't usually put widthxheight strings in filenames */
-        width = height = 0;
-        d = (char)0;
-        for (i=0;buf[i]!=(char)0;i++){
-			if (d == (char)32) {
-				width = atoi((char *)&buf[i]);
-			}
-			c = buf[i];
-			if (c=='x' && width > 0) {
-				if (d > (char)47 && d < (char)58) {
-					height = atoi((char *)&buf[i+1]);
-					if (height > 0) break;
-				}
-			}
-			d = c;
-		}
-		if (width == 0) break;
-        if (height == 0) break;
-        if (pad == 0) {
-			/* cropping (not padding) */
-			/* for widescreen images trim both sides, the height remains the same */
-        	fwidth = (float)1.3334 * height;
-        	cropwidth = (int)fwidth;
-        	if (cropwidth > width) {
-				/* if the cropping width is not 1/3 greater than the height, this is a portrait image
-				   and must be cropped in the vertical axis only */
-				cropwidth = width;
-				fheight = (float)0.75 * width;
-				cropheight = (int)fheight;
-			}
-			else {
-				cropheight = height;
-			}
-		}
-		else {
-			fheight = (float)0.75 * width;
-			cropheight = (int)fheight;
-			if (cropheight == height) {
-			   /* if the height is equal to 75% of the width, the output is verbatim (no padding is needed) */
-			   cropwidth = width;
-			   pad = 0;
-			}
-			else if (height < cropheight) {
-			   /* if the height is less than 75% of the width, the output is letterboxed with padding above and below */
-			   xtent = cropwidth = width;
-			}
-			else {
-			   /* if the height is greater than 75% of the width, the output is pillarboxed with padding on the sides */
-			   cropheight = height;
-        	   fwidth = (float)1.3334 * height;
-        	   xtent = cropwidth = (int)fwidth;
-			}
-		}
-        fp2 = fopen(outfile,"w");
-        if (NULL == fp2) break;
+        BenchResult(&run,"GetDistColor","bmp","ns/pixel",pixels,BenchCheckBuffer(0L,colors,count));
+    }
 
-        if (script == 0) {
-			/* batch file output */
-			fprintf(fp2,"@echo off\n");
-			if (pad == 0) {
-				/* %MAGICK% %%f -gravity center -crop 1440x1080+0+0 -define format:BMP %%~nf.bmp */
-				fprintf(fp2,"%%1 %%2 -gravity %s -crop %dx%d+0+0 -define format:BMP %%3.bmp\n",gravity,cropwidth,cropheight);
-			}
-			else {
-			   /* letterbox */
-               /* %MAGICK% %%f -gravity center -background black -extent 1920x1920 -crop 1920x1440+0+0 +repage -define format:BMP %%~nf.bmp */
-               /* pillarbox */
-               /* %MAGICK% %%f -gravity center -background black -extent 2730x2730 -crop 2730x2048+0+0 +repage -define format:BMP %%~nf.bmp */
-               fprintf(fp2,
-               "%%1 %%2 -gravity %s -background black -extent %dx%d -crop %dx%d+0+0 +repage -define format:BMP %%3.bmp\n",
-               gravity,xtent,xtent,cropwidth,cropheight);
+    for (BenchStart(&run); BenchRunning(&run); ) {
+        for (i = 0, check = 0L; i < BENCH_RANDOM * 3; i+=3)
+            check = BenchCheck(check,GetClosestColor(ctx, random[i],random[i+1],random[i+2]));
+    }
+    BenchResult(&run,"GetClosestColor","random","ns/pixel",(double)BENCH_RANDOM,check);
 
-			}
-		}
-		else {
-			/* shell script output */
-			fprintf(fp2,"#!/bin/sh\n");
-			if (pad == 0) {
-				/* $MAGICK $src -gravity center -crop 1440x1080+0+0 -define format:BMP $tgt.bmp */
-				fprintf(fp2,"$1 $2 -gravity %s -crop %dx%d+0+0 -define format:BMP $3.bmp\n",gravity,cropwidth,cropheight);
-			}
-			else {
-               fprintf(fp2,
-               "$1 $2 -gravity %s -background black -extent %dx%d -crop %dx%d+0+0 +repage -define format:BMP $3.bmp\n",
-               gravity,xtent,xtent,cropwidth,cropheight);
+    if (run.numbmp > 0) {
+        ctx->dither = 1;
+        for (ctx->dithertype = FLOYDSTEINBERG; ctx->dithertype <= ATKINSON2; ctx->dithertype++) {
+            SetDitherBleed(ctx);
+            for (BenchStart(&run); BenchRunning(&run); ) {
+                for (idx = 0, check = 0L; idx < run.numbmp; idx++) {
+                    BenchDitherImage(ctx, &run.bmp[idx]);
+                    check = BenchCheckBuffer(check,ctx->dhrbuf,16384L);
+                }
+            }
+            sprintf(kernel,"BuckelsDither %s",benchdithers[ctx->dithertype-1]);
+            BenchResult(&run,kernel,"bmp","ns/pixel",pixels,check);
+        }
+    }
 
-			}
-		}
-        status = 0;
+    if (run.numa2fc > 0) {
+        for (BenchStart(&run); BenchRunning(&run); ) {
+            for (idx = 0, check = 0L; idx < run.numa2fc; idx++) {
+                memcpy(ctx->dhrbuf,run.a2fc[idx].a2fc,16384);
+                for (y = 0; y < 192; y++) {
+                    for (x = 0; x < 140; x++) check = BenchCheck(check,(unsigned)dhrgetpixel(ctx, x,y));
+                }
+            }
+        }
+        BenchResult(&run,"dhrgetpixel","a2fc","ns/pixel",(double)run.numa2fc * 140 * 192,check);
     }
-    fclose(fp);
-    if (NULL != fp2) fclose(fp2);
 
-    return status;
+    free(ctx->dhrbuf);
+    free(colors);
+    free(random);
+    idx = BenchWriteJSON(&run);
+    BenchClose(&run);
+    if (idx != 0) return INVALID;
+    return SUCCESS;
 }
 
+/* the context for the command line conversion */
+A2BCONTEXT maincontext;
 
 int main(int argc, char **argv)
 {
 
   int status = 0, idx, jdx, pset;
   char fname[256],sname[256],outfile[256], c, d, e, f;
+  char pimseed[256];
+  int batchmode = 0, batchthreads = 0;
   uchar *wordptr;
   FILE *fp;
+  A2BCONTEXT *ctx = &maincontext;
 
-  fname[0] = sname[0] = outfile[0] = ASCIIZ;
+  fname[0] = sname[0] = outfile[0] = pimseed[0] = ASCIIZ;
 
-  for (idx = 0; idx < 16; idx++) {
-      desaturate[idx] = 100.0;
-  }
+  InitConversionContext(ctx);
+
+  setluma(ctx);
 
-  setluma();
+  if (argc > 1 && cmpstr(argv[1],"bench") == SUCCESS) {
+    if (KernelBench(ctx, argc - 2,(char **)&argv[2]) == INVALID) return 1;
+    return 0;
+  }
 
 #ifdef MSDOS
-  longnames = 0;
+  ctx->longnames = 0;
   system("cls");
 #endif
 
@@ -7935,11 +10001,16 @@ int main(int argc, char **argv)
     puts("If converting .BIN and .AUX file pairs, both must be present.");
     puts("Default is automatic naming. Optional different output filename.");
     puts("                       \"a2b MyDHires.2FC OutfileBaseName\"");
+    puts("Batch conversion of a directory, a wildcard or a list file of names:");
+    puts("                       \"a2b MyDir [OutDir] options [j4]\"");
+    puts("                   or  \"a2b \"MyDir/*.bmp\" [OutDir] options\" or \"a2b @MyList.txt options\"");
     puts("Option P - Palettes p0-p16");
     puts("Output: 280 x 192 x 24 Bit Windows .BMP File - Default");
     puts("        140 x 192 x 24 Bit Windows .BMP File - Option 140");
     puts("        560 x 384 x Monochrome Windows .BMP File - Option 384");
     puts("        560 x 192 x Monochrome Windows .BMP File - Option 192");
+    puts("Kernel benchmarks:     \"a2b bench ../bmp/*.bmp ../bmp/a2fc/*.A2FC\"");
+    puts("Stage times and color counts: option stats (or stats=trace for a Chrome trace)");
     puts("For additional options read the documentation and source code.");
     puts("Additional output includes Apple II DHGR, LGR and DLGR, and SHR files.");
     puts("Additional output also includes VBMP files (or Previews) and Image Fragments.");
@@ -7953,6 +10024,7 @@ int main(int argc, char **argv)
   }
   else {
     strcpy(fname, argv[1]);
+    batchmode = IsBatchSource(fname);
     /* getopts */
     if (argc > 2) {
         for (idx = 2; idx < argc; idx++) {
@@ -7997,11 +10069,25 @@ int main(int argc, char **argv)
 			   }
 			}
 
+            if (c == 'F' && d == 'I') {
+                /* use the fixed-point color distance that is shared with b2d */
+                if (cmpstr(wordptr,"fixed") == SUCCESS) {
+                    ctx->fixeddistance = 1;
+                    continue;
+                }
+                /* run the fixed-point color distance beside the usual one and report
+                   how often they pick a different color - the usual one is still used */
+                if (cmpstr(wordptr,"fixedcheck") == SUCCESS) {
+                    ctx->fixeddistance = 2;
+                    continue;
+                }
+            }
+
             if (c== 'B' && d == 'M') {
 				/* produce a 24-bit Windows 3.1 compatible BMP file of the input file */
 				/* this is primarily for compatibility with SuperConvert for running SHR comparisons */
 				if (cmpstr(wordptr,"bmp3") == SUCCESS) {
-					bmp3 = 1;
+					ctx->bmp3 = 1;
 					continue;
 				}
 			}
@@ -8015,19 +10101,19 @@ int main(int argc, char **argv)
                     /* creates a copy of the 320 x 200 input file using 12-bit legal GS colors */
                     /* this file is then processed into segmented palettes using ImageMagick */
                     /* it can also be processed into a 16-color external palette for Image Tone rendering */
-                    fourbit = 1;
+                    ctx->fourbit = 1;
                     continue;
                 }
                 if (cmpstr(wordptr,"4play") == SUCCESS) {
                     /* this setting affects only the colors that are in the orginal image and only for the
                        purposes of building palettes... */
-                    fourplay = 1;
+                    ctx->fourplay = 1;
                     continue;
                 }
                 if (cmpstr(wordptr,"4pal") == SUCCESS) {
                     /* use this setting just before we start the building of the palettes */
                     /* this does not apply to segmented external palettes */
-                    fourpal = 1;
+                    ctx->fourpal = 1;
                     continue;
                 }
             }
@@ -8036,14 +10122,24 @@ int main(int argc, char **argv)
                 /* suppress additional output unless quiet mode is disabled - additional output may be useful to some including me */
                 /* note also - windows and MS-DOS users should re-direct to a NUL device in batch (cmd) files
                    to avoid slowing-down processing with extraneous console output */
-                quietmode = 0;
+                ctx->quietmode = 0;
                 continue;
             }
 
             if (c == 'S' && d != (char)0) {
                 /* "lossless" dithering */
                 if (cmpstr(wordptr,"sum") == SUCCESS) {
-                    errorsum = 1;
+                    ctx->errorsum = 1;
+                    continue;
+                }
+                /* adaptive scbs for 16 palette output */
+                if (cmpstr(wordptr,"scb") == SUCCESS) {
+                    ctx->adaptivescb = 1;
+                    continue;
+                }
+                /* stage times and color counts - see ../src_common/stats.h */
+                if (StatsOption((char *)wordptr) != 0) {
+                    ctx->statsformat = StatsOption((char *)wordptr);
                     continue;
                 }
             }
@@ -8051,12 +10147,12 @@ int main(int argc, char **argv)
             if (c == 'M' && d != (char)0) {
                 /* Magick2SHR palette output in addition to SHR preview */
                 if (cmpstr(wordptr,"m2s") == SUCCESS){
-                    vbmp = m2s = 1;
+                    ctx->vbmp = ctx->m2s = 1;
                     continue;
                 }
                 if (cmpstr(wordptr,"mix") == SUCCESS){
                     /* use additional matching palettes for Brooks output */
-                    mix256 = 1;
+                    ctx->mix256 = 1;
                     continue;
                 }
             }
@@ -8078,7 +10174,7 @@ int main(int argc, char **argv)
                 if (d == (char) 0 || d == '0' && wordptr[2] == (char)0) {
                     /* greyscale final output if color not in image */
                     for (d = 0; d < 16; d++) {
-                        if(desaturate[d] == 100.0)desaturate[d] = 0.0;
+                        if(ctx->desaturate[d] == 100.0)ctx->desaturate[d] = 0.0;
                     }
                     continue;
                 }
@@ -8086,7 +10182,7 @@ int main(int argc, char **argv)
                 jdx = atoi((char *)&wordptr[1]);
                 if (jdx > 0 && jdx < 201) {
                     for (d = 0; d < 16; d++) {
-                        if(desaturate[d] == 100.0)desaturate[d] = (double)jdx;
+                        if(ctx->desaturate[d] == 100.0)ctx->desaturate[d] = (double)jdx;
                     }
                     continue;
                 }
@@ -8097,25 +10193,25 @@ int main(int argc, char **argv)
                 /* grey over-ride when making SHR file */
                 jdx = atoi((char *)&wordptr[2]);
                 if (jdx > 0 && jdx < 16) {
-                    greyoveride[jdx] = 1;
-                    desaturate[jdx] = 0.0;
+                    ctx->greyoveride[jdx] = 1;
+                    ctx->desaturate[jdx] = 0.0;
                     continue;
                 }
                 if (cmpstr(wordptr,"go0") == SUCCESS) {
-                    greyoveride[0] = 1;
-                    desaturate[0] = 0.0;
+                    ctx->greyoveride[0] = 1;
+                    ctx->desaturate[0] = 0.0;
                     continue;
                 }
             }
 
             if ((c == 'I' && d == (char)ASCIIZ) || cmpstr(wordptr,"imagetone") == SUCCESS){
-                useimagetone = 1;
+                ctx->useimagetone = 1;
                 continue;
             }
 
 
             if ((c == 'L' && d == (char)ASCIIZ) || cmpstr(wordptr,"lgr") == SUCCESS){
-                lores = 1;
+                ctx->lores = 1;
                 continue;
             }
 
@@ -8126,9 +10222,9 @@ int main(int argc, char **argv)
             else if (cmpstr(wordptr,"MAGICK") == SUCCESS) jdx = 709;/* most modern images */
             else if (cmpstr(wordptr,"HDTV") == SUCCESS) jdx = 240;
             if (jdx != 0) {
-               lumaREQ = jdx;
-               printf("Using Luma Rec. %d\n", lumaREQ);
-               setluma();
+               ctx->lumaREQ = jdx;
+               printf("Using Luma Rec. %d\n", ctx->lumaREQ);
+               setluma(ctx);
                continue;
             }
 
@@ -8136,33 +10232,33 @@ int main(int argc, char **argv)
               /* Luma */
               jdx = atoi((char *)&wordptr[1]);
               if (jdx == 601 || jdx == 709 || jdx == 240 || jdx == 911 || jdx == 411 || jdx == 2020) {
-                  lumaREQ = jdx;
-                  printf("Using Luma Rec. %d\n", lumaREQ);
-                  setluma();
+                  ctx->lumaREQ = jdx;
+                  printf("Using Luma Rec. %d\n", ctx->lumaREQ);
+                  setluma(ctx);
                   continue;
               }
             }
 
             if (cmpstr(wordptr,"dl") == SUCCESS || cmpstr(wordptr,"dlgr") == SUCCESS){
-                lores = doublelores = 1;
+                ctx->lores = ctx->doublelores = 1;
                 continue;
             }
 
             /* DOS 3.3 header will be appended to Apple II Output */
             if (cmpstr(wordptr,"dos") == SUCCESS) {
-                dosheader = 1;
+                ctx->dosheader = 1;
                 continue;
             }
 
             if (cmpstr(wordptr,"shr") == SUCCESS || cmpstr(wordptr,"shr2") == SUCCESS) {
-                shr = 320;
+                ctx->shr = 320;
                 if (cmpstr(wordptr,"shr2") == SUCCESS) {
-                    shr2 = 1;
+                    ctx->shr2 = 1;
                     puts("shr2 is in effect");
                 }
-                if (shrpalette == 15){
-                    palnumber = 15;
-                    GetBuiltinPalette('P','1',palnumber);
+                if (ctx->shrpalette == 15){
+                    ctx->palnumber = 15;
+                    GetBuiltinPalette(ctx, 'P','1',ctx->palnumber);
                 }
                 continue;
             }
@@ -8171,7 +10267,7 @@ int main(int argc, char **argv)
                 cmpstr(wordptr,"drooks3") == SUCCESS || cmpstr(wordptr,"drooks4") == SUCCESS ||
                 cmpstr(wordptr,"drooks5") == SUCCESS) {
                     wordptr[0] = 'b';
-                    usepalettedistance = 1;
+                    ctx->usepalettedistance = 1;
                     puts("Palette distance conversion is now on. This takes longer, be patient.");
             }
 
@@ -8180,26 +10276,26 @@ int main(int argc, char **argv)
                 cmpstr(wordptr,"brooks5") == SUCCESS || cmpstr(wordptr,"ega") == SUCCESS){
 
                 /* mutually exclusive options */
-                brooks2 = brooks3 = brooks4 = brooks5 = useegacolors = 0;
+                ctx->brooks2 = ctx->brooks3 = ctx->brooks4 = ctx->brooks5 = ctx->useegacolors = 0;
 
-                if (cmpstr(wordptr,"brooks2") == SUCCESS) brooks2 = 1;
-                else if (cmpstr(wordptr,"brooks3") == SUCCESS) brooks3 = 1;
+                if (cmpstr(wordptr,"brooks2") == SUCCESS) ctx->brooks2 = 1;
+                else if (cmpstr(wordptr,"brooks3") == SUCCESS) ctx->brooks3 = 1;
                 else if (cmpstr(wordptr,"brooks4") == SUCCESS) {
-                    brooks4 = 1;
+                    ctx->brooks4 = 1;
                 }
                 else if (cmpstr(wordptr,"brooks5") == SUCCESS) {
-                    brooks5 = 1;
+                    ctx->brooks5 = 1;
                 }
                 else if (cmpstr(wordptr,"ega") == SUCCESS) {
-                    useoriginalcolors = useegacolors = 1;
+                    ctx->useoriginalcolors = ctx->useegacolors = 1;
                 }
 
-                shr = 320;
-                brooks = 1;
-                shrgrey = mono = 0;
-                if (shrpalette == 15){
-                    palnumber = 15;
-                    GetBuiltinPalette('P','1',palnumber);
+                ctx->shr = 320;
+                ctx->brooks = 1;
+                ctx->shrgrey = ctx->mono = 0;
+                if (ctx->shrpalette == 15){
+                    ctx->palnumber = 15;
+                    GetBuiltinPalette(ctx, 'P','1',ctx->palnumber);
                 }
                 continue;
             }
@@ -8209,7 +10305,7 @@ int main(int argc, char **argv)
                 cmpstr(wordptr,"dic3") == SUCCESS || cmpstr(wordptr,"dic4") == SUCCESS ||
                 cmpstr(wordptr,"dic5") == SUCCESS){
                     wordptr[0] = 'p';
-                    usepalettedistance = 1;
+                    ctx->usepalettedistance = 1;
                     puts("Palette distance conversion is now on. This takes longer, be patient.");
             }
 
@@ -8218,107 +10314,117 @@ int main(int argc, char **argv)
                 cmpstr(wordptr,"pic5") == SUCCESS){
 
                 /* mutually exclusive options */
-                brooks2 = brooks3 = brooks4 = brooks5 = useegacolors = 0;
+                ctx->brooks2 = ctx->brooks3 = ctx->brooks4 = ctx->brooks5 = ctx->useegacolors = 0;
 
-                if (cmpstr(wordptr,"pic2") == SUCCESS) brooks2 = 1;
-                else if (cmpstr(wordptr,"pic3") == SUCCESS) brooks3 = 1;
+                if (cmpstr(wordptr,"pic2") == SUCCESS) ctx->brooks2 = 1;
+                else if (cmpstr(wordptr,"pic3") == SUCCESS) ctx->brooks3 = 1;
                 else if (cmpstr(wordptr,"pic4") == SUCCESS) {
-                    brooks4 = 1;
+                    ctx->brooks4 = 1;
                 }
                 else if (cmpstr(wordptr,"pic5") == SUCCESS) {
-                    brooks5 = 1;
+                    ctx->brooks5 = 1;
                 }
 
-                shr256 = 1;
-                shr = 320;
-                brooks = 1;
-                shrgrey = mono = 0;
-                if (shrpalette == 15){
-                    palnumber = 15;
-                    GetBuiltinPalette('P','1',palnumber);
+                ctx->shr256 = 1;
+                ctx->shr = 320;
+                ctx->brooks = 1;
+                ctx->shrgrey = ctx->mono = 0;
+                if (ctx->shrpalette == 15){
+                    ctx->palnumber = 15;
+                    GetBuiltinPalette(ctx, 'P','1',ctx->palnumber);
                 }
                 continue;
             }
 
             if (cmpstr(wordptr,"shrgrey") == SUCCESS || cmpstr(wordptr,"shrgray") == SUCCESS) {
-                shr = 320;
-                shrgrey = mono = 1;
-                brooks = 0;
+                ctx->shr = 320;
+                ctx->shrgrey = ctx->mono = 1;
+                ctx->brooks = 0;
                 continue;
             }
 
             if (cmpstr(wordptr,"rgb") == SUCCESS) {
-                hsl = 0;
+                ctx->hsl = 0;
                 continue;
             }
 
 
             if (cmpstr(wordptr,"gs") == SUCCESS) {
-                usegscolors = 1;
+                ctx->usegscolors = 1;
                 continue;
             }
 
             if (cmpstr(wordptr,"gs2") == SUCCESS) {
-                usegspalette = 1;
+                ctx->usegspalette = 1;
                 continue;
             }
 
 
             if (c == 'T' && d == (char)ASCIIZ) {
-                tags = 1;
+                ctx->tags = 1;
                 continue;
             }
 
             if (c == 'D') {
                 if (d == (char)ASCIIZ) {
-                    dither = 1;
+                    ctx->dither = 1;
                     continue;
                 }
                 if (d == 'R' && wordptr[2] == (char) ASCIIZ) {
-                    dither = randomdither = errorsum = 1;
+                    ctx->dither = ctx->randomdither = ctx->errorsum = 1;
                     continue;
                 }
                 if (d == 'F' && wordptr[2] == (char) ASCIIZ) {
-                    dithertype = FLOYDSTEINBERG;
-                    dither = errorsum = 1;
+                    ctx->dithertype = FLOYDSTEINBERG;
+                    ctx->dither = ctx->errorsum = 1;
                     continue;
                 }
                 if (d == 'A') {
                     if (wordptr[2] == (char) ASCIIZ) {
-                        dithertype == ATKINSON;
-                        dither = errorsum = 1;
+                        ctx->dithertype == ATKINSON;
+                        ctx->dither = ctx->errorsum = 1;
                         continue;
                     }
                     else if (wordptr[2] == '2' && wordptr[3] == (char)ASCIIZ) {
-                        dithertype = ATKINSON2;
-                        dither = errorsum = 1;
+                        ctx->dithertype = ATKINSON2;
+                        ctx->dither = ctx->errorsum = 1;
                         continue;
                     }
                 }
             }
 
             if (c == 'O' && d == (char)ASCIIZ) {
-                useoriginalcolors = usegscolors = 1;
-                outline = 1;
+                ctx->useoriginalcolors = ctx->usegscolors = 1;
+                ctx->outline = 1;
                 continue;
             }
 
             if (c == 'O' && d == '1') {
                 if (wordptr[2] == '6' || wordptr[2] == '4') {
-                   useoriginalcolors = usegscolors = 1;
-                   if (wordptr[2] == '6')usesixteencolors = 1;
-                   if (wordptr[2] == '4')usefourteencolors = 1;
+                   ctx->useoriginalcolors = ctx->usegscolors = 1;
+                   if (wordptr[2] == '6')ctx->usesixteencolors = 1;
+                   if (wordptr[2] == '4')ctx->usefourteencolors = 1;
                    continue;
                 }
             }
 
 
+            /* rate-distortion dithering for SHR - "rd" or "rd" followed by lambda */
+            if (c == 'R' && d == 'D') {
+                if (e == (char)ASCIIZ) jdx = RD_LAMBDA;
+                else jdx = atoi((char *)&wordptr[2]);
+                if (jdx > 0) {
+                    ctx->rdlambda = jdx;
+                    continue;
+                }
+            }
+
             if (c == 'R') {
                if (d == (char)ASCIIZ) jdx = 25;
                else jdx = atoi((char *)&wordptr[1]);
                if (jdx != 0) {
                     if (jdx > 0 && jdx < 101) {
-                        bleed = (8 * (100 + jdx))/ 100;
+                        ctx->bleed = (8 * (100 + jdx))/ 100;
                         printf("%d percent reduced color bleed\n",jdx);
                     }
                     continue;
@@ -8329,13 +10435,13 @@ int main(int argc, char **argv)
             /* also applies to A2FC pixel-art (pixel level dithering) output from 24-bit BMP's */
             if ((c == 'A' && d == (char)ASCIIZ) || cmpstr(wordptr,"BIN") == SUCCESS) {
                 /* output AUX,BIN - default is A2FC */
-                applesoft = 1;
+                ctx->applesoft = 1;
                 continue;
             }
 
             /* VBMP output for DHGR or preview output for LGR/DLGR and SHR */
             if ((c == 'V' && d == (char)ASCIIZ) || cmpstr(wordptr,"VBMP") == SUCCESS) {
-                vbmp = 1;
+                ctx->vbmp = 1;
                 continue;
             }
 
@@ -8349,45 +10455,92 @@ int main(int argc, char **argv)
                 if (jdx < 0) continue;
                 if (c == 'X') {
                     if (jdx > 139) continue;
-                    fragx = (ushort) jdx;
+                    ctx->fragx = (ushort) jdx;
                 }
                 else if (c == 'Y') {
                     if (jdx > 191) continue;
-                    fragy = (ushort) jdx;
+                    ctx->fragy = (ushort) jdx;
                 }
                 else if (c == 'W') {
                     if (jdx < 1 || jdx > 140) continue;
-                    fragwidth = (ushort) jdx;
+                    ctx->fragwidth = (ushort) jdx;
                 }
                 else if (c == 'H') {
                     if (jdx < 1 || jdx > 192) continue;
-                    fragheight = (ushort) jdx;
+                    ctx->fragheight = (ushort) jdx;
+                }
+                ctx->frag = 1;
+                continue;
+            }
+
+            /* k-means line palettes for brooks output */
+            /* "kmeans" or "kmeans" followed by the iterations per line, "kt" followed by a time budget in ms */
+            if (c == 'K') {
+                if (cmpstr(wordptr,"kmeans") == SUCCESS) {
+                    ctx->kmeans = 8;
+                    continue;
+                }
+                if (d == 'M' && strlen((char *)wordptr) > 6 && toupper(wordptr[2]) == 'E' && toupper(wordptr[3]) == 'A' &&
+                    toupper(wordptr[4]) == 'N' && toupper(wordptr[5]) == 'S') {
+                    jdx = atoi((char *)&wordptr[6]);
+                    if (jdx > 0 && jdx < 101) ctx->kmeans = jdx;
+                    continue;
+                }
+                if (d == 'T') {
+                    jdx = atoi((char *)&wordptr[2]);
+                    if (jdx > 0) ctx->kmeanstime = jdx;
+                    continue;
                 }
-                frag = 1;
+            }
+
+            /* number of worker threads for batch conversion */
+            if (c == 'J' && d >= '0' && d <= '9') {
+                batchthreads = atoi((char *)&wordptr[1]);
                 continue;
             }
 
             jdx = atoi((char *)&wordptr[0]);
             if (jdx == 140) {
                 /* 140 x 192 x 24-bit color BMP output option - default is 280 x 192 24-bit color BMP */
-                doublepixel = 0;
+                ctx->doublepixel = 0;
                 continue;
             }
             if ((c == 'M' && d == (char)ASCIIZ)|| jdx == 384 || jdx == 192 || cmpstr(wordptr,"mono") == SUCCESS) {
                 /* 560 x 384 or 560 x 192 monochrome BMP output option - default is 280 x 192 24-bit color BMP */
-                mono = 1;
+                ctx->mono = 1;
                 if (jdx == 192) {
-                    doublepixel = 0;
+                    ctx->doublepixel = 0;
                 }
                 continue;
             }
+            /* packed SHR output instead of the raw SHR file */
+            if (cmpstr(wordptr,"pnt") == SUCCESS || cmpstr(wordptr,"apf") == SUCCESS) {
+                ctx->packedshr = 1;
+                continue;
+            }
+            if (jdx == 3201) {
+                ctx->packedshr = 2;
+                continue;
+            }
             if (c == 'P') {
 
                 /* experimental ImageMagick segmentation for SHR output */
                 /* literal "pim" followed by "seed" palette pathname - sets conversion mode if valid */
                 if (toupper(wordptr[1]) == 'I') {
                     if (toupper(wordptr[2]) == 'M') {
-                        if (GetPIMPalettes((char *)&wordptr[3]) == SUCCESS) continue;
+                        /* or "pim" followed by 1, 8, 16 or 200 builds the palettes without ImageMagick */
+                        jdx = atoi((char *)&wordptr[3]);
+                        if (jdx == 1 || jdx == 8 || jdx == 16 || jdx == 200) {
+                            ctx->imnumpalettes = jdx;
+                            ctx->pimquantize = 1;
+                            continue;
+                        }
+                        /* in batch mode a * in the seed path is the input base name */
+                        if (batchmode == 1 && strchr((char *)&wordptr[3],'*') != NULL) {
+                            strcpy(pimseed,(char *)&wordptr[3]);
+                            continue;
+                        }
+                        if (GetPIMPalettes(ctx, (char *)&wordptr[3]) == SUCCESS) continue;
                         puts("Exiting...");
                         return (1);
 
@@ -8396,10 +10549,10 @@ int main(int argc, char **argv)
 
                 /* other palette routines */
                 /* first check for a bmp or a pcxfile being used as a palette */
-                jdx = GetBmpOrPcxPalette((char *)&wordptr[1]);
+                jdx = GetBmpOrPcxPalette(ctx, (char *)&wordptr[1]);
                 if (jdx != SUCCESS) {
                     /* always check for a user definable palette file */
-                    jdx = GetUserPalette((char *)&wordptr[1]);
+                    jdx = GetUserPalette(ctx, (char *)&wordptr[1]);
                 }
 
                 if (jdx == SUCCESS) {
@@ -8410,15 +10563,15 @@ int main(int argc, char **argv)
                     jdx = atoi((char *)&wordptr[1]);
                 }
                 /* palette option - p0 to p16 */
-                jdx = GetBuiltinPalette(c,d,jdx);
+                jdx = GetBuiltinPalette(ctx, c,d,jdx);
                 if (jdx != -1) {
-                    palnumber = jdx;
-                    shrpalette = palnumber;
+                    ctx->palnumber = jdx;
+                    ctx->shrpalette = ctx->palnumber;
                     continue;
                 }
             }
             if (cmpstr(wordptr,"full") == SUCCESS){
-                doublegrey = 1;
+                ctx->doublegrey = 1;
                 continue;
             }
             /* this is somewhat problematic */
@@ -8432,168 +10585,8 @@ int main(int argc, char **argv)
   }
 
 
-  /* do not allow extensions in output file base names */
-  jdx = 999;
-  for (idx = 0; outfile[idx] != ASCIIZ; idx++) {
-      if (outfile[idx] == '.') jdx = idx;
-  }
-  if (jdx != 999) outfile[jdx] = ASCIIZ;
-
-  jdx = 999;
-  for (idx = 0; fname[idx] != ASCIIZ; idx++) {
-      if (fname[idx] == '.') jdx = idx;
-  }
-
-  /* automatic bmp file extension for LGR, DLGR, and SHR output */
-  /* we can't just assume that the input file is a bmp file for DHGR output
-     because the input file extension drives the output type
-     and we run the risk of over-writing the wrong file if the user forgets
-     to put an extension on the input file name */
-  if (jdx == 999 && (lores == 1 || shr == 320) && fname[0] != (char)ASCIIZ) {
-      strcat(fname,".bmp");
-      for (idx = 0; fname[idx] != ASCIIZ; idx++) {
-        if (fname[idx] == '.') jdx = idx;
-      }
-  }
-
-  if (jdx != 999)
-  {
-      strcpy(sname, fname);
-      sname[jdx] = ASCIIZ;
-      if (outfile[0] == ASCIIZ)strcpy(outfile,sname);
-
-      c = toupper(fname[jdx + 1]);
-      d = toupper(fname[jdx + 2]);
-      e = toupper(fname[jdx + 3]);
-
-      if (longnames != 0) {
-        /* full-screen formats */
-        f = toupper(fname[jdx + 4]);
-        if (c == 'A' && d == '2' && e == 'F' && f == 'C') a2fc = 1;
-        if (c == 'A' && d == '2' && e == 'F' && f == 'M') a2fc = mono = 1;
-        /* support for Sheldon Simms tohgr */
-        if (c == 'D' && d == 'H' && e == 'G' && f == 'R') a2fc = tohgr = 1;
-      }
-
-      /* support for our extensions only */
-      /* full-screen formats only */
-      if (c == 'B' && d == 'M' && e == 'P') bmp = 1;
-      /* process back-up if requested */
-      if (c == 'B' && d == 'M' && e == '2') bmp = bm2 = 1;
-
-      /* full-screen formats */
-      if (c == '2' && d == 'F' && e == 'C') a2fc = 1;
-      if (c == 'B' && d == 'I' && e == 'N') auxbin = 1;
-      if (c == 'A' && d == 'U' && e == 'X') auxbin = 1;
-      /* image fragments */
-      if (c == 'D' && d == 'H' && e == 'R') dhr = 1;
-
-
-      if (c== 'S' && d == 'H') {
-          /* native SHR to M2S format BMP conversion */
-          if (e == 'R' || e == 'G' || e == '2' || e == '3') shrinput = 1;
-      }
-
-   }
-
-   /* native SHR to M2S format BMP conversion
-      all other options will be ignored */
-   if (shrinput == 1) return shrtom2s(fname,outfile);
-
-   dhrbuf = (uchar *)malloc(32000);
-
-   if (dhrbuf == NULL) {
-        puts("No memory...");
-        return (1);
-   }
-
-   if (imnumpalettes == 0 && fourbit == 0) {
-    if (mono == 1) {
-        if (shrgrey == 1) puts("Palette : 16 level Grey Scale");
-        else puts("Palette : Black and White Monochrome");
-
-    }
-    else {
-        printf("Palette : %d - %s\n",palnumber,palname[palnumber]);
-    }
-  }
-
-  /* color bleed is fixed for optional dither types for now */
-  /* not all these are implemented for now */
-   switch(dithertype) {
-        case  FLOYDSTEINBERG:   bleed = 16; break;
-        case  JARVIS:           bleed = 48; break;
-        case  STUCKI:           bleed = 42; break;
-        case  ATKINSON:         bleed = 8;  break;
-        case  ATKINSON2:        bleed = 6;  break;
-        case  BURKES:
-        case  SIERRA:           bleed = 32; break;
-        case  SIERRATWO:        bleed = 16; break;
-        case  SIERRALITE:       bleed = 4;  break;
-    }
-
-  status = INVALID;
-
-  if (bmp == 1) {
-
-      if (fourbit != 0) {
-          status = Convertfourbit(sname,outfile);
-          free(dhrbuf);
-          if (status == SUCCESS) return SUCCESS;
-          return 1;
-      }
-
-      if (imnumpalettes != 0) {
-          status = ConvertPIM(sname,outfile);
-          free(dhrbuf);
-          if (status == SUCCESS) return SUCCESS;
-          return 1;
-      }
-
-      if (lores == 1 || shr == 320) {
-          status = ConvertLoResAndSHR(sname,outfile);
-          free(dhrbuf);
-          if (status == SUCCESS) return SUCCESS;
-          return 1;
-      }
-      status = ReadHybrid(sname,outfile);
-
-      if (status == SUCCESS) {
-          free(dhrbuf);
-          return SUCCESS;
-      }
-
-      status = ReadAppleWin(sname,outfile);
-      if (status == SUCCESS) {
-          if (applesoft == 1) status = read_2fc(outfile);
-          else status = read_binaux(outfile);
-      }
-  }
-  if (auxbin == 1) status = read_binaux(sname);
-  if (a2fc == 1) status = read_2fc(sname);
-  if (dhr == 1) status = read_dhr(sname);
-
-  if (status) {
-    puts(szTextTitle);
-    printf("%s is an Unsupported Format or cannot be opened.\n", fname);
-    free(dhrbuf);
-    return 1;
-  }
-
-  if (mono == 1) status = save_to_bmp(outfile, doublepixel);
-  else status = save_to_bmp24(outfile);
-
-    if (status == SUCCESS) {
-        printf("%s.BMP Saved!\n",outfile);
-    }
-    else {
-        printf("Error saving %s.BMP!\n",outfile);
-        status = 1;
-    }
-    free(dhrbuf);
-#ifdef MSDOS
-    puts("Have a Nice Dos!");
-#endif
+  /* batch conversion of a directory, a wildcard or a list file */
+  if (batchmode == 1) return BatchConvert(ctx,fname,outfile,pimseed,batchthreads);
 
-    return status;
+  return ConvertFile(ctx,fname,outfile);
 }
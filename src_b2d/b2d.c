@@ -313,6 +313,8 @@ char *usage[] = {
 "Optional Usage: \"b2d input.bmp L (or DL) options\"",
 "  For Color LGR or DLGR Full Screen or Mixed Screen (option \"TOP\") Output",
 "See documentation for more information including additional input size info",
+"Kernel Benchmarks: \"b2d bench ../bmp/*.bmp ../bmp/a2fc/*.A2FC [fixed]\"",
+"Stage Times and Color Counts: option \"stats\" (or \"stats=trace\" for a Chrome trace)",
 NULL};
 
 char *dithertext[] = {
@@ -563,6 +565,15 @@ void InitDoubleArrays()
 		rgbDoubleDarken[i][2] = db;
 		rgbLumaDarken[i] = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
 	}
+
+	/* the same palettes for the fixed-point color distance */
+	/* b2d weighs blue with the green coefficient */
+	if (fixeddistance != 0) {
+		SetDistWeights(&distweights,lumaRED,lumaGREEN,lumaBLUE,dlumaRED,dlumaGREEN,dlumaGREEN,dlumaGREEN);
+		SetDistPalette(&distmed,rgbDouble,&distweights);
+		SetDistPalette(&disthigh,rgbDoubleBrighten,&distweights);
+		SetDistPalette(&distlow,rgbDoubleDarken,&distweights);
+	}
 }
 
 
@@ -950,6 +961,34 @@ void BuildPseudoPalette(sshort palidx)
 	}
 }
 
+/* the colors that GetMedColor(), GetHighColor() and GetLowColor() can pick */
+unsigned GetDitherMask()
+{
+	/* dither7 is set in FloydSteinberg() function */
+	if (dither7 == 'O') return (1U | (1U << LOMEDBLUE) | (1U << LOORANGE) | (1U << LOWHITE));
+	if (dither7 != (uchar) 0) return (1U | (1U << LOPURPLE) | (1U << LOLTGREEN) | (1U << LOWHITE));
+	return 0xffff;
+}
+
+/* closest color using the fixed-point color distance */
+uchar GetFixedColor(DISTPALETTE *pal, uchar r, uchar g, uchar b, double *paldistance)
+{
+	long long distance;
+	uchar drawcolor = GetDistColor(pal,&distweights,r,g,b,GetDitherMask(),&distance);
+
+	paldistance[0] = (double)distance / DIST_SCALE;
+	return drawcolor;
+}
+
+/* count the colors where the fixed-point color distance picks another color */
+void CheckFixedColor(DISTPALETTE *pal, uchar r, uchar g, uchar b, uchar drawcolor)
+{
+	double distance;
+
+	distlookups++;
+	if (GetFixedColor(pal,r,g,b,&distance) != drawcolor) distmismatches++;
+}
+
 /* use CCIR 601 luminosity to get closest color in current palette */
 /* based on palette that has been selected for conversion */
 uchar GetMedColor(uchar r, uchar g, uchar b, double *paldistance)
@@ -958,6 +997,8 @@ uchar GetMedColor(uchar r, uchar g, uchar b, double *paldistance)
 	double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
 	int i;
 
+	if (fixeddistance == 1) return GetFixedColor(&distmed,r,g,b,paldistance);
+
     dr = (double)r;
     dg = (double)g;
     db = (double)b;
@@ -1011,6 +1052,7 @@ uchar GetMedColor(uchar r, uchar g, uchar b, double *paldistance)
 		}
 
 	}
+	if (fixeddistance == 2) CheckFixedColor(&distmed,r,g,b,drawcolor);
 	return drawcolor;
 }
 
@@ -1024,6 +1066,8 @@ uchar GetHighColor(uchar r, uchar g, uchar b, double *paldistance)
 	double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
 	int i;
 
+	if (fixeddistance == 1) return GetFixedColor(&disthigh,r,g,b,paldistance);
+
     dr = (double)r;
     dg = (double)g;
     db = (double)b;
@@ -1077,6 +1121,7 @@ uchar GetHighColor(uchar r, uchar g, uchar b, double *paldistance)
 		}
 
 	}
+	if (fixeddistance == 2) CheckFixedColor(&disthigh,r,g,b,drawcolor);
 	return drawcolor;
 }
 
@@ -1089,6 +1134,8 @@ uchar GetLowColor(uchar r, uchar g, uchar b, double *paldistance)
 	double dr, dg, db, diffR, diffG, diffB, luma, lumadiff, distance, prevdistance;
 	int i;
 
+	if (fixeddistance == 1) return GetFixedColor(&distlow,r,g,b,paldistance);
+
     dr = (double)r;
     dg = (double)g;
     db = (double)b;
@@ -1142,23 +1189,19 @@ uchar GetLowColor(uchar r, uchar g, uchar b, double *paldistance)
 		}
 
 	}
+	if (fixeddistance == 2) CheckFixedColor(&distlow,r,g,b,drawcolor);
 	return drawcolor;
 }
 
-/* switchboard function to handle cross-hatched and non-cross-hatched output */
-/* keeps the conditionals out of the main loop */
-uchar GetDrawColor(uchar r, uchar g, uchar b, int x, int y)
+/* quick check for verbatim match in the current palette or hgr palette subset */
+/* returns 255 if the 12-bit color is not in the palette */
+uchar GetVerbatimColor(uchar r, uchar g, uchar b)
 {
-
-    /* additional vars for future */
-    double distance, lowdistance, highdistance;
-    uchar drawcolor, lowcolor, highcolor;
     uchar red 	= (uchar)(r >> 4),
 		  green = (uchar)(g >> 4),
 		  blue 	= (uchar)(b >> 4);
     int i;
 
-	/* quick check for verbatim match */
 	for (i = 0; i < 16; i++) {
 
         /* error test for doing dithered HGR */
@@ -1180,16 +1223,186 @@ uchar GetDrawColor(uchar r, uchar g, uchar b, int x, int y)
 			rgbAppleArray[i][2] == blue) return (uchar)i;
 
 	}
+	return 255;
+}
+
+/* closest color in the med, high or low palette after checking for a verbatim match */
+uchar MatchDrawColor(uchar r, uchar g, uchar b, int lut)
+{
+	double distance;
+	uchar drawcolor = GetVerbatimColor(r,g,b);
+
+	if (drawcolor != 255) {
+		StatsCount(stats,STATS_EXACT,1L);
+		return drawcolor;
+	}
+
+	switch(lut) {
+		case LUT_HIGH: return GetHighColor(r,g,b,&distance);
+		case LUT_LOW:  return GetLowColor(r,g,b,&distance);
+	}
+	return GetMedColor(r,g,b,&distance);
+}
+
+/* palette arrays of the med, high or low palette */
+void GetLutPalette(int lut, double (**pal)[3], double **palluma)
+{
+	switch(lut) {
+		case LUT_HIGH: *pal = rgbDoubleBrighten; *palluma = rgbLumaBrighten; break;
+		case LUT_LOW:  *pal = rgbDoubleDarken; *palluma = rgbLumaDarken; break;
+		default:       *pal = rgbDouble; *palluma = rgbLuma;
+	}
+}
+
+/* the palette colors that can be closest to some color in a cell of the
+   color cache */
+/* the distances to 2 palette colors differ by a linear function of r, g and b,
+   so a color that is farther than the closest color at the middle of the cell
+   by more than the slope of the difference across the cell can never be the
+   closest color in the cell. */
+ushort GetCellColors(uchar r, uchar g, uchar b, int lut)
+{
+	double (*pal)[3], *palluma;
+	double dr, dg, db, luma, lumadiff, diffR, diffG, diffB, slope;
+	double distance[16];
+	ushort mask = 0;
+	int i, best = 0;
+
+	/* a cell lies inside a single 12-bit color */
+	i = (int)GetVerbatimColor(r,g,b);
+	if (i != 255) return (ushort)(1 << i);
+
+	GetLutPalette(lut,&pal,&palluma);
+
+	/* same distance as GetMedColor(), GetHighColor() and GetLowColor() */
+	dr = (double)(r & 0xf8) + 3.5;
+	dg = (double)(g & 0xf8) + 3.5;
+	db = (double)(b & 0xf8) + 3.5;
+	luma = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
+	for (i = 0; i < 16; i++) {
+		if (i != 0 && dither7 != (uchar) 0) {
+			if (dither7 == 'O') {
+				if (i != LOMEDBLUE && i!= LOORANGE && i!= LOWHITE) continue;
+			}
+			else {
+				if (i != LOPURPLE && i!= LOLTGREEN && i!= LOWHITE) continue;
+			}
+		}
+		lumadiff = palluma[i]-luma;
+		diffR = (pal[i][0]-dr)/255.0;
+		diffG = (pal[i][1]-dg)/255.0;
+		diffB = (pal[i][2]-db)/255.0;
+		distance[i] = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
+			+ lumadiff*lumadiff;
+		if (distance[i] < distance[best]) best = i;
+		mask |= (ushort)(1 << i);
+	}
+
+	for (i = 0; i < 16; i++) {
+		if (i == best || 0 == (mask & (1 << i))) continue;
+		/* the change of the difference over half a cell in each gun */
+		lumadiff = (palluma[i] - palluma[best]) * 2.0 / (255.0*1000);
+		slope = fabs((pal[i][0] - pal[best][0]) * 1.5 * dlumaRED / (255.0*255.0) + lumadiff * lumaRED) +
+				fabs((pal[i][1] - pal[best][1]) * 1.5 * dlumaGREEN / (255.0*255.0) + lumadiff * lumaGREEN) +
+				fabs((pal[i][2] - pal[best][2]) * 1.5 * dlumaGREEN / (255.0*255.0) + lumadiff * lumaBLUE);
+		/* with room to spare for rounding */
+		if (distance[i] - distance[best] > slope * 3.5 + 0.000001) mask &= (ushort)~(1 << i);
+	}
+	return mask;
+}
+
+/* the closest color in the med, high or low palette */
+/* the palettes do not change during a conversion, so 5 bits of each gun pick a
+   cell of the cache that keeps the palette colors that can be closest in it.
+   a cell with one color is used as it is, otherwise only its colors are
+   compared. the match is always the same as MatchDrawColor(). */
+uchar GetLutColor(uchar r, uchar g, uchar b, int lut)
+{
+	double (*pal)[3], *palluma;
+	double dr, dg, db, luma, lumadiff, diffR, diffG, diffB, distance, prevdistance;
+	ushort *ptr, mask;
+	uchar drawcolor;
+	int set = 0, i;
+
+	StatsCount(stats,STATS_NEAREST,1L);
+
+	/* the fixed point distances are rounded and do not follow the cell
+	   rule, and option "fixedcheck" compares every lookup */
+	if (fixeddistance != 0) return MatchDrawColor(r,g,b,lut);
+
+	if (dither7 != (uchar) 0) {
+		if (dither7 == 'O') set = 1;
+		else set = 2;
+	}
+
+	if (NULL == colorlut[lut][set]) {
+		colorlut[lut][set] = (ushort *)calloc(LUT_CELLS,sizeof(ushort));
+		if (NULL == colorlut[lut][set]) return MatchDrawColor(r,g,b,lut);
+	}
+	ptr = (ushort *)&colorlut[lut][set][((ulong)(r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+	if (ptr[0] == 0) ptr[0] = GetCellColors(r,g,b,lut);
+	mask = ptr[0];
+
+	if (0 == (mask & (mask - 1))) {
+		StatsCount(stats,STATS_TABLE,1L);
+		for (drawcolor = 0; mask > 1; drawcolor++) mask >>= 1;
+		return drawcolor;
+	}
+
+	/* a verbatim match is a cell with one color, so this is the rest of
+	   MatchDrawColor() for the colors in the cell */
+	GetLutPalette(lut,&pal,&palluma);
+    dr = (double)r;
+    dg = (double)g;
+    db = (double)b;
+    luma = (dr*lumaRED + dg*lumaGREEN + db*lumaBLUE) / (255.0*1000);
+	drawcolor = 255;
+	prevdistance = 0.0;
+	for (i = 0; i < 16; i++) {
+		if (0 == (mask & (1 << i))) continue;
+		lumadiff = palluma[i]-luma;
+		diffR = (pal[i][0]-dr)/255.0;
+		diffG = (pal[i][1]-dg)/255.0;
+		diffB = (pal[i][2]-db)/255.0;
+    	distance = (diffR*diffR*dlumaRED + diffG*diffG*dlumaGREEN + diffB*diffB*dlumaGREEN)*0.75
+         	+ lumadiff*lumadiff;
+		if (drawcolor == 255 || distance < prevdistance) {
+			prevdistance = distance;
+			drawcolor = (uchar)i;
+		}
+	}
+	return drawcolor;
+}
+
+void FreeColorTables()
+{
+	int lut, set;
+
+	for (lut = 0; lut < 3; lut++) {
+		for (set = 0; set < 3; set++) {
+			if (NULL != colorlut[lut][set]) {
+				free(colorlut[lut][set]);
+				colorlut[lut][set] = NULL;
+			}
+		}
+	}
+}
+
+/* switchboard function to handle cross-hatched and non-cross-hatched output */
+/* keeps the conditionals out of the main loop */
+/* returns the palette to match the pixel at x,y with */
+int GetDrawLut(int x, int y)
+{
 
     /* non-cross-hatched output */
-    if (threshold == 0 && ymatrix == 0) return GetMedColor(r,g,b,&distance);
+    if (threshold == 0 && ymatrix == 0) return LUT_MED;
 
     if (ymatrix != 0) {
         switch(ymatrix) {
-        	case 1: return GetLowColor(r,g,b,&lowdistance);
-        	case 3: return GetHighColor(r,g,b,&highdistance);
+        	case 1: return LUT_LOW;
+        	case 3: return LUT_HIGH;
         	case 2:
-        	default:return GetMedColor(r,g,b,&distance);
+        	default:return LUT_MED;
 		}
 	}
 
@@ -1205,22 +1418,22 @@ uchar GetDrawColor(uchar r, uchar g, uchar b, int x, int y)
 			   med, low
 			*/
 			if (y % 2 == 0) {
-				if (x%2 == 1) return GetMedColor(r,g,b,&distance);
-				return GetLowColor(r,g,b,&lowdistance);
+				if (x%2 == 1) return LUT_MED;
+				return LUT_LOW;
 			}
-			if (x%2 == 0) return GetMedColor(r,g,b,&distance);
-			return GetLowColor(r,g,b,&lowdistance);
+			if (x%2 == 0) return LUT_MED;
+			return LUT_LOW;
 
 		case 3:
 			/* high, med
 			   med, high
 			*/
 			if (y % 2 == 0) {
-				if (x%2 == 1) return GetMedColor(r,g,b,&distance);
-				return GetHighColor(r,g,b,&highdistance);
+				if (x%2 == 1) return LUT_MED;
+				return LUT_HIGH;
 			}
-			if (x%2 == 0) return GetMedColor(r,g,b,&distance);
-			return GetHighColor(r,g,b,&highdistance);
+			if (x%2 == 0) return LUT_MED;
+			return LUT_HIGH;
 
 		case 2:
 		default:
@@ -1228,21 +1441,41 @@ uchar GetDrawColor(uchar r, uchar g, uchar b, int x, int y)
 			   low, high
 			*/
 			if (y % 2 == 0) {
-				if (x%2 == 1) return GetLowColor(r,g,b,&lowdistance);
-				return GetHighColor(r,g,b,&highdistance);
+				if (x%2 == 1) return LUT_LOW;
+				return LUT_HIGH;
 			}
-			if (x%2 == 0) return GetLowColor(r,g,b,&lowdistance);
-			return GetHighColor(r,g,b,&highdistance);
+			if (x%2 == 0) return LUT_LOW;
+			return LUT_HIGH;
 
 	}
 
 #ifndef TURBOC
     /* never gets to here */
-	return GetMedColor(r,g,b,&distance);
+	return LUT_MED;
 #endif
 
 }
 
+uchar GetDrawColor(uchar r, uchar g, uchar b, int x, int y)
+{
+	return GetLutColor(r,g,b,GetDrawLut(x,y));
+}
+
+/* same as GetDrawColor for palette index ch of 16 color and 256 color input */
+/* each palette entry is matched once for each of the med, high and low palettes */
+uchar GetIndexColor(uchar ch, int x, int y)
+{
+	int lut = GetDrawLut(x,y);
+
+	if (indexlut[lut][ch] == 0) {
+		indexlut[lut][ch] = (uchar)(GetLutColor(sbmp[ch].rgbRed,sbmp[ch].rgbGreen,sbmp[ch].rgbBlue,lut) + 1);
+	}
+	else {
+		StatsCount(stats,STATS_TABLE,1L);
+	}
+	return (uchar)(indexlut[lut][ch] - 1);
+}
+
 /* routines to save to Apple 2 Double Hires Format */
 /* a double hi-res pixel can occur at any one of 7 positions */
 /* in a 4 byte block which spans aux and main screen memory */
@@ -1635,6 +1868,7 @@ int WriteVBMPFile()
 		printf("Error opening %s for writing!\n",vbmpfile);
 		return INVALID;
 	}
+	StatsOutput(stats,vbmpfile);
 
 	if (WriteVbmpHeader(fp) == 0) {
 		fclose(fp);
@@ -1971,6 +2205,7 @@ int savelofragment()
 		}
 		fp = fopen(outfile,"wb");
 		if (NULL == fp)return INVALID;
+		StatsOutput(stats,outfile);
 		WriteDosHeader(fp,fl,1024);
 
 		/* On the double lo res display each byte in
@@ -2043,6 +2278,7 @@ int savelofragment()
 			}
 			fp = fopen(outfile,"wb");
 			if (NULL == fp)return INVALID;
+			StatsOutput(stats,outfile);
 			WriteDosHeader(fp,fl,1024);
 
 			memset(hgrbuf,0,LOBINSIZE);
@@ -2073,6 +2309,7 @@ int savelofragment()
 		}
 		fp = fopen(outfile,"wb");
 		if (NULL == fp)return INVALID;
+		StatsOutput(stats,outfile);
 		WriteDosHeader(fp,fl,1024);
 		memset(hgrbuf,0,LOBINSIZE);
 		for (y = 0; y< 48; y++) {
@@ -2115,11 +2352,13 @@ int savedhr()
 		/* just using the BIN file extension as always */
 		if (mono == 0) {
 			strcpy(mainfile,hgrcolor);
+			StatsNext(stats,STATS_WRITE,STATS_ENCODE);
         	memset(hgrbuf,0,8192);
 			for (y = 0; y < 192; y++) {
      			hgrline(y); /* translate from DHGR and format the HGR line */
 				hgrbits(y); /* put the HGR line into the HGR file buffer */
 			}
+			StatsNext(stats,STATS_ENCODE,STATS_WRITE);
 		}
 		else {
 			strcpy(mainfile,hgrmono);
@@ -2129,6 +2368,7 @@ int savedhr()
 			if (quietmode == 1)printf("Error Opening %s for writing!\n",mainfile);
 			return INVALID;
 		}
+		StatsOutput(stats,mainfile);
 
 		WriteDosHeader(fp,8192,8192);
 
@@ -2157,6 +2397,7 @@ int savedhr()
 	    	if (quietmode == 1)printf("Error Opening %s for writing!\n",a2fcfile);
 			return INVALID;
 		}
+		StatsOutput(stats,a2fcfile);
 
 		WriteDosHeader(fp,16384,8192);
 
@@ -2184,6 +2425,7 @@ int savedhr()
 	    if (quietmode == 1)printf("Error Opening %s for writing!\n",auxfile);
 		return INVALID;
 	}
+	StatsOutput(stats,auxfile);
 	WriteDosHeader(fp,8192,8192);
 	c = fwrite(dhrbuf,1,8192,fp);
 	fclose(fp);
@@ -2200,6 +2442,7 @@ int savedhr()
 		if (quietmode == 1)printf("Error Opening %s for writing!\n",mainfile);
 		return INVALID;
 	}
+	StatsOutput(stats,mainfile);
 	WriteDosHeader(fp,8192,8192);
 	c = fwrite(&dhrbuf[8192],1,8192,fp);
 	fclose(fp);
@@ -2240,11 +2483,13 @@ int saverag()
 	   return INVALID;
     }
 
+    StatsNext(stats,STATS_WRITE,STATS_ENCODE);
     memset(hgrbuf,0,8192);
 	for (y = 0; y < 192; y++) {
      	hgrline(y); /* translate from DHGR and format the HGR line */
 		hgrbits(y); /* put the HGR line into the HGR file buffer */
 	}
+    StatsNext(stats,STATS_ENCODE,STATS_WRITE);
 
     width = spritewidth;
     while (width%7 != 0)width++; /* multiples of 7 pixels */
@@ -2278,6 +2523,7 @@ int saverag()
 		printf("Error Opening %s for writing!\n",spritefile);
 		return INVALID;
 	}
+	StatsOutput(stats,spritefile);
 
 	/* write 2 byte header */
 	fputc((uchar)width,fp);          /* width in bytes */
@@ -2383,6 +2629,7 @@ int savesprite()
 		if (quietmode == 0) strcat(fname,"M");
 
 	}
+	StatsOutput(stats,(spritemask != 1 ? spritefile : fmask));
 
 	if (dosheader == 1) {
 		fl = (ushort) width;
@@ -2690,6 +2937,145 @@ int ReadCustomDither(char *name)
 
 }
 
+/* the error that one tap of a compiled dither adds to its pixel */
+/* when error summing is on the carry tap also adds the error that the
+   division by bleed rounded off in all of the taps */
+sshort DitherQuotient(DITHERKERNEL *kernel, int tap, int error)
+{
+	int i, value;
+
+	value = (error * kernel->taps[tap].weight) / bleed;
+	if (tap == kernel->carry) {
+		value += (error * kernel->divisor) / bleed;
+		for (i = 0; i < kernel->numtaps; i++) value -= (error * kernel->taps[i].weight) / bleed;
+	}
+	return (sshort)value;
+}
+
+/* compile a dither pattern into taps for lines that run in one direction */
+/* mirror is 0 for forward lines and for serpentine lines it is how the
+   dither is reversed - see ditherserpentine in b2d.h */
+void CompileDitherKernel(DITHERKERNEL *kernel, sshort pattern[3][11], int mirror, int divisor)
+{
+	DITHERTAP *tap;
+	int line, dx, i, j, error;
+
+	kernel->numtaps = 0;
+	kernel->divisor = divisor;
+	kernel->edge = 0;
+	for (line = 0; line < 3; line++) {
+		/* the current line comes first */
+		if (line == 1) kernel->onelinetaps = kernel->numtaps;
+		for (dx = 0; dx < 11; dx++) {
+			if (pattern[line][dx] < 1) continue;
+			tap = &kernel->taps[kernel->numtaps++];
+			tap->line = (sshort)line;
+			if (mirror == 2 || (mirror == 1 && line == 0)) tap->offset = (sshort)(5 - dx);
+			else tap->offset = (sshort)(dx - 5);
+			tap->weight = pattern[line][dx];
+			if (tap->offset < 0 && kernel->edge < -tap->offset) kernel->edge = -tap->offset;
+			/* the current line is always clipped and the lines ahead are
+			   clipped by the threshold option */
+			if (line == 0 || threshold != 0 || globalclip == 1) tap->clip = 1;
+			else tap->clip = 0;
+		}
+	}
+	if (mirror == 2) kernel->onelinetaps = kernel->numtaps;
+
+	/* with error summing the next pixel takes the rounding error */
+	if (divisor > 0 && errorsum != 0 && kernel->onelinetaps > 0) kernel->carry = 0;
+	else kernel->carry = -1;
+
+	/* the quotients are the same for taps of the same weight */
+	for (i = 0; i < kernel->numtaps; i++) {
+		tap = &kernel->taps[i];
+		for (j = 0; j < i; j++) {
+			if (j != kernel->carry && kernel->taps[j].weight == tap->weight) break;
+		}
+		if (j < i && i != kernel->carry) {
+			tap->quotient = kernel->taps[j].quotient;
+			continue;
+		}
+		tap->quotient = (sshort *)&kernel->quotients[i][255];
+		for (error = -255; error < 256; error++) tap->quotient[error] = DitherQuotient(kernel,i,error);
+	}
+}
+
+/* compile the selected dither into taps before the first line is dithered */
+/* a custom dither is never reversed and only Floyd-Steinberg and Buckels
+   sum the rounding error */
+void CompileDither()
+{
+	int idx, divisor = 0;
+
+	if (dither == CUSTOM) {
+		CompileDitherKernel(&ditherforward,customdither,0,0);
+		CompileDitherKernel(&ditherreverse,customdither,0,0);
+		return;
+	}
+	/* anything else is a buckels dither */
+	if (dither >= FLOYDSTEINBERG && dither <= BUCKELS) idx = dither - 1;
+	else idx = BUCKELS - 1;
+	if (idx == FLOYDSTEINBERG - 1) divisor = 16;
+	else if (idx == BUCKELS - 1) divisor = 8;
+	CompileDitherKernel(&ditherforward,ditherpattern[idx],0,divisor);
+	CompileDitherKernel(&ditherreverse,ditherpattern[idx],ditherserpentine[idx],divisor);
+}
+
+/* add the error of the 3 color channels to the pixels under the taps */
+void DiffuseTaps(DITHERKERNEL *kernel, int numtaps, int x, int red_error, int green_error, int blue_error)
+{
+	DITHERTAP *tap;
+	sshort *buf, *quotient, value;
+	int i, pos, color, error[3];
+
+	error[RED] = red_error;
+	error[GREEN] = green_error;
+	error[BLUE] = blue_error;
+
+	/* taps that fall off the left edge are skipped and errors outside the
+	   quotients are divided here */
+	if (x < kernel->edge || red_error < -255 || red_error > 255 ||
+		green_error < -255 || green_error > 255 || blue_error < -255 || blue_error > 255) {
+		for (i = 0, tap = &kernel->taps[0]; i < numtaps; i++, tap++) {
+			pos = x + tap->offset;
+			if (pos < 0) continue;
+			for (color = RED; color <= BLUE; color++) {
+				if (error[color] < -255 || error[color] > 255) value = DitherQuotient(kernel,i,error[color]);
+				else value = tap->quotient[error[color]];
+				buf = (sshort *)&ditherrows[color][tap->line][pos];
+				value = (sshort)(buf[0] + value);
+				if (tap->clip != 0) {
+					if (value < 0) value = 0;
+					else if (value > 255) value = 255;
+				}
+				buf[0] = value;
+			}
+		}
+		return;
+	}
+
+	for (i = 0, tap = &kernel->taps[0]; i < numtaps; i++, tap++) {
+		pos = x + tap->offset;
+		quotient = tap->quotient;
+		if (tap->clip != 0) {
+			for (color = RED; color <= BLUE; color++) {
+				buf = (sshort *)&ditherrows[color][tap->line][pos];
+				value = (sshort)(buf[0] + quotient[error[color]]);
+				if (value < 0) value = 0;
+				else if (value > 255) value = 255;
+				buf[0] = value;
+			}
+		}
+		else {
+			for (color = RED; color <= BLUE; color++) {
+				buf = (sshort *)&ditherrows[color][tap->line][pos];
+				buf[0] = (sshort)(buf[0] + quotient[error[color]]);
+			}
+		}
+	}
+}
+
 /* http://en.wikipedia.org/wiki/Floyd%E2%80%93Steinberg_dithering */
 /* http://www.tannerhelland.com/4660/dithering-eleven-algorithms-source-code/ */
 /* http://www.efg2.com/Lab/Library/ImageProcessing/DHALF.TXT */
@@ -2700,10 +3086,10 @@ void FloydSteinberg(int y, int width)
 
 	double paldistance; /* not used in this function */
 	sshort red, green, blue, red_error, green_error, blue_error;
-	sshort pos, mult;
-    int dx,i, x,x1, total_difference, total_error, total_used;
+    int x,x1, numtaps;
     int testrun, runs, temperror, z;
     uchar drawcolor, r,g,b;
+    DITHERKERNEL *kernel;
 
    if (ditherstart == 0) {
 
@@ -2745,8 +3131,13 @@ void FloydSteinberg(int y, int width)
 			default:				bleed = (8  * colorbleed)/100; break; /* same as atkinson */
 		}
 		if (bleed < 1) bleed = 1;
+		CompileDither();
    }
 
+   /* for serpentine effect alternating scanlines run the error in reverse */
+   if (serpentine == 1 && y%2 == 1) kernel = &ditherreverse;
+   else kernel = &ditherforward;
+
    /* When converting to HGR do palette matching here between Green-Violet and
 	  Orange-Blue palettes in groups of 7 pixels */
 
@@ -2830,6 +3221,10 @@ void FloydSteinberg(int y, int width)
 
 	   }
 
+	   /* if making hgr passes 0 and 1 dither first line only */
+	   if (runs < 2 || ditheroneline == 1) numtaps = kernel->onelinetaps;
+	   else numtaps = kernel->numtaps;
+
 	   for (x=0;x<width;x++) {
 
       	  red   = redDither[x];
@@ -2889,420 +3284,9 @@ void FloydSteinberg(int y, int width)
 
 		  }
 
-		for (i=0;i<3;i++) {
-
-			/* loop through all 3 RGB channels */
-			switch(i) {
-				case RED:   colorptr = (sshort *)&redDither[0];
-							seedptr   = (sshort *)&redSeed[0];
-							seed2ptr  = (sshort *)&redSeed2[0];
-							color_error = red_error;
-							break;
-				case GREEN: colorptr = (sshort *)&greenDither[0];
-							seedptr   = (sshort *)&greenSeed[0];
-							seed2ptr  = (sshort *)&greenSeed2[0];
-							color_error = green_error;
-							break;
-				case BLUE:  colorptr = (sshort *)&blueDither[0];
-							seedptr   = (sshort *)&blueSeed[0];
-							seed2ptr  = (sshort *)&blueSeed2[0];
-							color_error = blue_error;
-							break;
-			}
-
-			/* diffuse the error based on the dither */
-			switch(dither) {
-				/* F 1*/
-				case FLOYDSTEINBERG:
-					/*
-						*   7
-					3   5   1 	(1/16)
-
-					Serpentine
-
-					7   *
-					1   5   3
-
-					*/
-
-					/* if error summing is turned-on add the accumulated rounding error
-					   to the next pixel */
-					if (errorsum == 0) {
-						total_difference = 0;
-					}
-					else {
-						total_error = (color_error * 16) / bleed;
-						total_used =  (color_error * 3)/bleed;
-						total_used += (color_error * 5)/bleed;
-						total_used += (color_error * 1)/bleed;
-						total_used += (color_error * 7)/bleed;
-						total_difference = total_error - total_used;
-					}
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						/* for serpentine effect line 1 error is added behind */
-						if (x > 0) AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error * 7)/bleed)+total_difference);
-						/* seed next line forward */
-						/* for serpentine effect line 2 error is reversed */
-						if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 1)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 3)/bleed));
-
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 7)/bleed)+total_difference);
-
-						/* if making hgr passes 0 and 1 dither first line only */
-						if (runs < 2 || ditheroneline == 1) break;
-
-						/* seed next line forward */
-						if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 3)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 1)/bleed));
-					}
-
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error * 5)/bleed));
-					break;
-
-				/* J 2 */
-				case JARVIS:
-					/*
-						*   7   5
-					3   5   7   5   3
-					1   3   5   3   1	(1/48)
-					*/
-
-					/* finish this line */
-					AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 7)/bleed));
-					AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)((color_error * 5)/bleed));
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next lines forward */
-					if (x>0){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 5)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seed2ptr[x-1],(sshort)((color_error * 3)/bleed));
-					}
-					if (x>1){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-2],(sshort)((color_error * 3)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seed2ptr[x-2],(sshort)(color_error/bleed));
-
-					}
-
-					/* seed next line forward */
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error * 7)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 5)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+2],(sshort)((color_error * 3)/bleed));
-
-					/* seed furthest line forward */
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x],(sshort)((color_error * 5)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x+1],(sshort)((color_error * 3)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x+2],(sshort)(color_error/bleed));
-					break;
-
-				/* S 3 */
-				case STUCKI:
-					/*
-							*   8   4
-					2   4   8   4   2
-					1   2   4   2   1	(1/42)
-					*/
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if(x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error * 8)/bleed));
-						if(x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)((color_error * 4)/bleed));
-
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 8)/bleed));
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)((color_error * 4)/bleed));
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next lines forward */
-					if (x>0){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 4)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seed2ptr[x-1],(sshort)((color_error * 2)/bleed));
-					}
-					if (x>1){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-2],(sshort)((color_error * 2)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seed2ptr[x-2],(sshort)(color_error/bleed));
-
-					}
-
-					/* seed next line forward */
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error * 8)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 4)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+2],(sshort)((color_error * 2)/bleed));
-
-					/* seed furthest line forward */
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x],(sshort)((color_error * 4)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x+1],(sshort)((color_error * 2)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x+2],(sshort)(color_error/bleed));
-					break;
-
-				/* A 4 */
-				case ATKINSON:
-					/*
-						*   1   1
-					1   1   1
-						1			(1/8)
-
-					*/
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if (x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)(color_error/bleed));
-						if (x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)(color_error/bleed));
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)(color_error/bleed));
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next line forward */
-					if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)(color_error/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-
-					/* seed furthest line forward */
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-					break;
-
-				/* B 5 */
-				case BURKES:
-					/*
-							*   8   4
-					2   4   8   4   2	(1/32)
-					*/
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if(x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error * 8) /bleed));
-						if(x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)((color_error * 4) /bleed));
-
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 8) /bleed));
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)((color_error * 4) /bleed));
-
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next line forward */
-					if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 4) / bleed));
-					if (x>1)AdjustShortPixel(threshold,(sshort *)&seedptr[x-2],(sshort)((color_error * 2) / bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error * 8) /bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 4) /bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+2],(sshort)((color_error * 2) /bleed));
-					break;
-
-				/* SI 6 */
-				case SIERRA:
-					/*
-							*   5   3
-					2   4   5   4   2
-						2   3   2		(1/32)
-					*/
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if(x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error * 5)/bleed));
-						if(x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)((color_error * 3)/bleed));
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 5)/bleed));
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)((color_error * 3)/bleed));
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next lines forward */
-					if (x>0){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error * 4)/bleed));
-						AdjustShortPixel(threshold,(sshort *)&seed2ptr[x-1],(sshort)((color_error * 2)/bleed));
-					}
-					if (x>1){
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x-2],(sshort)((color_error * 2)/bleed));
-					}
-
-					/* seed next line forward */
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error * 5)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error * 4)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+2],(sshort)((color_error * 2)/bleed));
-
-					/* seed furthest line forward */
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x],(sshort)((color_error * 3)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x+1],(sshort)((color_error * 2)/bleed));
-					break;
-
-				/* S2 7 */
-				case SIERRATWO:
-					/*
-							*   4   3
-					1   2   3   2   1	(1/16)
-					*/
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if(x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error*4)/bleed));
-						if(x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)((color_error*3)/bleed));
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*4)/bleed));
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)((color_error*3)/bleed));
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next line forward */
-					if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)((color_error*2)/bleed));
-					if (x>1)AdjustShortPixel(threshold,(sshort *)&seedptr[x-2],(sshort)(color_error/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error*3)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)((color_error*2)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+2],(sshort)(color_error/bleed));
-					break;
-
-				/* SL 8 */
-				case SIERRALITE:
-					/*
-						*   2
-					1   1		(1/4)
-					*/
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if (x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error * 2) /bleed));
-
-						/* seed next line forward */
-						AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error * 2) /bleed));
-						/* if making hgr passes 0 and 1 dither first line only */
-						if (runs < 2 || ditheroneline == 1) break;
-
-						/* seed next line forward */
-						if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-					}
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)(color_error/bleed));
-
-					break;
-
-
-			   case CUSTOM:
-
-					/* 0,0,0,0,0,*,0,0,0,0,0
-					   0,0,0,0,0,0,0,0,0,0,0
-					   0,0,0,0,0,0,0,0,0,0,0 */
-
-					for (dx = 0,pos=x-5;dx < 11; dx++,pos++) {
-					   /* finish this line */
-					   if (pos < 0) continue;
-
-					   mult = customdither[0][dx];
-					   if (mult > 0) {
-						   AdjustShortPixel(1,(sshort *)&colorptr[pos],(sshort)((color_error * mult) /bleed));
-					   }
-
-					   /* if making hgr passes 0 and 1 dither first line only */
-					   if (runs < 2 || ditheroneline == 1) continue;
-
-					   /* seed next line forward */
-					   mult = customdither[1][dx];
-					   if (mult > 0) {
-						   AdjustShortPixel(threshold,(sshort *)&seedptr[pos],(sshort)((color_error * mult) /bleed));
-					   }
-					   /* seed furthest line forward */
-					   mult = customdither[2][dx];
-					   if (mult > 0) {
-						   AdjustShortPixel(threshold,(sshort *)&seed2ptr[pos],(sshort)((color_error * mult) /bleed));
-					   }
-
-					}
-					break;
-
-				default: /* buckels dither - d9 */
-				   /*
-					  * 2 1
-					1 2 1
-					  1          (1/8)
-
-					Serpentine
-
-				  1 2 *
-					1 2 1
-					  1
-
-					*/
-
-					/* if error summing is turned-on add the accumulated rounding error
-					   to the next pixel */
-					if (errorsum == 0) {
-						total_difference = 0;
-					}
-					else {
-						total_error = (color_error * 8) / bleed;
-						total_used =  (color_error * 2)/bleed;
-						total_used += (color_error * 2)/bleed;
-						total_used += (color_error /bleed);
-						total_used += (color_error /bleed);
-						total_used += (color_error /bleed);
-						total_used += (color_error /bleed);
-						total_difference = total_error - total_used;
-					}
-
-					/* for serpentine effect alternating scanlines run the error in reverse */
-					if (serpentine == 1 && y%2 == 1) {
-						/* finish this line */
-						if (x>0)AdjustShortPixel(1,(sshort *)&colorptr[x-1],(sshort)((color_error*2)/bleed)+total_difference);
-						if (x>1)AdjustShortPixel(1,(sshort *)&colorptr[x-2],(sshort)(color_error/bleed));
-					}
-					else {
-						/* finish this line */
-						AdjustShortPixel(1,(sshort *)&colorptr[x+1],(sshort)((color_error*2)/bleed)+total_difference);
-						AdjustShortPixel(1,(sshort *)&colorptr[x+2],(sshort)(color_error/bleed));
-					}
-
-					/* if making hgr passes 0 and 1 dither first line only */
-					if (runs < 2 || ditheroneline == 1) break;
-
-					/* seed next line forward */
-					if (x>0)AdjustShortPixel(threshold,(sshort *)&seedptr[x-1],(sshort)(color_error/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x],(sshort)((color_error*2)/bleed));
-					AdjustShortPixel(threshold,(sshort *)&seedptr[x+1],(sshort)(color_error/bleed));
-
-					/* seed furthest line forward */
-					AdjustShortPixel(threshold,(sshort *)&seed2ptr[x],(sshort)(color_error/bleed));
-
-
-
-				}
-			}
-		}
+		  /* diffuse the error through the compiled dither */
+		  DiffuseTaps(kernel,numtaps,x,red_error,green_error,blue_error);
+	   }
 	}
 
     /* turn-off hgr color dither */
@@ -3376,10 +3360,10 @@ void FloydSteinberg(int y, int width)
 
 }
 
-ushort WriteDIBHeader(FILE *fp, ushort pixels, ushort rasters)
+/* set-up the header for a 24-bit BMP in mybmp - returns the scanline length */
+ushort SetDIBHeader(ushort pixels, ushort rasters)
 {
     ushort outpacket;
-    int c;
 
     memset((char *)&mybmp.bfi.bfType[0],0,sizeof(BMPHEADER));
 
@@ -3403,6 +3387,16 @@ ushort WriteDIBHeader(FILE *fp, ushort pixels, ushort rasters)
     mybmp.bfi.bfOffBits = (ulong) sizeof(BMPHEADER);
     mybmp.bfi.bfSize = mybmp.bmi.biSizeImage + mybmp.bfi.bfOffBits;
 
+    return outpacket;
+}
+
+ushort WriteDIBHeader(FILE *fp, ushort pixels, ushort rasters)
+{
+    ushort outpacket;
+    int c;
+
+    outpacket = SetDIBHeader(pixels,rasters);
+
  	/* write the header for the output BMP */
     c = fwrite((char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER),1,fp);
 
@@ -3411,6 +3405,85 @@ ushort WriteDIBHeader(FILE *fp, ushort pixels, ushort rasters)
 return outpacket;
 }
 
+/* the reformatted, resized and error-diffused copies of the input file are
+   work bmps that are kept in memory rather than written to disk and read back.
+   they have the same layout as a BMP file so the code that reads them is the
+   same code that reads the input file. option "debug" saves them to disk. */
+
+void FreeWorkBMP(WORKBMP *work)
+{
+	if (NULL != work->buf) free(work->buf);
+	memset(work,0,sizeof(WORKBMP));
+}
+
+/* create an empty 24-bit work bmp - returns the scanline length or 0 */
+ushort NewWorkBMP(WORKBMP *work, ushort pixels, ushort rasters)
+{
+	ushort outpacket;
+
+	FreeWorkBMP(work);
+	outpacket = SetDIBHeader(pixels,rasters);
+	work->buf = (uchar *)malloc(mybmp.bfi.bfSize);
+	if (NULL == work->buf) return 0;
+	memset(work->buf,0,mybmp.bfi.bfSize);
+	memcpy(work->buf,(char *)&mybmp.bfi.bfType[0],sizeof(BMPHEADER));
+	work->size = mybmp.bfi.bfSize;
+	work->pos = sizeof(BMPHEADER);
+	return outpacket;
+}
+
+void WriteWorkBMP(uchar *buf, ushort len, WORKBMP *work)
+{
+	if (work->pos >= work->size) return;
+	if (work->pos + len > work->size) len = (ushort)(work->size - work->pos);
+	memcpy(&work->buf[work->pos],buf,len);
+	work->pos += len;
+}
+
+/* read from the current work bmp if there is one, otherwise from the input file */
+void SeekWorkBMP(FILE *fp, ulong pos)
+{
+	if (NULL != workbmp.buf) workbmp.pos = pos;
+	else fseek(fp,pos,SEEK_SET);
+}
+
+ushort ReadWorkBMP(uchar *buf, ushort len, FILE *fp)
+{
+	if (NULL == workbmp.buf) return (ushort)fread((char *)&buf[0],1,len,fp);
+
+	/* like fread, nothing is read past the end */
+	if (workbmp.pos >= workbmp.size) return 0;
+	if (workbmp.pos + len > workbmp.size) len = (ushort)(workbmp.size - workbmp.pos);
+	memcpy(buf,&workbmp.buf[workbmp.pos],len);
+	workbmp.pos += len;
+	return len;
+}
+
+/* the work bmp that was just created becomes the input for the next stage */
+void UseWorkBMP(char *name)
+{
+	FILE *fp;
+
+	FreeWorkBMP(&workbmp);
+	memcpy(&workbmp,&nextbmp,sizeof(WORKBMP));
+	memset(&nextbmp,0,sizeof(WORKBMP));
+
+	/* read the header stuff into the appropriate structures */
+	memcpy((char *)&bfi.bfType[0],&workbmp.buf[0],sizeof(BITMAPFILEHEADER));
+	memcpy((char *)&bmi.biSize,&workbmp.buf[sizeof(BITMAPFILEHEADER)],sizeof(BITMAPINFOHEADER));
+	workbmp.pos = sizeof(BMPHEADER);
+
+	if (debug == 0) return;
+
+	if((fp=fopen(name,"wb"))==NULL) {
+		printf("Error Opening %s for writing!\n",name);
+		return;
+	}
+	fwrite((char *)&workbmp.buf[0],1,workbmp.size,fp);
+	fclose(fp);
+	StatsOutput(stats,name);
+}
+
 void DiffuseError(ushort outpacket)
 {
 	/*
@@ -3481,31 +3554,23 @@ void DiffuseError(ushort outpacket)
 }
 
 
-/* create an error-diffused copy of the input file
+/* create an error-diffused copy of the input file in memory
    and use that instead */
 FILE *ReadDIBFile(FILE *fp, ushort packet)
 {
-	FILE *fpdib;
 	ushort y,outpacket;
 
-
-    if((fpdib=fopen(dibfile,"wb"))==NULL) {
-		printf("Error Opening %s for writing!\n",dibfile);
-		return fp;
-	}
-
-    outpacket = WriteDIBHeader(fpdib,bmpwidth,bmpheight);
+    outpacket = NewWorkBMP(&nextbmp,bmpwidth,bmpheight);
     if (outpacket != packet) {
-		fclose(fpdib);
-		remove(dibfile);
-		printf("Error writing header to %s!\n",dibfile);
+		FreeWorkBMP(&nextbmp);
+		printf("Error creating %s!\n",dibfile);
 		return fp;
 	}
 
     /* seek past extraneous info in header if any */
-	fseek(fp,bfi.bfOffBits,SEEK_SET);
+	SeekWorkBMP(fp,bfi.bfOffBits);
 	for (y=0;y<bmpheight;y++) {
-		fread((char *)&bmpscanline[0],1,packet,fp);
+		ReadWorkBMP(bmpscanline,packet,fp);
 		memcpy(&dibscanline1[0],&bmpscanline[0],packet);
 		if (y==0) memcpy(&dibscanline2[0],&bmpscanline[0],packet);
         DiffuseError(packet);
@@ -3518,24 +3583,12 @@ FILE *ReadDIBFile(FILE *fp, ushort packet)
 			/* otherwise use diffused line */
 			memcpy(&dibscanline2[0],&dibscanline1[0],packet);
 		}
-        fwrite((char *)&dibscanline1[0],1,packet,fpdib);
+        WriteWorkBMP(dibscanline1,packet,&nextbmp);
 
 	}
-    fclose(fpdib);
-    fclose(fp);
 
-    if((fp=fopen(dibfile,"rb"))==NULL) {
-		printf("Error Opening %s for reading!\n",dibfile);
-   		if((fp=fopen(bmpfile,"rb"))==NULL) {
-			printf("Error Opening %s for reading!\n",bmpfile);
-			return fp;
-		}
-	}
-    /* read the header stuff into the appropriate structures */
-    fread((char *)&bfi.bfType[0],
-	             sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+    /* the error-diffused copy is used from here on */
+    UseWorkBMP(dibfile);
     return fp;
 }
 
@@ -3596,13 +3649,13 @@ void ShrinkPixels(FILE *fp)
 
 	while (packet%4 != 0)packet++;
 
-	fread((char *)&bmpscanline[0],1,packet,fp);
+	ReadWorkBMP(bmpscanline,packet,fp);
   	ExpandBMPLine((uchar *)&bmpscanline[0],(uchar *)&dhrbuf[0],bmpwidth,7);
 	ShrinkBMPLine((uchar *)&dhrbuf[0],(uchar *)&dhrbuf[0],(ushort)(bmpwidth * 7));
 }
 
 /* table-driven scaling from 25 to 24 lines */
-void ShrinkLines25to24(FILE *fp, FILE *fp2)
+void ShrinkLines25to24(FILE *fp, WORKBMP *work)
 {
 	ushort pixel,x,i;
 	ushort x1,x2;
@@ -3635,14 +3688,14 @@ void ShrinkLines25to24(FILE *fp, FILE *fp2)
 			pixel = (ushort) (x1 * mix25to24[i][0]) + (x2 * mix25to24[i][1]);
 			bmpscanline[x] = (uchar)(pixel/25);
 		}
-	   fwrite((char *)&bmpscanline[0],1,420,fp2);
+	   WriteWorkBMP(bmpscanline,420,work);
 	   if (i<23)memcpy(&dibscanline1[0],&dibscanline2[0],420);
 	}
 }
 
 
 /* 640 x 480 scaled to 140 x 192 */
-void ShrinkLines640x480(FILE *fp, FILE *fp2)
+void ShrinkLines640x480(FILE *fp, WORKBMP *work)
 {
 	ushort pixel1,pixel2,x,i;
 
@@ -3670,28 +3723,28 @@ void ShrinkLines640x480(FILE *fp, FILE *fp2)
 		dibscanline2[x] = (uchar) (pixel2/5);
 	}
 
-	fwrite((char *)&dibscanline1[0],1,420,fp2);
-	fwrite((char *)&dibscanline2[0],1,420,fp2);
+	WriteWorkBMP(dibscanline1,420,work);
+	WriteWorkBMP(dibscanline2,420,work);
 }
 
 /* merges the RGB values of 2 lines into one */
-void ShrinkLines560x384(FILE *fp, FILE *fp2)
+void ShrinkLines560x384(FILE *fp, WORKBMP *work)
 {
 
 	ushort x, pixel, packet = (bmpwidth * 3);
 
 	while (packet%4 != 0)packet++;
 
-	fread((char *)&bmpscanline[0],1,packet,fp);
+	ReadWorkBMP(bmpscanline,packet,fp);
 	ShrinkBMPLine((uchar *)&bmpscanline[0],(uchar *)&dibscanline1[0],bmpwidth);
-	fread((char *)&bmpscanline[0],1,packet,fp);
+	ReadWorkBMP(bmpscanline,packet,fp);
 	ShrinkBMPLine((uchar *)&bmpscanline[0],(uchar *)&dibscanline2[0],bmpwidth);
 	for (x=0;x<420;x++) {
 		pixel = (ushort)dibscanline1[x];
 		pixel+= dibscanline2[x];
 		bmpscanline[x] = (uchar)(pixel/2);
 	}
-	fwrite((char *)&bmpscanline[0],1,420,fp2);
+	WriteWorkBMP(bmpscanline,420,work);
 }
 
 /* lo-res and double lo-res input files are in multiples of 80 pixels */
@@ -3720,7 +3773,7 @@ int ShrinkLoResLine(uchar *src, uchar *dest, int srcwidth)
 }
 
 
-void ShrinkLoResData(FILE *fp, FILE *fp2)
+void ShrinkLoResData(FILE *fp, WORKBMP *work)
 {
 
 	ushort x, x1, x2, y, lines, srcwidth, packet = (bmpwidth * 3), pixel;
@@ -3748,7 +3801,7 @@ void ShrinkLoResData(FILE *fp, FILE *fp2)
 	for (y = 0; y < lines; y++) {
 
 		if (bmpwidth == 40) {
-			fread((char *)&dibscanline1[0],1,packet,fp);
+			ReadWorkBMP(dibscanline1,packet,fp);
 			/* double the width */
 			for (x = 0, x1 = 0, x2 = 0; x < 40; x++) {
 				bmpscanline[x2] = bmpscanline[x2+3] = dibscanline1[x1]; x1++; x2++;
@@ -3757,7 +3810,7 @@ void ShrinkLoResData(FILE *fp, FILE *fp2)
 			}
 		}
 		else {
-			fread((char *)&bmpscanline[0],1,packet,fp);
+			ReadWorkBMP(bmpscanline,packet,fp);
 		}
 		ShrinkLoResLine((uchar *)&bmpscanline[0],(uchar *)&dibscanline1[0],srcwidth);
 
@@ -3779,15 +3832,14 @@ void ShrinkLoResData(FILE *fp, FILE *fp2)
 		bmpscanline[x1] = (uchar) pixel; x1++;
 
 	}
-	fwrite((char *)&bmpscanline[0],1,240,fp2);
+	WriteWorkBMP(bmpscanline,240,work);
 }
 
 
-/* create a resized copy of the input file
+/* create a resized copy of the input file in memory
    and use that instead */
 FILE *ResizeBMP(FILE *fp, sshort resize)
 {
-	FILE *fp2;
 	ushort x,y,packet,outpacket,chunks;
     ushort i,j,r,g,b;
     ulong offset=0L;
@@ -3796,30 +3848,23 @@ FILE *ResizeBMP(FILE *fp, sshort resize)
 	if (resize == 0)return NULL;
 #endif
 
-    if((fp2=fopen(scaledfile,"wb"))==NULL) {
-		printf("Error Opening %s for writing!\n",scaledfile);
-		return fp;
-	}
-
 	if (loresoutput == 1) {
 		/* Lo-Res and Double Lo-Res */
-		if (appletop == 0) outpacket = WriteDIBHeader(fp2,80,48);
-		else outpacket = WriteDIBHeader(fp2,80,40);
+		if (appletop == 0) outpacket = NewWorkBMP(&nextbmp,80,48);
+		else outpacket = NewWorkBMP(&nextbmp,80,40);
 		if (outpacket != 240) {
-			fclose(fp2);
-			remove(scaledfile);
-			printf("Error writing header to %s!\n",scaledfile);
+			FreeWorkBMP(&nextbmp);
+			printf("Error creating %s!\n",scaledfile);
 			return fp;
 		}
 	}
 	else {
         /* HGR and DHGR */
-		if (justify == 1) outpacket = WriteDIBHeader(fp2,280,192);
-		else outpacket = WriteDIBHeader(fp2,140,192);
+		if (justify == 1) outpacket = NewWorkBMP(&nextbmp,280,192);
+		else outpacket = NewWorkBMP(&nextbmp,140,192);
 		if (outpacket != 420 && outpacket != 840) {
-			fclose(fp2);
-			remove(scaledfile);
-			printf("Error writing header to %s!\n",scaledfile);
+			FreeWorkBMP(&nextbmp);
+			printf("Error creating %s!\n",scaledfile);
 			return fp;
 		}
 	}
@@ -3890,17 +3935,17 @@ FILE *ResizeBMP(FILE *fp, sshort resize)
 	}
 
     /* seek past extraneous info in header if any */
-	fseek(fp,bfi.bfOffBits+offset,SEEK_SET);
+	SeekWorkBMP(fp,bfi.bfOffBits+offset);
 
     if (justify == 1 && loresoutput == 0) {
 		for (y = 0;y< 192;y++) {
-		    fread((char *)&dibscanline1[0],1,packet,fp);
+		    ReadWorkBMP(dibscanline1,packet,fp);
 		    if (bmpheight == 200) {
 				/* no merging at all on 320 x 200 */
-				fwrite((char *)&dibscanline1[0],1,outpacket,fp2);
+				WriteWorkBMP(dibscanline1,outpacket,&nextbmp);
 				continue;
 			}
-			fread((char *)&dibscanline2[0],1,packet,fp);
+			ReadWorkBMP(dibscanline2,packet,fp);
 			for (x = 0,i=0,j=0;x<280;x++) {
 				b = (ushort)dibscanline1[i]; b+= dibscanline2[i]; i++;
 				g = (ushort)dibscanline1[i]; g+= dibscanline2[i]; i++;
@@ -3918,7 +3963,7 @@ FILE *ResizeBMP(FILE *fp, sshort resize)
 			    bmpscanline[j] = (uchar) (ushort)(g/4);j++;
 			    bmpscanline[j] = (uchar) (ushort)(r/4);j++;
 			}
-			fwrite((char *)&bmpscanline[0],1,outpacket,fp2);
+			WriteWorkBMP(bmpscanline,outpacket,&nextbmp);
 		}
 	}
     else {
@@ -3927,7 +3972,7 @@ FILE *ResizeBMP(FILE *fp, sshort resize)
 			if (appletop == 1) chunks = 40;
 			else chunks = 48;
 
-            for (y=0;y<chunks;y++) ShrinkLoResData(fp,fp2);
+            for (y=0;y<chunks;y++) ShrinkLoResData(fp,&nextbmp);
 		}
 		else {
 			/* HGR and DHGR input file */
@@ -3942,28 +3987,16 @@ FILE *ResizeBMP(FILE *fp, sshort resize)
 			for (y=0;y<chunks;y++) {
 				switch(bmpheight) {
 					case 200:
-					case 400: ShrinkLines25to24(fp,fp2);break;
-					case 480: ShrinkLines640x480(fp,fp2);break;
-					case 384: ShrinkLines560x384(fp,fp2);break;
+					case 400: ShrinkLines25to24(fp,&nextbmp);break;
+					case 480: ShrinkLines640x480(fp,&nextbmp);break;
+					case 384: ShrinkLines560x384(fp,&nextbmp);break;
 				}
 			}
 		}
 	}
-    fclose(fp2);
-    fclose(fp);
 
-    if((fp=fopen(scaledfile,"rb"))==NULL) {
-		printf("Error Opening %s for reading!\n",scaledfile);
-   		if((fp=fopen(bmpfile,"rb"))==NULL) {
-			printf("Error Opening %s for reading!\n",bmpfile);
-			return fp;
-		}
-	}
-    /* read the header stuff into the appropriate structures */
-    fread((char *)&bfi.bfType[0],
-	             sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
+    /* the resized copy is used from here on */
+    UseWorkBMP(scaledfile);
     return fp;
 }
 
@@ -4000,8 +4033,8 @@ void ReformatMonoLine()
      }
 }
 
-/* expand 16 color and 256 color bmp lines to 24-bit bmp lines */
-void ReformatVGALine()
+/* unpack 16 color and 256 color bmp lines to a palette index per byte in dibscanline1 */
+void UnpackVGALine()
 {
 	sshort i, j, packet;
 	uchar ch;
@@ -4020,6 +4053,15 @@ void ReformatVGALine()
 			dibscanline1[j] = ch; j++;
 		}
 	}
+}
+
+/* expand 16 color and 256 color bmp lines to 24-bit bmp lines */
+void ReformatVGALine()
+{
+	sshort i, j;
+	uchar ch;
+
+	UnpackVGALine();
 	memset(&bmpscanline[0],0,1920);
 	for (i=0,j=0;i<bmpwidth;i++) {
 		  ch = dibscanline1[i];
@@ -4034,7 +4076,6 @@ void ReformatVGALine()
 FILE *ReformatBMP(FILE *fp)
 {
 
-    FILE *fp2;
 	sshort status = SUCCESS;
 	ushort packet, outpacket,y;
 
@@ -4076,7 +4117,7 @@ FILE *ReformatBMP(FILE *fp)
 	    fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*2,1,fp);
 
     /* seek past extraneous info in header if any */
-	fseek(fp,bfi.bfOffBits,SEEK_SET);
+	SeekWorkBMP(fp,bfi.bfOffBits);
 
     /* align on 4 byte boundaries */
     if (bmi.biBitCount == 1) {
@@ -4092,51 +4133,79 @@ FILE *ReformatBMP(FILE *fp)
 	}
     while ((packet % 4)!=0)packet++;
 
-    if((fp2=fopen(reformatfile,"wb"))==NULL) {
-		printf("Error Opening %s for writing!\n",reformatfile);
-		return fp;
-	}
     if (bmi.biBitCount == 1) {
-		if (bmpwidth == 280) outpacket = WriteDIBHeader(fp2,bmpwidth,bmpheight);
-		else outpacket = WriteDIBHeader(fp2,bmpwidth,bmpheight*2);
+		if (bmpwidth == 280) outpacket = NewWorkBMP(&nextbmp,bmpwidth,bmpheight);
+		else outpacket = NewWorkBMP(&nextbmp,bmpwidth,bmpheight*2);
 	}
 	else {
-    	outpacket = WriteDIBHeader(fp2,bmpwidth,bmpheight);
+    	outpacket = NewWorkBMP(&nextbmp,bmpwidth,bmpheight);
 	}
     if (outpacket < 1) {
-		fclose(fp2);
-		remove(reformatfile);
-		printf("Error writing header to %s!\n",reformatfile);
+		FreeWorkBMP(&nextbmp);
+		printf("Error creating %s!\n",reformatfile);
 		return fp;
 	}
 
   	for (y=0;y<bmpheight;y++) {
-		fread((char *)&bmpscanline[0],1,packet,fp);
+		ReadWorkBMP(bmpscanline,packet,fp);
 		if (bmi.biBitCount == 1) ReformatMonoLine();
 		else ReformatVGALine();
-        fwrite((char *)&bmpscanline[0],1,outpacket,fp2);
+        WriteWorkBMP(bmpscanline,outpacket,&nextbmp);
         /* double lines for DHGR monochrome conversion */
         /* single lines for HGR monochrome conversion */
-        if (bmi.biBitCount == 1 && bmpwidth == 560) fwrite((char *)&bmpscanline[0],1,outpacket,fp2);
+        if (bmi.biBitCount == 1 && bmpwidth == 560) WriteWorkBMP(bmpscanline,outpacket,&nextbmp);
 	}
-    fclose(fp2);
-    fclose(fp);
 
-    reformat = 1;
+    /* the 24-bit copy is used from here on */
+    UseWorkBMP(reformatfile);
+    return fp;
+}
+
 
-    if((fp=fopen(reformatfile,"rb"))==NULL) {
-		printf("Error Opening %s for reading!\n",reformatfile);
-   		if((fp=fopen(bmpfile,"rb"))==NULL) {
-			printf("Error Opening %s for reading!\n",bmpfile);
-			return fp;
+/* 16 color and 256 color bmps that fit the output without resizing and are
+   not error-diffused or dithered are read as palette indices rather than
+   reformatted to 24-bit. the closest color is then found once for each
+   palette entry instead of once for each pixel. returns INVALID to reformat. */
+sshort ReadIndexedBMP(FILE *fp)
+{
+	if (dither != 0 || diffuse != 0 || loresoutput != 0 || debug != 0) return INVALID;
+	if (bmpwidth > 280 || bmpheight > 192) return INVALID;
+	/* merged pixels are the average of two palette entries */
+	if (merge == 1 && (scale == 1 || bmpwidth > 140)) return INVALID;
+
+	if (bmi.biBitCount == 8)
+		fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*256,1,fp);
+	else
+		fread((char *)&sbmp[0].rgbBlue, sizeof(RGBQUAD)*16,1,fp);
+	memset(&indexlut[0][0],0,sizeof(indexlut));
+	return SUCCESS;
+}
+
+/* plot a line of palette indices read by ReadIndexedBMP */
+/* the same as the 24-bit loop in Convert() without merge */
+void PlotIndexedLine(ushort y)
+{
+	ushort x, x1, x2, step = (ushort)(scale + 1);
+	uchar drawcolor;
+
+	UnpackVGALine();
+	for (x = 0, x1 = 0; x < bmpwidth; x += step) {
+		x2 = x / step;
+		maskpixel = 0;
+		if (overlay == 1) {
+			overcolor = maskline[x2];
+			if (overcolor != clearcolor) maskpixel = 1;
+		}
+		if (maskpixel == 1) drawcolor = (uchar)overcolor;
+		else drawcolor = GetIndexColor(dibscanline1[x],x2,y);
+
+		dhrplot(x2,y,drawcolor);
+		if (preview == 1) {
+			previewline[x1] = previewline[x1+3] = rgbPreview[drawcolor][BLUE]; x1++;
+			previewline[x1] = previewline[x1+3] = rgbPreview[drawcolor][GREEN]; x1++;
+			previewline[x1] = previewline[x1+3] = rgbPreview[drawcolor][RED]; x1+=4;
 		}
 	}
-    /* read the header stuff into the appropriate structures */
-    fread((char *)&bfi.bfType[0],
-	             sizeof(BITMAPFILEHEADER),1,fp);
-    fread((char *)&bmi.biSize,
-                 sizeof(BITMAPINFOHEADER),1,fp);
-    return fp;
 }
 
 
@@ -4488,8 +4557,8 @@ sshort ValidLoResSizeRange()
 sshort Convert()
 {
 
-    FILE *fp, *fpdib, *fpreview;
-    sshort status = INVALID, resize = 0;
+    FILE *fp, *fpreview;
+    sshort status = INVALID, resize = 0, indexed = 0;
 	ushort x,x1,x2,y,yoff,i,packet, outpacket, width, dwidth, red, green, blue;
 	uchar r,g,b,drawcolor;
 	ulong pos, prepos;
@@ -4499,7 +4568,9 @@ sshort Convert()
     /* it will be closed in main before exiting */
 	if (overlay == 1)OpenMaskFile();
 
+    StatsBegin(stats,STATS_HEADER);
     if((fp=fopen(bmpfile,"rb"))==NULL) {
+		StatsEnd(stats,STATS_HEADER);
 		printf("Error Opening %s for reading!\n",bmpfile);
 		return status;
 	}
@@ -4508,6 +4579,7 @@ sshort Convert()
 	             sizeof(BITMAPFILEHEADER),1,fp);
     fread((char *)&bmi.biSize,
                  sizeof(BITMAPINFOHEADER),1,fp);
+    StatsEnd(stats,STATS_HEADER);
 
     /* reformat to 24 bit */
     if (bmi.biCompression==BI_RGB &&
@@ -4527,14 +4599,17 @@ sshort Convert()
 		}
 
        if (bmi.biBitCount == 8 || bmi.biBitCount == 4) {
-	    	fp = ReformatBMP(fp);
+			StatsBegin(stats,STATS_REFORMAT);
+			if (ReadIndexedBMP(fp) == SUCCESS) indexed = 1;
+			else fp = ReformatBMP(fp);
+			StatsEnd(stats,STATS_REFORMAT);
 	    	if (fp == NULL) return INVALID;
 		}
 	}
 
     if (bmi.biCompression==BI_RGB &&
         bfi.bfType[0] == 'B' && bfi.bfType[1] == 'M' &&
-        bmi.biPlanes==1 && bmi.biBitCount == 24) {
+        bmi.biPlanes==1 && (bmi.biBitCount == 24 || indexed == 1)) {
 
 		bmpwidth = (ushort) bmi.biWidth;
 		bmpheight = (ushort) bmi.biHeight;
@@ -4576,7 +4651,9 @@ sshort Convert()
     		memset(&dibscanline2[0],0,1920);
     		memset(&dibscanline3[0],0,1920);
     		memset(&dibscanline4[0],0,1920);
+			StatsBegin(stats,STATS_RESIZE);
 			fp = ResizeBMP(fp,resize);
+			StatsEnd(stats,STATS_RESIZE);
 			if (fp == NULL) return INVALID;
 			bmpwidth = (ushort) bmi.biWidth;
 			bmpheight = (ushort) bmi.biHeight;
@@ -4623,7 +4700,11 @@ sshort Convert()
 	}
 
 
-	packet = bmpwidth * 3;
+	if (indexed == 1) {
+		if (bmi.biBitCount == 8) packet = bmpwidth;
+		else packet = (bmpwidth + 1) / 2;
+	}
+	else packet = bmpwidth * 3;
     /* BMP scanlines are padded to a multiple of 4 bytes (DWORD) */
 	while ((packet % 4) != 0) packet++;
 
@@ -4633,14 +4714,19 @@ sshort Convert()
     	memset(&bmpscanline[0],0,960);
     	memset(&dibscanline1[0],0,960);
     	memset(&dibscanline2[0],0,960);
+		StatsBegin(stats,STATS_DIFFUSE);
 		fp = ReadDIBFile(fp, packet);
+		StatsEnd(stats,STATS_DIFFUSE);
 		if (fp == NULL) return INVALID;
 	}
 
+	/* the preview is written as the scanlines are dithered */
+	StatsBegin(stats,STATS_DITHER);
 	if (preview!=0) {
 		fpreview = fopen(previewfile,"wb+");
 
 		if (fpreview != NULL) {
+			StatsOutput(stats,previewfile);
 			outpacket = WriteDIBHeader(fpreview,width,bmpheight);
 			if (outpacket == 0) {
 				fclose(fpreview);
@@ -4690,12 +4776,15 @@ sshort Convert()
 	}
 
 	for (y=0;y<bmpheight;y++,pos-=packet) {
-		fseek(fp,pos,SEEK_SET);
-		fread((char *)&bmpscanline[0],1,packet,fp);
+		SeekWorkBMP(fp,pos);
+		ReadWorkBMP(bmpscanline,packet,fp);
 
         if (overlay == 1)ReadMaskLine(y);
 
-		if (scale == 1) {
+		if (indexed == 1) {
+			PlotIndexedLine(y);
+		}
+		else if (scale == 1) {
 			for (x = 0,i = 0, x1=0; x < bmpwidth; x++) {
 				/* get even pixel values */
 				b = bmpscanline[i]; i++;
@@ -4865,15 +4954,15 @@ sshort Convert()
 		fclose(fpreview);
 		if (quietmode != 0) printf("Preview file %s created!\n",previewfile);
 	}
+	StatsEnd(stats,STATS_DITHER);
 
-    if (debug == 0) {
-		if (diffuse  != 0) remove(dibfile);
-		if (resize != 0) remove(scaledfile);
-		if (reformat != 0) remove(reformatfile);
-	}
+    FreeWorkBMP(&workbmp);
 
-    if (savedhr() != SUCCESS) return INVALID;
-    if (savesprite() != SUCCESS) return INVALID;
+    StatsBegin(stats,STATS_WRITE);
+    status = (sshort)savedhr();
+    if (status == SUCCESS) status = (sshort)savesprite();
+    StatsEnd(stats,STATS_WRITE);
+    if (status != SUCCESS) return INVALID;
 
 	return SUCCESS;
 
@@ -4887,7 +4976,9 @@ sshort ConvertMono()
 	ushort x,y,i,packet, outpacket, red, green, blue, verbatim;
 	ulong pos, prepos;
 
+    StatsBegin(stats,STATS_HEADER);
     if((fp=fopen(bmpfile,"rb"))==NULL) {
+		StatsEnd(stats,STATS_HEADER);
 		printf("Error Opening %s for reading!\n",bmpfile);
 		return status;
 	}
@@ -4896,6 +4987,7 @@ sshort ConvertMono()
 	             sizeof(BITMAPFILEHEADER),1,fp);
     fread((char *)&bmi.biSize,
                  sizeof(BITMAPINFOHEADER),1,fp);
+    StatsEnd(stats,STATS_HEADER);
 
 	bmpwidth = (ushort) bmi.biWidth;
 	bmpheight = (ushort) bmi.biHeight;
@@ -4930,7 +5022,9 @@ sshort ConvertMono()
     if (bmi.biCompression==BI_RGB &&
         bfi.bfType[0] == 'B' && bfi.bfType[1] == 'M' && bmi.biPlanes==1 &&
        ((bmi.biBitCount == 8) || (bmi.biBitCount == 4) || (bmi.biBitCount == 1))) {
+		StatsBegin(stats,STATS_REFORMAT);
 	    fp = ReformatBMP(fp);
+		StatsEnd(stats,STATS_REFORMAT);
 	    if (fp == NULL) return INVALID;
 	}
 
@@ -4959,10 +5053,12 @@ sshort ConvertMono()
     /* BMP scanlines are padded to a multiple of 4 bytes (DWORD) */
 	while ((packet % 4) != 0) packet++;
 
+	StatsBegin(stats,STATS_DITHER);
 	if (preview!=0) {
 		fpreview = fopen(previewfile,"wb+");
 
 		if (fpreview != NULL) {
+			StatsOutput(stats,previewfile);
 			outpacket = WriteDIBHeader(fpreview,bmpwidth,bmpheight);
 			if (outpacket == 0) {
 				fclose(fpreview);
@@ -5011,11 +5107,11 @@ sshort ConvertMono()
 
 
 	for (y=0;y<192;y++,pos-=packet) {
-		fseek(fp,pos,SEEK_SET);
-		fread((char *)&bmpscanline[0],1,packet,fp);
+		SeekWorkBMP(fp,pos);
+		ReadWorkBMP(bmpscanline,packet,fp);
 		if (hgroutput != 1) {
 			pos-=packet;
-			fread((char *)&bmpscanline2[0],1,packet,fp);
+			ReadWorkBMP(bmpscanline2,packet,fp);
 		}
 
 		for (x = 0,i = 0; x < bmpwidth; x++, i+=3) {
@@ -5081,12 +5177,14 @@ sshort ConvertMono()
 		fclose(fpreview);
 		if (quietmode != 0) printf("Preview file %s created!\n",previewfile);
 	}
+	StatsEnd(stats,STATS_DITHER);
 
-    if (debug == 0) {
-		if (reformat != 0) remove(reformatfile);
-	}
+    FreeWorkBMP(&workbmp);
 
-    if (savedhr() != SUCCESS) return INVALID;
+    StatsBegin(stats,STATS_WRITE);
+    status = (sshort)savedhr();
+    StatsEnd(stats,STATS_WRITE);
+    if (status != SUCCESS) return INVALID;
 	return SUCCESS;
 
 }
@@ -5408,6 +5506,7 @@ int save_to_bmp24(void)
 		preview = 0;
 		return INVALID;
 	}
+	StatsOutput(stats,previewfile);
 
 	if (mono == 1 && hgroutput == 0) {
 		width = 560;
@@ -5531,7 +5630,236 @@ sshort GetUserTextFile()
 	return SUCCESS;
 }
 
+/* ------------------------------------------------------------------------ */
+/* kernel micro-benchmarks - see ../src_common/bench.h                      */
+/* ------------------------------------------------------------------------ */
+
+#define BENCH_RANDOM 65536L
+
+/* error-diffusion dither a bmp into dhrbuf the same way as Convert() */
+void BenchDitherImage(BENCHIMAGE *img)
+{
+	int x, y, i, width = img->width;
+	uchar *ptr;
+
+    memset(dhrbuf,0,16384);
+	memset(&redDither[0],0,1280);
+	memset(&greenDither[0],0,1280);
+	memset(&blueDither[0],0,1280);
+	memset(&redSeed[0],0,1280);
+	memset(&greenSeed[0],0,1280);
+	memset(&blueSeed[0],0,1280);
+	memset(&redSeed2[0],0,1280);
+	memset(&greenSeed2[0],0,1280);
+	memset(&blueSeed2[0],0,1280);
+
+	for (y = 0; y < img->height; y++) {
+		ptr = (uchar *)&img->bgr[y * width * 3];
+		for (x = 0, i = 0; x < width; x++, i+=3) {
+			AdjustShortPixel(1,(sshort *)&redDither[x],(sshort)ptr[i+2]);
+			AdjustShortPixel(1,(sshort *)&greenDither[x],(sshort)ptr[i+1]);
+			AdjustShortPixel(1,(sshort *)&blueDither[x],(sshort)ptr[i]);
+		}
+		FloydSteinberg(y,width);
+		memcpy(&redDither[0],&redSeed[0],1280);
+		memcpy(&greenDither[0],&greenSeed[0],1280);
+		memcpy(&blueDither[0],&blueSeed[0],1280);
+		memcpy(&redSeed[0],&redSeed2[0],1280);
+		memcpy(&greenSeed[0],&greenSeed2[0],1280);
+		memcpy(&blueSeed[0],&blueSeed2[0],1280);
+		memset(&redSeed2[0],0,1280);
+		memset(&greenSeed2[0],0,1280);
+		memset(&blueSeed2[0],0,1280);
+	}
+}
+
+/* times GetMedColor, the FloydSteinberg dithers, DiffuseError,
+   ShrinkBMPLine, dhrplot and dhrgetpixel on their own */
+int KernelBench(int numfiles, char **files)
+{
+	BENCHRUN run;
+	BENCHIMAGE *img;
+	double pixels, bytes, distance;
+	unsigned long check = 0L;
+	uchar *random, *colors, *expanded, *ptr;
+	char kernel[32];
+	long i, j, count;
+	int idx, x, y, packet, savescale = scale;
+
+	BenchOpen(&run,"b2d",numfiles,files);
+	for (idx = 0; idx < run.numother; idx++) {
+		if (cmpstr(run.other[idx],"fixed") == SUCCESS) fixeddistance = 1;
+		else printf("%s is not a BMP or A2FC file!\n",run.other[idx]);
+	}
+
+	/* the dithers plot a full screen at most */
+	for (idx = 0, x = 0; idx < run.numbmp; idx++) {
+		if (run.bmp[idx].width > 140 || run.bmp[idx].height > 192) {
+			printf("%s is larger than 140 x 192!\n",run.bmp[idx].name);
+			free(run.bmp[idx].bgr);
+			continue;
+		}
+		memcpy(&run.bmp[x++],&run.bmp[idx],sizeof(BENCHIMAGE));
+	}
+	run.numbmp = x;
+	if (run.numbmp == 0 && run.numa2fc == 0) {
+		puts("No BMP or A2FC files to bench!");
+		return INVALID;
+	}
+
+	pixels = BenchPixels(&run);
+	random = (uchar *)malloc(BENCH_RANDOM * 3);
+	colors = (uchar *)malloc((size_t)pixels + 1);
+	if (NULL == random || NULL == colors) {
+		if (NULL != random) free(random);
+		BenchClose(&run);
+		puts("Not Enough Memory for Bench...");
+		return INVALID;
+	}
+	for (i = 0; i < BENCH_RANDOM * 3; i++) random[i] = (uchar)BenchRandom(&run);
+
+	/* the conversion palette */
+	quietmode = 0;
+	GetBuiltinPalette(5,5,0);
+	InitDoubleArrays();
+
+	printf("Kernel benchmarks: %d BMP and %d A2FC files%s\n",run.numbmp,run.numa2fc,
+		(fixeddistance == 1 ? ", fixed-point distance" : ""));
+
+	if (run.numbmp > 0) {
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, count = 0L; idx < run.numbmp; idx++) {
+				img = &run.bmp[idx];
+				ptr = img->bgr;
+				for (i = 0; i < (long)img->width * img->height; i++, ptr+=3)
+					colors[count++] = GetMedColor(ptr[2],ptr[1],ptr[0],&distance);
+			}
+		}
+		BenchResult(&run,"GetMedColor","bmp","ns/pixel",pixels,BenchCheckBuffer(0L,colors,count));
+	}
+
+	for (BenchStart(&run); BenchRunning(&run); ) {
+		for (i = 0, check = 0L; i < BENCH_RANDOM * 3; i+=3)
+			check = BenchCheck(check,GetMedColor(random[i],random[i+1],random[i+2],&distance));
+	}
+	BenchResult(&run,"GetMedColor","random","ns/pixel",(double)BENCH_RANDOM,check);
+
+	if (run.numbmp > 0) {
+		/* the match without the cache */
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, check = 0L; idx < run.numbmp; idx++) {
+				img = &run.bmp[idx];
+				ptr = img->bgr;
+				for (i = 0; i < (long)img->width * img->height; i++, ptr+=3)
+					check = BenchCheck(check,MatchDrawColor(ptr[2],ptr[1],ptr[0],LUT_MED));
+			}
+		}
+		BenchResult(&run,"MatchDrawColor","bmp","ns/pixel",pixels,check);
+
+		/* the cached look-up that the dithers use - each image starts with
+		   an empty cache like a conversion does */
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, check = 0L; idx < run.numbmp; idx++) {
+				FreeColorTables();
+				img = &run.bmp[idx];
+				ptr = img->bgr;
+				for (i = 0; i < (long)img->width * img->height; i++, ptr+=3)
+					check = BenchCheck(check,GetLutColor(ptr[2],ptr[1],ptr[0],LUT_MED));
+			}
+		}
+		FreeColorTables();
+		BenchResult(&run,"GetLutColor","bmp","ns/pixel",pixels,check);
+
+		for (dither = FLOYDSTEINBERG; dither <= BUCKELS; dither++) {
+			ditherstart = 0;
+			for (BenchStart(&run); BenchRunning(&run); ) {
+				for (idx = 0, check = 0L; idx < run.numbmp; idx++) {
+					FreeColorTables();
+					BenchDitherImage(&run.bmp[idx]);
+					check = BenchCheckBuffer(check,dhrbuf,16384L);
+				}
+			}
+			FreeColorTables();
+			sprintf(kernel,"FloydSteinberg %s",dithertext[dither-1]);
+			BenchResult(&run,kernel,"bmp","ns/pixel",pixels,check);
+		}
+		dither = 0;
+		ditherstart = 0;
+
+		/* the error-diffused copy made by option "diffuse" */
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, check = 0L; idx < run.numbmp; idx++) {
+				img = &run.bmp[idx];
+				packet = img->width * 3;
+				for (y = 0; y < img->height; y++) {
+					ptr = (uchar *)&img->bgr[y * packet];
+					memcpy(&dibscanline1[0],ptr,packet);
+					if (y == 0) memcpy(&dibscanline2[0],ptr,packet);
+					DiffuseError((ushort)packet);
+					memcpy(&dibscanline2[0],&dibscanline1[0],packet);
+				}
+				check = BenchCheckBuffer(check,dibscanline1,(long)packet);
+			}
+		}
+		BenchResult(&run,"DiffuseError","bmp","MB/s",pixels * 3,check);
+
+		/* 140 pixel lines expanded to 2240 pixels like a 320 pixel line
+		   expanded by 7 in ShrinkPixels() */
+		for (idx = 0, count = 0L; idx < run.numbmp; idx++) {
+			if (run.bmp[idx].width == 140) count += run.bmp[idx].height;
+		}
+		if (count > 0L && NULL != (expanded = (uchar *)malloc((size_t)(count * 6720)))) {
+			for (idx = 0, j = 0L; idx < run.numbmp; idx++) {
+				img = &run.bmp[idx];
+				if (img->width != 140) continue;
+				for (y = 0; y < img->height; y++, j++)
+					ExpandBMPLine((uchar *)&img->bgr[y * 420],(uchar *)&expanded[j * 6720],140,16);
+			}
+			for (BenchStart(&run); BenchRunning(&run); ) {
+				for (j = 0, check = 0L; j < count; j++) {
+					ShrinkBMPLine((uchar *)&expanded[j * 6720],(uchar *)&bmpscanline[0],2240);
+					check = BenchCheckBuffer(check,bmpscanline,420L);
+				}
+			}
+			scale = savescale;
+			BenchResult(&run,"ShrinkBMPLine","bmp","MB/s",(double)count * 6720,check);
+			free(expanded);
+		}
+
+		/* plot the closest colors from the GetMedColor run */
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, count = 0L, check = 0L; idx < run.numbmp; idx++) {
+				img = &run.bmp[idx];
+				memset(dhrbuf,0,16384);
+				for (y = 0; y < img->height; y++) {
+					for (x = 0; x < img->width; x++) dhrplot(x,y,colors[count++]);
+				}
+				check = BenchCheckBuffer(check,dhrbuf,16384L);
+			}
+		}
+		BenchResult(&run,"dhrplot","bmp","ns/pixel",pixels,check);
+	}
+
+	if (run.numa2fc > 0) {
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (idx = 0, check = 0L; idx < run.numa2fc; idx++) {
+				memcpy(dhrbuf,run.a2fc[idx].a2fc,16384);
+				for (y = 0; y < 192; y++) {
+					for (x = 0; x < 140; x++) check = BenchCheck(check,(unsigned)dhrgetpixel(x,y));
+				}
+			}
+		}
+		BenchResult(&run,"dhrgetpixel","a2fc","ns/pixel",(double)run.numa2fc * 140 * 192,check);
+	}
 
+	free(colors);
+	free(random);
+	FreeColorTables();
+	idx = BenchWriteJSON(&run);
+	BenchClose(&run);
+	if (idx != 0) return INVALID;
+	return SUCCESS;
+}
 
 
 int main(int argc, char **argv)
@@ -5561,6 +5889,14 @@ int main(int argc, char **argv)
     /* initialize color space for color distance */
 	setluma();
 
+	if (cmpstr(argv[1],"bench") == SUCCESS) {
+		status = KernelBench(argc - 2,(char **)&argv[2]);
+		free(dhrbuf);
+		free(hgrbuf);
+		if (status == INVALID) return (1);
+		return SUCCESS;
+	}
+
     /* automatic naming is used for a number of reasons */
     /* I make no attempt to test for a legal ProDOS file name length - that's up to the user */
     /* but short names should be used when possible for a number of reasons */
@@ -5589,6 +5925,19 @@ int main(int argc, char **argv)
 				continue;
 			}
 
+			/* use the fixed-point color distance that is shared with a2b */
+			if (cmpstr(wordptr,"fixed") == SUCCESS) {
+				fixeddistance = 1;
+				continue;
+			}
+
+			/* run the fixed-point color distance beside the usual one and report
+			   how often they pick a different color - the usual one is still used */
+			if (cmpstr(wordptr,"fixedcheck") == SUCCESS) {
+				fixeddistance = 2;
+				continue;
+			}
+
             /* set different Luma for color distance */
             jdx = 0;
 			if (cmpstr(wordptr,"GIMP") == SUCCESS) jdx = 411;
@@ -5632,6 +5981,12 @@ int main(int argc, char **argv)
 				continue;
 			}
 
+			/* stage times and color counts - see ../src_common/stats.h */
+			if (StatsOption((char *)wordptr) != 0) {
+				statsformat = StatsOption((char *)wordptr);
+				continue;
+			}
+
 			if (cmpstr(wordptr,"mono") == SUCCESS || cmpstr(wordptr,"reverse") == SUCCESS) {
 				mono = 1;
 				if (dither == 0) dither = FLOYDSTEINBERG;
@@ -6213,6 +6568,9 @@ int main(int argc, char **argv)
     /* user titling file */
     sprintf(usertextfile,"%s.txt",fname);
 
+    /* stats go in fname_stats.json or fname_trace.json */
+    stats = StatsOpen(statsformat,"b2d",bmpfile,fname);
+
     /* upper case basename for Apple II Output */
     for (idx = 0; fname[idx] != (uchar)0; idx++) {
 		ch = toupper(fname[idx]);
@@ -6324,6 +6682,7 @@ int main(int argc, char **argv)
 #endif
 	}
 
+	StatsBegin(stats,STATS_PALETTE);
 	if (mono == 1) {
 		palidx = previewidx = 4;
 		/* create a black and white palette */
@@ -6340,6 +6699,7 @@ int main(int argc, char **argv)
 
   	GetBuiltinPalette(palidx,previewidx,0);
     InitDoubleArrays();
+	StatsEnd(stats,STATS_PALETTE);
 
     if (mono == 1) status = ConvertMono();
     else status = Convert();
@@ -6347,6 +6707,13 @@ int main(int argc, char **argv)
     /* close mask file if any before exiting */
     if (NULL != fpmask) fclose(fpmask);
 
+    if (fixeddistance == 2)
+    	printf("%s: fixed-point distance differs in %lu of %lu lookups\n",
+    	       bmpfile,(unsigned long)distmismatches,(unsigned long)distlookups);
+
+    StatsClose(stats);
+    FreeWorkBMP(&workbmp);
+    FreeColorTables();
     free(dhrbuf);
     free(hgrbuf);
 
@@ -36,6 +36,7 @@ Apple II color or monochrome HGR or DHGR files.
 /* ***************************************************************** */
 
 #include "tomthumb.h"
+#include "../src_common/colordist.h"
 
 /* ***************************************************************** */
 /* ========================== defines ============================== */
@@ -115,6 +116,10 @@ typedef unsigned short ushort;
 typedef unsigned long ulong;
 typedef short sshort;
 
+/* the kernel benchmarks and the stats need uchar */
+#include "../src_common/bench.h"
+#include "../src_common/stats.h"
+
 /* Bitmap Header structures */
 #ifdef MINGW
 typedef struct __attribute__((__packed__)) tagBITMAPINFOHEADER
@@ -171,6 +176,36 @@ typedef struct tagRGBQUAD
     unsigned char    rgbReserved;
 } RGBQUAD;
 
+/* in-memory work bmp - headers followed by scanlines like a BMP file */
+typedef struct tagWORKBMP
+{
+    uchar *buf;
+    ulong size, pos;
+} WORKBMP;
+
+/* an error diffusion dither compiled into a list of taps - see CompileDither() */
+#define DITHER_TAPS 33
+
+typedef struct tagDITHERTAP
+{
+    sshort line;        /* 0 is the current line, 1 the next and 2 the one after */
+    sshort offset;      /* from the current pixel */
+    sshort weight;
+    sshort clip;        /* clip the sum to 0-255 like AdjustShortPixel() */
+    sshort *quotient;   /* the error each tap adds, indexed by errors -255 to 255 */
+} DITHERTAP;
+
+typedef struct tagDITHERKERNEL
+{
+    int numtaps;
+    int onelinetaps;    /* the taps that are used when only the current line is dithered */
+    int carry;          /* the tap that takes the summed rounding error or -1 */
+    int divisor;        /* for the summed rounding error */
+    int edge;           /* the pixels on the left that have taps behind the line */
+    DITHERTAP taps[DITHER_TAPS];
+    sshort quotients[DITHER_TAPS][511];
+} DITHERKERNEL;
+
 
 /* ***************************************************************** */
 /* =================== prototypes as required  ===================== */
@@ -193,6 +228,10 @@ BITMAPINFOHEADER bmi;
 BMPHEADER mybmp,maskbmp;
 RGBQUAD   sbmp[256], maskpalette[256]; /* super vga - applewin */
 
+/* work bmps for reformatting, resizing and error diffusion */
+/* workbmp is the current input if in use and nextbmp is being created */
+WORKBMP workbmp, nextbmp;
+
 /* overlay file for screen titling and framing and "cleansing" */
 FILE *fpmask = NULL;
 unsigned char remap[256];
@@ -206,7 +245,11 @@ char hgrcolor[MAXF],hgrmono[MAXF],hgrwork[MAXF];
 
 int mono = 0, dosheader = 0, spritemask = 0, tags=0;
 int backgroundcolor = 0, quietmode = 1, diffuse = 0, merge = 0, scale = 0, applesoft = 0, outputtype = BIN_OUTPUT;
-int reformat = 0, debug = 0;
+int debug = 0;
+
+/* option "stats" - see ../src_common/stats.h */
+int statsformat = 0;
+STATS *stats = NULL;
 int preview = 0, vbmp = 0, hgroutput = 0;
 int overlay = 0, maskpixel=0, overcolor=0, clearcolor=5;
 
@@ -236,6 +279,55 @@ int paletteclip = 0;
 sshort customdivisor;
 sshort customdither[3][11];
 
+/* the built-in dithers in the same layout as a custom dither with the
+   current pixel at subscript 5 of the first line */
+sshort ditherpattern[9][3][11] = {
+    /* Floyd-Steinberg (1/16) */
+    {{0,0,0,0,0,0,7,0,0,0,0},
+     {0,0,0,0,3,5,1,0,0,0,0},
+     {0,0,0,0,0,0,0,0,0,0,0}},
+    /* Jarvis (1/48) */
+    {{0,0,0,0,0,0,7,5,0,0,0},
+     {0,0,0,3,5,7,5,3,0,0,0},
+     {0,0,0,1,3,5,3,1,0,0,0}},
+    /* Stucki (1/42) */
+    {{0,0,0,0,0,0,8,4,0,0,0},
+     {0,0,0,2,4,8,4,2,0,0,0},
+     {0,0,0,1,2,4,2,1,0,0,0}},
+    /* Atkinson (1/8) */
+    {{0,0,0,0,0,0,1,1,0,0,0},
+     {0,0,0,0,1,1,1,0,0,0,0},
+     {0,0,0,0,0,1,0,0,0,0,0}},
+    /* Burkes (1/32) */
+    {{0,0,0,0,0,0,8,4,0,0,0},
+     {0,0,0,2,4,8,4,2,0,0,0},
+     {0,0,0,0,0,0,0,0,0,0,0}},
+    /* Sierra (1/32) */
+    {{0,0,0,0,0,0,5,3,0,0,0},
+     {0,0,0,2,4,5,4,2,0,0,0},
+     {0,0,0,0,2,3,2,0,0,0,0}},
+    /* Sierra Two (1/16) */
+    {{0,0,0,0,0,0,4,3,0,0,0},
+     {0,0,0,1,2,3,2,1,0,0,0},
+     {0,0,0,0,0,0,0,0,0,0,0}},
+    /* Sierra Lite (1/4) */
+    {{0,0,0,0,0,0,2,0,0,0,0},
+     {0,0,0,0,1,1,0,0,0,0,0},
+     {0,0,0,0,0,0,0,0,0,0,0}},
+    /* Buckels (1/8) */
+    {{0,0,0,0,0,0,2,1,0,0,0},
+     {0,0,0,0,1,2,1,0,0,0,0},
+     {0,0,0,0,0,1,0,0,0,0,0}}};
+
+/* how the serpentine effect reverses each built-in dither */
+/* 0 - not at all, 1 - the current line only, 2 - all 3 lines and the
+   next line is seeded even when only the current line is dithered */
+uchar ditherserpentine[9] = {2,0,1,1,1,1,1,2,1};
+
+/* the dither compiled for lines that run forward and for lines that run in
+   reverse with the serpentine effect */
+DITHERKERNEL ditherforward, ditherreverse;
+
 unsigned char msk[]={0x80,0x40,0x20,0x10,0x8,0x4,0x2,0x1};
 int reverse = 0;
 
@@ -282,7 +374,10 @@ sshort redDither[640],greenDither[640],blueDither[640];
 /* seed values from previous line */
 sshort redSeed[640],greenSeed[640],blueSeed[640];
 sshort redSeed2[640],greenSeed2[640],blueSeed2[640];
-sshort *colorptr, *seedptr, *seed2ptr, color_error;
+sshort *ditherrows[3][3] = {
+    {redDither,redSeed,redSeed2},
+    {greenDither,greenSeed,greenSeed2},
+    {blueDither,blueSeed,blueSeed2}};
 
 int colorbleed = 100;
 
@@ -696,6 +791,29 @@ double rgbOrangeLuma[3], rgbGreenLuma[3];
 double rgbLumaBrighten[16], rgbDoubleBrighten[16][3];
 double rgbLumaDarken[16], rgbDoubleDarken[16][3];
 
+/* the med, high and low palettes */
+#define LUT_MED  0
+#define LUT_HIGH 1
+#define LUT_LOW  2
+
+/* nearest color caches - a cache for each palette and for the full palette
+   and the 2 hgr palette subsets, only allocated when it is first used */
+/* a cell holds a bit for each palette color that can be the closest somewhere
+   in its 8 x 8 x 8 block of colors, zero if the block has not been seen yet */
+#define LUT_CELLS 32768L /* 5 bits of each gun */
+ushort *colorlut[3][3];
+
+/* 16 color and 256 color input that is plotted without reformatting */
+/* palette index + 1 of each bmp palette entry for the med, high and low palettes */
+uchar indexlut[3][256];
+
+/* fixed-point color distance shared with a2b */
+/* 0 = off, 1 = use it, 2 = check it against the double distance */
+int fixeddistance = 0;
+DISTWEIGHTS distweights;
+DISTPALETTE distmed, disthigh, distlow;
+ulong distlookups = 0, distmismatches = 0;
+
 /* provides base address for page1 hires scanlines  */
 unsigned HB[]={
 0x2000, 0x2400, 0x2800, 0x2C00, 0x3000, 0x3400, 0x3800, 0x3C00,
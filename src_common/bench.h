@@ -0,0 +1,352 @@
+/* ---------------------------------------------------------------------
+bench.h - kernel micro-benchmarks shared by a2b, b2d, m2s and xpack
+
+Module Name - Description
+-------------------------
+
+Each tool has a bench command that times its own inner loops on their
+own, away from the file reading and writing around them:
+
+    a2b bench file.bmp ... file.A2FC ...
+    b2d bench file.bmp ... file.A2FC ...
+    m2s bench file.SHR ... file.SH3 ...
+    xpack bench file.A2FC ...
+
+"make bench" in each src_ directory runs its tool over the BMP and A2FC
+files in ../bmp and ../bmp/a2fc, or for m2s over the SHR files in CORPUS.
+
+The tools load their inputs with the helpers in this module so that the
+same files give the same pixels in every tool. 24-bit BMP files are kept
+top-down in blue, green, red order and A2FC files are kept as the 16384
+bytes of auxiliary and main memory. The random inputs come from a fixed
+seed so that every run times the same colors.
+
+Each kernel runs over all of its inputs as many times as it takes to
+fill BENCH_SECONDS of processor time. Color matching and dithering are
+given in nanoseconds per pixel and the byte oriented kernels in MB/s.
+The check value is a checksum of what the kernel produced on its last
+pass so a run that is faster but gives other output stands out.
+
+The results are printed and saved as JSON, by default in the file
+<tool>_bench.json. Give another name ending in .json on the command line
+to keep the results of runs that are to be compared.
+
+Include this after the uchar type has been defined.
+
+*/
+
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 0.25
+#endif
+
+#define BENCH_SEED    0xACE1UL
+#define BENCH_FILES   64
+#define BENCH_RESULTS 64
+#define BENCH_A2FC    16384
+
+/* the helpers are static inline so that a tool that does not call every
+   one of them builds without unused function warnings. other compilers
+   just get static functions */
+#ifdef __GNUC__
+#define BENCHINLINE static inline
+#else
+#define BENCHINLINE static
+#endif
+
+typedef struct tagBENCHIMAGE
+{
+    char *name;
+    int width, height;
+    uchar *bgr;     /* top-down, 3 bytes a pixel, no padding */
+    uchar *a2fc;    /* or aux and main memory of an A2FC file */
+} BENCHIMAGE;
+
+typedef struct tagBENCHRESULT
+{
+    char kernel[32];
+    char input[16];
+    char unit[16];
+    double value;
+    double count;   /* pixels or bytes a pass */
+    long passes;
+    unsigned long check;
+} BENCHRESULT;
+
+typedef struct tagBENCHRUN
+{
+    char *program;
+    char jsonfile[256];
+    int numbmp, numa2fc, numother;
+    BENCHIMAGE bmp[BENCH_FILES];
+    BENCHIMAGE a2fc[BENCH_FILES];
+    char *other[BENCH_FILES];   /* left for the tool to load */
+    int numresults;
+    BENCHRESULT results[BENCH_RESULTS];
+    unsigned long seed;
+    clock_t start;
+    long passes;
+} BENCHRUN;
+
+/* 32-bit linear congruential generator with the run's fixed seed */
+BENCHINLINE unsigned BenchRandom(BENCHRUN *run)
+{
+    run->seed = (run->seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return (unsigned)(run->seed >> 16) & 0x7fff;
+}
+
+/* checksum of kernel output so that runs can be compared */
+BENCHINLINE unsigned long BenchCheck(unsigned long check, unsigned value)
+{
+    return ((check * 31UL) + value) & 0xffffffffUL;
+}
+
+BENCHINLINE unsigned long BenchCheckBuffer(unsigned long check, uchar *buf, long len)
+{
+    long i;
+
+    for (i = 0; i < len; i++) check = BenchCheck(check,buf[i]);
+    return check;
+}
+
+BENCHINLINE int BenchHasExt(char *name, char *ext)
+{
+    int len = (int)strlen(name), extlen = (int)strlen(ext), i;
+
+    if (len < extlen) return 0;
+    for (i = 0; i < extlen; i++) {
+        if (toupper(name[len - extlen + i]) != toupper(ext[i])) return 0;
+    }
+    return 1;
+}
+
+/* 24-bit uncompressed BMP to a top-down blue, green, red buffer */
+BENCHINLINE int BenchLoadBMP(BENCHIMAGE *img, char *name)
+{
+    FILE *fp;
+    uchar header[54];
+    long offset, width, height, packet, y;
+    int topdown = 0;
+
+    if (NULL == (fp = fopen(name,"rb"))) {
+        printf("Error Opening %s for reading!\n",name);
+        return -1;
+    }
+    if (fread(header,1,54,fp) != 54 || header[0] != 'B' || header[1] != 'M' ||
+        header[28] != 24 || header[30] != 0) {
+        fclose(fp);
+        printf("%s is not a 24-bit BMP!\n",name);
+        return -1;
+    }
+    offset = header[10] | ((long)header[11] << 8) | ((long)header[12] << 16) | ((long)header[13] << 24);
+    width  = header[18] | ((long)header[19] << 8) | ((long)header[20] << 16);
+    height = header[22] | ((long)header[23] << 8) | ((long)header[24] << 16);
+    if (header[25] & 0x80) {
+        /* negative height */
+        height = 0x1000000L - height;
+        topdown = 1;
+    }
+    if (width < 1 || width > 640 || height < 1 || height > 480) {
+        fclose(fp);
+        printf("%s is too large to bench!\n",name);
+        return -1;
+    }
+    packet = (width * 3 + 3) & ~3L;
+    if (NULL == (img->bgr = (uchar *)malloc((size_t)(packet * height)))) {
+        fclose(fp);
+        puts("Not Enough Memory for Bench...");
+        return -1;
+    }
+    for (y = 0; y < height; y++) {
+        fseek(fp,offset + packet * (topdown == 1 ? y : height - 1 - y),SEEK_SET);
+        if (fread(&img->bgr[y * width * 3],1,(size_t)(width * 3),fp) != (size_t)(width * 3)) {
+            fclose(fp);
+            free(img->bgr);
+            img->bgr = NULL;
+            printf("%s is truncated!\n",name);
+            return -1;
+        }
+    }
+    fclose(fp);
+    img->name = name;
+    img->width = (int)width;
+    img->height = (int)height;
+    img->a2fc = NULL;
+    return 0;
+}
+
+BENCHINLINE int BenchLoadA2FC(BENCHIMAGE *img, char *name)
+{
+    FILE *fp;
+
+    if (NULL == (fp = fopen(name,"rb"))) {
+        printf("Error Opening %s for reading!\n",name);
+        return -1;
+    }
+    if (NULL == (img->a2fc = (uchar *)malloc(BENCH_A2FC))) {
+        fclose(fp);
+        puts("Not Enough Memory for Bench...");
+        return -1;
+    }
+    if (fread(img->a2fc,1,BENCH_A2FC,fp) != BENCH_A2FC) {
+        fclose(fp);
+        free(img->a2fc);
+        img->a2fc = NULL;
+        printf("%s is not an A2FC file!\n",name);
+        return -1;
+    }
+    fclose(fp);
+    img->name = name;
+    img->width = 140;
+    img->height = 192;
+    img->bgr = NULL;
+    return 0;
+}
+
+/* sort the command line into BMP and A2FC inputs and the JSON file name */
+/* anything else is kept in the other list for the tool */
+BENCHINLINE int BenchOpen(BENCHRUN *run, char *program, int numfiles, char **files)
+{
+    int idx;
+
+    memset(run,0,sizeof(BENCHRUN));
+    run->program = program;
+    run->seed = BENCH_SEED;
+    sprintf(run->jsonfile,"%s_bench.json",program);
+
+    for (idx = 0; idx < numfiles; idx++) {
+        if (BenchHasExt(files[idx],".json")) {
+            strncpy(run->jsonfile,files[idx],255);
+            continue;
+        }
+        if (BenchHasExt(files[idx],".bmp")) {
+            if (run->numbmp < BENCH_FILES &&
+                BenchLoadBMP(&run->bmp[run->numbmp],files[idx]) == 0) run->numbmp++;
+            continue;
+        }
+        if (BenchHasExt(files[idx],".A2FC") || BenchHasExt(files[idx],".2FC")) {
+            if (run->numa2fc < BENCH_FILES &&
+                BenchLoadA2FC(&run->a2fc[run->numa2fc],files[idx]) == 0) run->numa2fc++;
+            continue;
+        }
+        if (run->numother < BENCH_FILES) run->other[run->numother++] = files[idx];
+    }
+    return run->numbmp + run->numa2fc + run->numother;
+}
+
+BENCHINLINE void BenchClose(BENCHRUN *run)
+{
+    int idx;
+
+    for (idx = 0; idx < run->numbmp; idx++) free(run->bmp[idx].bgr);
+    for (idx = 0; idx < run->numa2fc; idx++) free(run->a2fc[idx].a2fc);
+    run->numbmp = run->numa2fc = 0;
+}
+
+/* total pixels in the BMP inputs */
+BENCHINLINE double BenchPixels(BENCHRUN *run)
+{
+    double pixels = 0.0;
+    int idx;
+
+    for (idx = 0; idx < run->numbmp; idx++) pixels += (double)run->bmp[idx].width * run->bmp[idx].height;
+    return pixels;
+}
+
+/* timing loop - for (BenchStart(run); BenchRunning(run); ) { one pass } */
+BENCHINLINE void BenchStart(BENCHRUN *run)
+{
+    run->passes = -1L;
+    run->start = clock();
+}
+
+BENCHINLINE int BenchRunning(BENCHRUN *run)
+{
+    run->passes++;
+    if (run->passes == 0L) return 1;
+    return ((double)(clock() - run->start) / CLOCKS_PER_SEC) < BENCH_SECONDS;
+}
+
+/* record the timing loop that just finished */
+/* count is the number of pixels or bytes in one pass */
+/* unit "ns/pixel" gives the time a pixel and "MB/s" gives the rate */
+BENCHINLINE void BenchResult(BENCHRUN *run, char *kernel, char *input, char *unit, double count, unsigned long check)
+{
+    BENCHRESULT *result;
+    double secs = (double)(clock() - run->start) / CLOCKS_PER_SEC;
+
+    if (run->numresults >= BENCH_RESULTS) return;
+    if (secs <= 0.0) secs = 1.0 / CLOCKS_PER_SEC;
+    if (run->passes < 1L) run->passes = 1L;
+
+    result = &run->results[run->numresults++];
+    sprintf(result->kernel,"%.31s",kernel);
+    sprintf(result->input,"%.15s",input);
+    sprintf(result->unit,"%.15s",unit);
+    result->count = count;
+    result->passes = run->passes;
+    result->check = check;
+    if (strcmp(unit,"MB/s") == 0) result->value = count * run->passes / 1000000.0 / secs;
+    else result->value = secs * 1000000000.0 / (count * run->passes);
+
+    printf("%-28s %-6s %10.2f %-8s %6ld passes  check %08lx\n",
+        result->kernel,result->input,result->value,result->unit,result->passes,result->check);
+}
+
+BENCHINLINE void BenchWriteString(FILE *fp, char *str)
+{
+    fputc('"',fp);
+    for (; *str != (char)0; str++) {
+        if (*str == '"' || *str == (char)92) fputc((char)92,fp);
+        fputc(*str,fp);
+    }
+    fputc('"',fp);
+}
+
+BENCHINLINE int BenchWriteJSON(BENCHRUN *run)
+{
+    FILE *fp;
+    int idx;
+    BENCHRESULT *result;
+
+    if (NULL == (fp = fopen(run->jsonfile,"w"))) {
+        printf("Error Opening %s for writing!\n",run->jsonfile);
+        return -1;
+    }
+    fprintf(fp,"{\n  \"program\": ");
+    BenchWriteString(fp,run->program);
+    fprintf(fp,",\n  \"seconds\": %.2f,\n  \"seed\": %lu,\n  \"inputs\": [",
+        (double)BENCH_SECONDS,(unsigned long)BENCH_SEED);
+    for (idx = 0; idx < run->numbmp + run->numa2fc + run->numother; idx++) {
+        fprintf(fp,"%s\n    ",(idx == 0 ? "" : ","));
+        if (idx < run->numbmp) BenchWriteString(fp,run->bmp[idx].name);
+        else if (idx < run->numbmp + run->numa2fc) BenchWriteString(fp,run->a2fc[idx - run->numbmp].name);
+        else BenchWriteString(fp,run->other[idx - run->numbmp - run->numa2fc]);
+    }
+    fprintf(fp,"\n  ],\n  \"results\": [");
+    for (idx = 0; idx < run->numresults; idx++) {
+        result = &run->results[idx];
+        fprintf(fp,"%s\n    {\"kernel\": ",(idx == 0 ? "" : ","));
+        BenchWriteString(fp,result->kernel);
+        fprintf(fp,", \"input\": ");
+        BenchWriteString(fp,result->input);
+        fprintf(fp,", \"unit\": ");
+        BenchWriteString(fp,result->unit);
+        fprintf(fp,", \"value\": %.4f, \"count\": %.0f, \"passes\": %ld, \"check\": \"%08lx\"}",
+            result->value,result->count,result->passes,result->check);
+    }
+    fprintf(fp,"\n  ]\n}\n");
+    fclose(fp);
+    printf("%s Saved!\n",run->jsonfile);
+    return 0;
+}
+
+#endif
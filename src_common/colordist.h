@@ -0,0 +1,114 @@
+/* ---------------------------------------------------------------------
+colordist.h - fixed-point color distance shared by a2b and b2d
+
+Module Name - Description
+-------------------------
+
+Both a2b (a2fcbmp.c) and b2d (b2d.c) pick the closest palette color with
+the same luma weighted distance:
+
+    distance = (dR*dR*wR + dG*dG*wG + dB*dB*wB) * 0.75 + dL*dL
+
+where dR, dG, dB are the red, green and blue differences divided by 255,
+wR, wG, wB are the double luma coefficients from setluma() and dL is the
+difference in luma computed with the integer luma coefficients.
+
+The original code does this in doubles with a divide by 255 for each gun
+of each palette entry for every pixel. This module does the same in
+64-bit integers with all the scaling folded into the weights:
+
+    distance * 4 * (256 * 255000)^2 =
+        dR'*dR'*(3000000*wR) + dG'*dG'*(3000000*wG) + dB'*dB'*(3000000*wB)
+        + 4*dL'*dL'
+
+where the primed differences are taken on colors scaled by 256 so that
+palettes that are not whole numbers (like the b2d brighten and darken
+palettes) keep 8 bits of fraction. Luma coefficients with up to 6 decimal
+places give exact integer weights, so the only differences from the
+double code are where it rounds a near tie the other way.
+
+Each tool keeps its own blue weighting. The first palette entry can be
+given a different blue weight than the rest (blue0 and blue) and a mask
+selects which palette entries can be picked. Entry 0 is always the
+starting point like it is in the original code.
+
+Include this after the uchar type has been defined.
+
+*/
+
+#ifndef COLORDIST_H
+#define COLORDIST_H 1
+
+/* legacy distance = fixed-point distance / DIST_SCALE */
+#define DIST_SCALE (4.0 * 65280000.0 * 65280000.0)
+
+typedef struct tagDISTWEIGHTS
+{
+    long long red, green, blue0, blue;
+    long long lumaRED, lumaGREEN, lumaBLUE;
+} DISTWEIGHTS;
+
+typedef struct tagDISTPALETTE
+{
+    long long red[16], green[16], blue[16], luma[16];
+} DISTPALETTE;
+
+/* weights from the integer and double luma coefficients */
+static void SetDistWeights(DISTWEIGHTS *w, int lumaRED, int lumaGREEN, int lumaBLUE,
+                           double dlumaRED, double dlumaGREEN, double blue0, double blue)
+{
+    w->red   = (long long)(dlumaRED * 3000000.0 + 0.5);
+    w->green = (long long)(dlumaGREEN * 3000000.0 + 0.5);
+    w->blue0 = (long long)(blue0 * 3000000.0 + 0.5);
+    w->blue  = (long long)(blue * 3000000.0 + 0.5);
+    w->lumaRED = lumaRED;
+    w->lumaGREEN = lumaGREEN;
+    w->lumaBLUE = lumaBLUE;
+}
+
+/* palette from the double palette arrays that the tools already keep */
+static void SetDistPalette(DISTPALETTE *pal, double rgb[16][3], DISTWEIGHTS *w)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        pal->red[i]   = (long long)(rgb[i][0] * 256.0 + 0.5);
+        pal->green[i] = (long long)(rgb[i][1] * 256.0 + 0.5);
+        pal->blue[i]  = (long long)(rgb[i][2] * 256.0 + 0.5);
+        pal->luma[i]  = pal->red[i] * w->lumaRED + pal->green[i] * w->lumaGREEN + pal->blue[i] * w->lumaBLUE;
+    }
+}
+
+/* closest palette entry among the entries in mask */
+/* the fixed-point distance is returned in distance */
+static unsigned char GetDistColor(DISTPALETTE *pal, DISTWEIGHTS *w, unsigned char r, unsigned char g,
+                                  unsigned char b, unsigned mask, long long *distance)
+{
+    long long red = (long long)r << 8, green = (long long)g << 8, blue = (long long)b << 8;
+    long long luma, diffR, diffG, diffB, lumadiff, dist, prevdist;
+    long long wb = w->blue0;
+    unsigned char drawcolor = 0;
+    int i;
+
+    luma = red * w->lumaRED + green * w->lumaGREEN + blue * w->lumaBLUE;
+
+    for (i = 0; i < 16; i++, wb = w->blue) {
+        if (i != 0 && (mask & (1U << i)) == 0) continue;
+
+        diffR = pal->red[i] - red;
+        diffG = pal->green[i] - green;
+        diffB = pal->blue[i] - blue;
+        lumadiff = pal->luma[i] - luma;
+        dist = diffR * diffR * w->red + diffG * diffG * w->green + diffB * diffB * wb
+               + 4 * lumadiff * lumadiff;
+
+        if (i == 0 || dist < prevdist) {
+            prevdist = dist;
+            drawcolor = (unsigned char)i;
+        }
+    }
+    distance[0] = prevdist;
+    return drawcolor;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/* ---------------------------------------------------------------------
+packbytes.h - Apple PackBytes encoder and decoder
+
+Module Name - Description
+-------------------------
+
+PackBytes is the run length encoding of the Apple Preferred Format (APF)
+PNT file. Each packed run starts with a flag byte:
+
+    00xxxxxx: 1 to 64 bytes follow, all different
+    01xxxxxx: 1 to 64 repeats of the next byte
+    10xxxxxx: 1 to 64 repeats of the next 4 bytes
+    11xxxxxx: 1 to 64 repeats of the next byte taken as 4 bytes
+
+where xxxxxx is the count minus 1.
+
+PackBytesOptimal finds the shortest possible packed line. It works back
+from the end of the line keeping the shortest packing of the rest of the
+line from each position, so it tries every run of every kind at every
+position. Lines with a repeated 2 byte pattern are covered by the 4 byte
+pattern runs.
+
+UnPackBytes is the reverse and is also used to check packed lines.
+
+Include this after the uchar type has been defined.
+
+*/
+
+#ifndef PACKBYTES_H
+#define PACKBYTES_H 1
+
+/* flag bytes */
+#define PB_SINGLES 0x00
+#define PB_REPEAT  0x40
+#define PB_QUAD    0x80
+#define PB_REPEAT4 0xc0
+
+/* longer lines are packed in pieces of this size */
+#define PB_MAXLINE 1024
+
+/* the largest a packed line can be - all singletons */
+#define PB_PACKEDMAX(len) ((len) + ((len) + 63) / 64)
+
+/* pack a line of up to PB_MAXLINE bytes - returns the packed length */
+static int PackBytesPiece(uchar *in, int inlen, uchar *out)
+{
+    unsigned short best[PB_MAXLINE+1], runlen[PB_MAXLINE+1], quadlen[PB_MAXLINE+1];
+    uchar flag[PB_MAXLINE], count[PB_MAXLINE];
+    int i, j, k, cost, outlen;
+
+    /* runlen is the number of bytes from each position that repeat the byte */
+    /* quadlen is the number of bytes past the first 4 that repeat the 4 bytes */
+    runlen[inlen] = quadlen[inlen] = 0;
+    for (i = inlen - 1; i > -1; i--) {
+        if (i + 1 < inlen && in[i] == in[i+1]) runlen[i] = (unsigned short)(runlen[i+1] + 1);
+        else runlen[i] = 1;
+        if (i + 4 < inlen && in[i] == in[i+4]) quadlen[i] = (unsigned short)(quadlen[i+1] + 1);
+        else quadlen[i] = 0;
+    }
+
+    best[inlen] = 0;
+    for (i = inlen - 1; i > -1; i--) {
+        /* singletons */
+        best[i] = (unsigned short)(2 + best[i+1]);
+        flag[i] = PB_SINGLES;
+        count[i] = 1;
+        for (j = 2; j <= 64 && i + j <= inlen; j++) {
+            cost = 1 + j + best[i+j];
+            if (cost < best[i]) {
+                best[i] = (unsigned short)cost;
+                count[i] = (uchar)j;
+            }
+        }
+        /* repeats of a byte */
+        for (j = 2; j <= 64 && j <= runlen[i]; j++) {
+            cost = 2 + best[i+j];
+            if (cost < best[i]) {
+                best[i] = (unsigned short)cost;
+                flag[i] = PB_REPEAT;
+                count[i] = (uchar)j;
+            }
+        }
+        /* repeats of a byte taken as 4 bytes */
+        for (k = 1; k <= 64 && k * 4 <= runlen[i]; k++) {
+            cost = 2 + best[i+k*4];
+            if (cost < best[i]) {
+                best[i] = (unsigned short)cost;
+                flag[i] = PB_REPEAT4;
+                count[i] = (uchar)k;
+            }
+        }
+        /* repeats of 4 bytes */
+        for (k = 2; k <= 64 && k * 4 <= quadlen[i] + 4; k++) {
+            cost = 5 + best[i+k*4];
+            if (cost < best[i]) {
+                best[i] = (unsigned short)cost;
+                flag[i] = PB_QUAD;
+                count[i] = (uchar)k;
+            }
+        }
+    }
+
+    /* write the runs */
+    for (i = 0, outlen = 0; i < inlen;) {
+        out[outlen++] = (uchar)(flag[i] | (count[i] - 1));
+        switch(flag[i]) {
+            case PB_SINGLES:
+                for (j = 0; j < count[i]; j++) out[outlen++] = in[i+j];
+                i += count[i];
+                break;
+            case PB_REPEAT:
+                out[outlen++] = in[i];
+                i += count[i];
+                break;
+            case PB_REPEAT4:
+                out[outlen++] = in[i];
+                i += count[i] * 4;
+                break;
+            default:
+                for (j = 0; j < 4; j++) out[outlen++] = in[i+j];
+                i += count[i] * 4;
+                break;
+        }
+    }
+    return outlen;
+}
+
+/* pack a line into the shortest PackBytes runs */
+/* out must have room for PB_PACKEDMAX(inlen) bytes */
+/* returns the packed length */
+static int PackBytesOptimal(uchar *in, int inlen, uchar *out)
+{
+    int piece, outlen = 0;
+
+    while (inlen > 0) {
+        piece = (inlen > PB_MAXLINE ? PB_MAXLINE : inlen);
+        outlen += PackBytesPiece(in, piece, &out[outlen]);
+        in += piece;
+        inlen -= piece;
+    }
+    return outlen;
+}
+
+/* unpack outlen bytes from a packed buffer of inlen bytes */
+/* returns the number of packed bytes used or -1 if the packed buffer is bad */
+static int UnPackBytes(uchar *in, int inlen, uchar *out, int outlen)
+{
+    int i = 0, j, k, count, pos = 0;
+
+    while (pos < outlen) {
+        if (i >= inlen) return -1;
+        count = (in[i] & 0x3f) + 1;
+        switch(in[i++] & 0xc0) {
+            case PB_SINGLES:
+                if (i + count > inlen || pos + count > outlen) return -1;
+                for (j = 0; j < count; j++) out[pos++] = in[i++];
+                break;
+            case PB_REPEAT:
+                if (i >= inlen || pos + count > outlen) return -1;
+                for (j = 0; j < count; j++) out[pos++] = in[i];
+                i++;
+                break;
+            case PB_REPEAT4:
+                if (i >= inlen || pos + count * 4 > outlen) return -1;
+                for (j = 0; j < count * 4; j++) out[pos++] = in[i];
+                i++;
+                break;
+            default:
+                if (i + 4 > inlen || pos + count * 4 > outlen) return -1;
+                for (j = 0; j < count; j++) {
+                    for (k = 0; k < 4; k++) out[pos++] = in[i+k];
+                }
+                i += 4;
+                break;
+        }
+    }
+    return i;
+}
+
+#endif
@@ -0,0 +1,319 @@
+/* ---------------------------------------------------------------------
+shrdecode.h - Apple IIgs Super Hi-Res file decoder
+
+Module Name - Description
+-------------------------
+
+Decodes the SHR file formats that a2b and m2s read and write to palette
+indices, SCBs and 24-bit palettes, and from there to 320 x 200 RGB:
+
+    PIC     $C1/$0000 - 32768 bytes - 16 palettes selected by the SCBs
+    BROOKS  $C1/$0002 - 38400 bytes - 200 palettes, one for each line
+    PNT     $C0/$0001 - a PIC file packed with PackBytes
+    APF     $C0/$0002 - Apple Preferred Format (the m2s PNT file)
+    3201    mode3200 - "APP" 0 header, 200 Brooks color tables, packed pixels
+
+An APF file is a list of blocks, each starting with a 4 byte length and
+a Pascal string naming the block. The MAIN block holds the color tables,
+a scanline directory of packed lengths and mode words (the low byte of
+the mode word is the SCB) and the PackBytes scanlines. An optional
+MULTIPAL block holds 200 color tables for mode3200 images, which are
+always mode320 whatever the mode words say. Other blocks are skipped. APF images that are not 320 x 200 are cropped or padded
+with black.
+
+Colors are $0RGB words, low byte first. The 4 bit guns are doubled to 8
+bits (0xf becomes 0xff) like the rest of the tools do. The color tables
+of BROOKS and 3201 files are stored back to front and are flipped here.
+
+Lines with the mode640 bit set in their SCB are decoded at half width,
+with each pair of 640 pixels averaged into one 320 pixel. Fill mode is
+honored for mode320 lines.
+
+DecodeSHR is the one call decode of a file to RGB. DecodeSHRFile and
+SHRImageToRGB split it for programs that also want the palettes.
+Nothing here is static data so the decoder is safe to call from any
+number of threads.
+
+Include this after the uchar type has been defined and after
+packbytes.h.
+
+*/
+
+#ifndef SHRDECODE_H
+#define SHRDECODE_H 1
+
+/* formats returned by the decoder - 0 is not an SHR file */
+#define SHR_PIC    1
+#define SHR_BROOKS 2
+#define SHR_PNT    3
+#define SHR_APF    4
+#define SHR_3201   5
+
+typedef struct tagSHRIMAGE
+{
+    int   format;                  /* SHR_PIC etc. */
+    int   numpalettes;             /* 16 (selected by the SCBs) or 200 (one per line) */
+    uchar pixels[200][160];        /* mode320 or mode640 scanlines */
+    uchar scb[200];                /* mode640 0x80, fill mode 0x20, palette 0-15 */
+    uchar palettes[200][16][3];    /* 24-bit RGB */
+} SHRIMAGE;
+
+/* little endian words as used by the IIgs */
+static unsigned SHRWord(uchar *buf)
+{
+    return (unsigned)buf[0] | ((unsigned)buf[1] << 8);
+}
+
+static unsigned long SHRLong(uchar *buf)
+{
+    return (unsigned long)SHRWord(buf) | ((unsigned long)SHRWord(&buf[2]) << 16);
+}
+
+/* decode a 16 color table of $0RGB words */
+static void SHRColorTable(uchar *table, uchar pal[16][3], int reverse)
+{
+    int i, k;
+    uchar r, g, b;
+
+    for (i = 0; i < 16; i++) {
+        k = (reverse == 1 ? 15 - i : i) * 2;
+        r = (uchar)(table[k+1] & 0xf);
+        g = (uchar)(table[k] >> 4);
+        b = (uchar)(table[k] & 0xf);
+        pal[i][0] = (uchar)(r << 4 | r);
+        pal[i][1] = (uchar)(g << 4 | g);
+        pal[i][2] = (uchar)(b << 4 | b);
+    }
+}
+
+/* the 32768 byte PIC layout - 32000 pixels, 200 SCBs, 56 unused, 16 tables */
+static int SHRDecodePIC(uchar *buf, SHRIMAGE *img)
+{
+    int j;
+
+    memcpy(&img->pixels[0][0],buf,32000);
+    memcpy(&img->scb[0],&buf[32000],200);
+    for (j = 0; j < 16; j++) SHRColorTable(&buf[32256+j*32],img->palettes[j],0);
+    img->numpalettes = 16;
+    return SHR_PIC;
+}
+
+/* the 38400 byte BROOKS layout - 32000 pixels and 200 reversed tables */
+static int SHRDecodeBrooks(uchar *buf, SHRIMAGE *img)
+{
+    int y;
+
+    memcpy(&img->pixels[0][0],buf,32000);
+    memset(&img->scb[0],0,200);
+    for (y = 0; y < 200; y++) SHRColorTable(&buf[32000+y*32],img->palettes[y],1);
+    img->numpalettes = 200;
+    return SHR_BROOKS;
+}
+
+/* a 3201 file - 200 reversed tables and 32000 bytes of pixels packed as one */
+static int SHRDecode3201(uchar *buf, long len, SHRIMAGE *img)
+{
+    int y;
+
+    if (len < 4 + 6400 + 1 || memcmp(buf,"APP",4) != 0) return 0;
+    if (UnPackBytes(&buf[6404],(int)(len - 6404),&img->pixels[0][0],32000) < 0) return 0;
+    for (y = 0; y < 200; y++) SHRColorTable(&buf[4+y*32],img->palettes[y],1);
+    img->numpalettes = 200;
+    return SHR_3201;
+}
+
+/* the MAIN block of an APF file - returns 0 if it is bad */
+static int SHRDecodeMain(uchar *buf, long len, SHRIMAGE *img)
+{
+    uchar *line;
+    unsigned mastermode, width, numtables, numlines, packed, mode;
+    long pos, data;
+    int y, j, bytes, copy;
+
+    if (len < 8) return 0;
+    mastermode = SHRWord(buf);
+    width = SHRWord(&buf[2]);
+    numtables = SHRWord(&buf[4]);
+    pos = 6 + (long)numtables * 32;
+    if (numtables > 16 || pos + 2 > len) return 0;
+    for (j = 0; j < (int)numtables; j++) SHRColorTable(&buf[6+j*32],img->palettes[j],0);
+
+    numlines = SHRWord(&buf[pos]);
+    pos += 2;
+    data = pos + (long)numlines * 4;
+    if (data > len) return 0;
+
+    /* mode640 packs 4 pixels to a byte, mode320 packs 2 */
+    if ((mastermode & 0x80) != 0) bytes = (int)((width + 3) / 4);
+    else bytes = (int)((width + 1) / 2);
+    if (bytes < 1) return 0;
+    copy = (bytes > 160 ? 160 : bytes);
+    line = (uchar *)malloc(bytes);
+    if (NULL == line) return 0;
+
+    for (y = 0; y < (int)numlines; y++, pos += 4) {
+        packed = SHRWord(&buf[pos]);
+        mode = SHRWord(&buf[pos+2]);
+        if (data + packed > len || UnPackBytes(&buf[data],(int)packed,line,bytes) < 0) {
+            free(line);
+            return 0;
+        }
+        data += packed;
+        if (y > 199) continue;
+        memcpy(&img->pixels[y][0],line,copy);
+        img->scb[y] = (uchar)(mode & 0xff);
+    }
+    free(line);
+    img->numpalettes = 16;
+    return SHR_APF;
+}
+
+/* walk the blocks of an APF file - returns 0 if it is not one */
+static int SHRDecodeAPF(uchar *buf, long len, SHRIMAGE *img)
+{
+    unsigned long blocklen;
+    long pos = 0;
+    int y, namelen, status = 0, multipal = 0;
+
+    while (pos < len) {
+        if (pos + 5 > len) return 0;
+        blocklen = SHRLong(&buf[pos]);
+        namelen = buf[pos+4];
+        if (namelen == 0 || blocklen < (unsigned long)(5 + namelen) || blocklen > (unsigned long)(len - pos)) return 0;
+
+        if (namelen == 4 && memcmp(&buf[pos+5],"MAIN",4) == 0 && status == 0) {
+            status = SHRDecodeMain(&buf[pos+9],(long)blocklen - 9,img);
+            if (status == 0) return 0;
+        }
+        else if (namelen == 8 && memcmp(&buf[pos+5],"MULTIPAL",8) == 0 && blocklen >= 15 + 200 * 32) {
+            if (SHRWord(&buf[pos+13]) >= 200) multipal = (int)pos + 15;
+        }
+        pos += (long)blocklen;
+    }
+
+    /* mode3200 color tables are in the usual order */
+    /* mode3200 is always mode320 so the mode words are not used
+       (m2s puts the line number there) */
+    if (status != 0 && multipal != 0) {
+        for (y = 0; y < 200; y++) SHRColorTable(&buf[multipal+y*32],img->palettes[y],0);
+        memset(&img->scb[0],0,200);
+        img->numpalettes = 200;
+    }
+    return status;
+}
+
+/* decode an SHR file that has been read into memory */
+/* returns the format or 0 if it is not a supported SHR file */
+static int DecodeSHRBuffer(uchar *buf, long len, SHRIMAGE *img)
+{
+    uchar *pic;
+    int status;
+
+    memset(img,0,sizeof(SHRIMAGE));
+
+    status = SHRDecode3201(buf,len,img);
+    if (status == 0) status = SHRDecodeAPF(buf,len,img);
+    if (status == 0) {
+        memset(img,0,sizeof(SHRIMAGE));
+        if (len == 32768L) status = SHRDecodePIC(buf,img);
+        else if (len == 38400L) status = SHRDecodeBrooks(buf,img);
+        else if (NULL != (pic = (uchar *)malloc(32768))) {
+            /* a whole PIC file packed as one buffer */
+            if (UnPackBytes(buf,(int)len,pic,32768) > 0 && SHRDecodePIC(pic,img) != 0) status = SHR_PNT;
+            free(pic);
+        }
+    }
+    img->format = status;
+    return status;
+}
+
+/* read and decode an SHR file */
+/* returns the format, 0 if it is not a supported SHR file or -1 if it can't be read */
+static int DecodeSHRFile(char *name, SHRIMAGE *img)
+{
+    FILE *fp;
+    uchar *buf;
+    long len;
+    int status;
+
+    if (NULL == (fp = fopen(name,"rb"))) return -1;
+    fseek(fp,0L,SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    /* nothing that is an SHR image is this big */
+    if (len < 1L || len > 1048576L) {
+        fclose(fp);
+        return 0;
+    }
+    if (NULL == (buf = (uchar *)malloc(len))) {
+        fclose(fp);
+        return -1;
+    }
+    if (fread(buf,1,len,fp) != (size_t)len) status = -1;
+    else status = DecodeSHRBuffer(buf,len,img);
+    fclose(fp);
+    free(buf);
+    return status;
+}
+
+/* the 24-bit color of an SHR pixel */
+static uchar *SHRPixel(SHRIMAGE *img, uchar pal[16][3], int y, int x)
+{
+    uchar c = img->pixels[y][x/2];
+
+    if ((x & 1) == 0) c >>= 4;
+    return pal[c & 0xf];
+}
+
+/* convert a decoded image to 320 x 200 x 24-bit RGB, top line first */
+static void SHRImageToRGB(SHRIMAGE *img, uchar *rgb)
+{
+    uchar (*pal)[3], *c0, *c1, last[3], c;
+    int x, y, i, k;
+
+    for (y = 0; y < 200; y++) {
+        if (img->numpalettes == 200) pal = img->palettes[y];
+        else pal = img->palettes[img->scb[y] & 0xf];
+
+        if ((img->scb[y] & 0x80) != 0) {
+            /* mode640 - the 4 pixels in a byte use palette entries 8-11, 12-15, 0-3 and 4-7 */
+            for (x = 0; x < 160; x++) {
+                c = img->pixels[y][x];
+                for (i = 0; i < 2; i++) {
+                    c0 = pal[(i == 0 ? 8 : 0) + ((c >> (i == 0 ? 6 : 2)) & 3)];
+                    c1 = pal[(i == 0 ? 12 : 4) + ((c >> (i == 0 ? 4 : 0)) & 3)];
+                    for (k = 0; k < 3; k++) *rgb++ = (uchar)((c0[k] + c1[k] + 1) / 2);
+                }
+            }
+            continue;
+        }
+
+        memset(last,0,3);
+        for (x = 0; x < 320; x++) {
+            c0 = SHRPixel(img,pal,y,x);
+            /* fill mode - color 0 repeats the pixel to the left */
+            if ((img->scb[y] & 0x20) != 0 && c0 == pal[0]) c0 = last;
+            else memcpy(last,c0,3);
+            *rgb++ = c0[0];
+            *rgb++ = c0[1];
+            *rgb++ = c0[2];
+        }
+    }
+}
+
+/* one call decode of any supported SHR file to 320 x 200 x 24-bit RGB */
+/* rgb must have room for 320 * 200 * 3 bytes */
+/* returns the format, 0 if it is not a supported SHR file or -1 if it can't be read */
+static int DecodeSHR(char *name, uchar *rgb)
+{
+    SHRIMAGE *img;
+    int status;
+
+    if (NULL == (img = (SHRIMAGE *)malloc(sizeof(SHRIMAGE)))) return -1;
+    status = DecodeSHRFile(name,img);
+    if (status > 0) SHRImageToRGB(img,rgb);
+    free(img);
+    return status;
+}
+
+#endif
@@ -0,0 +1,195 @@
+/* ---------------------------------------------------------------------
+shrencode.h - Apple IIgs packed Super Hi-Res file writers
+
+Module Name - Description
+-------------------------
+
+Writes the packed SHR formats straight from 200 lines of mode320 pixels
+and their $0RGB color tables, without going through a raw SHR file:
+
+    APF     $C0/$0002 - Apple Preferred Format (the m2s PNT file)
+    3201    mode3200 - "APP" 0 header, 200 color tables, packed pixels
+
+An APF file is a MAIN block followed, for mode3200 images, by a MULTIPAL
+block. The MAIN block holds the color tables, a scanline directory of
+packed lengths and mode words and the scanlines, each packed on its own.
+For mode320 images the low byte of each mode word is the line's SCB.
+For mode3200 images the 200 color tables go in the MULTIPAL block and
+MAIN carries only the first one, which viewers like CiderPress expect
+to find.
+
+MULTIPAL always has one color table for each line, so a mode3200 image
+can only store fewer tables by not being a mode3200 image. When its 200
+line palettes fold down to 16 or less different color tables (like an
+m2s palette file with 16 palettes or less gives) it is written as a
+mode320 APF instead, with the shared tables in MAIN and SCBs that
+select them. That drops the 6400 byte MULTIPAL block and shows the
+same image.
+
+The legacy layout is the one m2s wrote before it used these writers
+and is what m2s writes unless option O is given, so by default it gives
+the same files as it always has: mode3200 images are never folded, the
+one color table in MAIN is all black and the mode word of each line is
+its line number.
+
+A 3201 file is the mode3200 (Brooks) format packed: "APP" 0, the 200
+color tables stored back to front like a Brooks file, then the pixels
+packed line by line.
+
+The color tables passed in are always in palette order (color 0 first).
+Lines are packed with PackBytesOptimal unless a different packer is
+passed in (m2s passes its original greedy encoder unless option O is
+given). The writers return the number of bytes written or -1 if the
+file could not be written.
+
+Include this after the uchar type has been defined and after
+packbytes.h.
+
+*/
+
+#ifndef SHRENCODE_H
+#define SHRENCODE_H 1
+
+/* packs a line of inlen bytes into out and returns the packed length */
+typedef int (*SHRPACKER)(uchar *in, int inlen, uchar *out);
+
+/* little endian words as used by the IIgs */
+static void SHRPutWord(uchar *buf, unsigned val)
+{
+    buf[0] = (uchar)(val & 0xff);
+    buf[1] = (uchar)((val >> 8) & 0xff);
+}
+
+static void SHRPutLong(uchar *buf, unsigned long val)
+{
+    SHRPutWord(buf,(unsigned)(val & 0xffff));
+    SHRPutWord(&buf[2],(unsigned)((val >> 16) & 0xffff));
+}
+
+/* a block header - length and Pascal string name */
+static int SHRPutBlock(uchar *buf, unsigned long len, char *name)
+{
+    int namelen = (int)strlen(name);
+
+    SHRPutLong(buf,len);
+    buf[4] = (uchar)namelen;
+    memcpy(&buf[5],name,namelen);
+    return 5 + namelen;
+}
+
+/* fold 200 line color tables into 16 or less shared tables and SCBs */
+/* returns the number of shared tables or 0 if there are more than 16 */
+static int SHRFoldTables(uchar *tables, uchar *shared, uchar *scb)
+{
+    int y, j, count = 0;
+
+    for (y = 0; y < 200; y++) {
+        /* most lines share the palette of the line above */
+        if (y > 0 && memcmp(&tables[y*32],&tables[(y-1)*32],32) == 0) {
+            scb[y] = scb[y-1];
+            continue;
+        }
+        for (j = 0; j < count; j++) {
+            if (memcmp(&tables[y*32],&shared[j*32],32) == 0) break;
+        }
+        if (j == count) {
+            if (count == 16) return 0;
+            memcpy(&shared[count*32],&tables[y*32],32);
+            count++;
+        }
+        scb[y] = (uchar)j;
+    }
+    return count;
+}
+
+/* write an APF file */
+/* pixels are 200 lines of 160 bytes, scb is ignored for mode3200 */
+/* numtables is 1 to 16 for mode320 or 200 for mode3200 */
+/* pack is the line packer - NULL for PackBytesOptimal */
+/* legacy is 1 for the legacy mode3200 layout described above */
+static long WriteAPF(FILE *fp, uchar *pixels, uchar *scb, uchar *tables, int numtables, SHRPACKER pack, int legacy)
+{
+    uchar *buf, shared[16*32], foldscb[200];
+    long len, mainlen, dir;
+    int y, packed, maintables;
+
+    if (NULL == pack) pack = PackBytesOptimal;
+
+    /* mode3200 with 16 or less different palettes is written as mode320 */
+    if (numtables == 200 && legacy == 0 && (maintables = SHRFoldTables(tables,shared,foldscb)) != 0) {
+        tables = shared;
+        scb = foldscb;
+        numtables = maintables;
+    }
+    maintables = (numtables == 200 ? 1 : numtables);
+
+    /* room for the worst case - every line all singletons */
+    buf = (uchar *)malloc(9 + 6 + 32 * 16 + 2 + 200 * 4 + 200 * PB_PACKEDMAX(160) + 15 + 200 * 32);
+    if (NULL == buf) return -1;
+
+    len = SHRPutBlock(buf,0L,"MAIN");
+    SHRPutWord(&buf[len],0);         /* MasterMode - mode320 */
+    SHRPutWord(&buf[len+2],320);     /* PixelsPerScanline */
+    SHRPutWord(&buf[len+4],(unsigned)maintables);
+    len += 6;
+    if (numtables == 200 && legacy == 1) memset(&buf[len],0,32);
+    else memcpy(&buf[len],tables,maintables * 32);
+    len += maintables * 32;
+    SHRPutWord(&buf[len],200);       /* NumScanLines */
+    len += 2;
+    dir = len;
+    len += 200 * 4;
+
+    for (y = 0; y < 200; y++) {
+        packed = pack(&pixels[y*160],160,&buf[len]);
+        SHRPutWord(&buf[dir+y*4],(unsigned)packed);
+        if (numtables != 200) SHRPutWord(&buf[dir+y*4+2],(unsigned)scb[y]);
+        else SHRPutWord(&buf[dir+y*4+2],(unsigned)(legacy == 1 ? y : 0));
+        len += packed;
+    }
+    mainlen = len;
+    SHRPutLong(buf,(unsigned long)mainlen);
+
+    if (numtables == 200) {
+        len += SHRPutBlock(&buf[len],(unsigned long)(15 + 200 * 32),"MULTIPAL");
+        SHRPutWord(&buf[len],200);
+        len += 2;
+        memcpy(&buf[len],tables,200 * 32);
+        len += 200 * 32;
+    }
+
+    if (fwrite(buf,1,len,fp) != (size_t)len) len = -1;
+    free(buf);
+    return len;
+}
+
+/* write a 3201 file from 200 lines of pixels and 200 color tables */
+/* pack is the line packer - NULL for PackBytesOptimal */
+static long Write3201(FILE *fp, uchar *pixels, uchar *tables, SHRPACKER pack)
+{
+    uchar *buf;
+    long len;
+    int y, i;
+
+    if (NULL == pack) pack = PackBytesOptimal;
+
+    buf = (uchar *)malloc(4 + 200 * 32 + 200 * PB_PACKEDMAX(160));
+    if (NULL == buf) return -1;
+
+    memcpy(buf,"APP",4);
+    len = 4;
+    /* color 15 is stored first like a Brooks file */
+    for (y = 0; y < 200; y++) {
+        for (i = 0; i < 16; i++, len += 2) {
+            buf[len] = tables[y*32+(15-i)*2];
+            buf[len+1] = tables[y*32+(15-i)*2+1];
+        }
+    }
+    for (y = 0; y < 200; y++) len += pack(&pixels[y*160],160,&buf[len]);
+
+    if (fwrite(buf,1,len,fp) != (size_t)len) len = -1;
+    free(buf);
+    return len;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/* ---------------------------------------------------------------------
+stats.h - per-stage timing and counters for a2b, b2d and m2s
+
+Module Name - Description
+-------------------------
+
+Option "stats" on the a2b, b2d and m2s command line saves where the time
+went in a conversion and what the color matching did:
+
+    a2b foo.bmp shr d -stats          writes foo_stats.json
+    b2d foo.bmp d1 -stats=trace       writes foo_trace.json
+    m2s foo -stats                    writes foo_stats.json
+
+The conversion is split into the stages below. Each stage has its total
+wall clock time, the processor time of the whole process over the same
+span and the number of times it was entered. Stages that a tool does not
+have, or that were not needed for the input, are saved with 0 calls.
+The processor time comes from clock(), so it adds up the time of every
+thread: when a2b builds palettes on more than one thread it is the sum
+of their time and can be more than the wall clock time. It is saved as
+process_cpu_ms to say so.
+
+    header      opening the input and reading its headers
+    reformat    promoting 1, 4 and 8-bit BMPs to 24-bit
+    resize      scaling classic screen sizes down (b2d)
+    diffuse     error diffusion before the conversion (b2d option E)
+    palette     building the conversion palettes and lookup tables
+    dither      color matching and dithering of the scanlines
+    encode      packing the Apple II and IIgs screen memory
+    write       writing the output files
+
+The counters are the number of nearest color lookups, how many of those
+were answered by the scan for a verbatim palette color (GetClosestColor
+in a2b and GetDrawColor in b2d) or by b2d's color tables, how many
+palette slots repeat a 12-bit color that is already in the same palette
+(the colors that shrdupecount reports), and the m2s lines that no
+palette has all the colors for. Each output file is listed with its
+size in bytes.
+
+"-stats" saves a summary as JSON. "-stats=trace" saves the same
+stages as a Chrome trace (chrome://tracing or ui.perfetto.dev) with one
+event each time a stage is entered, the counters as a counter event and
+the summary in otherData.
+
+The functions do nothing when they are given a NULL pointer, so a tool
+can leave its calls in place and only open the stats when asked to.
+StatsNext ends one stage and begins the next, and a stage that is still
+open when the stats are closed is ended there, so the many early returns
+in the conversion routines need no calls of their own.
+
+Include this after the uchar type has been defined.
+
+*/
+
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef MSDOS
+#include <sys/time.h>
+#endif
+
+#define STATS_HEADER    0
+#define STATS_REFORMAT  1
+#define STATS_RESIZE    2
+#define STATS_DIFFUSE   3
+#define STATS_PALETTE   4
+#define STATS_DITHER    5
+#define STATS_ENCODE    6
+#define STATS_WRITE     7
+#define STATS_STAGES    8
+
+#define STATS_NEAREST    0
+#define STATS_EXACT      1
+#define STATS_TABLE      2
+#define STATS_COLLISIONS 3
+#define STATS_UNMATCHED  4
+#define STATS_COUNTERS   5
+
+/* output formats */
+#define STATS_JSON  1
+#define STATS_TRACE 2
+
+#define STATS_EVENTS  512
+#define STATS_OUTPUTS 16
+
+/* the functions are static inline so that a tool that does not call every
+   one of them builds without unused function warnings. other compilers
+   just get static functions */
+#ifdef __GNUC__
+#define STATSINLINE static inline
+#else
+#define STATSINLINE static
+#endif
+
+static char *statsstages[STATS_STAGES] = {
+    "header", "reformat", "resize", "diffuse", "palette", "dither", "encode", "write"};
+
+static char *statscounters[STATS_COUNTERS] = {
+    "nearest_color", "exact_match", "color_table", "palette_collisions", "unmatched_lines"};
+
+typedef struct tagSTATSEVENT
+{
+    int stage;
+    double start, wall, cpu;    /* seconds from StatsOpen - cpu is for the whole process */
+} STATSEVENT;
+
+typedef struct tagSTATS
+{
+    int format;
+    char program[16], input[256], file[256];
+    double origin, cpuorigin;
+    /* open stages - a stage that is entered again before it ends is timed once */
+    int depth[STATS_STAGES];
+    double wallstart[STATS_STAGES], cpustart[STATS_STAGES];
+    /* totals */
+    long calls[STATS_STAGES];
+    double wall[STATS_STAGES], cpu[STATS_STAGES];
+    long counts[STATS_COUNTERS];
+    int numevents;
+    STATSEVENT events[STATS_EVENTS];
+    int numoutputs;
+    char outputs[STATS_OUTPUTS][256];
+} STATS;
+
+STATSINLINE double StatsWallClock(void)
+{
+#ifdef MSDOS
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#endif
+}
+
+STATSINLINE double StatsCpuClock(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* "stats" or "stats=json" gives STATS_JSON and "stats=trace" gives STATS_TRACE */
+/* the switch character has already been taken off - returns 0 for anything else */
+STATSINLINE int StatsOption(char *word)
+{
+    char buf[16];
+    int i;
+
+    for (i = 0; i < 15 && word[i] != (char)0; i++) buf[i] = (char)tolower(word[i]);
+    buf[i] = (char)0;
+    if (word[i] != (char)0) return 0;
+
+    if (strcmp(buf,"stats") == 0 || strcmp(buf,"stats=json") == 0) return STATS_JSON;
+    if (strcmp(buf,"stats=trace") == 0) return STATS_TRACE;
+    return 0;
+}
+
+/* the results go in basename_stats.json or basename_trace.json */
+STATSINLINE STATS *StatsOpen(int format, char *program, char *input, char *basename)
+{
+    STATS *st;
+
+    if (format == 0) return NULL;
+    if (NULL == (st = (STATS *)calloc(1,sizeof(STATS)))) {
+        puts("Not Enough Memory for Stats...");
+        return NULL;
+    }
+    st->format = format;
+    sprintf(st->program,"%.15s",program);
+    sprintf(st->input,"%.255s",input);
+    sprintf(st->file,"%.240s_%s.json",basename,(format == STATS_TRACE ? "trace" : "stats"));
+    st->origin = StatsWallClock();
+    st->cpuorigin = StatsCpuClock();
+    return st;
+}
+
+STATSINLINE void StatsBegin(STATS *st, int stage)
+{
+    if (NULL == st) return;
+    if (st->depth[stage]++ > 0) return;
+    st->wallstart[stage] = StatsWallClock();
+    st->cpustart[stage] = StatsCpuClock();
+}
+
+STATSINLINE void StatsEnd(STATS *st, int stage)
+{
+    STATSEVENT *event;
+    double wall, cpu;
+
+    if (NULL == st || st->depth[stage] < 1) return;
+    if (--st->depth[stage] > 0) return;
+
+    wall = StatsWallClock() - st->wallstart[stage];
+    cpu = StatsCpuClock() - st->cpustart[stage];
+    st->calls[stage]++;
+    st->wall[stage] += wall;
+    st->cpu[stage] += cpu;
+
+    /* the totals are kept when there are more events than the trace holds */
+    if (st->numevents < STATS_EVENTS) {
+        event = &st->events[st->numevents++];
+        event->stage = stage;
+        event->start = st->wallstart[stage] - st->origin;
+        event->wall = wall;
+        event->cpu = cpu;
+    }
+}
+
+/* end one stage and begin the next */
+STATSINLINE void StatsNext(STATS *st, int stage, int next)
+{
+    StatsEnd(st,stage);
+    StatsBegin(st,next);
+}
+
+STATSINLINE void StatsCount(STATS *st, int counter, long count)
+{
+    if (NULL == st) return;
+    st->counts[counter] += count;
+}
+
+/* add the counters of a worker thread's own stats */
+STATSINLINE void StatsMerge(STATS *st, STATS *from)
+{
+    int i;
+
+    if (NULL == st || NULL == from) return;
+    for (i = 0; i < STATS_COUNTERS; i++) st->counts[i] += from->counts[i];
+}
+
+/* palette slots that repeat a 12-bit color already in the same palette */
+/* three bytes a color in RGB or BGR order, 8 bits to a component */
+/* black is left out since unused slots are usually black */
+STATSINLINE void StatsCollisions(STATS *st, uchar *rgb, int colors)
+{
+    unsigned seen[16];
+    unsigned color;
+    int i, j;
+
+    if (NULL == st) return;
+    if (colors > 16) colors = 16;
+    for (i = 0; i < colors; i++, rgb += 3) {
+        seen[i] = color = ((unsigned)(rgb[0] >> 4) << 8) | ((unsigned)(rgb[1] >> 4) << 4) | (rgb[2] >> 4);
+        if (color == 0) continue;
+        for (j = 0; j < i; j++) {
+            if (seen[j] == color) {
+                st->counts[STATS_COLLISIONS]++;
+                break;
+            }
+        }
+    }
+}
+
+/* note an output file - the sizes are read when the stats are saved */
+STATSINLINE void StatsOutput(STATS *st, char *name)
+{
+    int idx;
+
+    if (NULL == st) return;
+    for (idx = 0; idx < st->numoutputs; idx++) {
+        if (strcmp(st->outputs[idx],name) == 0) return;
+    }
+    if (st->numoutputs < STATS_OUTPUTS) sprintf(st->outputs[st->numoutputs++],"%.255s",name);
+}
+
+/* -1 if the output was removed or is not there */
+STATSINLINE long StatsFileSize(char *name)
+{
+    FILE *fp;
+    long len;
+
+    if (NULL == (fp = fopen(name,"rb"))) return -1L;
+    fseek(fp,0L,SEEK_END);
+    len = ftell(fp);
+    fclose(fp);
+    return len;
+}
+
+STATSINLINE void StatsString(FILE *fp, char *str)
+{
+    fputc('"',fp);
+    for (; *str != (char)0; str++) {
+        if (*str == '"' || *str == (char)92) fputc((char)92,fp);
+        fputc(*str,fp);
+    }
+    fputc('"',fp);
+}
+
+STATSINLINE void StatsWriteSummary(STATS *st, FILE *fp, double wall, double cpu, char *indent)
+{
+    long bytes, total = 0L;
+    int idx, count;
+
+    fprintf(fp,"%s\"program\": ",indent);
+    StatsString(fp,st->program);
+    fprintf(fp,",\n%s\"input\": ",indent);
+    StatsString(fp,st->input);
+    fprintf(fp,",\n%s\"wall_ms\": %.3f,\n%s\"process_cpu_ms\": %.3f,\n%s\"stages\": [",
+        indent,wall * 1000.0,indent,cpu * 1000.0,indent);
+    for (idx = 0; idx < STATS_STAGES; idx++) {
+        fprintf(fp,"%s\n%s  {\"stage\": \"%s\", \"calls\": %ld, \"wall_ms\": %.3f, \"process_cpu_ms\": %.3f}",
+            (idx == 0 ? "" : ","),indent,statsstages[idx],st->calls[idx],st->wall[idx] * 1000.0,st->cpu[idx] * 1000.0);
+    }
+    fprintf(fp,"\n%s],\n%s\"counters\": {",indent,indent);
+    for (idx = 0; idx < STATS_COUNTERS; idx++) {
+        fprintf(fp,"%s\"%s\": %ld",(idx == 0 ? "" : ", "),statscounters[idx],st->counts[idx]);
+    }
+    fprintf(fp,"},\n%s\"outputs\": [",indent);
+    for (idx = 0, count = 0; idx < st->numoutputs; idx++) {
+        if ((bytes = StatsFileSize(st->outputs[idx])) < 0L) continue;
+        total += bytes;
+        fprintf(fp,"%s\n%s  {\"file\": ",(count++ == 0 ? "" : ","),indent);
+        StatsString(fp,st->outputs[idx]);
+        fprintf(fp,", \"bytes\": %ld}",bytes);
+    }
+    fprintf(fp,"\n%s],\n%s\"bytes_written\": %ld",indent,indent,total);
+}
+
+/* save the stats and free them - returns 0 or -1 like the bench */
+STATSINLINE int StatsClose(STATS *st)
+{
+    FILE *fp;
+    STATSEVENT *event;
+    double wall, cpu;
+    int idx;
+
+    if (NULL == st) return 0;
+
+    /* a conversion that returns early can leave its last stage open */
+    for (idx = 0; idx < STATS_STAGES; idx++) {
+        if (st->depth[idx] < 1) continue;
+        st->depth[idx] = 1;
+        StatsEnd(st,idx);
+    }
+    wall = StatsWallClock() - st->origin;
+    cpu = StatsCpuClock() - st->cpuorigin;
+
+    if (NULL == (fp = fopen(st->file,"w"))) {
+        printf("Error Opening %s for writing!\n",st->file);
+        free(st);
+        return -1;
+    }
+
+    if (st->format == STATS_TRACE) {
+        /* timestamps in microseconds from the start of the conversion */
+        fprintf(fp,"{\n\"traceEvents\": [\n");
+        fprintf(fp,"  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": ");
+        StatsString(fp,st->program);
+        fprintf(fp,"}},\n  {\"name\": ");
+        StatsString(fp,st->input);
+        fprintf(fp,", \"cat\": \"convert\", \"ph\": \"X\", \"ts\": 0, \"dur\": %.1f, \"pid\": 1, \"tid\": 1,"
+            " \"args\": {\"process_cpu_us\": %.1f}}",wall * 1000000.0,cpu * 1000000.0);
+        for (idx = 0; idx < st->numevents; idx++) {
+            event = &st->events[idx];
+            fprintf(fp,",\n  {\"name\": \"%s\", \"cat\": \"stage\", \"ph\": \"X\", \"ts\": %.1f, \"dur\": %.1f,"
+                " \"pid\": 1, \"tid\": 1, \"args\": {\"process_cpu_us\": %.1f}}",
+                statsstages[event->stage],event->start * 1000000.0,event->wall * 1000000.0,event->cpu * 1000000.0);
+        }
+        fprintf(fp,",\n  {\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.1f, \"pid\": 1, \"tid\": 1, \"args\": {",
+            wall * 1000000.0);
+        for (idx = 0; idx < STATS_COUNTERS; idx++) {
+            fprintf(fp,"%s\"%s\": %ld",(idx == 0 ? "" : ", "),statscounters[idx],st->counts[idx]);
+        }
+        fprintf(fp,"}}\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": {\n");
+        StatsWriteSummary(st,fp,wall,cpu,"  ");
+        fprintf(fp,"\n}\n}\n");
+    }
+    else {
+        fprintf(fp,"{\n");
+        StatsWriteSummary(st,fp,wall,cpu,"  ");
+        fprintf(fp,"\n}\n");
+    }
+    fclose(fp);
+    printf("%s Saved!\n",st->file);
+    free(st);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,936 @@
+/* ------------------------------------------------------------------------ */
+/* E2E.C - end-to-end throughput benchmark and golden-output check for     */
+/*         a2b, b2d, m2s and xpack                                          */
+/*                                                                          */
+/* Licence Agreement                                                        */
+/* -----------------                                                        */
+/*                                                                          */
+/* You have a royalty-free right to use, modify, reproduce and              */
+/* distribute this source code in any way you find useful.                  */
+/*                                                                          */
+/* Purpose      : Runs the converters over the bmp/ and bmp/a2fc/ corpus   */
+/*                for each mode in cases.txt and checks every output file   */
+/*                against the SHA-256 hashes of known-good output kept in   */
+/*                golden.txt.                                               */
+/*                                                                          */
+/*      "e2e check"  - compare with golden.txt, fail on any mismatch or     */
+/*                     on a mode that is slower than the recorded rate      */
+/*                     by more than the threshold (default 25%)             */
+/*      "e2e record" - write golden.txt from the current converters         */
+/*                                                                          */
+/*      Options:  bin=dir      where the converters are (default ..)        */
+/*                cases=file   mode list (default cases.txt)                */
+/*                golden=file  hashes and rates (default golden.txt)        */
+/*                work=dir     scratch directory (default e2e_work)         */
+/*                json=file    results (default e2e.json)                   */
+/*                runs=n       time each image n times, keep the best (3)   */
+/*                t=n          throughput threshold in percent              */
+/*                norate       check the hashes only                        */
+/*                base=dir     time the converters in dir as well and      */
+/*                             report the speedup of bin= over them         */
+/*                                                                          */
+/*      Each line of cases.txt is mode|tool|input|options. The input is     */
+/*      a file name relative to this directory with an optional * in the    */
+/*      file part. "@320x200" after the name windowboxes the picture in a   */
+/*      black 24-bit BMP of that size for the modes that need one.          */
+/*      "=mode" takes the outputs of an earlier mode and gives the image    */
+/*      base name to the tool (m2s opens base_proc.bmp and base_palette).  */
+/*                                                                          */
+/*      For each mode the images/s, bytes read and written and the peak    */
+/*      resident set size of the converters are printed and saved as JSON. */
+/*      The rate comes from the processor time of the converters. Peak RSS */
+/*      needs wait4() too - on Windows the rate is from the clock around    */
+/*      system() and the RSS is reported as 0.                              */
+/*                                                                          */
+/*      "make release" in the top directory trains the instrumented         */
+/*      converters in ../pgo/bin with "e2e record" and then checks the      */
+/*      profile-guided build with base=../pgo/plain, the plain build.       */
+/* ------------------------------------------------------------------------ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define getcwd _getcwd
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef short sshort;
+
+#include "../src_common/bench.h"
+
+#define SUCCESS  0
+#define VALID    SUCCESS
+#define FAILURE  -1
+#define INVALID  FAILURE
+
+#define ASCIIZ 0
+
+#define MAXF      256
+#define MAXMODES  64
+#define MAXIMAGES 64
+#define MAXFILES  16
+#define MAXGOLDEN 4096
+#define LOGFILE   "e2e.log"
+
+/* one output file of one image */
+typedef struct tagOUTFILE
+{
+    char name[64];
+    long bytes;
+    char hash[65];
+} OUTFILE;
+
+/* one image converted in one mode */
+typedef struct tagRUN
+{
+    char image[64];         /* base name of the input */
+    char dir[MAXF];         /* scratch directory that keeps the outputs */
+    int numinputs;
+    char inputs[MAXFILES][64];
+    int numoutputs;
+    OUTFILE outputs[MAXFILES];
+    long bytesread;
+    double secs, basesecs;
+    long rsskb;
+    int status;
+} RUN;
+
+typedef struct tagMODE
+{
+    char name[32], tool[16], input[MAXF], options[MAXF];
+    int numruns;
+    RUN runs[MAXIMAGES];
+    double rate, goldenrate, baserate;
+    long bytesread, byteswritten, rsskb;
+    int mismatches, slow;
+} MODE;
+
+/* a line of golden.txt */
+typedef struct tagGOLDEN
+{
+    char mode[32], image[64], name[64], hash[65];
+    long bytes;
+    int seen;
+} GOLDEN;
+
+char bindir[MAXF] = "..", basedir[MAXF] = "", casefile[MAXF] = "cases.txt", goldenfile[MAXF] = "golden.txt";
+char workdir[MAXF] = "e2e_work", jsonfile[MAXF] = "e2e.json";
+int runs = 3, threshold = 25, checkrate = 1;
+
+MODE modes[MAXMODES];
+int nummodes = 0;
+GOLDEN golden[MAXGOLDEN];
+int numgolden = 0;
+
+/* ------------------------------------------------------------------------ */
+/* SHA-256 (FIPS 180-4)                                                     */
+/* ------------------------------------------------------------------------ */
+
+typedef struct tagSHA256
+{
+    unsigned long state[8], bits[2];
+    uchar block[64];
+    int used;
+} SHA256;
+
+static const unsigned long sha256k[64] = {
+0x428a2f98UL,0x71374491UL,0xb5c0fbcfUL,0xe9b5dba5UL,0x3956c25bUL,0x59f111f1UL,0x923f82a4UL,0xab1c5ed5UL,
+0xd807aa98UL,0x12835b01UL,0x243185beUL,0x550c7dc3UL,0x72be5d74UL,0x80deb1feUL,0x9bdc06a7UL,0xc19bf174UL,
+0xe49b69c1UL,0xefbe4786UL,0x0fc19dc6UL,0x240ca1ccUL,0x2de92c6fUL,0x4a7484aaUL,0x5cb0a9dcUL,0x76f988daUL,
+0x983e5152UL,0xa831c66dUL,0xb00327c8UL,0xbf597fc7UL,0xc6e00bf3UL,0xd5a79147UL,0x06ca6351UL,0x14292967UL,
+0x27b70a85UL,0x2e1b2138UL,0x4d2c6dfcUL,0x53380d13UL,0x650a7354UL,0x766a0abbUL,0x81c2c92eUL,0x92722c85UL,
+0xa2bfe8a1UL,0xa81a664bUL,0xc24b8b70UL,0xc76c51a3UL,0xd192e819UL,0xd6990624UL,0xf40e3585UL,0x106aa070UL,
+0x19a4c116UL,0x1e376c08UL,0x2748774cUL,0x34b0bcb5UL,0x391c0cb3UL,0x4ed8aa4aUL,0x5b9cca4fUL,0x682e6ff3UL,
+0x748f82eeUL,0x78a5636fUL,0x84c87814UL,0x8cc70208UL,0x90befffaUL,0xa4506cebUL,0xbef9a3f7UL,0xc67178f2UL};
+
+#define ROR32(x,n) ((((x) >> (n)) | ((x) << (32 - (n)))) & 0xffffffffUL)
+
+void SHA256Block(SHA256 *sha)
+{
+    unsigned long w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((unsigned long)sha->block[i*4] << 24) | ((unsigned long)sha->block[i*4+1] << 16) |
+               ((unsigned long)sha->block[i*4+2] << 8) | sha->block[i*4+3];
+    }
+    for (i = 16; i < 64; i++) {
+        t1 = ROR32(w[i-2],17) ^ ROR32(w[i-2],19) ^ (w[i-2] >> 10);
+        t2 = ROR32(w[i-15],7) ^ ROR32(w[i-15],18) ^ (w[i-15] >> 3);
+        w[i] = (t1 + w[i-7] + t2 + w[i-16]) & 0xffffffffUL;
+    }
+    a = sha->state[0]; b = sha->state[1]; c = sha->state[2]; d = sha->state[3];
+    e = sha->state[4]; f = sha->state[5]; g = sha->state[6]; h = sha->state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = (h + (ROR32(e,6) ^ ROR32(e,11) ^ ROR32(e,25)) + ((e & f) ^ (~e & g)) + sha256k[i] + w[i]) & 0xffffffffUL;
+        t2 = ((ROR32(a,2) ^ ROR32(a,13) ^ ROR32(a,22)) + ((a & b) ^ (a & c) ^ (b & c))) & 0xffffffffUL;
+        h = g; g = f; f = e;
+        e = (d + t1) & 0xffffffffUL;
+        d = c; c = b; b = a;
+        a = (t1 + t2) & 0xffffffffUL;
+    }
+    sha->state[0] = (sha->state[0] + a) & 0xffffffffUL;
+    sha->state[1] = (sha->state[1] + b) & 0xffffffffUL;
+    sha->state[2] = (sha->state[2] + c) & 0xffffffffUL;
+    sha->state[3] = (sha->state[3] + d) & 0xffffffffUL;
+    sha->state[4] = (sha->state[4] + e) & 0xffffffffUL;
+    sha->state[5] = (sha->state[5] + f) & 0xffffffffUL;
+    sha->state[6] = (sha->state[6] + g) & 0xffffffffUL;
+    sha->state[7] = (sha->state[7] + h) & 0xffffffffUL;
+}
+
+void SHA256Init(SHA256 *sha)
+{
+    sha->state[0] = 0x6a09e667UL; sha->state[1] = 0xbb67ae85UL;
+    sha->state[2] = 0x3c6ef372UL; sha->state[3] = 0xa54ff53aUL;
+    sha->state[4] = 0x510e527fUL; sha->state[5] = 0x9b05688cUL;
+    sha->state[6] = 0x1f83d9abUL; sha->state[7] = 0x5be0cd19UL;
+    sha->bits[0] = sha->bits[1] = 0UL;
+    sha->used = 0;
+}
+
+void SHA256Add(SHA256 *sha, uchar *buf, long len)
+{
+    long i;
+
+    for (i = 0; i < len; i++) {
+        sha->block[sha->used++] = buf[i];
+        if (sha->used == 64) {
+            SHA256Block(sha);
+            sha->used = 0;
+        }
+    }
+    /* message length in bits as two 32-bit halves */
+    for (i = len; i > 0L; i -= 0x10000000L) {
+        unsigned long add = (unsigned long)(i > 0x10000000L ? 0x10000000L : i) << 3;
+        sha->bits[0] = (sha->bits[0] + add) & 0xffffffffUL;
+        if (sha->bits[0] < add) sha->bits[1]++;
+    }
+}
+
+void SHA256Hex(SHA256 *sha, char *hex)
+{
+    unsigned long lo = sha->bits[0], hi = sha->bits[1];
+    int i;
+
+    sha->block[sha->used++] = 0x80;
+    if (sha->used > 56) {
+        while (sha->used < 64) sha->block[sha->used++] = 0;
+        SHA256Block(sha);
+        sha->used = 0;
+    }
+    while (sha->used < 56) sha->block[sha->used++] = 0;
+    for (i = 0; i < 4; i++) {
+        sha->block[56+i] = (uchar)(hi >> (24 - i*8));
+        sha->block[60+i] = (uchar)(lo >> (24 - i*8));
+    }
+    SHA256Block(sha);
+    for (i = 0; i < 8; i++) sprintf(&hex[i*8],"%08lx",sha->state[i]);
+}
+
+/* hash and size of a file - returns -1 if it can't be read */
+long HashFile(char *name, char *hex)
+{
+    FILE *fp;
+    SHA256 sha;
+    uchar buf[4096];
+    long bytes = 0L;
+    size_t len;
+
+    if (NULL == (fp = fopen(name,"rb"))) return -1L;
+    SHA256Init(&sha);
+    while ((len = fread(buf,1,sizeof(buf),fp)) > 0) {
+        SHA256Add(&sha,buf,(long)len);
+        bytes += (long)len;
+    }
+    fclose(fp);
+    SHA256Hex(&sha,hex);
+    return bytes;
+}
+
+/* ------------------------------------------------------------------------ */
+/* files and directories                                                    */
+/* ------------------------------------------------------------------------ */
+
+int MakeDir(char *name)
+{
+#ifdef _WIN32
+    return _mkdir(name);
+#else
+    return mkdir(name,0777);
+#endif
+}
+
+/* remove the files in a scratch directory */
+void ClearDir(char *name)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char path[MAXF * 2];
+
+    if (NULL == (dir = opendir(name))) return;
+    while (NULL != (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        sprintf(path,"%s/%s",name,entry->d_name);
+        remove(path);
+    }
+    closedir(dir);
+}
+
+long CopyFile(char *from, char *to)
+{
+    FILE *fp, *fp2;
+    uchar buf[4096];
+    long bytes = 0L;
+    size_t len;
+
+    if (NULL == (fp = fopen(from,"rb"))) return -1L;
+    if (NULL == (fp2 = fopen(to,"wb"))) {
+        fclose(fp);
+        return -1L;
+    }
+    while ((len = fread(buf,1,sizeof(buf),fp)) > 0) {
+        fwrite(buf,1,len,fp2);
+        bytes += (long)len;
+    }
+    fclose(fp);
+    fclose(fp2);
+    return bytes;
+}
+
+/* centre a 24-bit BMP on a black background of width x height */
+long WindowBox(char *from, char *to, int width, int height)
+{
+    BENCHIMAGE img;
+    FILE *fp;
+    uchar header[54], *line;
+    long packet = ((long)width * 3 + 3) & ~3L, size = 54L + packet * height;
+    int x0, y0, y, i;
+
+    if (BenchLoadBMP(&img,from) != 0) return -1L;
+    if (img.width > width || img.height > height || NULL == (line = (uchar *)malloc(packet))) {
+        free(img.bgr);
+        return -1L;
+    }
+    if (NULL == (fp = fopen(to,"wb"))) {
+        free(line);
+        free(img.bgr);
+        return -1L;
+    }
+
+    memset(header,0,54);
+    header[0] = 'B'; header[1] = 'M';
+    for (i = 0; i < 4; i++) {
+        header[2+i]  = (uchar)(size >> (i*8));
+        header[18+i] = (uchar)((long)width >> (i*8));
+        header[22+i] = (uchar)((long)height >> (i*8));
+        header[34+i] = (uchar)((packet * height) >> (i*8));
+    }
+    header[10] = 54;
+    header[14] = 40;
+    header[26] = 1;
+    header[28] = 24;
+    fwrite(header,1,54,fp);
+
+    /* bottom-up */
+    x0 = (width - img.width) / 2;
+    y0 = (height - img.height) / 2;
+    for (y = height - 1; y > -1; y--) {
+        memset(line,0,packet);
+        if (y >= y0 && y < y0 + img.height)
+            memcpy(&line[x0*3],&img.bgr[(long)(y - y0) * img.width * 3],(size_t)img.width * 3);
+        fwrite(line,1,packet,fp);
+    }
+    fclose(fp);
+    free(line);
+    free(img.bgr);
+    return size;
+}
+
+/* simple wildcard match - * only, case insensitive */
+int WildMatch(char *pattern, char *name)
+{
+    if (*pattern == ASCIIZ) return (*name == ASCIIZ);
+    if (*pattern == '*') {
+        for (;;) {
+            if (WildMatch(pattern + 1,name)) return 1;
+            if (*name == ASCIIZ) return 0;
+            name++;
+        }
+    }
+    if (toupper(*pattern) != toupper(*name)) return 0;
+    return WildMatch(pattern + 1,name + 1);
+}
+
+int CompareNames(const void *a, const void *b)
+{
+    return strcmp((char *)a,(char *)b);
+}
+
+/* base name without directory or extension */
+void BaseName(char *path, char *base)
+{
+    char *ptr = path, *dot = NULL;
+    int idx;
+
+    for (idx = 0; path[idx] != ASCIIZ; idx++) {
+        if (path[idx] == (char)92 || path[idx] == (char)47) ptr = &path[idx+1];
+    }
+    strncpy(base,ptr,63);
+    base[63] = ASCIIZ;
+    for (idx = 0; base[idx] != ASCIIZ; idx++) {
+        if (base[idx] == '.') dot = &base[idx];
+    }
+    if (NULL != dot) *dot = ASCIIZ;
+}
+
+/* ------------------------------------------------------------------------ */
+/* running the converters                                                   */
+/* ------------------------------------------------------------------------ */
+
+/* run a converter in the scratch directory with its output in e2e.log */
+/* returns the exit status, the seconds taken and the peak rss of the converter */
+/* the time is the processor time of the converter where wait4() gives it */
+/* since the wall clock time of short runs depends too much on the machine */
+int RunTool(char *bin, char *dir, char *tool, char *arg, char *options, double *secs, long *rsskb)
+{
+    char command[MAXF * 4], *argv[32], *ptr;
+    int argc = 0, status;
+
+    sprintf(command,"%s/%s",bin,tool);
+    if (bin[0] != (char)47 && bin[0] != (char)92 && bin[1] != ':') {
+        /* relative to the scratch directory */
+        char cwd[MAXF];
+        if (NULL != getcwd(cwd,MAXF)) sprintf(command,"%s/%s/%s",cwd,bin,tool);
+    }
+    *secs = 0.0;
+    *rsskb = 0L;
+
+#ifdef _WIN32
+    sprintf(&command[strlen(command)],"\" %s %s > %s 2>&1",arg,options,LOGFILE);
+    {
+        char line[MAXF * 6];
+        clock_t start = clock();
+
+        sprintf(line,"cd \"%s\" && \"%s",dir,command);
+        status = system(line);
+        *secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    (void)argv; (void)argc; (void)ptr;
+    return status;
+#else
+    {
+        char opts[MAXF];
+        struct rusage usage;
+        pid_t pid;
+        FILE *fp;
+
+        strcpy(opts,options);
+        argv[argc++] = command;
+        argv[argc++] = arg;
+        for (ptr = strtok(opts," "); NULL != ptr && argc < 31; ptr = strtok(NULL," ")) argv[argc++] = ptr;
+        argv[argc] = NULL;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) return -1;
+        if (pid == 0) {
+            if (chdir(dir) != 0) _exit(127);
+            /* the converters prompt for a file name when they are given nothing */
+            if (NULL == freopen("/dev/null","r",stdin)) _exit(127);
+            fp = freopen(LOGFILE,"w",stdout);
+            if (NULL != fp) dup2(fileno(stdout),2);
+            execv(command,argv);
+            _exit(127);
+        }
+        if (wait4(pid,&status,0,&usage) < 0) return -1;
+        *secs = (double)usage.ru_utime.tv_sec + (double)usage.ru_stime.tv_sec +
+                ((double)usage.ru_utime.tv_usec + (double)usage.ru_stime.tv_usec) / 1000000.0;
+#ifdef __APPLE__
+        *rsskb = (long)(usage.ru_maxrss / 1024);
+#else
+        *rsskb = (long)usage.ru_maxrss;
+#endif
+        if (WIFEXITED(status)) return WEXITSTATUS(status);
+        return -1;
+    }
+#endif
+}
+
+/* copy the inputs of one image into its scratch directory */
+int StageInputs(MODE *mode, RUN *run, char *source, int box, int boxwidth, int boxheight, RUN *from)
+{
+    char path[MAXF * 2], target[MAXF * 2];
+    long bytes;
+    int idx;
+
+    ClearDir(run->dir);
+    run->bytesread = 0L;
+
+    if (NULL != from) {
+        /* the outputs of an earlier mode */
+        for (idx = 0; idx < from->numoutputs; idx++) {
+            sprintf(path,"%s/%s",from->dir,from->outputs[idx].name);
+            sprintf(target,"%s/%s",run->dir,from->outputs[idx].name);
+            if ((bytes = CopyFile(path,target)) < 0L) return INVALID;
+            run->bytesread += bytes;
+        }
+        return SUCCESS;
+    }
+
+    sprintf(path,"%s/%s",run->dir,run->inputs[0]);
+    if (box == 1) bytes = WindowBox(source,path,boxwidth,boxheight);
+    else bytes = CopyFile(source,path);
+    if (bytes < 0L) {
+        printf("%s: %s can't be staged!\n",mode->name,source);
+        return INVALID;
+    }
+    run->bytesread = bytes;
+    return SUCCESS;
+}
+
+/* list what the converter wrote - everything that is not an input */
+void ListOutputs(RUN *run)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char names[MAXFILES][64], path[MAXF * 2];
+    int idx, count = 0, input;
+
+    run->numoutputs = 0;
+    if (NULL == (dir = opendir(run->dir))) return;
+    while (NULL != (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name,LOGFILE) == 0) continue;
+        for (idx = 0, input = 0; idx < run->numinputs; idx++) {
+            if (strcmp(entry->d_name,run->inputs[idx]) == 0) input = 1;
+        }
+        if (input == 1 || count >= MAXFILES) continue;
+        strncpy(names[count],entry->d_name,63);
+        names[count++][63] = ASCIIZ;
+    }
+    closedir(dir);
+
+    /* directory order is not the same everywhere */
+    qsort(names,count,64,CompareNames);
+    for (idx = 0; idx < count; idx++) {
+        strcpy(run->outputs[idx].name,names[idx]);
+        sprintf(path,"%s/%s",run->dir,names[idx]);
+        run->outputs[idx].bytes = HashFile(path,run->outputs[idx].hash);
+    }
+    run->numoutputs = count;
+}
+
+MODE *FindMode(char *name)
+{
+    int idx;
+
+    for (idx = 0; idx < nummodes; idx++) {
+        if (strcmp(modes[idx].name,name) == 0) return &modes[idx];
+    }
+    return NULL;
+}
+
+/* expand the input of a mode into its images and convert each of them */
+int RunMode(MODE *mode)
+{
+    char source[MAXF], pattern[MAXF], dirname[MAXF], names[MAXIMAGES][MAXF], arg[MAXF], *ptr;
+    DIR *dir;
+    struct dirent *entry;
+    MODE *frommode = NULL;
+    RUN *run;
+    int idx, rep, count = 0, box = 0, boxwidth = 0, boxheight = 0, status = INVALID;
+    long rsskb;
+    double secs, total = 0.0, basetotal = 0.0;
+
+    strcpy(source,mode->input);
+    if (source[0] == '=') {
+        if (NULL == (frommode = FindMode(&source[1]))) {
+            printf("%s: mode %s must come first!\n",mode->name,&source[1]);
+            return INVALID;
+        }
+        for (idx = 0; idx < frommode->numruns; idx++) strcpy(names[count++],frommode->runs[idx].image);
+    }
+    else {
+        if (NULL != (ptr = strchr(source,'@'))) {
+            *ptr++ = ASCIIZ;
+            if (sscanf(ptr,"%dx%d",&boxwidth,&boxheight) == 2) box = 1;
+        }
+        /* split the directory from the file pattern */
+        strcpy(dirname,".");
+        strcpy(pattern,source);
+        for (idx = (int)strlen(source) - 1; idx > -1; idx--) {
+            if (source[idx] == (char)47 || source[idx] == (char)92) {
+                strncpy(dirname,source,idx);
+                dirname[idx] = ASCIIZ;
+                strcpy(pattern,&source[idx+1]);
+                break;
+            }
+        }
+        if (NULL == (dir = opendir(dirname))) {
+            printf("%s: %s can't be opened!\n",mode->name,dirname);
+            return INVALID;
+        }
+        while (NULL != (entry = readdir(dir)) && count < MAXIMAGES) {
+            if (entry->d_name[0] == '.' || !WildMatch(pattern,entry->d_name)) continue;
+            sprintf(names[count++],"%s/%s",dirname,entry->d_name);
+        }
+        closedir(dir);
+        qsort(names,count,MAXF,CompareNames);
+    }
+    if (count == 0) {
+        printf("%s: no input files for %s!\n",mode->name,mode->input);
+        return INVALID;
+    }
+
+    sprintf(dirname,"%s/%s",workdir,mode->name);
+    MakeDir(dirname);
+
+    mode->numruns = 0;
+    mode->bytesread = mode->byteswritten = mode->rsskb = 0L;
+    for (idx = 0; idx < count; idx++) {
+        run = &mode->runs[mode->numruns++];
+        memset(run,0,sizeof(RUN));
+        if (NULL != frommode) {
+            strcpy(run->image,names[idx]);
+            for (rep = 0; rep < frommode->runs[idx].numoutputs && rep < MAXFILES; rep++)
+                strcpy(run->inputs[rep],frommode->runs[idx].outputs[rep].name);
+            run->numinputs = rep;
+            strcpy(arg,run->image);
+        }
+        else {
+            BaseName(names[idx],run->image);
+            ptr = names[idx];
+            for (rep = 0; names[idx][rep] != ASCIIZ; rep++) {
+                if (names[idx][rep] == (char)47 || names[idx][rep] == (char)92) ptr = &names[idx][rep+1];
+            }
+            strcpy(run->inputs[0],ptr);
+            run->numinputs = 1;
+            strcpy(arg,ptr);
+        }
+        sprintf(run->dir,"%s/%s",dirname,run->image);
+        MakeDir(run->dir);
+
+        /* best of the timed runs */
+        run->secs = run->basesecs = 0.0;
+        for (rep = 0; rep < runs; rep++) {
+            if (basedir[0] != ASCIIZ) {
+                /* the base converters go first so the outputs that are kept come from bin */
+                status = StageInputs(mode,run,names[idx],box,boxwidth,boxheight,
+                                     (NULL != frommode ? &frommode->runs[idx] : NULL));
+                if (status != SUCCESS) break;
+                RunTool(basedir,run->dir,mode->tool,arg,mode->options,&secs,&rsskb);
+                if (rep == 0 || secs < run->basesecs) run->basesecs = secs;
+            }
+            status = StageInputs(mode,run,names[idx],box,boxwidth,boxheight,
+                                 (NULL != frommode ? &frommode->runs[idx] : NULL));
+            if (status != SUCCESS) break;
+            status = RunTool(bindir,run->dir,mode->tool,arg,mode->options,&secs,&rsskb);
+            if (rep == 0 || secs < run->secs) run->secs = secs;
+            if (rsskb > run->rsskb) run->rsskb = rsskb;
+        }
+        run->status = status;
+        ListOutputs(run);
+        if (status != SUCCESS) printf("*** %s: %s %s %s exited with %d!\n",mode->name,mode->tool,arg,mode->options,status);
+
+        total += run->secs;
+        basetotal += run->basesecs;
+        mode->bytesread += run->bytesread;
+        for (rep = 0; rep < run->numoutputs; rep++) mode->byteswritten += run->outputs[rep].bytes;
+        if (run->rsskb > mode->rsskb) mode->rsskb = run->rsskb;
+    }
+    if (total <= 0.0) total = 0.000001;
+    mode->rate = (double)mode->numruns / total;
+    mode->baserate = 0.0;
+    if (basedir[0] != ASCIIZ) {
+        if (basetotal <= 0.0) basetotal = 0.000001;
+        mode->baserate = (double)mode->numruns / basetotal;
+    }
+    return SUCCESS;
+}
+
+/* ------------------------------------------------------------------------ */
+/* cases, golden output and results                                         */
+/* ------------------------------------------------------------------------ */
+
+int ReadCases()
+{
+    FILE *fp;
+    char line[MAXF * 4], *field[4], *ptr;
+    int idx;
+    MODE *mode;
+
+    if (NULL == (fp = fopen(casefile,"r"))) {
+        printf("Error Opening %s for reading!\n",casefile);
+        return INVALID;
+    }
+    while (NULL != fgets(line,sizeof(line),fp) && nummodes < MAXMODES) {
+        for (idx = 0; line[idx] != ASCIIZ; idx++) {
+            if (line[idx] == '\r' || line[idx] == '\n') line[idx] = ASCIIZ;
+        }
+        if (line[0] == '#' || line[0] == ASCIIZ) continue;
+        ptr = line;
+        for (idx = 0; idx < 4; idx++) {
+            field[idx] = ptr;
+            if (NULL != (ptr = strchr(ptr,'|'))) *ptr++ = ASCIIZ;
+            else break;
+        }
+        if (idx < 3) {
+            printf("%s: %s is not mode|tool|input|options!\n",casefile,line);
+            continue;
+        }
+        /* modes is zero to begin with - clearing all of it here would put */
+        /* pages of unused runs in the peak rss of every converter we fork */
+        mode = &modes[nummodes++];
+        strncpy(mode->name,field[0],31);
+        strncpy(mode->tool,field[1],15);
+        strncpy(mode->input,field[2],MAXF-1);
+        strncpy(mode->options,field[3],MAXF-1);
+    }
+    fclose(fp);
+    return SUCCESS;
+}
+
+int ReadGolden()
+{
+    FILE *fp;
+    char line[MAXF], kind[8], mode[32];
+    double rate;
+    MODE *ptr;
+
+    if (NULL == (fp = fopen(goldenfile,"r"))) {
+        printf("Error Opening %s for reading! Use \"e2e record\" first.\n",goldenfile);
+        return INVALID;
+    }
+    while (NULL != fgets(line,sizeof(line),fp)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line,"%7s",kind) != 1) continue;
+        if (strcmp(kind,"rate") == 0) {
+            if (sscanf(line,"%*s %31s %lf",mode,&rate) == 2 && NULL != (ptr = FindMode(mode)))
+                ptr->goldenrate = rate;
+            continue;
+        }
+        if (strcmp(kind,"out") == 0 && numgolden < MAXGOLDEN) {
+            if (sscanf(line,"%*s %31s %63s %63s %ld %64s",golden[numgolden].mode,golden[numgolden].image,
+                golden[numgolden].name,&golden[numgolden].bytes,golden[numgolden].hash) == 5) {
+                golden[numgolden].seen = 0;
+                numgolden++;
+            }
+        }
+    }
+    fclose(fp);
+    return SUCCESS;
+}
+
+int WriteGolden()
+{
+    FILE *fp;
+    MODE *mode;
+    RUN *run;
+    int idx, jdx, kdx;
+
+    if (NULL == (fp = fopen(goldenfile,"w"))) {
+        printf("Error Opening %s for writing!\n",goldenfile);
+        return INVALID;
+    }
+    fprintf(fp,"# known-good output of the modes in %s - written by \"e2e record\"\n",casefile);
+    fprintf(fp,"# out <mode> <image> <file> <bytes> <sha256>\n");
+    fprintf(fp,"# rate <mode> <images/s> - on this machine, check with norate on others\n");
+    for (idx = 0; idx < nummodes; idx++) {
+        mode = &modes[idx];
+        fprintf(fp,"rate %s %.2f\n",mode->name,mode->rate);
+        for (jdx = 0; jdx < mode->numruns; jdx++) {
+            run = &mode->runs[jdx];
+            for (kdx = 0; kdx < run->numoutputs; kdx++) {
+                fprintf(fp,"out %s %s %s %ld %s\n",mode->name,run->image,run->outputs[kdx].name,
+                    run->outputs[kdx].bytes,run->outputs[kdx].hash);
+            }
+        }
+    }
+    fclose(fp);
+    printf("%s Saved!\n",goldenfile);
+    return SUCCESS;
+}
+
+/* compare a mode with the golden output - returns the number of failures */
+int CheckMode(MODE *mode)
+{
+    RUN *run;
+    GOLDEN *gold;
+    int idx, jdx, kdx, found;
+
+    mode->mismatches = mode->slow = 0;
+    for (jdx = 0; jdx < mode->numruns; jdx++) {
+        run = &mode->runs[jdx];
+        for (kdx = 0; kdx < run->numoutputs; kdx++) {
+            found = 0;
+            for (idx = 0; idx < numgolden; idx++) {
+                gold = &golden[idx];
+                if (strcmp(gold->mode,mode->name) != 0 || strcmp(gold->image,run->image) != 0 ||
+                    strcmp(gold->name,run->outputs[kdx].name) != 0) continue;
+                gold->seen = found = 1;
+                if (strcmp(gold->hash,run->outputs[kdx].hash) != 0) {
+                    printf("*** MISMATCH %s %s %s: %ld bytes %.16s... expected %ld bytes %.16s...\n",
+                        mode->name,run->image,run->outputs[kdx].name,run->outputs[kdx].bytes,
+                        run->outputs[kdx].hash,gold->bytes,gold->hash);
+                    mode->mismatches++;
+                }
+                break;
+            }
+            if (found == 0) {
+                printf("*** UNEXPECTED OUTPUT %s %s %s\n",mode->name,run->image,run->outputs[kdx].name);
+                mode->mismatches++;
+            }
+        }
+    }
+    for (idx = 0; idx < numgolden; idx++) {
+        gold = &golden[idx];
+        if (gold->seen == 0 && strcmp(gold->mode,mode->name) == 0) {
+            printf("*** MISSING OUTPUT %s %s %s\n",mode->name,gold->image,gold->name);
+            gold->seen = 1;
+            mode->mismatches++;
+        }
+    }
+
+    if (checkrate == 1 && mode->goldenrate > 0.0 &&
+        mode->rate < mode->goldenrate * (100 - threshold) / 100.0) {
+        printf("*** SLOW %s: %.2f images/s against %.2f recorded (more than %d%% slower)\n",
+            mode->name,mode->rate,mode->goldenrate,threshold);
+        mode->slow = 1;
+    }
+    return mode->mismatches + mode->slow;
+}
+
+int WriteResults()
+{
+    FILE *fp;
+    MODE *mode;
+    int idx;
+
+    if (NULL == (fp = fopen(jsonfile,"w"))) {
+        printf("Error Opening %s for writing!\n",jsonfile);
+        return INVALID;
+    }
+    fprintf(fp,"{\n  \"runs\": %d,\n  \"threshold\": %d,\n  \"bin\": ",runs,threshold);
+    BenchWriteString(fp,bindir);
+    if (basedir[0] != ASCIIZ) {
+        fprintf(fp,",\n  \"base\": ");
+        BenchWriteString(fp,basedir);
+    }
+    fprintf(fp,",\n  \"modes\": [");
+    for (idx = 0; idx < nummodes; idx++) {
+        mode = &modes[idx];
+        fprintf(fp,"%s\n    {\"mode\": ",(idx == 0 ? "" : ","));
+        BenchWriteString(fp,mode->name);
+        fprintf(fp,", \"tool\": ");
+        BenchWriteString(fp,mode->tool);
+        fprintf(fp,", \"options\": ");
+        BenchWriteString(fp,mode->options);
+        fprintf(fp,", \"images\": %d, \"images_per_sec\": %.2f, \"recorded_images_per_sec\": %.2f,"
+            " \"bytes_read\": %ld, \"bytes_written\": %ld, \"peak_rss_kb\": %ld,"
+            " \"mismatches\": %d, \"slow\": %d",
+            mode->numruns,mode->rate,mode->goldenrate,mode->bytesread,mode->byteswritten,mode->rsskb,
+            mode->mismatches,mode->slow);
+        if (basedir[0] != ASCIIZ)
+            fprintf(fp,", \"base_images_per_sec\": %.2f, \"speedup\": %.3f",mode->baserate,mode->rate / mode->baserate);
+        fprintf(fp,"}");
+    }
+    fprintf(fp,"\n  ]\n}\n");
+    fclose(fp);
+    printf("%s Saved!\n",jsonfile);
+    return SUCCESS;
+}
+
+void pusage(void)
+{
+    puts("Usage: \"e2e check [options]\"  - compare with golden.txt");
+    puts("       \"e2e record [options]\" - write golden.txt");
+    puts("Options: bin=dir cases=file golden=file work=dir json=file runs=n t=n norate base=dir");
+}
+
+int main(int argc, char **argv)
+{
+    int idx, record = 0, failures = 0, images = 0;
+    double secs = 0.0, basesecs = 0.0;
+    MODE *mode;
+
+    if (argc < 2) {
+        pusage();
+        return 1;
+    }
+    if (strcmp(argv[1],"record") == 0) record = 1;
+    else if (strcmp(argv[1],"check") != 0) {
+        pusage();
+        return 1;
+    }
+
+    for (idx = 2; idx < argc; idx++) {
+        if (strncmp(argv[idx],"bin=",4) == 0) strncpy(bindir,&argv[idx][4],MAXF-1);
+        else if (strncmp(argv[idx],"cases=",6) == 0) strncpy(casefile,&argv[idx][6],MAXF-1);
+        else if (strncmp(argv[idx],"golden=",7) == 0) strncpy(goldenfile,&argv[idx][7],MAXF-1);
+        else if (strncmp(argv[idx],"work=",5) == 0) strncpy(workdir,&argv[idx][5],MAXF-1);
+        else if (strncmp(argv[idx],"json=",5) == 0) strncpy(jsonfile,&argv[idx][5],MAXF-1);
+        else if (strncmp(argv[idx],"runs=",5) == 0) runs = atoi(&argv[idx][5]);
+        else if (strncmp(argv[idx],"t=",2) == 0) threshold = atoi(&argv[idx][2]);
+        else if (strcmp(argv[idx],"norate") == 0) checkrate = 0;
+        else if (strncmp(argv[idx],"base=",5) == 0) strncpy(basedir,&argv[idx][5],MAXF-1);
+        else {
+            printf("Unknown option %s!\n",argv[idx]);
+            pusage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+
+    if (ReadCases() != SUCCESS) return 1;
+    if (record == 0 && ReadGolden() != SUCCESS) return 1;
+    MakeDir(workdir);
+
+    printf("%-12s %-6s %6s %10s %10s %10s %8s  ","mode","tool","images","images/s","read","written","rss kb");
+    if (basedir[0] != ASCIIZ) printf("%10s %7s  ","base/s","speedup");
+    printf("status\n");
+    for (idx = 0; idx < nummodes; idx++) {
+        mode = &modes[idx];
+        if (RunMode(mode) != SUCCESS) {
+            failures++;
+            continue;
+        }
+        if (record == 0) failures += CheckMode(mode);
+        images += mode->numruns;
+        printf("%-12s %-6s %6d %10.2f %10ld %10ld %8ld  ",mode->name,mode->tool,mode->numruns,
+            mode->rate,mode->bytesread,mode->byteswritten,mode->rsskb);
+        if (basedir[0] != ASCIIZ) {
+            printf("%10.2f %6.2fx  ",mode->baserate,mode->rate / mode->baserate);
+            secs += (double)mode->numruns / mode->rate;
+            basesecs += (double)mode->numruns / mode->baserate;
+        }
+        printf("%s\n",(record == 1 ? "recorded" : (mode->mismatches > 0 ? "MISMATCH" : (mode->slow > 0 ? "SLOW" : "ok"))));
+    }
+    WriteResults();
+    if (basedir[0] != ASCIIZ && secs > 0.0)
+        printf("%s is %.2fx as fast as %s over %d images.\n",bindir,basesecs / secs,basedir,images);
+
+    if (record == 1) {
+        if (failures > 0) {
+            printf("*** %d modes failed - %s not written!\n",failures,goldenfile);
+            return 1;
+        }
+        return (WriteGolden() == SUCCESS ? 0 : 1);
+    }
+    if (failures > 0) {
+        printf("*** E2E FAILED: %d failures in %d images over %d modes!\n",failures,images,nummodes);
+        return 1;
+    }
+    printf("E2E passed: %d images over %d modes match %s.\n",images,nummodes,goldenfile);
+    return 0;
+}
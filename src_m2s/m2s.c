@@ -29,9 +29,18 @@ Options:  -A = Alternate PNT file output (run length encoded).
           -T = Use CiderPress Attribute Preservation Tags.
                Default: No Tags! (unadorned file extensions)
                Does not apply to M2S16.EXE (MS-DOS binary).
+          -3 = 3201 file output (packed mode3200) instead of SH3.
+          -O = Optimal PackBytes for PNT and 3201 output (shortest
+               packed lines) and mode3200 PNT folded into mode320.
+               Default: Greedy PackBytes (the original encoder).
           Options may be combined: "-ta" or "-at"
           Options are Case Insensitive - Switchar "-" is Optional.
 
+          "m2s bench file1.SHR file2.SH3 ..." compares the packed size
+          and speed of the greedy and optimal PackBytes encoders over
+          the scanlines of the named SHR files. BMP files are taken as
+          16 levels of green and the results are saved in m2s_bench.json.
+
 Designed by:   Jonas Grnhagen and Bill Buckels
 Programmed by: Bill Buckels
 Email:         bbuckels@mts.net
@@ -66,6 +75,7 @@ Built under MinGW 5.1.4 (gcc)
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 /* ***************************************************************** */
 /* ========================== defines ============================== */
@@ -116,6 +126,11 @@ typedef unsigned short ushort;
 typedef unsigned long ulong;
 typedef short sshort;
 
+#include "../src_common/packbytes.h"
+#include "../src_common/shrencode.h"
+#include "../src_common/bench.h"
+#include "../src_common/stats.h"
+
 /* Bitmap Header structures */
 #ifdef MINGW
 typedef struct __attribute__((__packed__)) tagBITMAPINFOHEADER
@@ -229,55 +244,8 @@ typedef struct tagPICFILE
 } PICFILE;
 
 
-/* APF structures */
-/* FileType - $C0 AuxType $0002 */
-/* integers are in big endian (Motorola) Format */
-
-#ifdef MINGW
-typedef struct __attribute__((__packed__)) tagPNTPIC
-#else
-typedef struct tagPNTPIC
-#endif
-{
-	ulong  Length;                   /* Block Length (also image length) */
-	uchar  Kind[5];                  /* 4 'M' 'A' 'I' 'N' */
-	ushort MasterMode;               /* 0 for mode320 and 0x80 for mode640 */
-	ushort PixelsPerScanline;        /* 320 or 640 */
-	ushort NumColorTables;           /* 16 */
-    uchar  ColorTable[16][32];       /* $0RGB table buffer */
-    ushort NumScanLines;             /* vertical resolution */
-    ushort ScanLineDirectory[200][2];
-} PNTPIC;
-
-#ifdef MINGW
-typedef struct __attribute__((__packed__)) tagPNTBROOKS
-#else
-typedef struct tagPNTBROOKS
-#endif
-{
-	ulong  Length;
-	uchar  Kind[5];                  /* 4 'M' 'A' 'I' 'N' */
-	ushort MasterMode;
-	ushort PixelsPerScanline;        /* 320 */
-	ushort NumColorTables;           /* 1 */
-    uchar  ColorTable[1][32];        /* $0RGB table buffer - All Black */
-    ushort NumScanLines;             /* vertical resolution */
-    ushort ScanLineDirectory[200][2];/* ModeWord is used for sequential scbs */
-} PNTBROOKS;
-
-#ifdef MINGW
-typedef struct __attribute__((__packed__)) tagMULTIPAL
-#else
-typedef struct tagMULTIPAL
-#endif
-{
-	ulong  Length;
-	uchar  Kind[9];                   /* 8 'M' 'U' 'L' 'T' 'I' 'P' 'A' 'L' */
-	ushort NumColorTables;            /* 200 */
-    uchar  ColorTableArray[200][32];  /* $0RGB table buffer */
- } MULTIPAL;
-
-/* end of Big Endian Motorola Format Structures */
+/* APF files (FileType - $C0 AuxType $0002) and 3201 files
+   are written by shrencode.h */
 
 
 /* PackBytes Line Encoder List Structure */
@@ -324,17 +292,29 @@ uchar svgaline[320];
 uchar bmpline[960];
 
 /* filenames */
-char bmpfile[256], cmapfile[256], shrfile[256], brooksfile[256], pntfile[256];
+char bmpfile[256], cmapfile[256], shrfile[256], brooksfile[256], pntfile[256], file3201[256];
+
+/* option "stats" - see ../src_common/stats.h */
+int statsformat = 0;
+STATS *stats = NULL;
 
 /* default */
 sshort output_format = PIC_FMT;
 sshort numpalettes = 16;
 
+/* 12-bit color index built by ReadColorMap */
+/* colorsets has a bit for each palette that has the color */
+/* colorentry has the first entry plus 1 of each palette for each color */
+/* if these can't be allocated (MS-DOS) the palettes are searched instead */
+#define PALSETSIZE 25
+uchar *colorsets = NULL;  /* [4096][PALSETSIZE] */
+uchar *colorentry = NULL; /* [numpalettes][4096] */
+
 /* ***************************************************************** */
 /* ========================== RLE specific globals ================= */
 /* ***************************************************************** */
 
-sshort output_pnt = 0, suppress_pnt = 1, no_tags = 1, suppress_pic = 0;
+sshort output_pnt = 0, suppress_pnt = 1, no_tags = 1, suppress_pic = 0, optimal_pnt = 0, output_3201 = 0;
 ulong MainLength = 0L;
 
 /* an SHR file is always 160 bytes x 200 scanlines */
@@ -344,10 +324,6 @@ ulong MainLength = 0L;
 
 ushort RawCount = 0, SingleCount = 0;
 RAWLIST *RawBuf;
-MULTIPAL *MultiPal;
-
-PNTPIC *picMain;
-PNTBROOKS *brooksMain;
 
 ushort PackedCount = 0;
 /* output buffer for the Packed Line */
@@ -1155,282 +1131,115 @@ SKIP:;
 
 }
 
-
-/* intel uses little endian */
-/* motorola uses big endian */
-
-/* for debugging */
-ulong Intel32(ulong val)
-{
-	uchar buf[4];
-	ulong *ptr;
-
-  	buf[0] = (uchar) val &0xff; val >>=8;
-	buf[1] = (uchar) val &0xff; val >>=8;
-	buf[2] = (uchar) val &0xff; val >>=8;
-	buf[3] = (uchar) val &0xff;
-
-    ptr = (ulong *)&buf[0];
-    val = ptr[0];
-
-    return val;
-
-
-}
-
-ushort Intel16(ushort val)
+/* packs a scanline into PackedBuf with the encoder selected by option O */
+/* the optimal encoder (packbytes.h) tries every run of all 4 PackBytes
+   flags and keeps the shortest packed line, so it also uses the 0x80
+   quad pattern that the greedy list processor above leaves out */
+int PackLine(uchar *inbuff, sshort inlen)
 {
-	uchar buf[12];
-	ushort *ptr;
+	if (optimal_pnt == 0) return PackBytes(inbuff, inlen);
 
-	/* msb in largest address */
-	buf[0] = (uchar) val &0xff; val >>=8;
-	buf[1] = (uchar) val &0xff;
-
-    ptr = (ushort *)&buf[0];
-    val = ptr[0];
-
-    return val;
+	PackedCount = (ushort)PackBytesOptimal(inbuff, inlen, PackedBuf);
+	return PackedCount;
 }
 
-/* for conversion */
-ulong Motorola32(ulong val)
+/* the line packer for the shrencode.h writers */
+int PackAPFLine(uchar *inbuff, int inlen, uchar *outbuff)
 {
-	uchar buf[4];
-	ulong *ptr;
-
-	/*
-
-	Base Address+0   Byte3
-	Base Address+1   Byte2
-	Base Address+2   Byte1
-	Base Address+3   Byte0
-
-	*/
-
-	buf[0] = (uchar) (val % 256); val = val/256;
-	buf[1] = (uchar) (val % 256); val = val/256;
-	buf[2] = (uchar) (val % 256); val = val/256;
-	buf[3] = (uchar) (val % 256);
-
-    /* cast back to unsigned long data type */
-    ptr = (ulong *)&buf[0];
-    val = ptr[0];
-
-    return val;
-
-
+	PackLine(inbuff, (sshort)inlen);
+	memcpy(outbuff,PackedBuf,PackedCount);
+	return PackedCount;
 }
 
-ushort Motorola16(ushort val)
-{
-	uchar buf[2];
-	ushort *ptr;
-
-	/* msb in smallest address */
-	buf[0] = (uchar) (val % 256); val = val/256;
-	buf[1] = (uchar) (val % 256);
-
-    ptr = (ushort *)&buf[0];
-    val = ptr[0];
-
-    return val;
-}
 
 /* frees memory allocated by PntAlloc (below) */
 void PntFree()
 {
-	if (output_pnt == 0) return;
+	if (output_pnt == 0 && output_3201 == 0) return;
 
 	free(RawBuf); /* packbytes list */
-
-	switch(output_format) {
-		case BROOKS_FMT:
-
-					free(MultiPal);
-					free(brooksMain);
-					break;
-
-		case PIC_FMT:
-		default:
-					free(picMain);
-					break;
-	}
 }
 
 
 
-/* allocates memory and sets-up defaults for the type of
-   PNT file output that will be produced */
+/* allocates memory for the packed output files */
 sshort PntAlloc()
 {
-	sshort status = INVALID;
-	uchar buf[10];
-
     output_pnt = 0;
 
-    if(suppress_pnt == 1) return INVALID;
+    /* 3201 output applies only to mode3200 */
+    if (output_format != BROOKS_FMT) output_3201 = 0;
+
+    if(suppress_pnt == 1 && output_3201 == 0) return INVALID;
 
    	if (NULL == (RawBuf = (RAWLIST *) malloc(sizeof(RAWLIST)*RAW_MAX))) {
 		puts("Not Enough Memory for PackBytes... PNT Output Disabled.");
-		return status;
+		output_3201 = 0;
+		return INVALID;
 	}
 
-	switch(output_format) {
-		case BROOKS_FMT:
-
-					MultiPal = (MULTIPAL *) malloc(sizeof(MULTIPAL));
-
-					if (NULL == MultiPal)
-					{
-						free(RawBuf);
-						puts("Not Enough Memory for Multipalette... PNT Output Disabled.");
-						break;
-					}
-
-					brooksMain = (PNTBROOKS *) malloc(sizeof(PNTBROOKS));
-
-					if (NULL == brooksMain) {
-						puts("Not Enough Memory for Main... PNT Output Disabled.");
-						free(MultiPal);
-						free(RawBuf);
-						break;
-					}
-
-					/* set defaults and invariants */
-					memset(&MultiPal[0].Length,0,sizeof(MULTIPAL));
-					MultiPal[0].Length = Motorola32((ulong)sizeof(MULTIPAL));
-					strcpy(&buf[1],"MULTIPAL"); buf[0] = 8;
-					memcpy(&MultiPal[0].Kind[0],&buf[0],9);
-					MultiPal[0].NumColorTables = Motorola16((ushort)200);
-
-                    /* The 200 Palettes will be assigned when the Brooks Palettes are built
-                       so nothing further to do except write to disk when done processing */
-
-					memset(&brooksMain[0].Length,0,sizeof(PNTBROOKS));
-					strcpy(&buf[1],"MAIN"); buf[0] = 4;
-					memcpy(&brooksMain[0].Kind[0],&buf[0],5);
-					brooksMain[0].PixelsPerScanline = Motorola16((ushort)320);
-					/* as dumb as it may sound, the CiderPress file viewer needs one color table
-					   to be included in the MAIN block even when a Brooks MULTIPAL is used. */
-
-					brooksMain[0].NumColorTables = Motorola16((ushort)1);
-					brooksMain[0].NumScanLines = Motorola16((ushort)200);
+	if (suppress_pnt == 0) output_pnt = 1;
+	return SUCCESS;
+}
 
-					/* the scbs will be setup in the scan line directory
-					   with the packed lengths when the scanlines are packed... */
 
-                    output_pnt = 1;
-					status = SUCCESS;
-					break;
+/* the color tables in palette order (color 0 first) for the packed files */
+sshort GetColorTables(uchar tables[200][32])
+{
+	sshort i,j,y;
 
-		case PIC_FMT:
-		default:
-					picMain = (PNTPIC *) malloc(sizeof(PNTPIC));
-
-					if (NULL == picMain) {
-						puts("Not Enough Memory for Main... PNT Output Disabled.");
-						free(RawBuf);
-						break;
-					}
-
-					/* set defaults and invariants */
-					memset(&picMain[0].Length,0,sizeof(PNTPIC));
-					strcpy(&buf[1],"MAIN"); buf[0] = 4;
-					memcpy(&picMain[0].Kind[0],&buf[0],5);
-					picMain[0].PixelsPerScanline = Motorola16((ushort)320);
-					picMain[0].NumColorTables = Motorola16((ushort)16);
-					picMain[0].NumScanLines = Motorola16((ushort)200);
-
-                    output_pnt = 1;
-               		status = SUCCESS;
-					break;
+	if (output_format != BROOKS_FMT) {
+		memcpy(&tables[0][0],&shr.pal[0][0],512);
+		return 16;
 	}
 
-	return status;
+	/* Brooks Palette Lines are in reverse order
+	   the color value for color 15 is stored first.*/
+	for (y = 0; y < 200; y++) {
+		for (i = 0,j=30; i < 16;i++,j-=2) {
+			tables[y][i*2] = shr.pal[y][j];
+			tables[y][i*2+1] = shr.pal[y][j+1];
+		}
+	}
+	return 200;
 }
 
 
-
+/* writes the APF file - mode3200 images with 16 palettes or less
+   are folded into a mode320 APF by WriteAPF with option O */
 sshort WritePnt(FILE *fp)
 {
-	sshort status = SUCCESS;
-	ulong blocklen = 0L;
-    ushort len,y;
-
-    if (output_pnt == 0) return status;
-
-
-    /* write the header to disk as-is, then rewind, write it again
-       after updating it when we are done packing scanlines etc. */
-    if (output_format == BROOKS_FMT) {
-
-		fwrite((char*)&brooksMain[0].Length,sizeof(PNTBROOKS),1,fp);
-		blocklen = (ulong)sizeof(PNTBROOKS);
-
-		for (y=0;y<200;y++) {
+	uchar tables[200][32];
+	sshort numtables;
 
-           len = PackBytes((char *)&shrline[y][0],160);
-           fwrite((char *)&PackedBuf[0],sizeof(uchar) * len,1,fp);
+    if (output_pnt == 0) return SUCCESS;
 
-           brooksMain[0].ScanLineDirectory[y][0] = Motorola16(len);
-           brooksMain[0].ScanLineDirectory[y][1] = Motorola16(y);
-           blocklen += len;
+	numtables = GetColorTables(tables);
+	/* without option O the legacy layout is kept as well as the greedy encoder */
+	if (WriteAPF(fp,&shrline[0][0],&shr.scb[0],&tables[0][0],numtables,PackAPFLine,1 - optimal_pnt) < 0) return INVALID;
 
-    	}
-
-    	fwrite((char*)&MultiPal[0].Length,sizeof(MULTIPAL),1,fp);
-
-    	rewind(fp);
-    	brooksMain[0].Length = Motorola32(blocklen);
-    	fwrite(&brooksMain[0].Length,sizeof(PNTBROOKS),1,fp);
-
-#ifdef DEBUG
-	printf("APF File Length = %ld\n",(ulong)Intel32(brooksMain[0].Length) + sizeof(MULTIPAL));
-	printf("MasterMode = %d\n",Intel16(brooksMain[0].MasterMode));
-	printf("Pixels per Line = %d\n",Intel16(brooksMain[0].PixelsPerScanline));
-	printf("Color Tables = %d\n",Intel16(brooksMain[0].NumColorTables));
-	printf("Number of Lines = %d\n",Intel16(brooksMain[0].NumScanLines));
-	printf("MAIN Information Block Length = %ld\n", blocklen);
-    printf("MULTIPALETTE Information Block Length = %ld\n", (ulong) sizeof(MULTIPAL));
-#endif
-
-	}
-	else {
-
-    	/* copy palette from picfile */
-		memcpy(&picMain[0].ColorTable[0][0],&shr.pal[0][0],512);
-
-		fwrite((char*)&picMain[0].Length,sizeof(PNTPIC),1,fp);
-		blocklen = (ulong)sizeof(PNTPIC);
-
-		for (y=0;y<200;y++) {
-
-           len = PackBytes((char *)&shrline[y][0],160);
-           fwrite((char *)&PackedBuf[0],sizeof(uchar) * len,1,fp);
-
-           picMain[0].ScanLineDirectory[y][0] = Motorola16(len);
-           picMain[0].ScanLineDirectory[y][1] = Motorola16((ushort)shr.scb[y]);
-           blocklen += len;
-
-    	}
+	return SUCCESS;
+}
 
-    	rewind(fp);
-    	picMain[0].Length = Motorola32(blocklen);
-    	fwrite(&picMain[0].Length,sizeof(PNTPIC),1,fp);
 
-#ifdef DEBUG
-	printf("APF File Length = %ld\n",Intel32(picMain[0].Length ));
-	printf("MasterMode = %d\n",Intel16(picMain[0].MasterMode));
-	printf("Pixels per Line = %d\n",Intel16(picMain[0].PixelsPerScanline));
-	printf("Color Tables = %d\n",Intel16(picMain[0].NumColorTables));
-	printf("Number of Lines = %d\n",Intel16(picMain[0].NumScanLines));
-	printf("MAIN Information Block Length = %ld\n", blocklen);
-#endif
+/* writes the 3201 file - mode3200 packed */
+sshort Write3201File()
+{
+	FILE *fp;
+	uchar tables[200][32];
+	sshort status = SUCCESS;
 
+	if (output_3201 == 0) return SUCCESS;
 
+	if (NULL == (fp = fopen(file3201,"wb"))) {
+		printf("Error Opening %s!\n",file3201);
+		return INVALID;
 	}
+	GetColorTables(tables);
+	if (Write3201(fp,&shrline[0][0],&tables[0][0],PackAPFLine) < 0) status = INVALID;
+	fclose(fp);
 
+	if (status == SUCCESS) printf("Created %s!\n",file3201);
 	return status;
 }
 
@@ -1444,7 +1253,7 @@ sshort WritePnt(FILE *fp)
 /* Brooks Palettes are stored sequentially. There are no scb's */
 void BuildBrooksPaletteLine(short y, sshort midx)
 {
-	uchar g, *pal;
+	uchar g;
 	sshort i,j;
 
 	/* Brooks Palette Lines are in reverse order
@@ -1454,21 +1263,6 @@ void BuildBrooksPaletteLine(short y, sshort midx)
 		shr.pal[y][j] = g | cmap[midx][i][BLUE];
 		shr.pal[y][j+1] = cmap[midx][i][RED];
 	}
-
-	if (output_pnt == 0) return;
-
-    /* Build the Palette for the APF when we build the Brooks Palette */
-    pal = (uchar *)&MultiPal[0].ColorTableArray[y][0];
-
-	/* According to Apple's Filetype Notes mode3200 palettes
-	   are in the same order as any other palette: 0..16 */
-	for (i = 0,j=0; i < 16;i++,j+=2) {
-		g = cmap[midx][i][GREEN] << 4;
-		pal[j] = g | cmap[midx][i][BLUE];
-		pal[j+1] = cmap[midx][i][RED];
-	}
-
-
 }
 
 
@@ -1479,6 +1273,8 @@ void SetColorIndex(sshort midx)
 	sshort i,j,k;
 	uchar r,g,b;
 
+	StatsCollisions(stats,bmpline,16);
+
 	for (i=0,j=0; i< 16; i++) {
 
 	    /* read BGR triples - 48 bytes */
@@ -1505,8 +1301,70 @@ void SetColorIndex(sshort midx)
 }
 
 
+/* frees memory allocated by BuildColorIndex (below) */
+void FreeColorIndex()
+{
+	if (NULL != colorsets) free(colorsets);
+	if (NULL != colorentry) free(colorentry);
+	colorsets = colorentry = NULL;
+}
+
+/* index the colors of all the palettes by 12-bit color */
+/* so that a line can be matched to its palette without searching */
+void BuildColorIndex()
+{
+	sshort i, midx;
+	ushort color;
+
+	FreeColorIndex();
+	if (numpalettes < 1) return;
+
+	colorsets = (uchar *) malloc(4096 * PALSETSIZE);
+	colorentry = (uchar *) malloc(4096 * (ulong)numpalettes);
+	if (NULL == colorsets || NULL == colorentry) {
+		FreeColorIndex();
+		return;
+	}
+	memset(colorsets,0,4096 * PALSETSIZE);
+	memset(colorentry,0,4096 * (ulong)numpalettes);
+
+	for (midx = 0; midx < numpalettes; midx++) {
+		/* backwards so the first entry with a color is the one kept */
+		for (i = 15; i > -1; i--) {
+			color = (ushort)((cmap[midx][i][RED] << 8) | (cmap[midx][i][GREEN] << 4) | cmap[midx][i][BLUE]);
+			colorentry[(ulong)midx * 4096 + color] = (uchar)(i + 1);
+			colorsets[color * PALSETSIZE + (midx >> 3)] |= (uchar)(1 << (midx & 7));
+		}
+	}
+}
+
+/* the first palette that has every color in the line */
+/* returns -1 if no palette has them all */
+sshort GetLinePalette()
+{
+	uchar lineset[PALSETSIZE], *ptr;
+	sshort x, i, j, midx;
+	ushort color, lastcolor = 0xffff;
+
+	memset(lineset,0xff,PALSETSIZE);
+	for (x = 0, j = 0; x < 320; x++, j+=3) {
+		/* bmpline is in BGR order */
+		color = (ushort)((bmpline[j+2] << 8) | (bmpline[j+1] << 4) | bmpline[j]);
+		if (color == lastcolor) continue;
+		lastcolor = color;
+		ptr = &colorsets[color * PALSETSIZE];
+		for (i = 0; i < PALSETSIZE; i++) lineset[i] &= ptr[i];
+	}
+
+	for (midx = 0; midx < numpalettes; midx++) {
+		if (lineset[midx >> 3] & (1 << (midx & 7))) return midx;
+	}
+	return INVALID;
+}
+
 /* returns -1 if color not found in 16 color palette */
 /* unfortunely for us a sequential search is required */
+/* unless the color index could be built */
 sshort GetColorIndex(uchar r, uchar g, uchar b, sshort midx)
 {
 	sshort i;
@@ -1533,24 +1391,38 @@ sshort ConvertLine(sshort y)
 	     bmpline[i] = (uchar) (bmpline[i] >> 4);
     }
 
-    /* go through every palette until we hit one that works for the whole line */
-    /* try to build the line as we go */
-	for (i = 0; i < numpalettes; i++) {
-		/* convert to a line index in the range of 0-16 */
-	    memset(svgaline,0,320);
-		for (x = 0, j=0; x < 320; x++) {
-		   b = bmpline[j]; j++;
-		   g = bmpline[j]; j++;
-		   r = bmpline[j]; j++;
-		   /* just bail immediately if the palette doesn't match
-		      and try the next palette */
-		   midx = GetColorIndex(r,g,b,i);
-		   if (midx == INVALID) break;
-		   svgaline[x] = (uchar)midx;
+    /* look the line up in the color index */
+    if (NULL != colorsets) {
+		midx = GetLinePalette();
+		if (midx != INVALID) {
+			for (x = 0, j = 0; x < 320; x++, j+=3) {
+				b = bmpline[j];
+				g = bmpline[j+1];
+				r = bmpline[j+2];
+				svgaline[x] = (uchar)(colorentry[(ulong)midx * 4096 + ((r << 8) | (g << 4) | b)] - 1);
+			}
+		}
+	}
+	else {
+	    /* go through every palette until we hit one that works for the whole line */
+	    /* try to build the line as we go */
+		for (i = 0; i < numpalettes; i++) {
+			/* convert to a line index in the range of 0-16 */
+		    memset(svgaline,0,320);
+			for (x = 0, j=0; x < 320; x++) {
+			   b = bmpline[j]; j++;
+			   g = bmpline[j]; j++;
+			   r = bmpline[j]; j++;
+			   /* just bail immediately if the palette doesn't match
+			      and try the next palette */
+			   midx = GetColorIndex(r,g,b,i);
+			   if (midx == INVALID) break;
+			   svgaline[x] = (uchar)midx;
+			}
+			if (midx == INVALID) continue;
+			midx = i;
+			break;
 		}
-		if (midx == INVALID) continue;
-		midx = i;
-		break;
 	}
 
     /* we only use the scb array for the PIC structure but.
@@ -1565,6 +1437,7 @@ sshort ConvertLine(sshort y)
 	}
 	if (output_format == BROOKS_FMT) BuildBrooksPaletteLine(y,midx);
 	else shr.scb[y] = midx;
+	StatsCount(stats,STATS_EXACT,320L);
 
 
 	/* create 4 bit line - pixel order nibbles */
@@ -1583,7 +1456,9 @@ sshort Convert()
     sshort status = INVALID, i, y, bmpversion;
     uchar ch;
 
+    StatsBegin(stats,STATS_HEADER);
     if((fp=fopen(bmpfile,"rb"))==NULL) {
+		StatsEnd(stats,STATS_HEADER);
 		printf("Error Opening %s!\n",bmpfile);
 		return status;
 	}
@@ -1638,6 +1513,8 @@ sshort Convert()
 			if (bmi.biWidth == 320 && bmi.biHeight == 200) status = SUCCESS;
 	}
 
+	StatsEnd(stats,STATS_HEADER);
+
 	if (status == INVALID) {
 		printf("%s is in the wrong format!\n",bmpfile);
 		fclose(fp);
@@ -1647,19 +1524,24 @@ sshort Convert()
     /* seek past extraneous info in header if any */
 	fseek(fp,bfi.bfOffBits,SEEK_SET);
 
+	StatsBegin(stats,STATS_DITHER);
 	for (i = 0,y=199; i< 200; i++, y--) {
 		fread((char *)&bmpline[0],1,960,fp);
 		if (ConvertLine(y) == INVALID) {
 		   printf("No palette for line %d\n",y);
+		   StatsCount(stats,STATS_UNMATCHED,1L);
 		   status = INVALID;
 	    }
 	}
 	fclose(fp);
+	StatsEnd(stats,STATS_DITHER);
 
 	/* insert RLE routines here */
     /* the buffers are ready to be written by the time it gets to this point */
 
+    StatsBegin(stats,STATS_WRITE);
     if((fpshr=fopen(shrfile,"wb"))==NULL) {
+		StatsEnd(stats,STATS_WRITE);
 		printf("Error Opening %s!\n",shrfile);
 		return INVALID;
 	}
@@ -1690,15 +1572,25 @@ sshort Convert()
 
     fclose(fpshr);
 
-    if (suppress_pic == 1) remove(shrfile);
+    /* the 3201 file replaces the raw mode3200 file */
+    if (suppress_pic == 1 || output_3201 == 1) remove(shrfile);
     else printf("Created %s!\n",shrfile);
+    StatsOutput(stats,shrfile);
+    StatsEnd(stats,STATS_WRITE);
+
+    /* the packed files are written as they are packed */
+    StatsBegin(stats,STATS_ENCODE);
+    Write3201File();
+    if (output_3201 != 0) StatsOutput(stats,file3201);
 
     if (output_pnt != 0) {
     	if (WritePnt(fpapf) == SUCCESS) {
 			printf("Created %s!\n",pntfile);
 		}
 		fclose(fpapf);
+		StatsOutput(stats,pntfile);
 	}
+    StatsEnd(stats,STATS_ENCODE);
 
 	return SUCCESS;
 
@@ -1710,7 +1602,9 @@ sshort ReadColorMap()
     sshort status = INVALID,i,x,y,localpalettes, bmpversion;
 
     /* open the colormap */
+    StatsBegin(stats,STATS_HEADER);
     if((fp=fopen(cmapfile,"rb"))==NULL) {
+		StatsEnd(stats,STATS_HEADER);
 		printf("Error Opening %s!\n",cmapfile);
 		return status;
 	}
@@ -1784,12 +1678,15 @@ sshort ReadColorMap()
 			}
 	}
 
+	StatsEnd(stats,STATS_HEADER);
+
 	if (status == INVALID) {
 		printf("%s is in the wrong format!\n",cmapfile);
 		fclose(fp);
 		return status;
 	}
 
+	StatsBegin(stats,STATS_PALETTE);
 	PntAlloc();
 
     /* clear the memory for the shr file buffers */
@@ -1832,10 +1729,110 @@ sshort ReadColorMap()
 	}
 	fclose(fp);
 
+	BuildColorIndex();
+	StatsEnd(stats,STATS_PALETTE);
+
 return status;
 }
 
 
+/* times the greedy and optimal PackBytes encoders over the scanlines
+   of a list of SHR files and checks that both unpack to the original */
+/* BMP files are reduced to 16 levels of green two pixels a byte and cut
+   into 160 byte lines - see ../src_common/bench.h for the JSON results */
+int PackBench(int numfiles, char **files)
+{
+	FILE *fp;
+	BENCHRUN run;
+	BENCHIMAGE *img;
+	uchar *lines, *ptr, unpacked[160];
+	long numlines = 0L, y, i, bytes, greedybytes = 0L, optimalbytes = 0L;
+	int idx, len, pass, status = SUCCESS;
+	unsigned long check = 0L;
+
+	BenchOpen(&run,"m2s",numfiles,files);
+
+	if (NULL == (RawBuf = (RAWLIST *) malloc(sizeof(RAWLIST)*RAW_MAX))) {
+		BenchClose(&run);
+		puts("Not Enough Memory for PackBytes...");
+		return INVALID;
+	}
+	if (NULL == (lines = (uchar *) malloc((size_t)(run.numother + run.numbmp * 10) * 32000))) {
+		free(RawBuf);
+		BenchClose(&run);
+		puts("Not Enough Memory for Scanlines...");
+		return INVALID;
+	}
+
+	/* the first 32000 bytes of SHR, SH2 and SH3 files are the pixels */
+	for (idx = 0; idx < run.numother; idx++) {
+		if (NULL == (fp = fopen(run.other[idx],"rb"))) {
+			printf("Error Opening %s for reading!\n",run.other[idx]);
+			continue;
+		}
+		if (fread((char *)&lines[numlines*160],1,32000,fp) == 32000) numlines += 200;
+		else printf("%s is not an SHR file!\n",run.other[idx]);
+		fclose(fp);
+	}
+	for (idx = 0; idx < run.numbmp; idx++) {
+		img = &run.bmp[idx];
+		ptr = (uchar *)&lines[numlines*160];
+		bytes = ((long)img->width * img->height) / 320;
+		for (i = 0; i < bytes * 160; i++)
+			ptr[i] = (uchar)((img->bgr[i*6+1] & 0xf0) | (img->bgr[i*6+4] >> 4));
+		numlines += bytes;
+	}
+	if (numlines == 0L) {
+		free(lines);
+		free(RawBuf);
+		BenchClose(&run);
+		puts("No SHR or BMP files to bench!");
+		return INVALID;
+	}
+
+	/* check the packed lines */
+	for (y = 0; y < numlines; y++) {
+		for (pass = 0; pass < 2; pass++) {
+			optimal_pnt = (sshort)pass;
+			len = PackLine(&lines[y*160],160);
+			if (pass == 0) greedybytes += len;
+			else optimalbytes += len;
+			if (UnPackBytes(PackedBuf,len,unpacked,160) != len ||
+				memcmp(unpacked,&lines[y*160],160) != 0) {
+				printf("%s PackBytes error on line %ld!\n",(pass == 0 ? "Greedy" : "Optimal"),y);
+				status = INVALID;
+			}
+		}
+	}
+
+	bytes = numlines * 160;
+	printf("Scanlines: %ld (%ld bytes) from %d files\n",numlines,bytes,run.numother + run.numbmp);
+	printf("Greedy  : %ld bytes (%.2f%%)\n",greedybytes,(double)greedybytes * 100.0 / bytes);
+	printf("Optimal : %ld bytes (%.2f%%)\n",optimalbytes,(double)optimalbytes * 100.0 / bytes);
+	printf("Saved   : %ld bytes (%.2f%% of greedy)\n",greedybytes - optimalbytes,
+		(double)(greedybytes - optimalbytes) * 100.0 / greedybytes);
+
+	for (pass = 0; pass < 2; pass++) {
+		optimal_pnt = (sshort)pass;
+		for (BenchStart(&run); BenchRunning(&run); ) {
+			for (y = 0, check = 0L; y < numlines; y++) {
+				len = PackLine(&lines[y*160],160);
+				check = BenchCheckBuffer(check,PackedBuf,(long)len);
+			}
+		}
+		BenchResult(&run,(pass == 0 ? "PackBytes greedy" : "PackBytes optimal"),
+			(run.numother > 0 ? "shr" : "bmp"),"MB/s",(double)bytes,check);
+	}
+	optimal_pnt = 0;
+
+	if (BenchWriteJSON(&run) != 0) status = INVALID;
+	free(lines);
+	free(RawBuf);
+	BenchClose(&run);
+	return status;
+}
+
+
 int main(int argc, char **argv)
 {
 	sshort idx, jdx=999, status = 0;
@@ -1846,6 +1843,16 @@ int main(int argc, char **argv)
 	suppress_pic = 0;
 	no_tags = 1;
 
+    /* PackBytes benchmark */
+    if (argc > 2) {
+		for (idx = 0; idx < 6 && argv[1][idx] != 0; idx++) fname[idx] = toupper(argv[1][idx]);
+		fname[idx] = 0;
+		if (strcmp(fname,"BENCH") == 0) {
+			if (PackBench(argc - 2, &argv[2]) == INVALID) return (1);
+			return SUCCESS;
+		}
+	}
+
     /* getopts */
     if (argc > 2) {
     	for (idx = 2; idx < argc; idx++) {
@@ -1857,15 +1864,27 @@ int main(int argc, char **argv)
 			}
 			if (ch != 0) ch2 = toupper(wordptr[1]);
 
+			/* before the letters - "stats" has a T and an A in it */
+			if (ch == 'S' && ch2 == 'T') {
+			   statsformat = StatsOption((char *)wordptr);
+			   if (statsformat != 0) continue;
+			}
+
 			if (ch == 'A' || ch2 == 'A') {
 			   suppress_pnt = 0; suppress_pic = 1;
 			}
 			if (ch == 'T' || ch2 == 'T') {
 			   no_tags = 0;
 			}
+			if (ch == 'O' || ch2 == 'O') {
+			   optimal_pnt = 1;
+			}
+			if (ch == '3' || ch2 == '3') {
+			   output_3201 = 1;
+			}
 
 		}
-	   	if (suppress_pnt == 0 || no_tags == 0) argc = 2;
+	   	if (suppress_pnt == 0 || no_tags == 0 || optimal_pnt == 1 || output_3201 == 1 || statsformat != 0) argc = 2;
 	}
 
 
@@ -1931,8 +1950,15 @@ int main(int argc, char **argv)
 		puts("          -T = Use CiderPress Attribute Preservation Tags.");
 		puts("               Default: No Tags! (unadorned file extensions)");
 		puts("               Does not apply to M2S16.EXE (MS-DOS binary).");
+		puts("          -3 = 3201 file output (packed mode3200) instead of SH3.");
+		puts("          -O = Optimal PackBytes for PNT and 3201 output (shortest");
+		puts("               packed lines) and mode3200 PNT folded into mode320.");
+		puts("               Default: Greedy PackBytes (the original encoder).");
+		puts("          -STATS = Save stage times and color counts as BaseName_stats.json");
+		puts("          -STATS=TRACE = The same as a Chrome trace in BaseName_trace.json");
 		puts("          Options may be combined: \"-ta\" or \"-at\"");
 		puts("          Options are Case Insensitive - Switchar \"-\" is Optional.");
+		puts("Bench:    m2s bench file1.SHR file2.SH3 file3.bmp ... [results.json]");
 		return(1);
 	}
 
@@ -1943,6 +1969,7 @@ int main(int argc, char **argv)
     sprintf(shrfile,"%s.SHR",fname);
     sprintf(brooksfile,"%s.SH3",fname);
     sprintf(pntfile,"%s.PNT",fname);
+    sprintf(file3201,"%s.321",fname);
  #else
     /* if using long file names add
        ciderpress file attribute preservation tags
@@ -1960,9 +1987,13 @@ else {
     sprintf(brooksfile,"%s.SH3#C10002",fname);
     sprintf(pntfile,"%s.PNT#C00002",fname);
 }
+/* no attribute preservation tag - the 3201 extension is the file type */
+sprintf(file3201,"%s.3201",fname);
 
 #endif
 
+    stats = StatsOpen(statsformat,"m2s",bmpfile,(char *)fname);
+
     for (;;) {
     	if ((status = ReadColorMap()) == INVALID) break;
 
@@ -1971,6 +2002,8 @@ else {
 	}
 
 	PntFree();
+	FreeColorIndex();
+	StatsClose(stats);
     if (status == INVALID) return (1);
 
 return SUCCESS;
@@ -74,6 +74,8 @@ typedef unsigned short ushort;
 typedef unsigned long ulong;
 typedef short sshort;
 
+#include "../src_common/bench.h"
+
 #define ASCIIZ 0
 
 char *szTextTitle =
@@ -320,6 +322,60 @@ int save_to_X(uchar *basename)
 }
 
 
+/* kernel micro-benchmark - see ../src_common/bench.h */
+/* times encline on the DHX rasters of a list of A2FC files */
+int KernelBench(int numfiles, char **files)
+{
+    BENCHRUN run;
+    FILE *fp;
+    uchar *rasters;
+    unsigned long check = 0L;
+    int idx, status = SUCCESS;
+
+    BenchOpen(&run,"xpack",numfiles,files);
+    for (idx = 0; idx < run.numbmp; idx++) printf("%s is not an A2FC file!\n",run.bmp[idx].name);
+    for (idx = 0; idx < run.numother; idx++) printf("%s is not an A2FC file!\n",run.other[idx]);
+    if (run.numa2fc == 0) {
+        BenchClose(&run);
+        puts("No A2FC files to bench!");
+        return INVALID;
+    }
+
+    /* encline writes to a scratch file the same as it writes the DHX */
+    rasters = (uchar *)malloc((size_t)run.numa2fc * 15360);
+    fp = tmpfile();
+    if (NULL == rasters || NULL == fp) {
+        if (NULL != rasters) free(rasters);
+        if (NULL != fp) fclose(fp);
+        BenchClose(&run);
+        puts("Not Enough Memory for Bench...");
+        return INVALID;
+    }
+
+    interlace = 0;
+    for (idx = 0; idx < run.numa2fc; idx++) {
+        memcpy(dhrbuf,run.a2fc[idx].a2fc,16384);
+        dhrmakedhx(fp);
+        memcpy(&rasters[(long)idx * 15360],bigbuf,15360);
+    }
+
+    printf("Kernel benchmarks: %d A2FC files\n",run.numa2fc);
+    for (BenchStart(&run); BenchRunning(&run); ) {
+        for (idx = 0, check = 0L; idx < run.numa2fc; idx++) {
+            rewind(fp);
+            check = BenchCheck(check,(unsigned)encline(&rasters[(long)idx * 15360],15360,fp));
+        }
+    }
+    BenchResult(&run,"encline","a2fc","MB/s",(double)run.numa2fc * 15360,check);
+
+    fclose(fp);
+    free(rasters);
+    if (BenchWriteJSON(&run) != 0) status = INVALID;
+    BenchClose(&run);
+    return status;
+}
+
+
 int main(int argc, char **argv)
 {
 
@@ -333,6 +389,16 @@ int main(int argc, char **argv)
   system("cls");
 #endif
 
+  /* kernel benchmarks */
+  if (argc > 1) {
+    for (idx = 0; idx < 6 && argv[1][idx] != ASCIIZ; idx++) fname[idx] = toupper(argv[1][idx]);
+    fname[idx] = ASCIIZ;
+    if (strcmp(fname,"BENCH") == 0) {
+      if (KernelBench(argc - 2, &argv[2]) == INVALID) return 1;
+      return 0;
+    }
+  }
+
   if(argc == 1) {
     puts(szTextTitle);
     puts("Command line Usage is \"XPACK MyHires.2FC\"");
@@ -342,6 +408,7 @@ int main(int argc, char **argv)
     puts("                      \"XPACK MyHires.BIN OutfileBaseName\"");
     puts("                      \"XPACK MyHires.AUX OutfileBaseName\"");
     puts("If converting .BIN and .AUX file pairs, both must be present.");
+    puts("Kernel benchmarks:    \"XPACK bench MyHires.A2FC ...\"");
     printf("Enter Input FileName (Blank to Exit): ");
     gets(fname);
     if (fname[0] == ASCIIZ) return 1;